@@ -0,0 +1,1285 @@
+/* mdb-btree.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <errno.h>
+#include <string.h>
+
+#include "mdb-btree.h"
+
+
+/*
+ * Type codes of the compact v1 key format. Each element starts with a
+ * byte holding one of these, with BTREE_KEY_HASMORE set if another
+ * element follows. Keys that cannot be stored compactly start with
+ * BTREE_KEY_BSON followed by a BSON document.
+ */
+#define BTREE_KEY_MINKEY   1
+#define BTREE_KEY_NULL     2
+#define BTREE_KEY_DOUBLE   4
+#define BTREE_KEY_STRING   6
+#define BTREE_KEY_BINDATA  7
+#define BTREE_KEY_OID      8
+#define BTREE_KEY_FALSE    10
+#define BTREE_KEY_TRUE     11
+#define BTREE_KEY_DATE     12
+#define BTREE_KEY_MAXKEY   14
+#define BTREE_KEY_INT      0x14
+#define BTREE_KEY_LONG     0x24
+#define BTREE_KEY_HASMORE  0x40
+#define BTREE_KEY_BSON     0xff
+
+
+static const int gBinDataLength[] = {
+   0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 20, 24, 32
+};
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_loc --
+ *
+ *       Unpack a 7 byte btree location.
+ *
+ * Returns:
+ *       The location, with a fileno of -1 if it is null.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static file_loc_t
+btree_loc (const btree_loc_t *bloc) /* IN */
+{
+   file_loc_t loc;
+   bson_int32_t offset;
+
+   memcpy(&offset, &bloc->offset, sizeof offset);
+   offset = BSON_UINT32_FROM_LE(offset);
+
+   if (offset < 0) {
+      loc.fileno = -1;
+      loc.offset = 0;
+   } else {
+      loc.fileno = bloc->fileno[0] |
+                   (bloc->fileno[1] << 8) |
+                   (bloc->fileno[2] << 16);
+      loc.offset = offset;
+   }
+
+   return loc;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_record_at --
+ *
+ *       Point @record at the record stored at @loc, pinning its data file.
+ *       The caller must release the file with db_file_release().
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       record is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+btree_record_at (db_t *db,              /* IN */
+                 const file_loc_t *loc, /* IN */
+                 size_t minlen,         /* IN */
+                 record_t *record)      /* OUT */
+{
+   const char *map;
+   size_t maplen;
+
+   if ((loc->fileno < 0) || (loc->offset < 0)) {
+      errno = ENOENT;
+      return -1;
+   }
+
+   if (!(map = db_file_acquire(db, loc->fileno, &maplen))) {
+      return -1;
+   }
+
+   if (((size_t)loc->offset + offsetof(record_header_t, data) + minlen) >
+       maplen) {
+      db_file_release(db, loc->fileno);
+      errno = EBADF;
+      return -1;
+   }
+
+   memset(record, 0, sizeof *record);
+   record->map = map;
+   record->maplen = maplen;
+   record->offset = loc->offset;
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ns_index_spec --
+ *
+ *       Fetch the spec of the @index'th index of @ns, such as
+ *       { "v" : 1, "key" : { "_id" : 1 }, "ns" : "db.coll", "name" : "_id_" }.
+ *
+ * Returns:
+ *       A newly allocated bson_t to be freed with bson_destroy(), or NULL
+ *       and errno is set.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+bson_t *
+ns_index_spec (ns_t *ns,  /* IN */
+               int index) /* IN */
+{
+   index_details_t details;
+   const bson_uint8_t *data;
+   record_t record;
+   bson_t *spec = NULL;
+   size_t len;
+
+   if (!!ns_index_details(ns, index, &details) ||
+       !!btree_record_at(ns->db, &details.info, 5, &record)) {
+      return NULL;
+   }
+
+   if ((data = record_data(&record, &len)) &&
+       !(spec = bson_new_from_data(data, len))) {
+      errno = EBADF;
+   }
+
+   db_file_release(ns->db, details.info.fileno);
+
+   return spec;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ns_index_find --
+ *
+ *       Find the index of @ns named @name, such as "_id_".
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set to ENOENT if there
+ *       is no such index.
+ *
+ * Side effects:
+ *       index is set.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+ns_index_find (ns_t *ns,         /* IN */
+               const char *name, /* IN */
+               int *index)       /* OUT */
+{
+   bson_iter_t iter;
+   bson_t *spec;
+   int found;
+   int i;
+
+   if (!ns || !name || !index) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   for (i = 0; i < ns_get_details(ns)->nindexes; i++) {
+      if (!(spec = ns_index_spec(ns, i))) {
+         continue;
+      }
+
+      found = (bson_iter_init_find(&iter, spec, "name") &&
+               (bson_iter_type(&iter) == BSON_TYPE_UTF8) &&
+               !strcmp(bson_iter_utf8(&iter, NULL), name));
+
+      bson_destroy(spec);
+
+      if (found) {
+         *index = i;
+         return 0;
+      }
+   }
+
+   errno = ENOENT;
+   return -1;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_key_to_bson --
+ *
+ *       Decode the key stored at @data, which has @avail bytes left in
+ *       its bucket, into @key. Like keys in the server, each element has
+ *       an empty field name.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       Elements are appended to key.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+btree_key_to_bson (const bson_uint8_t *data, /* IN */
+                   size_t avail,             /* IN */
+                   bson_t *key)              /* IN */
+{
+   const bson_uint8_t *p = data;
+   const bson_uint8_t *end = data + avail;
+   bson_iter_t iter;
+   bson_int64_t i64;
+   bson_int32_t len;
+   bson_uint8_t bits;
+   bson_t b;
+   int subtype;
+   double d;
+
+   if (!avail) {
+      goto failure;
+   }
+
+   if (*p == BTREE_KEY_BSON) {
+      if ((avail < 6) ||
+          (memcpy(&len, p + 1, 4), len = BSON_UINT32_FROM_LE(len),
+           (len < 5) || ((size_t)len > (avail - 1))) ||
+          !bson_init_static(&b, p + 1, len) ||
+          !bson_iter_init(&iter, &b)) {
+         goto failure;
+      }
+      while (bson_iter_next(&iter)) {
+         bson_append_iter(key, "", 0, &iter);
+      }
+      return 0;
+   }
+
+   do {
+      if (p >= end) {
+         goto failure;
+      }
+
+      bits = *p++;
+
+      switch (bits & 0x3f) {
+      case BTREE_KEY_MINKEY:
+         bson_append_minkey(key, "", 0);
+         break;
+      case BTREE_KEY_NULL:
+         bson_append_null(key, "", 0);
+         break;
+      case BTREE_KEY_MAXKEY:
+         bson_append_maxkey(key, "", 0);
+         break;
+      case BTREE_KEY_FALSE:
+      case BTREE_KEY_TRUE:
+         bson_append_bool(key, "", 0, ((bits & 0x3f) == BTREE_KEY_TRUE));
+         break;
+      case BTREE_KEY_DOUBLE:
+      case BTREE_KEY_INT:
+      case BTREE_KEY_LONG:
+         if ((end - p) < 8) {
+            goto failure;
+         }
+         memcpy(&d, p, 8);
+         p += 8;
+         if ((bits & 0x3f) == BTREE_KEY_INT) {
+            bson_append_int32(key, "", 0, (bson_int32_t)d);
+         } else if ((bits & 0x3f) == BTREE_KEY_LONG) {
+            bson_append_int64(key, "", 0, (bson_int64_t)d);
+         } else {
+            bson_append_double(key, "", 0, d);
+         }
+         break;
+      case BTREE_KEY_STRING:
+         if (((end - p) < 1) || ((end - p - 1) < *p)) {
+            goto failure;
+         }
+         bson_append_utf8(key, "", 0, (const char *)p + 1, *p);
+         p += 1 + *p;
+         break;
+      case BTREE_KEY_OID:
+         if ((end - p) < 12) {
+            goto failure;
+         }
+         bson_append_oid(key, "", 0, (const bson_oid_t *)p);
+         p += 12;
+         break;
+      case BTREE_KEY_DATE:
+         if ((end - p) < 8) {
+            goto failure;
+         }
+         memcpy(&i64, p, 8);
+         bson_append_date_time(key, "", 0, BSON_UINT64_FROM_LE(i64));
+         p += 8;
+         break;
+      case BTREE_KEY_BINDATA:
+         if ((end - p) < 1) {
+            goto failure;
+         }
+         len = gBinDataLength[*p >> 4];
+         subtype = *p & 0x0f;
+         if (subtype & 0x8) {
+            subtype = (subtype & 0x7) | 0x80;
+         }
+         if ((end - p - 1) < len) {
+            goto failure;
+         }
+         bson_append_binary(key, "", 0, subtype, p + 1, len);
+         p += 1 + len;
+         break;
+      default:
+         goto failure;
+      }
+   } while (bits & BTREE_KEY_HASMORE);
+
+   return 0;
+
+failure:
+   errno = EBADF;
+   return -1;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_canonical --
+ *
+ *       Map a BSON type to its rank in the server's sort order. Types of
+ *       the same rank, such as the numeric types, compare by value.
+ *
+ * Returns:
+ *       The rank of type.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+btree_canonical (bson_type_t type) /* IN */
+{
+   switch (type) {
+   case BSON_TYPE_MINKEY:
+      return -1;
+   case BSON_TYPE_UNDEFINED:
+      return 0;
+   case BSON_TYPE_NULL:
+      return 5;
+   case BSON_TYPE_DOUBLE:
+   case BSON_TYPE_INT32:
+   case BSON_TYPE_INT64:
+      return 10;
+   case BSON_TYPE_UTF8:
+   case BSON_TYPE_SYMBOL:
+      return 15;
+   case BSON_TYPE_DOCUMENT:
+      return 20;
+   case BSON_TYPE_ARRAY:
+      return 25;
+   case BSON_TYPE_BINARY:
+      return 30;
+   case BSON_TYPE_OID:
+      return 35;
+   case BSON_TYPE_BOOL:
+      return 40;
+   case BSON_TYPE_DATE_TIME:
+      return 45;
+   case BSON_TYPE_TIMESTAMP:
+      return 47;
+   case BSON_TYPE_REGEX:
+      return 50;
+   case BSON_TYPE_DBPOINTER:
+      return 55;
+   case BSON_TYPE_CODE:
+      return 60;
+   case BSON_TYPE_CODEWSCOPE:
+      return 65;
+   case BSON_TYPE_MAXKEY:
+   default:
+      return 127;
+   }
+}
+
+
+static int
+btree_compare_bytes (const void *a,  /* IN */
+                     size_t alen,    /* IN */
+                     const void *b,  /* IN */
+                     size_t blen)    /* IN */
+{
+   int cmp;
+
+   if ((cmp = memcmp(a, b, (alen < blen) ? alen : blen))) {
+      return cmp;
+   }
+
+   return (alen < blen) ? -1 : (alen > blen);
+}
+
+
+static const char *
+btree_string (const bson_iter_t *iter, /* IN */
+              bson_uint32_t *len)      /* OUT */
+{
+   switch (bson_iter_type(iter)) {
+   case BSON_TYPE_SYMBOL:
+      return bson_iter_symbol(iter, len);
+   case BSON_TYPE_CODE:
+      return bson_iter_code(iter, len);
+   default:
+      return bson_iter_utf8(iter, len);
+   }
+}
+
+
+static int btree_compare_iters (bson_iter_t *a,
+                                bson_iter_t *b,
+                                int names,
+                                bson_uint32_t ordering);
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_compare_values --
+ *
+ *       Compare the values at @a and @b, which have the same canonical
+ *       rank. Integers compare exactly, mixed numbers as doubles with NaN
+ *       before every other number.
+ *
+ * Returns:
+ *       Less than, equal to or greater than zero.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+btree_compare_values (const bson_iter_t *a, /* IN */
+                      const bson_iter_t *b) /* IN */
+{
+   const bson_uint8_t *adata;
+   const bson_uint8_t *bdata;
+   bson_subtype_t asub;
+   bson_subtype_t bsub;
+   bson_uint32_t alen;
+   bson_uint32_t blen;
+   bson_uint32_t at;
+   bson_uint32_t ai;
+   bson_uint32_t bt;
+   bson_uint32_t bi;
+   bson_int64_t ia;
+   bson_int64_t ib;
+   bson_iter_t achild;
+   bson_iter_t bchild;
+   const char *aopts;
+   const char *bopts;
+   const char *astr;
+   const char *bstr;
+   int cmp;
+   double da;
+   double db;
+
+   switch (bson_iter_type(a)) {
+   case BSON_TYPE_DOUBLE:
+   case BSON_TYPE_INT32:
+   case BSON_TYPE_INT64:
+      if ((bson_iter_type(a) != BSON_TYPE_DOUBLE) &&
+          (bson_iter_type(b) != BSON_TYPE_DOUBLE)) {
+         ia = (bson_iter_type(a) == BSON_TYPE_INT32) ?
+              bson_iter_int32(a) : bson_iter_int64(a);
+         ib = (bson_iter_type(b) == BSON_TYPE_INT32) ?
+              bson_iter_int32(b) : bson_iter_int64(b);
+         return (ia < ib) ? -1 : (ia > ib);
+      }
+      da = (bson_iter_type(a) == BSON_TYPE_DOUBLE) ? bson_iter_double(a) :
+           (bson_iter_type(a) == BSON_TYPE_INT32) ? bson_iter_int32(a) :
+           bson_iter_int64(a);
+      db = (bson_iter_type(b) == BSON_TYPE_DOUBLE) ? bson_iter_double(b) :
+           (bson_iter_type(b) == BSON_TYPE_INT32) ? bson_iter_int32(b) :
+           bson_iter_int64(b);
+      if ((da != da) || (db != db)) {
+         return (db != db) - (da != da);
+      }
+      return (da < db) ? -1 : (da > db);
+   case BSON_TYPE_UTF8:
+   case BSON_TYPE_SYMBOL:
+   case BSON_TYPE_CODE:
+      astr = btree_string(a, &alen);
+      bstr = btree_string(b, &blen);
+      return btree_compare_bytes(astr, alen, bstr, blen);
+   case BSON_TYPE_DOCUMENT:
+   case BSON_TYPE_ARRAY:
+      if (!bson_iter_recurse(a, &achild) || !bson_iter_recurse(b, &bchild)) {
+         return 0;
+      }
+      return btree_compare_iters(&achild, &bchild, TRUE, 0);
+   case BSON_TYPE_BINARY:
+      bson_iter_binary(a, &asub, &alen, &adata);
+      bson_iter_binary(b, &bsub, &blen, &bdata);
+      if (alen != blen) {
+         return (alen < blen) ? -1 : 1;
+      }
+      if (asub != bsub) {
+         return ((int)asub < (int)bsub) ? -1 : 1;
+      }
+      return memcmp(adata, bdata, alen);
+   case BSON_TYPE_OID:
+      return memcmp(bson_iter_oid(a), bson_iter_oid(b), sizeof(bson_oid_t));
+   case BSON_TYPE_BOOL:
+      return bson_iter_bool(a) - bson_iter_bool(b);
+   case BSON_TYPE_DATE_TIME:
+      ia = bson_iter_date_time(a);
+      ib = bson_iter_date_time(b);
+      return (ia < ib) ? -1 : (ia > ib);
+   case BSON_TYPE_TIMESTAMP:
+      bson_iter_timestamp(a, &at, &ai);
+      bson_iter_timestamp(b, &bt, &bi);
+      if (at != bt) {
+         return (at < bt) ? -1 : 1;
+      }
+      return (ai < bi) ? -1 : (ai > bi);
+   case BSON_TYPE_REGEX:
+      astr = bson_iter_regex(a, &aopts);
+      bstr = bson_iter_regex(b, &bopts);
+      if ((cmp = strcmp(astr, bstr))) {
+         return cmp;
+      }
+      return strcmp(aopts, bopts);
+   case BSON_TYPE_MINKEY:
+   case BSON_TYPE_MAXKEY:
+   case BSON_TYPE_NULL:
+   case BSON_TYPE_UNDEFINED:
+      return 0;
+   default:
+      return btree_compare_bytes(a->raw + a->d1, a->next_off - a->d1,
+                                 b->raw + b->d1, b->next_off - b->d1);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_compare_iters --
+ *
+ *       Compare the remaining elements of @a and @b in order. Field names
+ *       are only compared within embedded documents when @names is set;
+ *       index keys have empty names. Bit i of @ordering reverses the
+ *       direction of the i'th element.
+ *
+ * Returns:
+ *       Less than, equal to or greater than zero. A prefix sorts first.
+ *
+ * Side effects:
+ *       a and b are advanced.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+btree_compare_iters (bson_iter_t *a,          /* IN */
+                     bson_iter_t *b,          /* IN */
+                     int names,               /* IN */
+                     bson_uint32_t ordering)  /* IN */
+{
+   int amore;
+   int bmore;
+   int cmp;
+   int i;
+
+   for (i = 0; ; i++) {
+      amore = bson_iter_next(a);
+      bmore = bson_iter_next(b);
+
+      if (!amore || !bmore) {
+         return amore - bmore;
+      }
+
+      cmp = btree_canonical(bson_iter_type(a)) -
+            btree_canonical(bson_iter_type(b));
+
+      if (!cmp && names) {
+         cmp = strcmp(bson_iter_key(a), bson_iter_key(b));
+      }
+
+      if (!cmp) {
+         cmp = btree_compare_values(a, b);
+      }
+
+      if (cmp) {
+         cmp = (cmp < 0) ? -1 : 1;
+         return ((i < 32) && (ordering & (1U << i))) ? -cmp : cmp;
+      }
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_key_compare --
+ *
+ *       Compare the index keys @a and @b in the order of the server's
+ *       indexes. Field names are ignored, and bit i of @ordering reverses
+ *       the direction of the i'th field.
+ *
+ * Returns:
+ *       Less than, equal to or greater than zero.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+btree_key_compare (const bson_t *a,        /* IN */
+                   const bson_t *b,        /* IN */
+                   bson_uint32_t ordering) /* IN */
+{
+   bson_iter_t aiter;
+   bson_iter_t biter;
+
+   if (!bson_iter_init(&aiter, a) || !bson_iter_init(&biter, b)) {
+      return 0;
+   }
+
+   return btree_compare_iters(&aiter, &biter, FALSE, ordering);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_push --
+ *
+ *       Push the bucket at @loc onto the cursor stack, pinning its data
+ *       file until it is popped.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       The cursor depth is increased.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+btree_cursor_push (btree_cursor_t *cursor, /* IN */
+                   const file_loc_t *loc)  /* IN */
+{
+   const btree_bucket_t *bucket;
+   btree_frame_t *frame;
+   record_t record;
+
+   if (cursor->depth == BTREE_MAX_DEPTH) {
+      errno = EBADF;
+      return -1;
+   }
+
+   if (!!btree_record_at(cursor->db, loc, BTREE_BUCKET_SIZE, &record)) {
+      return -1;
+   }
+
+   bucket = (const btree_bucket_t *)
+      (record.map + record.offset + offsetof(record_header_t, data));
+
+   if ((bucket->n * sizeof(btree_key_node_t)) > BTREE_BODY_SIZE) {
+      db_file_release(cursor->db, loc->fileno);
+      errno = EBADF;
+      return -1;
+   }
+
+   frame = &cursor->frames[cursor->depth++];
+   frame->loc = *loc;
+   frame->bucket = bucket;
+   frame->pos = 0;
+   frame->visited = FALSE;
+
+   return 0;
+}
+
+
+static void
+btree_cursor_pop (btree_cursor_t *cursor) /* IN */
+{
+   btree_frame_t *frame;
+
+   frame = &cursor->frames[--cursor->depth];
+   db_file_release(cursor->db, frame->loc.fileno);
+   memset(frame, 0, sizeof *frame);
+}
+
+
+static const btree_key_node_t *
+btree_key_node (const btree_bucket_t *bucket, /* IN */
+                int i)                        /* IN */
+{
+   return ((const btree_key_node_t *)bucket->data) + i;
+}
+
+
+static int
+btree_bucket_key (const btree_bucket_t *bucket, /* IN */
+                  int i,                        /* IN */
+                  bson_t *key)                  /* IN */
+{
+   int kdo;
+
+   kdo = btree_key_node(bucket, i)->key_offset;
+   if (kdo >= (int)BTREE_BODY_SIZE) {
+      errno = EBADF;
+      return -1;
+   }
+
+   return btree_key_to_bson((const bson_uint8_t *)bucket->data + kdo,
+                            BTREE_BODY_SIZE - kdo, key);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_init --
+ *
+ *       Initialize @cursor to walk the keys of the @index'th index of @ns
+ *       in ascending order. The cursor is positioned before the first key;
+ *       call btree_cursor_next() to advance to it.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set. ENOTSUP if the
+ *       index is not in the v1 format.
+ *
+ * Side effects:
+ *       cursor is initialized and must be released with
+ *       btree_cursor_destroy().
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+btree_cursor_init (btree_cursor_t *cursor, /* OUT */
+                   ns_t *ns,               /* IN */
+                   int index)              /* IN */
+{
+   index_details_t details;
+   bson_iter_t child;
+   bson_iter_t iter;
+   bson_t *spec;
+   double dir;
+   int v = 0;
+   int i;
+
+   if (!cursor || !ns) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   memset(cursor, 0, sizeof *cursor);
+   cursor->db = ns->db;
+   cursor->pinned = -1;
+
+   if (!!ns_index_details(ns, index, &details) ||
+       !(spec = ns_index_spec(ns, index))) {
+      return -1;
+   }
+
+   if (bson_iter_init_find(&iter, spec, "v")) {
+      if (bson_iter_type(&iter) == BSON_TYPE_INT32) {
+         v = bson_iter_int32(&iter);
+      } else if (bson_iter_type(&iter) == BSON_TYPE_DOUBLE) {
+         v = bson_iter_double(&iter);
+      }
+   }
+
+   /*
+    * Fields with a negative direction in the key pattern are stored in
+    * descending order. Special indexes such as "hashed" are ascending.
+    */
+   if (bson_iter_init_find(&iter, spec, "key") &&
+       (bson_iter_type(&iter) == BSON_TYPE_DOCUMENT) &&
+       bson_iter_recurse(&iter, &child)) {
+      for (i = 0; bson_iter_next(&child) && (i < 32); i++) {
+         switch (bson_iter_type(&child)) {
+         case BSON_TYPE_DOUBLE:
+            dir = bson_iter_double(&child);
+            break;
+         case BSON_TYPE_INT32:
+            dir = bson_iter_int32(&child);
+            break;
+         case BSON_TYPE_INT64:
+            dir = bson_iter_int64(&child);
+            break;
+         default:
+            dir = 1;
+            break;
+         }
+         if (dir < 0) {
+            cursor->ordering |= (1U << i);
+         }
+      }
+   }
+
+   bson_destroy(spec);
+
+   if (v != 1) {
+      errno = ENOTSUP;
+      return -1;
+   }
+
+   cursor->head = details.head;
+
+   if ((details.head.fileno != -1) &&
+       !!btree_cursor_push(cursor, &details.head)) {
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_init_id --
+ *
+ *       Initialize @cursor on the "_id_" index of @ns.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set. ENOENT if the
+ *       collection has no _id index.
+ *
+ * Side effects:
+ *       cursor is initialized and must be released with
+ *       btree_cursor_destroy().
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+btree_cursor_init_id (btree_cursor_t *cursor, /* OUT */
+                      ns_t *ns)               /* IN */
+{
+   int index;
+
+   if (!!ns_index_find(ns, "_id_", &index)) {
+      return -1;
+   }
+
+   return btree_cursor_init(cursor, ns, index);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_seek --
+ *
+ *       Position @cursor so that the next call to btree_cursor_next()
+ *       moves to the first key that is not less than @key. Field names
+ *       of @key are ignored, so { "_id" : 5 } may be used to seek an _id
+ *       index.
+ *
+ *       The seek descends from the head bucket, binary searching each
+ *       bucket on the way, so only one bucket per level is touched.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       The previous key and record are invalidated.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+btree_cursor_seek (btree_cursor_t *cursor, /* IN */
+                   const bson_t *key)      /* IN */
+{
+   const btree_bucket_t *bucket;
+   btree_frame_t *frame;
+   file_loc_t child;
+   bson_t probe;
+   int lo;
+   int hi;
+   int mid;
+   int cmp;
+
+   if (!cursor || !key) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (cursor->has_key) {
+      bson_destroy(&cursor->key);
+      cursor->has_key = FALSE;
+   }
+
+   while (cursor->depth) {
+      btree_cursor_pop(cursor);
+   }
+
+   if (cursor->head.fileno == -1) {
+      return 0;
+   }
+
+   child = cursor->head;
+
+   do {
+      if (!!btree_cursor_push(cursor, &child)) {
+         return -1;
+      }
+
+      frame = &cursor->frames[cursor->depth - 1];
+      bucket = frame->bucket;
+
+      /*
+       * Find the first key not less than @key. Everything before it,
+       * including its left child, sorts before @key.
+       */
+      lo = 0;
+      hi = bucket->n;
+
+      while (lo < hi) {
+         mid = lo + (hi - lo) / 2;
+
+         bson_init(&probe);
+         if (!!btree_bucket_key(bucket, mid, &probe)) {
+            bson_destroy(&probe);
+            return -1;
+         }
+         cmp = btree_key_compare(&probe, key, cursor->ordering);
+         bson_destroy(&probe);
+
+         if (cmp < 0) {
+            lo = mid + 1;
+         } else {
+            hi = mid;
+         }
+      }
+
+      frame->pos = lo;
+      frame->visited = TRUE;
+
+      if (lo < bucket->n) {
+         child = btree_loc(&btree_key_node(bucket, lo)->prev_child);
+      } else {
+         child = btree_loc(&bucket->next_child);
+      }
+   } while (child.fileno != -1);
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_find --
+ *
+ *       Look up the record whose key equals @key, such as { "_id" : 5 }
+ *       on an _id index. If the key occurs more than once the first
+ *       match is returned; further matches may be read with
+ *       btree_cursor_next() and btree_cursor_compare().
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set. ENOENT if there
+ *       is no such key.
+ *
+ * Side effects:
+ *       The cursor is positioned on the key and record is initialized as
+ *       with btree_cursor_record().
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+btree_cursor_find (btree_cursor_t *cursor, /* IN */
+                   const bson_t *key,      /* IN */
+                   record_t *record)       /* OUT */
+{
+   if (!!btree_cursor_seek(cursor, key) ||
+       !!btree_cursor_next(cursor)) {
+      return -1;
+   }
+
+   if (!!btree_cursor_compare(cursor, key)) {
+      errno = ENOENT;
+      return -1;
+   }
+
+   return btree_cursor_record(cursor, record);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_next --
+ *
+ *       Advance @cursor to the next key in index order. Each bucket's
+ *       child preceding a key is walked before the key, and the bucket's
+ *       last child after all of its keys. Unused keys are skipped.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set to ENOENT when
+ *       there are no more keys.
+ *
+ * Side effects:
+ *       The previous key and record are invalidated.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+btree_cursor_next (btree_cursor_t *cursor) /* IN */
+{
+   const btree_key_node_t *node;
+   const btree_bucket_t *bucket;
+   btree_frame_t *frame;
+   file_loc_t child;
+
+   if (!cursor) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (cursor->has_key) {
+      bson_destroy(&cursor->key);
+      cursor->has_key = FALSE;
+   }
+
+   while (cursor->depth) {
+      frame = &cursor->frames[cursor->depth - 1];
+      bucket = frame->bucket;
+
+      if (!frame->visited) {
+         frame->visited = TRUE;
+         if (frame->pos < bucket->n) {
+            child = btree_loc(&btree_key_node(bucket, frame->pos)->prev_child);
+         } else {
+            child = btree_loc(&bucket->next_child);
+         }
+         if (child.fileno != -1) {
+            if (!!btree_cursor_push(cursor, &child)) {
+               return -1;
+            }
+            continue;
+         }
+      }
+
+      if (frame->pos == bucket->n) {
+         btree_cursor_pop(cursor);
+         continue;
+      }
+
+      node = btree_key_node(bucket, frame->pos++);
+      frame->visited = FALSE;
+
+      /*
+       * Keys are marked unused by setting the low bit of their record
+       * offset, which is otherwise always a multiple of 4.
+       */
+      if (node->record_loc.offset & 1) {
+         continue;
+      }
+
+      bson_init(&cursor->key);
+      cursor->has_key = TRUE;
+
+      if (!!btree_bucket_key(bucket, frame->pos - 1, &cursor->key)) {
+         return -1;
+      }
+
+      cursor->loc = btree_loc(&node->record_loc);
+
+      return 0;
+   }
+
+   errno = ENOENT;
+   return -1;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_compare --
+ *
+ *       Compare the current key with @key in index order, ignoring field
+ *       names. Used to stop a range scan started with btree_cursor_seek().
+ *
+ * Returns:
+ *       Less than, equal to or greater than zero if the current key sorts
+ *       before, equal to or after @key.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+btree_cursor_compare (btree_cursor_t *cursor, /* IN */
+                      const bson_t *key)      /* IN */
+{
+   bson_return_val_if_fail(cursor, 0);
+   bson_return_val_if_fail(cursor->has_key, 0);
+   bson_return_val_if_fail(key, 0);
+
+   return btree_key_compare(&cursor->key, key, cursor->ordering);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_key --
+ *
+ *       Fetch the current key. Its elements have empty field names, one
+ *       for each field of the index key pattern.
+ *
+ * Returns:
+ *       The key, valid until the cursor is advanced, or NULL.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+const bson_t *
+btree_cursor_key (btree_cursor_t *cursor) /* IN */
+{
+   bson_return_val_if_fail(cursor, NULL);
+
+   return cursor->has_key ? &cursor->key : NULL;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_record --
+ *
+ *       Resolve the record location of the current key to a record_t in
+ *       the data files, for use with record_bson().
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       The record's data file is pinned until the next call or until
+ *       the cursor is destroyed.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+btree_cursor_record (btree_cursor_t *cursor, /* IN */
+                     record_t *record)       /* OUT */
+{
+   if (!cursor || !record) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (!cursor->has_key) {
+      errno = ENOENT;
+      return -1;
+   }
+
+   if (cursor->pinned != -1) {
+      db_file_release(cursor->db, cursor->pinned);
+      cursor->pinned = -1;
+   }
+
+   if (!!btree_record_at(cursor->db, &cursor->loc, 5, record)) {
+      return -1;
+   }
+
+   cursor->pinned = cursor->loc.fileno;
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * btree_cursor_destroy --
+ *
+ *       Release the buckets and records pinned by @cursor.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+btree_cursor_destroy (btree_cursor_t *cursor) /* IN */
+{
+   bson_return_if_fail(cursor);
+
+   while (cursor->depth) {
+      btree_cursor_pop(cursor);
+   }
+
+   if (cursor->pinned != -1) {
+      db_file_release(cursor->db, cursor->pinned);
+   }
+
+   if (cursor->has_key) {
+      bson_destroy(&cursor->key);
+   }
+
+   memset(cursor, 0, sizeof *cursor);
+   cursor->pinned = -1;
+}
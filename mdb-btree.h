@@ -0,0 +1,149 @@
+/* mdb-btree.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_BTREE_H
+#define MDB_BTREE_H
+
+
+#include <bson.h>
+
+#include "mdb.h"
+
+
+BSON_BEGIN_DECLS
+
+
+/*
+ * Indexes are B-trees whose buckets are stored as records in the extents
+ * of the index namespace, such as "db.coll.$_id_". The head bucket of each
+ * index is found in the index_details_t of the collection namespace.
+ *
+ * Only the v1 index format (the default since MongoDB 2.0) is supported.
+ * Its keys are usually stored in a compact encoding rather than BSON, and
+ * child and record locations are packed into 7 bytes.
+ *
+ * Keys are compared in the server's order: first by the canonical order of
+ * their types (MinKey, null, numbers, strings, documents, arrays, binary,
+ * ObjectId, booleans, dates, ...), then by value, with the direction of
+ * each field taken from the index key pattern. Strings compare bytewise.
+ */
+
+
+#define BTREE_BUCKET_SIZE  (8192 - 16)
+#define BTREE_MAX_DEPTH    64
+
+
+#pragma pack(push, 1)
+typedef struct {
+   bson_int32_t offset;
+   bson_uint8_t fileno[3];
+} btree_loc_t;
+#pragma pack(pop)
+
+
+BSON_STATIC_ASSERT(sizeof(btree_loc_t) == 7);
+
+
+#pragma pack(push, 1)
+typedef struct {
+   btree_loc_t    prev_child;
+   btree_loc_t    record_loc;
+   unsigned short key_offset;
+} btree_key_node_t;
+#pragma pack(pop)
+
+
+BSON_STATIC_ASSERT(sizeof(btree_key_node_t) == 16);
+
+
+#pragma pack(push, 1)
+typedef struct {
+   btree_loc_t    parent;
+   btree_loc_t    next_child;
+   unsigned short flags;
+   unsigned short empty_size;
+   unsigned short top_size;
+   unsigned short n;
+   char           data[4];
+} btree_bucket_t;
+#pragma pack(pop)
+
+
+BSON_STATIC_ASSERT(offsetof(btree_bucket_t, data) == 22);
+
+
+#define BTREE_BODY_SIZE (BTREE_BUCKET_SIZE - offsetof(btree_bucket_t, data))
+
+
+typedef struct
+{
+   file_loc_t            loc;
+   const btree_bucket_t *bucket;
+   int                   pos;
+   int                   visited;
+} btree_frame_t;
+
+
+typedef struct _btree_cursor_t btree_cursor_t;
+
+
+struct _btree_cursor_t
+{
+   db_t          *db;
+   file_loc_t     head;
+   bson_uint32_t  ordering;
+   btree_frame_t  frames[BTREE_MAX_DEPTH];
+   int            depth;
+   bson_t         key;
+   int            has_key;
+   file_loc_t     loc;
+   int            pinned;
+};
+
+
+bson_t       *ns_index_spec        (ns_t *ns,
+                                    int index);
+int           ns_index_find        (ns_t *ns,
+                                    const char *name,
+                                    int *index);
+int           btree_cursor_init    (btree_cursor_t *cursor,
+                                    ns_t *ns,
+                                    int index);
+int           btree_cursor_init_id (btree_cursor_t *cursor,
+                                    ns_t *ns);
+int           btree_cursor_seek    (btree_cursor_t *cursor,
+                                    const bson_t *key);
+int           btree_cursor_find    (btree_cursor_t *cursor,
+                                    const bson_t *key,
+                                    record_t *record);
+int           btree_cursor_next    (btree_cursor_t *cursor);
+int           btree_cursor_compare (btree_cursor_t *cursor,
+                                    const bson_t *key);
+const bson_t *btree_cursor_key     (btree_cursor_t *cursor);
+int           btree_cursor_record  (btree_cursor_t *cursor,
+                                    record_t *record);
+void          btree_cursor_destroy (btree_cursor_t *cursor);
+int           btree_key_compare    (const bson_t *a,
+                                    const bson_t *b,
+                                    bson_uint32_t ordering);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_BTREE_H */
@@ -0,0 +1,224 @@
+/* mdb-buffer.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mdb-buffer.h"
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * buffer_init --
+ *
+ *       Initialize an empty buffer. No memory is allocated until data
+ *       is appended.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buffer is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+buffer_init (buffer_t *buffer) /* OUT */
+{
+   bson_return_if_fail(buffer);
+
+   memset(buffer, 0, sizeof *buffer);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * buffer_reserve --
+ *
+ *       Make room for @len more bytes at the end of the buffer and
+ *       return a pointer to them. The caller must fill in all @len bytes
+ *       since they are counted as part of the buffer immediately.
+ *
+ * Returns:
+ *       A pointer to @len writable bytes.
+ *
+ * Side effects:
+ *       buffer may be reallocated; previous data pointers are invalid.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+char *
+buffer_reserve (buffer_t *buffer, /* IN */
+                size_t len)       /* IN */
+{
+   size_t alloc;
+   char *ret;
+
+   BSON_ASSERT(buffer);
+
+   if ((buffer->len + len) > buffer->alloc) {
+      alloc = buffer->alloc ? buffer->alloc : 4096;
+      while (alloc < (buffer->len + len)) {
+         alloc *= 2;
+      }
+      buffer->data = bson_realloc(buffer->data, alloc);
+      buffer->alloc = alloc;
+   }
+
+   ret = buffer->data + buffer->len;
+   buffer->len += len;
+
+   return ret;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * buffer_append --
+ *
+ *       Append @len bytes from @data to the buffer.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buffer may be reallocated.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+buffer_append (buffer_t *buffer,  /* IN */
+               const void *data,  /* IN */
+               size_t len)        /* IN */
+{
+   bson_return_if_fail(buffer);
+   bson_return_if_fail(data || !len);
+
+   if (len) {
+      memcpy(buffer_reserve(buffer, len), data, len);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * buffer_clear --
+ *
+ *       Discard the contents of the buffer while keeping the allocation.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buffer is emptied.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+buffer_clear (buffer_t *buffer) /* IN */
+{
+   bson_return_if_fail(buffer);
+
+   buffer->len = 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * buffer_flush --
+ *
+ *       Write the entire contents of the buffer to @fd, retrying short
+ *       writes, and then clear the buffer.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       buffer is emptied on success.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+buffer_flush (buffer_t *buffer, /* IN */
+              int fd)           /* IN */
+{
+   const char *data;
+   size_t len;
+   ssize_t n;
+
+   if (!buffer || fd < 0) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   data = buffer->data;
+   len = buffer->len;
+
+   while (len) {
+      if (-1 == (n = write(fd, data, len))) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return -1;
+      }
+      data += n;
+      len -= n;
+   }
+
+   buffer->len = 0;
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * buffer_destroy --
+ *
+ *       Release the memory held by the buffer.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buffer is reset to empty.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+buffer_destroy (buffer_t *buffer) /* IN */
+{
+   bson_return_if_fail(buffer);
+
+   bson_free(buffer->data);
+   memset(buffer, 0, sizeof *buffer);
+}
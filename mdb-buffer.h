@@ -0,0 +1,61 @@
+/* mdb-buffer.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_BUFFER_H
+#define MDB_BUFFER_H
+
+
+#include <bson.h>
+#include <stddef.h>
+
+
+BSON_BEGIN_DECLS
+
+
+typedef struct _buffer_t buffer_t;
+
+
+/*
+ * A growable byte buffer. Unlike bson_string_t it may contain embedded
+ * NUL bytes, so it is suitable for both JSON text and raw BSON. Clearing
+ * a buffer keeps its allocation so that it can be reused as an arena.
+ */
+struct _buffer_t
+{
+   char   *data;
+   size_t  len;
+   size_t  alloc;
+};
+
+
+void  buffer_init    (buffer_t *buffer);
+char *buffer_reserve (buffer_t *buffer,
+                      size_t len);
+void  buffer_append  (buffer_t *buffer,
+                      const void *data,
+                      size_t len);
+void  buffer_clear   (buffer_t *buffer);
+int   buffer_flush   (buffer_t *buffer,
+                      int fd);
+void  buffer_destroy (buffer_t *buffer);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_BUFFER_H */
@@ -0,0 +1,881 @@
+/* mdb-carve.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mdb-carve.h"
+#include "mdb-pool.h"
+
+
+/*
+ * Data files are scanned in chunks so that a handful of large files is
+ * spread over all workers as well as many small ones. Chunks start at
+ * multiples of this size, which keeps them page aligned.
+ */
+#define CARVE_CHUNK (64 * 1024 * 1024)
+
+
+/*
+ * The rebuilt namespace table is at least as large as the server's
+ * default .ns file, and is kept sparse so that every namespace is found
+ * within the probe limit of db_namespace_lookup().
+ */
+#define CARVE_NS_SIZE (16 * 1024 * 1024)
+#define CARVE_NS_LOAD 20
+
+
+typedef struct
+{
+   int          fileno;
+   bson_int64_t offset;
+   bson_int64_t len;
+} carve_task_t;
+
+
+typedef struct
+{
+   file_loc_t   loc;
+   file_loc_t   next;
+   file_loc_t   prev;
+   bson_int32_t length;
+   int          ns;
+   int          succ;
+   int          pred;
+   int          done;
+} carve_extent_t;
+
+
+typedef struct
+{
+   char         name[128];
+   bson_int32_t hash;
+   int          first;
+   int          count;
+} carve_ns_t;
+
+
+typedef struct
+{
+   file_loc_t loc;
+   file_loc_t next;
+} carve_link_t;
+
+
+typedef struct
+{
+   db_t           *db;
+   carve_task_t   *tasks;
+   int             ntasks;
+   carve_extent_t *extents;
+   int             nextents;
+   int             alloc;
+   carve_ns_t     *names;
+   int             nnames;
+   int            *table;
+   int             tablesize;
+   carve_stats_t   stats;
+} carve_scan_t;
+
+
+struct _carve_t
+{
+   carve_link_t *links;
+   int           nlinks;
+};
+
+
+static int
+carve_loc_compare (const void *a, /* IN */
+                   const void *b) /* IN */
+{
+   const file_loc_t *x = a;
+   const file_loc_t *y = b;
+
+   if (x->fileno != y->fileno) {
+      return (x->fileno < y->fileno) ? -1 : 1;
+   }
+
+   return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_find --
+ *
+ *       Finds the next EXTENT_MAGIC at a 4-byte aligned position between
+ *       @p and @end. Extents are allocated at offsets that are multiples
+ *       of 256 bytes, so no header is missed. With SSE2, 64 bytes are
+ *       compared per iteration and only a hit is narrowed down one word
+ *       at a time.
+ *
+ * Returns:
+ *       A pointer to the magic, or @end if there is none.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static const char *
+carve_find (const char *p,   /* IN */
+            const char *end) /* IN */
+{
+   const bson_int32_t magic = EXTENT_MAGIC;
+#ifdef __SSE2__
+   const __m128i needle = _mm_set1_epi32(magic);
+   __m128i a;
+   __m128i b;
+   __m128i c;
+   __m128i d;
+
+   while ((end - p) >= 64) {
+      a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)p), needle);
+      b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + 16)), needle);
+      c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + 32)), needle);
+      d = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + 48)), needle);
+      if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b),
+                                         _mm_or_si128(c, d)))) {
+         break;
+      }
+      p += 64;
+   }
+#endif
+
+   for (; (end - p) >= (ptrdiff_t)sizeof magic; p += sizeof magic) {
+      if (!memcmp(p, &magic, sizeof magic)) {
+         return p;
+      }
+   }
+
+   return end;
+}
+
+
+static int
+carve_loc_valid (const file_loc_t *loc, /* IN */
+                 int filescnt)          /* IN */
+{
+   return ((loc->fileno == -1) ||
+           ((loc->fileno >= 0) && (loc->fileno < filescnt) &&
+            (loc->offset >= 0)));
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_check --
+ *
+ *       Checks whether the EXTENT_MAGIC at @offset of data file @fileno
+ *       starts a real extent header rather than a document that happens
+ *       to contain the same bytes. A header knows its own location, names
+ *       a namespace, and describes an extent that fits in the file.
+ *
+ * Returns:
+ *       TRUE if the header is plausible.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+carve_check (const db_t *db,      /* IN */
+             const char *map,     /* IN */
+             size_t maplen,       /* IN */
+             int fileno,          /* IN */
+             bson_int64_t offset) /* IN */
+{
+   extent_header_t ehdr;
+
+   if ((offset > INT32_MAX) || ((offset + sizeof ehdr) > maplen)) {
+      return FALSE;
+   }
+
+   memcpy(&ehdr, map + offset, sizeof ehdr);
+
+   return ((ehdr.my_loc.fileno == fileno) &&
+           (ehdr.my_loc.offset == offset) &&
+           (ehdr.length >= (bson_int32_t)sizeof ehdr) &&
+           ((offset + ehdr.length) <= maplen) &&
+           ehdr.namespace[0] &&
+           memchr(ehdr.namespace, '\0', sizeof ehdr.namespace) &&
+           carve_loc_valid(&ehdr.next, db->filescnt) &&
+           carve_loc_valid(&ehdr.prev, db->filescnt));
+}
+
+
+static void
+carve_advise (const db_t *db,    /* IN */
+              const char *start, /* IN */
+              size_t len,        /* IN */
+              int done)          /* IN */
+{
+   if (!db->advise || !len) {
+      return;
+   }
+
+   if (done) {
+#ifdef MADV_COLD
+      madvise((void *)start, len, MADV_COLD);
+#endif
+      madvise((void *)start, len, MADV_DONTNEED);
+   } else {
+      madvise((void *)start, len, MADV_WILLNEED);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_task --
+ *
+ *       Scans one chunk of a data file. The buffer receives the number
+ *       of EXTENT_MAGIC matches as a bson_uint64_t, followed by a copy of
+ *       each valid extent header in the order found.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       The data file is mapped. Readahead is requested for the chunk,
+ *       and its pages are dropped from this process afterwards.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+carve_task (void *data,       /* IN */
+            int index,        /* IN */
+            buffer_t *buffer) /* OUT */
+{
+   carve_scan_t *scan = data;
+   carve_task_t *task = &scan->tasks[index];
+   bson_uint64_t candidates = 0;
+   const char *start;
+   const char *end;
+   const char *map;
+   const char *p;
+   size_t maplen;
+
+   if (!(map = db_file_acquire(scan->db, task->fileno, &maplen))) {
+      return -1;
+   }
+
+   buffer_append(buffer, &candidates, sizeof candidates);
+
+   /*
+    * A file that shrank since it was sized is scanned as far as it goes.
+    */
+   if ((size_t)task->offset < maplen) {
+      start = map + task->offset;
+      end = ((size_t)(task->offset + task->len) < maplen) ?
+            start + task->len : map + maplen;
+
+      carve_advise(scan->db, start, end - start, FALSE);
+
+      for (p = start; (p = carve_find(p, end)) != end; p += 4) {
+         candidates++;
+         if (carve_check(scan->db, map, maplen, task->fileno, p - map)) {
+            buffer_append(buffer, p, sizeof(extent_header_t));
+         }
+      }
+
+      carve_advise(scan->db, start, end - start, TRUE);
+   }
+
+   memcpy(buffer->data, &candidates, sizeof candidates);
+   db_file_release(scan->db, task->fileno);
+
+   return 0;
+}
+
+
+static void
+carve_rehash (carve_scan_t *scan) /* IN */
+{
+   unsigned mask;
+   unsigned i;
+   int k;
+
+   bson_free(scan->table);
+
+   scan->tablesize = scan->tablesize ? scan->tablesize * 2 : 64;
+   scan->table = bson_malloc(scan->tablesize * sizeof *scan->table);
+   memset(scan->table, 0xff, scan->tablesize * sizeof *scan->table);
+   mask = scan->tablesize - 1;
+
+   for (k = 0; k < scan->nnames; k++) {
+      for (i = scan->names[k].hash & mask;
+           scan->table[i] != -1;
+           i = (i + 1) & mask) {
+      }
+      scan->table[i] = k;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_intern --
+ *
+ *       Looks up the namespace @name, adding it if it has not been seen.
+ *
+ * Returns:
+ *       The index of the namespace in scan->names.
+ *
+ * Side effects:
+ *       The namespace may be added.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+carve_intern (carve_scan_t *scan, /* IN */
+              const char *name)   /* IN */
+{
+   bson_int32_t hash;
+   carve_ns_t *ns;
+   unsigned mask;
+   unsigned i;
+   size_t len;
+
+   if ((scan->nnames * 2) >= scan->tablesize) {
+      carve_rehash(scan);
+   }
+
+   hash = ns_hash(name);
+   mask = scan->tablesize - 1;
+
+   for (i = hash & mask; scan->table[i] != -1; i = (i + 1) & mask) {
+      ns = &scan->names[scan->table[i]];
+      if ((ns->hash == hash) && !strcmp(ns->name, name)) {
+         return scan->table[i];
+      }
+   }
+
+   scan->names = bson_realloc(scan->names,
+                              (scan->nnames + 1) * sizeof *scan->names);
+   ns = &scan->names[scan->nnames];
+   memset(ns, 0, sizeof *ns);
+   len = strnlen(name, sizeof ns->name - 1);
+   memcpy(ns->name, name, len);
+   ns->name[len] = '\0';
+   ns->hash = hash;
+   scan->table[i] = scan->nnames;
+
+   return scan->nnames++;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_emit --
+ *
+ *       Adds the extent headers found by a task. Tasks are emitted in
+ *       file and offset order, so the extents come out sorted by
+ *       location, and a header that starts inside the extent before it
+ *       is a stale copy that was overwritten by that extent.
+ *
+ * Returns:
+ *       0.
+ *
+ * Side effects:
+ *       Extents and namespaces are added to @data.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+carve_emit (void *data,       /* IN */
+            int index,        /* IN */
+            buffer_t *buffer) /* IN */
+{
+   const extent_header_t *ehdr;
+   carve_scan_t *scan = data;
+   carve_extent_t *ext;
+   carve_extent_t *last;
+   bson_uint64_t candidates;
+   size_t off;
+
+   memcpy(&candidates, buffer->data, sizeof candidates);
+   scan->stats.candidates += candidates;
+   scan->stats.bytes += scan->tasks[index].len;
+
+   for (off = sizeof candidates;
+        (off + sizeof *ehdr) <= buffer->len;
+        off += sizeof *ehdr) {
+      ehdr = (const extent_header_t *)(buffer->data + off);
+
+      if (scan->nextents) {
+         last = &scan->extents[scan->nextents - 1];
+         if ((last->loc.fileno == ehdr->my_loc.fileno) &&
+             (ehdr->my_loc.offset <
+              ((bson_int64_t)last->loc.offset + last->length))) {
+            scan->stats.overlapping++;
+            continue;
+         }
+      }
+
+      if (scan->nextents == scan->alloc) {
+         scan->alloc = scan->alloc ? scan->alloc * 2 : 256;
+         scan->extents = bson_realloc(scan->extents,
+                                      scan->alloc * sizeof *scan->extents);
+      }
+
+      ext = &scan->extents[scan->nextents++];
+      ext->loc = ehdr->my_loc;
+      ext->next = ehdr->next;
+      ext->prev = ehdr->prev;
+      ext->length = ehdr->length;
+      ext->ns = carve_intern(scan, ehdr->namespace);
+      ext->succ = -1;
+      ext->pred = -1;
+      ext->done = FALSE;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_link --
+ *
+ *       Links each extent to its successor. A link is only trusted if
+ *       both ends agree on it: the next pointer of one extent and the
+ *       prev pointer of the other, within the same namespace. Since each
+ *       extent has one of each, no extent gains two successors or two
+ *       predecessors.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       succ and pred of the extents are set.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+carve_link (carve_scan_t *scan) /* IN */
+{
+   carve_extent_t *found;
+   carve_extent_t *ext;
+   int i;
+
+   for (i = 0; i < scan->nextents; i++) {
+      ext = &scan->extents[i];
+
+      if (ext->next.fileno == -1) {
+         continue;
+      }
+
+      found = bsearch(&ext->next, scan->extents, scan->nextents,
+                      sizeof *scan->extents, carve_loc_compare);
+
+      if (found && (found != ext) && (found->ns == ext->ns) &&
+          !carve_loc_compare(&found->prev, &ext->loc)) {
+         ext->succ = found - scan->extents;
+         found->pred = i;
+      }
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_order --
+ *
+ *       Puts the extents of each namespace in chain order. The intact
+ *       chain starting at the extent without a prev pointer comes first.
+ *       Chains cut off by damage follow in the order of their first
+ *       extent on disk, and extents that only link to each other in a
+ *       cycle come last.
+ *
+ * Returns:
+ *       An array of extent indexes grouped by namespace, which must be
+ *       freed with bson_free().
+ *
+ * Side effects:
+ *       first and count of the namespaces are set.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int *
+carve_order (carve_scan_t *scan) /* IN */
+{
+   carve_extent_t *ext;
+   carve_ns_t *ns;
+   int *filled;
+   int *order;
+   int first = 0;
+   int start;
+   int pass;
+   int i;
+   int j;
+
+   order = bson_malloc((scan->nextents + 1) * sizeof *order);
+   filled = bson_malloc0((scan->nnames + 1) * sizeof *filled);
+
+   for (i = 0; i < scan->nextents; i++) {
+      scan->names[scan->extents[i].ns].count++;
+   }
+
+   for (i = 0; i < scan->nnames; i++) {
+      scan->names[i].first = first;
+      first += scan->names[i].count;
+   }
+
+   for (pass = 0; pass < 3; pass++) {
+      for (i = 0; i < scan->nextents; i++) {
+         ext = &scan->extents[i];
+
+         switch (pass) {
+         case 0:
+            start = (ext->pred == -1) && (ext->prev.fileno == -1);
+            break;
+         case 1:
+            start = (ext->pred == -1);
+            break;
+         default:
+            start = TRUE;
+            break;
+         }
+
+         if (ext->done || !start) {
+            continue;
+         }
+
+         ns = &scan->names[ext->ns];
+         scan->stats.segments++;
+
+         for (j = i; (j != -1) && !scan->extents[j].done;
+              j = scan->extents[j].succ) {
+            scan->extents[j].done = TRUE;
+            order[ns->first + filled[ext->ns]++] = j;
+         }
+      }
+   }
+
+   bson_free(filled);
+
+   return order;
+}
+
+
+static ns_hash_node_t *
+carve_node (ns_hash_node_t *nodes, /* IN */
+            int nnodes,            /* IN */
+            bson_int32_t hash)     /* IN */
+{
+   int maxchain;
+   int chain = 0;
+   int start;
+   int i;
+
+   maxchain = (int)(nnodes * 0.05);
+   start = i = hash % nnodes;
+
+   do {
+      if (!nodes[i].hash) {
+         return &nodes[i];
+      }
+      i = (i + 1) % nnodes;
+   } while ((++chain < maxchain) && (i != start));
+
+   return NULL;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_namespaces --
+ *
+ *       Builds the namespace table from the carved extents and installs
+ *       it as the .ns file of @db. Each namespace is placed where the
+ *       server would have hashed it, so db_namespace_lookup() works, and
+ *       its details point at the first and last extent of its rebuilt
+ *       chain. The deleted lists and indexes cannot be recovered this
+ *       way and are left empty.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       db->nsfile is set to an anonymous read-only mapping.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+carve_namespaces (db_t *db,           /* IN */
+                  carve_scan_t *scan, /* IN */
+                  const int *order)   /* IN */
+{
+   const carve_extent_t *first;
+   const carve_extent_t *last;
+   ns_hash_node_t *nodes;
+   ns_hash_node_t *node;
+   ns_details_t *details;
+   carve_ns_t *ns;
+   size_t maplen;
+   void *map;
+   int nnodes;
+   int i;
+   int k;
+
+   nnodes = CARVE_NS_SIZE / sizeof *nodes;
+   while ((scan->nnames * CARVE_NS_LOAD) > nnodes) {
+      nnodes *= 2;
+   }
+
+again:
+   maplen = (size_t)nnodes * sizeof *nodes;
+   map = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (map == MAP_FAILED) {
+      return -1;
+   }
+
+   nodes = map;
+
+   for (k = 0; k < scan->nnames; k++) {
+      ns = &scan->names[k];
+
+      if (!(node = carve_node(nodes, nnodes, ns->hash))) {
+         munmap(map, maplen);
+         nnodes *= 2;
+         goto again;
+      }
+
+      first = &scan->extents[order[ns->first]];
+      last = &scan->extents[order[ns->first + ns->count - 1]];
+
+      node->hash = ns->hash;
+      memcpy(node->key, ns->name, sizeof node->key);
+
+      details = (ns_details_t *)node->details;
+      details->first_extent = first->loc;
+      details->last_extent = last->loc;
+      details->last_extent_size = last->length;
+      details->padding_factor = 1.0;
+      details->cap_extent.fileno = -1;
+      details->cap_first_new_record.fileno = -1;
+      for (i = 0; i < N_BUCKETS; i++) {
+         details->buckets[i].fileno = -1;
+      }
+   }
+
+   mprotect(map, maplen, PROT_READ);
+
+   db->nsfile.fileno = -1;
+   db->nsfile.fd = -1;
+   db->nsfile.map = map;
+   db->nsfile.maplen = maplen;
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_scan --
+ *
+ *       Scans all data files of @db for extent headers using @jobs
+ *       threads, and rebuilds its namespaces from them.
+ *
+ * Returns:
+ *       A carve_t to be freed with carve_destroy() on success --
+ *       otherwise NULL and errno is set.
+ *
+ * Side effects:
+ *       db->nsfile is set to the rebuilt namespace table. @stats, if
+ *       not NULL, is filled in.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+carve_t *
+carve_scan (db_t *db,             /* IN */
+            int jobs,             /* IN */
+            carve_stats_t *stats) /* OUT */
+{
+   carve_scan_t scan;
+   carve_extent_t *ext;
+   carve_ns_t *ns;
+   carve_t *carve = NULL;
+   struct stat st;
+   bson_int64_t offset;
+   int *order = NULL;
+   int i;
+   int j;
+
+   if (!db) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   memset(&scan, 0, sizeof scan);
+   scan.db = db;
+
+   for (i = 0; i < db->filescnt; i++) {
+      if (!!stat(db->files[i].path, &st)) {
+         goto failure;
+      }
+
+      for (offset = 0; offset < st.st_size; offset += CARVE_CHUNK) {
+         scan.tasks = bson_realloc(scan.tasks,
+                                   (scan.ntasks + 1) * sizeof *scan.tasks);
+         scan.tasks[scan.ntasks].fileno = i;
+         scan.tasks[scan.ntasks].offset = offset;
+         scan.tasks[scan.ntasks].len = BSON_MIN(CARVE_CHUNK,
+                                                st.st_size - offset);
+         scan.ntasks++;
+      }
+   }
+
+   if (!!pool_run(jobs, scan.ntasks, carve_task, carve_emit, &scan)) {
+      goto failure;
+   }
+
+   carve_link(&scan);
+   order = carve_order(&scan);
+
+   if (!!carve_namespaces(db, &scan, order)) {
+      goto failure;
+   }
+
+   /*
+    * The successor of each extent in its rebuilt chain. The links are
+    * indexed like the extents, so they are sorted by location too.
+    */
+   carve = bson_malloc0(sizeof *carve);
+   carve->nlinks = scan.nextents;
+   carve->links = bson_malloc0((scan.nextents + 1) * sizeof *carve->links);
+
+   for (i = 0; i < scan.nnames; i++) {
+      ns = &scan.names[i];
+      for (j = 0; j < ns->count; j++) {
+         ext = &scan.extents[order[ns->first + j]];
+         carve->links[order[ns->first + j]].loc = ext->loc;
+         if ((j + 1) < ns->count) {
+            carve->links[order[ns->first + j]].next =
+               scan.extents[order[ns->first + j + 1]].loc;
+         } else {
+            carve->links[order[ns->first + j]].next.fileno = -1;
+         }
+      }
+   }
+
+   scan.stats.extents = scan.nextents;
+   scan.stats.namespaces = scan.nnames;
+
+   if (stats) {
+      *stats = scan.stats;
+   }
+
+failure:
+   bson_free(order);
+   bson_free(scan.table);
+   bson_free(scan.names);
+   bson_free(scan.extents);
+   bson_free(scan.tasks);
+
+   return carve;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_next --
+ *
+ *       Fetches the successor of the extent at @loc in its rebuilt chain.
+ *
+ * Returns:
+ *       The location of the next extent, with a fileno of -1 at the end
+ *       of the chain, or NULL if @loc is not a carved extent.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+const file_loc_t *
+carve_next (const carve_t *carve,  /* IN */
+            const file_loc_t *loc) /* IN */
+{
+   const carve_link_t *link;
+
+   link = bsearch(loc, carve->links, carve->nlinks, sizeof *carve->links,
+                  carve_loc_compare);
+
+   return link ? &link->next : NULL;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * carve_destroy --
+ *
+ *       Frees @carve. The namespace table belongs to the db_t and is
+ *       unmapped with its .ns file.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+carve_destroy (carve_t *carve) /* IN */
+{
+   bson_return_if_fail(carve);
+
+   bson_free(carve->links);
+   bson_free(carve);
+}
@@ -0,0 +1,58 @@
+/* mdb-carve.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_CARVE_H
+#define MDB_CARVE_H
+
+
+#include "mdb.h"
+
+
+BSON_BEGIN_DECLS
+
+
+/*
+ * Carving rebuilds the namespaces of a database from its data files
+ * alone, for when "dbname.ns" is missing or damaged. Every extent header
+ * names its namespace and links to its neighbours, so the data files are
+ * scanned for EXTENT_MAGIC and the chains are put back together from
+ * those fields.
+ *
+ * The result is a namespace table in anonymous memory that takes the
+ * place of the .ns file, and the rebuilt successor of every extent,
+ * which the extent iterators use instead of the on-disk next link.
+ *
+ * This is internal to the library; callers use db_init_carved().
+ */
+
+
+typedef struct _carve_t carve_t;
+
+
+carve_t          *carve_scan    (db_t *db,
+                                 int jobs,
+                                 carve_stats_t *stats);
+const file_loc_t *carve_next    (const carve_t *carve,
+                                 const file_loc_t *loc);
+void              carve_destroy (carve_t *carve);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_CARVE_H */
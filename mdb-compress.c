@@ -0,0 +1,700 @@
+/* mdb-compress.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "mdb-compress.h"
+
+
+#define ZSTD_FRAME_MAGIC    0xFD2FB528
+#define LZ4_FRAME_MAGIC     0x184D2204
+#define SKIPPABLE_MAGIC     0x184D2A50
+#define SKIPPABLE_MASK      0xFFFFFFF0
+#define SEEK_TABLE_MAGIC    0x184D2A5E
+#define SEEKABLE_MAGIC      0x8F92EAB1
+#define SEEK_TABLE_FOOTER   9
+
+
+static bson_uint32_t
+read_le32 (const bson_uint8_t *data) /* IN */
+{
+   bson_uint32_t v;
+
+   memcpy(&v, data, 4);
+
+   return BSON_UINT32_FROM_LE(v);
+}
+
+
+static void
+append_le32 (buffer_t *out,      /* IN */
+             bson_uint32_t v)    /* IN */
+{
+   v = BSON_UINT32_TO_LE(v);
+   buffer_append(out, &v, 4);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * compress_init --
+ *
+ *       Initialize @compress from @spec, which names the codec and
+ *       optionally the compression level as in "zstd" or "lz4:9".
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set to EINVAL for an
+ *       unknown codec, or ENOTSUP if it was not built in.
+ *
+ * Side effects:
+ *       compress is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+compress_init (compress_t *compress,  /* OUT */
+               const char *spec)      /* IN */
+{
+   const char *level;
+   size_t len;
+
+   if (!compress || !spec) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   memset(compress, 0, sizeof *compress);
+
+   level = strchr(spec, ':');
+   len = level ? (size_t)(level - spec) : strlen(spec);
+
+   if ((len == 4) && !strncmp(spec, "zstd", 4)) {
+      compress->codec = COMPRESS_ZSTD;
+      compress->level = 3;
+   } else if ((len == 3) && !strncmp(spec, "lz4", 3)) {
+      compress->codec = COMPRESS_LZ4;
+      compress->level = 0;
+   } else {
+      errno = EINVAL;
+      return -1;
+   }
+
+#ifndef HAVE_ZSTD
+   if (compress->codec == COMPRESS_ZSTD) {
+      errno = ENOTSUP;
+      return -1;
+   }
+#endif
+
+#ifndef HAVE_LZ4
+   if (compress->codec == COMPRESS_LZ4) {
+      errno = ENOTSUP;
+      return -1;
+   }
+#endif
+
+   if (level) {
+      compress->level = atoi(level + 1);
+   }
+
+   pthread_mutex_init(&compress->mutex, NULL);
+
+   return 0;
+}
+
+
+#ifdef HAVE_ZSTD
+/*
+ *--------------------------------------------------------------------------
+ *
+ * compress_zstd --
+ *
+ *       Compress @len bytes of @data into a single zstd frame appended
+ *       to @out. Compression contexts are expensive to set up, so they
+ *       are kept in @compress and shared between threads one at a time.
+ *
+ * Returns:
+ *       The size of the frame on success -- otherwise -1 and errno is
+ *       set.
+ *
+ * Side effects:
+ *       out grows.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static ssize_t
+compress_zstd (compress_t *compress, /* IN */
+               const void *data,     /* IN */
+               size_t len,           /* IN */
+               buffer_t *out)        /* IN */
+{
+   ZSTD_CCtx *cctx = NULL;
+   size_t bound;
+   size_t ret;
+   char *dst;
+
+   pthread_mutex_lock(&compress->mutex);
+   if (compress->ncontexts) {
+      cctx = compress->contexts[--compress->ncontexts];
+   }
+   pthread_mutex_unlock(&compress->mutex);
+
+   if (!cctx && !(cctx = ZSTD_createCCtx())) {
+      errno = ENOMEM;
+      return -1;
+   }
+
+   bound = ZSTD_compressBound(len);
+   dst = buffer_reserve(out, bound);
+   ret = ZSTD_compressCCtx(cctx, dst, bound, data, len, compress->level);
+   out->len -= bound;
+
+   pthread_mutex_lock(&compress->mutex);
+   compress->contexts = bson_realloc(compress->contexts,
+                                     (compress->ncontexts + 1) *
+                                     sizeof *compress->contexts);
+   compress->contexts[compress->ncontexts++] = cctx;
+   pthread_mutex_unlock(&compress->mutex);
+
+   if (ZSTD_isError(ret)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   out->len += ret;
+
+   return ret;
+}
+#endif
+
+
+#ifdef HAVE_LZ4
+/*
+ *--------------------------------------------------------------------------
+ *
+ * compress_lz4 --
+ *
+ *       Compress @len bytes of @data into a single lz4 frame appended to
+ *       @out. The content size is recorded in the frame header so that
+ *       compress_scan() can find it again.
+ *
+ * Returns:
+ *       The size of the frame on success -- otherwise -1 and errno is
+ *       set.
+ *
+ * Side effects:
+ *       out grows.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static ssize_t
+compress_lz4 (compress_t *compress, /* IN */
+              const void *data,     /* IN */
+              size_t len,           /* IN */
+              buffer_t *out)        /* IN */
+{
+   LZ4F_preferences_t prefs;
+   size_t bound;
+   size_t ret;
+   char *dst;
+
+   memset(&prefs, 0, sizeof prefs);
+   prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+   prefs.frameInfo.contentSize = len;
+   prefs.compressionLevel = compress->level;
+
+   bound = LZ4F_compressFrameBound(len, &prefs);
+   dst = buffer_reserve(out, bound);
+   ret = LZ4F_compressFrame(dst, bound, data, len, &prefs);
+   out->len -= bound;
+
+   if (LZ4F_isError(ret)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   out->len += ret;
+
+   return ret;
+}
+#endif
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * compress_frame --
+ *
+ *       Compress @len bytes of @data into one independent frame, append
+ *       it to @out and add its sizes to @table.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       out grows and an entry is added to table.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+compress_frame (compress_t *compress, /* IN */
+                const void *data,     /* IN */
+                size_t len,           /* IN */
+                buffer_t *out,        /* IN */
+                seek_table_t *table)  /* IN */
+{
+   ssize_t ret = -1;
+
+   if (!compress || (!data && len) || !out || !table) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (len > (UINT32_MAX / 2)) {
+      errno = EFBIG;
+      return -1;
+   }
+
+   switch (compress->codec) {
+#ifdef HAVE_ZSTD
+   case COMPRESS_ZSTD:
+      ret = compress_zstd(compress, data, len, out);
+      break;
+#endif
+#ifdef HAVE_LZ4
+   case COMPRESS_LZ4:
+      ret = compress_lz4(compress, data, len, out);
+      break;
+#endif
+   default:
+      errno = ENOTSUP;
+      break;
+   }
+
+   if (ret == -1) {
+      return -1;
+   }
+
+   seek_table_add(table, ret, len);
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * lz4_frame_sizes --
+ *
+ *       Find the compressed and decompressed size of the lz4 frame at
+ *       @data by walking its block headers.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       csize and dsize are set.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+lz4_frame_sizes (const bson_uint8_t *data, /* IN */
+                 size_t len,               /* IN */
+                 size_t *csize,            /* OUT */
+                 bson_uint64_t *dsize)     /* OUT */
+{
+   bson_uint32_t bsize;
+   bson_uint8_t flg;
+   size_t pos = 6;
+
+   if (len < 7) {
+      errno = EBADF;
+      return -1;
+   }
+
+   flg = data[4];
+
+   /*
+    * Only frames that carry their content size can go into the seek
+    * table, which compress_lz4() always sets.
+    */
+   if (!(flg & 0x08) || (len < 15)) {
+      errno = EBADF;
+      return -1;
+   }
+
+   memcpy(dsize, data + pos, 8);
+   *dsize = BSON_UINT64_FROM_LE(*dsize);
+   pos += 8;
+
+   if (flg & 0x01) {
+      pos += 4;
+   }
+
+   pos++;
+
+   for (;;) {
+      if ((pos + 4) > len) {
+         errno = EBADF;
+         return -1;
+      }
+      bsize = read_le32(data + pos);
+      pos += 4;
+      if (!bsize) {
+         break;
+      }
+      pos += (bsize & 0x7FFFFFFF) + ((flg & 0x10) ? 4 : 0);
+   }
+
+   if (flg & 0x04) {
+      pos += 4;
+   }
+
+   if (pos > len) {
+      errno = EBADF;
+      return -1;
+   }
+
+   *csize = pos;
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * compress_scan --
+ *
+ *       Rebuild the seek table entries for a stream of frames, such as
+ *       the part of an output that was written before a restart. The
+ *       stream must end on a frame boundary. Skippable frames, including
+ *       earlier seek tables, are not listed.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       Entries are added to table.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+compress_scan (const void *data,     /* IN */
+               size_t len,           /* IN */
+               seek_table_t *table)  /* IN */
+{
+   const bson_uint8_t *p = data;
+   bson_uint64_t dsize;
+   bson_uint32_t magic;
+   size_t csize;
+
+   if ((!data && len) || !table) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   while (len) {
+      if (len < 8) {
+         errno = EBADF;
+         return -1;
+      }
+
+      magic = read_le32(p);
+
+      if ((magic & SKIPPABLE_MASK) == SKIPPABLE_MAGIC) {
+         csize = 8 + (size_t)read_le32(p + 4);
+         if (csize > len) {
+            errno = EBADF;
+            return -1;
+         }
+         p += csize;
+         len -= csize;
+         continue;
+      }
+
+      if (magic == LZ4_FRAME_MAGIC) {
+         if (!!lz4_frame_sizes(p, len, &csize, &dsize)) {
+            return -1;
+         }
+#ifdef HAVE_ZSTD
+      } else if (magic == ZSTD_FRAME_MAGIC) {
+         csize = ZSTD_findFrameCompressedSize(p, len);
+         dsize = ZSTD_getFrameContentSize(p, len);
+         if (ZSTD_isError(csize) ||
+             (dsize == ZSTD_CONTENTSIZE_UNKNOWN) ||
+             (dsize == ZSTD_CONTENTSIZE_ERROR)) {
+            errno = EBADF;
+            return -1;
+         }
+#endif
+      } else {
+         errno = EBADF;
+         return -1;
+      }
+
+      if ((csize > UINT32_MAX) || (dsize > UINT32_MAX)) {
+         errno = EFBIG;
+         return -1;
+      }
+
+      seek_table_add(table, csize, dsize);
+      p += csize;
+      len -= csize;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * compress_destroy --
+ *
+ *       Release the resources of @compress.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+compress_destroy (compress_t *compress) /* IN */
+{
+   bson_return_if_fail(compress);
+
+#ifdef HAVE_ZSTD
+   while (compress->ncontexts) {
+      ZSTD_freeCCtx(compress->contexts[--compress->ncontexts]);
+   }
+#endif
+
+   bson_free(compress->contexts);
+   pthread_mutex_destroy(&compress->mutex);
+   memset(compress, 0, sizeof *compress);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * seek_table_init --
+ *
+ *       Initialize an empty seek table.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       table is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+seek_table_init (seek_table_t *table) /* OUT */
+{
+   bson_return_if_fail(table);
+
+   memset(table, 0, sizeof *table);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * seek_table_add --
+ *
+ *       Add a frame of @csize compressed and @dsize decompressed bytes.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       table may be reallocated.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+seek_table_add (seek_table_t *table,  /* IN */
+                bson_uint32_t csize,  /* IN */
+                bson_uint32_t dsize)  /* IN */
+{
+   bson_return_if_fail(table);
+
+   if (table->nentries == table->alloc) {
+      table->alloc = table->alloc ? (table->alloc * 2) : 16;
+      table->entries = bson_realloc(table->entries,
+                                    table->alloc * sizeof *table->entries);
+   }
+
+   table->entries[table->nentries].csize = csize;
+   table->entries[table->nentries].dsize = dsize;
+   table->nentries++;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * seek_table_append --
+ *
+ *       Add the frames of @other after those of @table.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       table may be reallocated.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+seek_table_append (seek_table_t *table,       /* IN */
+                   const seek_table_t *other) /* IN */
+{
+   int i;
+
+   bson_return_if_fail(table);
+   bson_return_if_fail(other);
+
+   for (i = 0; i < other->nentries; i++) {
+      seek_table_add(table, other->entries[i].csize, other->entries[i].dsize);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * seek_table_encode --
+ *
+ *       Append @table to @out as a skippable frame. The layout is that
+ *       of the zstd seekable format: a little-endian pair of compressed
+ *       and decompressed size per frame, followed by the number of
+ *       frames, a descriptor byte without checksums, and the seekable
+ *       magic number, which lets readers find the table from the end of
+ *       the file.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       out grows.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+seek_table_encode (const seek_table_t *table, /* IN */
+                   buffer_t *out)             /* IN */
+{
+   bson_uint8_t descriptor = 0;
+   int i;
+
+   bson_return_if_fail(table);
+   bson_return_if_fail(out);
+
+   append_le32(out, SEEK_TABLE_MAGIC);
+   append_le32(out, (table->nentries * 8) + SEEK_TABLE_FOOTER);
+
+   for (i = 0; i < table->nentries; i++) {
+      append_le32(out, table->entries[i].csize);
+      append_le32(out, table->entries[i].dsize);
+   }
+
+   append_le32(out, table->nentries);
+   buffer_append(out, &descriptor, 1);
+   append_le32(out, SEEKABLE_MAGIC);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * seek_table_clear --
+ *
+ *       Remove all entries from @table, keeping its allocation.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+seek_table_clear (seek_table_t *table) /* IN */
+{
+   bson_return_if_fail(table);
+
+   table->nentries = 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * seek_table_destroy --
+ *
+ *       Release the memory held by @table.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+seek_table_destroy (seek_table_t *table) /* IN */
+{
+   bson_return_if_fail(table);
+
+   bson_free(table->entries);
+   memset(table, 0, sizeof *table);
+}
@@ -0,0 +1,109 @@
+/* mdb-compress.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_COMPRESS_H
+#define MDB_COMPRESS_H
+
+
+#include <bson.h>
+#include <pthread.h>
+
+#include "mdb-buffer.h"
+
+
+BSON_BEGIN_DECLS
+
+
+/*
+ * Framed compression for output streams. Every block of output is
+ * compressed into an independent zstd or lz4 frame, so blocks can be
+ * compressed on different threads and simply concatenated, and the result
+ * is a regular stream for the zstd and lz4 command line tools.
+ *
+ * A seek table listing the compressed and decompressed size of every
+ * frame is appended in a skippable frame, using the layout of the zstd
+ * seekable format. Readers use it to split the stream and decompress the
+ * parts in parallel; decompressors that do not know about it skip it.
+ *
+ * The codecs are optional and only available when built with HAVE_ZSTD
+ * and HAVE_LZ4 respectively.
+ */
+#define COMPRESS_BLOCK_SIZE (1024 * 1024)
+
+
+typedef enum
+{
+   COMPRESS_ZSTD = 1,
+   COMPRESS_LZ4  = 2,
+} compress_codec_t;
+
+
+typedef struct
+{
+   bson_uint32_t csize;
+   bson_uint32_t dsize;
+} seek_entry_t;
+
+
+typedef struct
+{
+   seek_entry_t *entries;
+   int           nentries;
+   int           alloc;
+} seek_table_t;
+
+
+typedef struct
+{
+   compress_codec_t  codec;
+   int               level;
+   pthread_mutex_t   mutex;
+   void            **contexts;
+   int               ncontexts;
+} compress_t;
+
+
+int  compress_init      (compress_t *compress,
+                         const char *spec);
+int  compress_frame     (compress_t *compress,
+                         const void *data,
+                         size_t len,
+                         buffer_t *out,
+                         seek_table_t *table);
+int  compress_scan      (const void *data,
+                         size_t len,
+                         seek_table_t *table);
+void compress_destroy   (compress_t *compress);
+
+
+void seek_table_init    (seek_table_t *table);
+void seek_table_add     (seek_table_t *table,
+                         bson_uint32_t csize,
+                         bson_uint32_t dsize);
+void seek_table_append  (seek_table_t *table,
+                         const seek_table_t *other);
+void seek_table_encode  (const seek_table_t *table,
+                         buffer_t *out);
+void seek_table_clear   (seek_table_t *table);
+void seek_table_destroy (seek_table_t *table);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_COMPRESS_H */
@@ -0,0 +1,926 @@
+/* mdb-filter.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <errno.h>
+#include <string.h>
+
+#include "mdb-filter.h"
+
+
+typedef enum
+{
+   FILTER_AND,
+   FILTER_OR,
+   FILTER_NOR,
+   FILTER_EQ,
+   FILTER_GT,
+   FILTER_GTE,
+   FILTER_LT,
+   FILTER_LTE,
+   FILTER_IN,
+   FILTER_EXISTS,
+} filter_op_t;
+
+
+struct _filter_node_t
+{
+   filter_op_t     op;
+   int             negate;
+   int             missing;
+   char           *pathbuf;
+   char          **path;
+   int             npath;
+   bson_iter_t     operand;
+   filter_node_t **children;
+   int             nchildren;
+};
+
+
+typedef enum
+{
+   FILTER_CLASS_MINKEY,
+   FILTER_CLASS_NULL,
+   FILTER_CLASS_NUMBER,
+   FILTER_CLASS_STRING,
+   FILTER_CLASS_DOCUMENT,
+   FILTER_CLASS_ARRAY,
+   FILTER_CLASS_BINARY,
+   FILTER_CLASS_OID,
+   FILTER_CLASS_BOOL,
+   FILTER_CLASS_DATE,
+   FILTER_CLASS_TIMESTAMP,
+   FILTER_CLASS_MAXKEY,
+   FILTER_CLASS_OTHER,
+} filter_class_t;
+
+
+static const struct
+{
+   const char  *name;
+   filter_op_t  op;
+   int          negate;
+} gOperators[] = {
+   { "$eq",     FILTER_EQ,     FALSE },
+   { "$ne",     FILTER_EQ,     TRUE },
+   { "$gt",     FILTER_GT,     FALSE },
+   { "$gte",    FILTER_GTE,    FALSE },
+   { "$lt",     FILTER_LT,     FALSE },
+   { "$lte",    FILTER_LTE,    FALSE },
+   { "$in",     FILTER_IN,     FALSE },
+   { "$nin",    FILTER_IN,     TRUE },
+   { "$exists", FILTER_EXISTS, FALSE },
+   { NULL },
+};
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_class --
+ *
+ *       Map a BSON type to the class of values it can be compared with,
+ *       so that for example int32 and double values compare numerically.
+ *
+ * Returns:
+ *       A filter_class_t.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static filter_class_t
+filter_class (const bson_iter_t *iter) /* IN */
+{
+   switch (bson_iter_type(iter)) {
+   case BSON_TYPE_MINKEY:
+      return FILTER_CLASS_MINKEY;
+   case BSON_TYPE_NULL:
+   case BSON_TYPE_UNDEFINED:
+      return FILTER_CLASS_NULL;
+   case BSON_TYPE_DOUBLE:
+   case BSON_TYPE_INT32:
+   case BSON_TYPE_INT64:
+      return FILTER_CLASS_NUMBER;
+   case BSON_TYPE_UTF8:
+   case BSON_TYPE_SYMBOL:
+      return FILTER_CLASS_STRING;
+   case BSON_TYPE_DOCUMENT:
+      return FILTER_CLASS_DOCUMENT;
+   case BSON_TYPE_ARRAY:
+      return FILTER_CLASS_ARRAY;
+   case BSON_TYPE_BINARY:
+      return FILTER_CLASS_BINARY;
+   case BSON_TYPE_OID:
+      return FILTER_CLASS_OID;
+   case BSON_TYPE_BOOL:
+      return FILTER_CLASS_BOOL;
+   case BSON_TYPE_DATE_TIME:
+      return FILTER_CLASS_DATE;
+   case BSON_TYPE_TIMESTAMP:
+      return FILTER_CLASS_TIMESTAMP;
+   case BSON_TYPE_MAXKEY:
+      return FILTER_CLASS_MAXKEY;
+   default:
+      return FILTER_CLASS_OTHER;
+   }
+}
+
+
+static int
+filter_compare_bytes (const void *a,  /* IN */
+                      size_t alen,    /* IN */
+                      const void *b,  /* IN */
+                      size_t blen)    /* IN */
+{
+   int ret;
+
+   if ((ret = memcmp(a, b, (alen < blen) ? alen : blen))) {
+      return ret;
+   }
+
+   return (alen < blen) ? -1 : (alen > blen);
+}
+
+
+static const char *
+filter_string (const bson_iter_t *iter, /* IN */
+               bson_uint32_t *len)      /* OUT */
+{
+   if (bson_iter_type(iter) == BSON_TYPE_SYMBOL) {
+      return bson_iter_symbol(iter, len);
+   }
+
+   return bson_iter_utf8(iter, len);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_compare --
+ *
+ *       Compare the values at @a and @b. Values can only be compared if
+ *       their types are of the same class. Integers are compared exactly,
+ *       other numbers as doubles. Strings are compared bytewise, and
+ *       embedded documents, arrays and binary values by their encoding.
+ *
+ * Returns:
+ *       TRUE if the values are comparable, in which case @cmp is set to
+ *       less than, equal to or greater than zero.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+filter_compare (const bson_iter_t *a, /* IN */
+                const bson_iter_t *b, /* IN */
+                int *cmp)             /* OUT */
+{
+   const bson_uint8_t *adata;
+   const bson_uint8_t *bdata;
+   const char *astr;
+   const char *bstr;
+   bson_subtype_t subtype;
+   bson_uint32_t alen;
+   bson_uint32_t blen;
+   bson_uint32_t at;
+   bson_uint32_t ai;
+   bson_uint32_t bt;
+   bson_uint32_t bi;
+   filter_class_t klass;
+   bson_int64_t ai64;
+   bson_int64_t bi64;
+   double ad;
+   double bd;
+
+   if ((klass = filter_class(a)) != filter_class(b)) {
+      return FALSE;
+   }
+
+   switch (klass) {
+   case FILTER_CLASS_MINKEY:
+   case FILTER_CLASS_NULL:
+   case FILTER_CLASS_MAXKEY:
+      *cmp = 0;
+      return TRUE;
+   case FILTER_CLASS_NUMBER:
+      if ((bson_iter_type(a) != BSON_TYPE_DOUBLE) &&
+          (bson_iter_type(b) != BSON_TYPE_DOUBLE)) {
+         ai64 = (bson_iter_type(a) == BSON_TYPE_INT32) ?
+                bson_iter_int32(a) : bson_iter_int64(a);
+         bi64 = (bson_iter_type(b) == BSON_TYPE_INT32) ?
+                bson_iter_int32(b) : bson_iter_int64(b);
+         *cmp = (ai64 < bi64) ? -1 : (ai64 > bi64);
+         return TRUE;
+      }
+      ad = (bson_iter_type(a) == BSON_TYPE_DOUBLE) ? bson_iter_double(a) :
+           (bson_iter_type(a) == BSON_TYPE_INT32) ? bson_iter_int32(a) :
+           bson_iter_int64(a);
+      bd = (bson_iter_type(b) == BSON_TYPE_DOUBLE) ? bson_iter_double(b) :
+           (bson_iter_type(b) == BSON_TYPE_INT32) ? bson_iter_int32(b) :
+           bson_iter_int64(b);
+      if ((ad != ad) || (bd != bd)) {
+         return FALSE;
+      }
+      *cmp = (ad < bd) ? -1 : (ad > bd);
+      return TRUE;
+   case FILTER_CLASS_STRING:
+      astr = filter_string(a, &alen);
+      bstr = filter_string(b, &blen);
+      *cmp = filter_compare_bytes(astr, alen, bstr, blen);
+      return TRUE;
+   case FILTER_CLASS_DOCUMENT:
+      bson_iter_document(a, &alen, &adata);
+      bson_iter_document(b, &blen, &bdata);
+      *cmp = filter_compare_bytes(adata, alen, bdata, blen);
+      return TRUE;
+   case FILTER_CLASS_ARRAY:
+      bson_iter_array(a, &alen, &adata);
+      bson_iter_array(b, &blen, &bdata);
+      *cmp = filter_compare_bytes(adata, alen, bdata, blen);
+      return TRUE;
+   case FILTER_CLASS_BINARY:
+      bson_iter_binary(a, &subtype, &alen, &adata);
+      bson_iter_binary(b, &subtype, &blen, &bdata);
+      *cmp = filter_compare_bytes(adata, alen, bdata, blen);
+      return TRUE;
+   case FILTER_CLASS_OID:
+      *cmp = memcmp(bson_iter_oid(a), bson_iter_oid(b), sizeof(bson_oid_t));
+      return TRUE;
+   case FILTER_CLASS_BOOL:
+      *cmp = (int)bson_iter_bool(a) - (int)bson_iter_bool(b);
+      return TRUE;
+   case FILTER_CLASS_DATE:
+      ai64 = bson_iter_date_time(a);
+      bi64 = bson_iter_date_time(b);
+      *cmp = (ai64 < bi64) ? -1 : (ai64 > bi64);
+      return TRUE;
+   case FILTER_CLASS_TIMESTAMP:
+      bson_iter_timestamp(a, &at, &ai);
+      bson_iter_timestamp(b, &bt, &bi);
+      *cmp = (at != bt) ? ((at < bt) ? -1 : 1) :
+             (ai < bi) ? -1 : (ai > bi);
+      return TRUE;
+   case FILTER_CLASS_OTHER:
+   default:
+      return FALSE;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_test --
+ *
+ *       Test a single value against a comparison node.
+ *
+ * Returns:
+ *       TRUE if the value satisfies the node.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+filter_test (const filter_node_t *node, /* IN */
+             const bson_iter_t *iter)   /* IN */
+{
+   bson_iter_t child;
+   int cmp;
+
+   switch (node->op) {
+   case FILTER_EQ:
+      return filter_compare(iter, &node->operand, &cmp) && (cmp == 0);
+   case FILTER_GT:
+      return filter_compare(iter, &node->operand, &cmp) && (cmp > 0);
+   case FILTER_GTE:
+      return filter_compare(iter, &node->operand, &cmp) && (cmp >= 0);
+   case FILTER_LT:
+      return filter_compare(iter, &node->operand, &cmp) && (cmp < 0);
+   case FILTER_LTE:
+      return filter_compare(iter, &node->operand, &cmp) && (cmp <= 0);
+   case FILTER_IN:
+      if (bson_iter_recurse(&node->operand, &child)) {
+         while (bson_iter_next(&child)) {
+            if (filter_compare(iter, &child, &cmp) && (cmp == 0)) {
+               return TRUE;
+            }
+         }
+      }
+      return FALSE;
+   case FILTER_EXISTS:
+      return TRUE;
+   case FILTER_AND:
+   case FILTER_OR:
+   case FILTER_NOR:
+   default:
+      return FALSE;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_match_value --
+ *
+ *       Test a value found at the path of @node. As in MongoDB, an array
+ *       matches if either the array itself or any of its elements does.
+ *
+ * Returns:
+ *       TRUE if the value satisfies the node.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+filter_match_value (const filter_node_t *node, /* IN */
+                    const bson_iter_t *iter)   /* IN */
+{
+   bson_iter_t child;
+
+   if (filter_test(node, iter)) {
+      return TRUE;
+   }
+
+   if ((bson_iter_type(iter) == BSON_TYPE_ARRAY) &&
+       bson_iter_recurse(iter, &child)) {
+      while (bson_iter_next(&child)) {
+         if (filter_test(node, &child)) {
+            return TRUE;
+         }
+      }
+   }
+
+   return FALSE;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_match_path --
+ *
+ *       Look up the components of the path of @node starting at @depth
+ *       within the document or array that @container iterates, testing
+ *       each value found. When the container is an array, the path is
+ *       also looked up within each embedded document of the array.
+ *
+ *       Lookup stops at the first value that satisfies the node.
+ *
+ * Returns:
+ *       TRUE if a value satisfies the node.
+ *
+ * Side effects:
+ *       found is set to TRUE if any value exists at the path.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+filter_match_path (const filter_node_t *node,    /* IN */
+                   const bson_iter_t *container, /* IN */
+                   int is_array,                 /* IN */
+                   int depth,                    /* IN */
+                   int *found)                   /* OUT */
+{
+   bson_iter_t child;
+   bson_iter_t iter;
+   bson_type_t type;
+
+   iter = *container;
+
+   if (bson_iter_find(&iter, node->path[depth])) {
+      type = bson_iter_type(&iter);
+      if ((depth + 1) == node->npath) {
+         *found = TRUE;
+         if (filter_match_value(node, &iter)) {
+            return TRUE;
+         }
+      } else if (((type == BSON_TYPE_DOCUMENT) ||
+                  (type == BSON_TYPE_ARRAY)) &&
+                 bson_iter_recurse(&iter, &child) &&
+                 filter_match_path(node, &child, (type == BSON_TYPE_ARRAY),
+                                   depth + 1, found)) {
+         return TRUE;
+      }
+   }
+
+   if (is_array) {
+      iter = *container;
+      while (bson_iter_next(&iter)) {
+         if ((bson_iter_type(&iter) == BSON_TYPE_DOCUMENT) &&
+             bson_iter_recurse(&iter, &child) &&
+             filter_match_path(node, &child, FALSE, depth, found)) {
+            return TRUE;
+         }
+      }
+   }
+
+   return FALSE;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_eval --
+ *
+ *       Evaluate @node against the document that @root iterates. Clauses
+ *       of $and, $or and $nor are evaluated in order and evaluation stops
+ *       as soon as the result is known.
+ *
+ * Returns:
+ *       TRUE if the document satisfies the node.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+filter_eval (const filter_node_t *node, /* IN */
+             const bson_iter_t *root)   /* IN */
+{
+   int found = FALSE;
+   int ret;
+   int i;
+
+   switch (node->op) {
+   case FILTER_AND:
+      for (i = 0; i < node->nchildren; i++) {
+         if (!filter_eval(node->children[i], root)) {
+            return FALSE;
+         }
+      }
+      return TRUE;
+   case FILTER_OR:
+   case FILTER_NOR:
+      for (i = 0; i < node->nchildren; i++) {
+         if (filter_eval(node->children[i], root)) {
+            return (node->op == FILTER_OR);
+         }
+      }
+      return (node->op == FILTER_NOR);
+   case FILTER_EXISTS:
+      filter_match_path(node, root, FALSE, 0, &found);
+      return node->negate ? !found : found;
+   default:
+      ret = filter_match_path(node, root, FALSE, 0, &found);
+      if (!found && node->missing) {
+         ret = TRUE;
+      }
+      return node->negate ? !ret : ret;
+   }
+}
+
+
+static filter_node_t *
+filter_node_new (filter_op_t op) /* IN */
+{
+   filter_node_t *node;
+
+   node = bson_malloc0(sizeof *node);
+   node->op = op;
+
+   return node;
+}
+
+
+static void
+filter_node_add (filter_node_t *parent, /* IN */
+                 filter_node_t *child)  /* IN */
+{
+   parent->children = bson_realloc(parent->children,
+                                   (parent->nchildren + 1) *
+                                   sizeof *parent->children);
+   parent->children[parent->nchildren++] = child;
+}
+
+
+static void
+filter_node_destroy (filter_node_t *node) /* IN */
+{
+   int i;
+
+   for (i = 0; i < node->nchildren; i++) {
+      filter_node_destroy(node->children[i]);
+   }
+
+   bson_free(node->children);
+   bson_free(node->path);
+   bson_free(node->pathbuf);
+   bson_free(node);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_node_set_path --
+ *
+ *       Split the dotted @path into the components looked up by @node.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+filter_node_set_path (filter_node_t *node, /* IN */
+                      const char *path)    /* IN */
+{
+   char *p;
+
+   node->pathbuf = bson_strdup(path);
+   node->npath = 1;
+
+   for (p = node->pathbuf; *p; p++) {
+      node->npath += (*p == '.');
+   }
+
+   node->path = bson_malloc0(node->npath * sizeof *node->path);
+   node->path[0] = node->pathbuf;
+   node->npath = 1;
+
+   for (p = node->pathbuf; *p; p++) {
+      if (*p == '.') {
+         *p = '\0';
+         node->path[node->npath++] = p + 1;
+      }
+   }
+}
+
+
+static int filter_compile_document (filter_node_t *parent,
+                                    bson_iter_t *iter);
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_compile_field --
+ *
+ *       Compile the condition on @path found at @iter. It is either a
+ *       value to compare for equality, or a document of operators which
+ *       must all be satisfied.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       Nodes are added to parent.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+filter_compile_field (filter_node_t *parent,   /* IN */
+                      const char *path,        /* IN */
+                      const bson_iter_t *iter) /* IN */
+{
+   filter_node_t *node;
+   bson_iter_t child;
+   bson_iter_t ops;
+   int i;
+
+   if (!*path) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if ((bson_iter_type(iter) != BSON_TYPE_DOCUMENT) ||
+       !bson_iter_recurse(iter, &ops) ||
+       !bson_iter_next(&ops) ||
+       (bson_iter_key(&ops)[0] != '$')) {
+      node = filter_node_new(FILTER_EQ);
+      node->operand = *iter;
+      node->missing = (bson_iter_type(iter) == BSON_TYPE_NULL);
+      filter_node_set_path(node, path);
+      filter_node_add(parent, node);
+      return 0;
+   }
+
+   bson_iter_recurse(iter, &ops);
+
+   while (bson_iter_next(&ops)) {
+      for (i = 0; gOperators[i].name; i++) {
+         if (!strcmp(gOperators[i].name, bson_iter_key(&ops))) {
+            break;
+         }
+      }
+
+      if (!gOperators[i].name) {
+         errno = EINVAL;
+         return -1;
+      }
+
+      node = filter_node_new(gOperators[i].op);
+      node->negate = gOperators[i].negate;
+      node->operand = ops;
+      filter_node_set_path(node, path);
+      filter_node_add(parent, node);
+
+      switch (node->op) {
+      case FILTER_IN:
+         if ((bson_iter_type(&ops) != BSON_TYPE_ARRAY) ||
+             !bson_iter_recurse(&ops, &child)) {
+            errno = EINVAL;
+            return -1;
+         }
+         while (bson_iter_next(&child)) {
+            if (bson_iter_type(&child) == BSON_TYPE_NULL) {
+               node->missing = TRUE;
+            }
+         }
+         break;
+      case FILTER_EXISTS:
+         /*
+          * Like the server, numbers are taken for their truth value, so
+          * { $exists : 0 } asks for the field to be missing.
+          */
+         switch (bson_iter_type(&ops)) {
+         case BSON_TYPE_BOOL:
+            node->negate = !bson_iter_bool(&ops);
+            break;
+         case BSON_TYPE_INT32:
+            node->negate = !bson_iter_int32(&ops);
+            break;
+         case BSON_TYPE_INT64:
+            node->negate = !bson_iter_int64(&ops);
+            break;
+         case BSON_TYPE_DOUBLE:
+            node->negate = !bson_iter_double(&ops);
+            break;
+         default:
+            errno = EINVAL;
+            return -1;
+         }
+         break;
+      case FILTER_EQ:
+         node->missing = (bson_iter_type(&ops) == BSON_TYPE_NULL);
+         break;
+      default:
+         break;
+      }
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_compile_logical --
+ *
+ *       Compile a $and, $or or $nor clause whose value at @iter is an
+ *       array of query documents.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       A node is added to parent.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+filter_compile_logical (filter_node_t *parent,   /* IN */
+                        filter_op_t op,          /* IN */
+                        const bson_iter_t *iter) /* IN */
+{
+   filter_node_t *clause;
+   filter_node_t *node;
+   bson_iter_t child;
+   bson_iter_t doc;
+
+   if ((bson_iter_type(iter) != BSON_TYPE_ARRAY) ||
+       !bson_iter_recurse(iter, &child)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   node = filter_node_new(op);
+   filter_node_add(parent, node);
+
+   while (bson_iter_next(&child)) {
+      if ((bson_iter_type(&child) != BSON_TYPE_DOCUMENT) ||
+          !bson_iter_recurse(&child, &doc)) {
+         errno = EINVAL;
+         return -1;
+      }
+      clause = filter_node_new(FILTER_AND);
+      filter_node_add(node, clause);
+      if (!!filter_compile_document(clause, &doc)) {
+         return -1;
+      }
+   }
+
+   if (!node->nchildren) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_compile_document --
+ *
+ *       Compile each condition of the query document that @iter
+ *       iterates into a child of @parent, which must be an $and node.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       Nodes are added to parent.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+filter_compile_document (filter_node_t *parent, /* IN */
+                         bson_iter_t *iter)     /* IN */
+{
+   const char *key;
+   int ret;
+
+   while (bson_iter_next(iter)) {
+      key = bson_iter_key(iter);
+
+      if (!strcmp(key, "$and")) {
+         ret = filter_compile_logical(parent, FILTER_AND, iter);
+      } else if (!strcmp(key, "$or")) {
+         ret = filter_compile_logical(parent, FILTER_OR, iter);
+      } else if (!strcmp(key, "$nor")) {
+         ret = filter_compile_logical(parent, FILTER_NOR, iter);
+      } else if (key[0] == '$') {
+         errno = EINVAL;
+         ret = -1;
+      } else {
+         ret = filter_compile_field(parent, key, iter);
+      }
+
+      if (!!ret) {
+         return -1;
+      }
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_init --
+ *
+ *       Compile the query in @json, a MongoDB style query document in
+ *       Extended JSON.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set to EINVAL if the
+ *       query could not be parsed or uses an unsupported operator.
+ *
+ * Side effects:
+ *       filter is initialized and must be released with filter_destroy().
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+filter_init (filter_t *filter, /* OUT */
+             const char *json) /* IN */
+{
+   bson_error_t error;
+   bson_iter_t iter;
+
+   if (!filter || !json) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   memset(filter, 0, sizeof *filter);
+
+   if (!bson_init_from_json(&filter->query, json, -1, &error)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   /*
+    * Operands are iterators into filter->query, which is kept until the
+    * filter is destroyed.
+    */
+   filter->root = filter_node_new(FILTER_AND);
+
+   if (!bson_iter_init(&iter, &filter->query) ||
+       !!filter_compile_document(filter->root, &iter)) {
+      filter_destroy(filter);
+      errno = EINVAL;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_match --
+ *
+ *       Evaluate @filter against @bson.
+ *
+ * Returns:
+ *       TRUE if the document matches.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+filter_match (const filter_t *filter, /* IN */
+              const bson_t *bson)     /* IN */
+{
+   bson_iter_t iter;
+
+   bson_return_val_if_fail(filter, FALSE);
+   bson_return_val_if_fail(bson, FALSE);
+
+   if (!bson_iter_init(&iter, bson)) {
+      return FALSE;
+   }
+
+   return filter_eval(filter->root, &iter);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * filter_destroy --
+ *
+ *       Release the resources held by @filter.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+filter_destroy (filter_t *filter) /* IN */
+{
+   bson_return_if_fail(filter);
+
+   if (filter->root) {
+      filter_node_destroy(filter->root);
+      bson_destroy(&filter->query);
+   }
+
+   memset(filter, 0, sizeof *filter);
+}
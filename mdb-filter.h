@@ -0,0 +1,61 @@
+/* mdb-filter.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_FILTER_H
+#define MDB_FILTER_H
+
+
+#include <bson.h>
+
+
+BSON_BEGIN_DECLS
+
+
+typedef struct _filter_t filter_t;
+typedef struct _filter_node_t filter_node_t;
+
+
+/*
+ * A predicate compiled from a MongoDB style query document, such as
+ * { "status" : "A", "ts" : { "$gt" : 10 } }. The query is parsed once and
+ * filter_match() then evaluates it directly against BSON documents, so
+ * records that do not match are never decoded any further.
+ *
+ * Supported are equality on dotted paths (including into arrays), the
+ * $eq, $ne, $gt, $gte, $lt, $lte, $in, $nin and $exists operators, and
+ * the $and, $or and $nor combinators. A compiled filter is read-only and
+ * may be shared between threads.
+ */
+struct _filter_t
+{
+   bson_t         query;
+   filter_node_t *root;
+};
+
+
+int  filter_init    (filter_t *filter,
+                     const char *json);
+int  filter_match   (const filter_t *filter,
+                     const bson_t *bson);
+void filter_destroy (filter_t *filter);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_FILTER_H */
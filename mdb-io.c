@@ -0,0 +1,749 @@
+/* mdb-io.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mdb-io.h"
+
+
+/*
+ * O_DIRECT requires the file offset, length and buffer address to be
+ * aligned to the logical block size of the device. 4096 covers every
+ * device we care about.
+ */
+#define IO_ALIGN 4096
+#define IO_ALIGN_DOWN(n) ((n) & ~((bson_int64_t)IO_ALIGN - 1))
+#define IO_ALIGN_UP(n)   IO_ALIGN_DOWN((n) + IO_ALIGN - 1)
+
+
+#define IO_QUEUED  1
+#define IO_READING 2
+#define IO_DONE    3
+
+
+struct _io_t
+{
+   db_t            *db;
+   pthread_mutex_t  mutex;
+   pthread_cond_t   cond;
+   pthread_t       *threads;
+   int              nthreads;
+   int              depth;
+   int             *fds;
+   io_buf_t        *pending;
+   int              npending;
+   io_buf_t        *free;
+   int              nfree;
+   int              shutdown;
+};
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_fd --
+ *
+ *       Fetches the descriptor used to read data file @fileno, opening
+ *       it on first use. O_DIRECT is used unless the filesystem rejects
+ *       it, as tmpfs does.
+ *
+ * Returns:
+ *       A file descriptor on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       The file may be opened.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+io_fd (io_t *io,   /* IN */
+       int fileno) /* IN */
+{
+   const char *path;
+   int fd;
+
+   if (fileno < 0 || fileno >= io->db->filescnt) {
+      errno = ENOENT;
+      return -1;
+   }
+
+   pthread_mutex_lock(&io->mutex);
+
+   if (-1 == (fd = io->fds[fileno])) {
+      path = io->db->files[fileno].path;
+      fd = open(path, O_RDONLY | O_DIRECT);
+      if ((fd == -1) && (errno == EINVAL)) {
+         fd = open(path, O_RDONLY);
+      }
+      io->fds[fileno] = fd;
+   }
+
+   pthread_mutex_unlock(&io->mutex);
+
+   return fd;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_buf_reserve --
+ *
+ *       Ensures @buf can hold @len bytes. The first @keep bytes are
+ *       preserved if the buffer has to grow.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buf->data may be reallocated.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+io_buf_reserve (io_buf_t *buf, /* IN */
+                size_t len,    /* IN */
+                size_t keep)   /* IN */
+{
+   void *data;
+
+   if (len <= buf->alloc) {
+      return;
+   }
+
+   if (!!posix_memalign(&data, IO_ALIGN, len)) {
+      abort();
+   }
+
+   if (keep) {
+      memcpy(data, buf->data, keep);
+   }
+
+   free(buf->data);
+   buf->data = data;
+   buf->alloc = len;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_pread --
+ *
+ *       Reads up to @len bytes at @offset into @data, retrying short and
+ *       interrupted reads. Stops early at end of file.
+ *
+ * Returns:
+ *       The number of bytes read -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static ssize_t
+io_pread (int fd,              /* IN */
+          char *data,          /* OUT */
+          size_t len,          /* IN */
+          bson_int64_t offset) /* IN */
+{
+   size_t total = 0;
+   ssize_t n;
+
+   while (total < len) {
+      n = pread(fd, data + total, len - total, offset + total);
+      if (n == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return -1;
+      }
+      if (!n) {
+         break;
+      }
+      total += n;
+   }
+
+   return total;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_buf_fill --
+ *
+ *       Reads the extent at (@buf->fileno, @buf->offset) into @buf. The
+ *       first block is read to learn the length of the extent from its
+ *       header and the remainder is read with a single call.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       buf->data, buf->base and buf->len are set.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+io_buf_fill (io_t *io,     /* IN */
+             io_buf_t *buf) /* IN/OUT */
+{
+   extent_header_t *ehdr;
+   bson_int64_t start;
+   bson_int64_t end;
+   size_t head;
+   ssize_t n;
+   int fd;
+
+   if (-1 == (fd = io_fd(io, buf->fileno))) {
+      return -1;
+   }
+
+   start = IO_ALIGN_DOWN((bson_int64_t)buf->offset);
+   head = IO_ALIGN_UP(buf->offset + sizeof *ehdr) - start;
+
+   io_buf_reserve(buf, head, 0);
+   if (-1 == (n = io_pread(fd, buf->data, head, start))) {
+      return -1;
+   }
+
+   if ((buf->offset - start + sizeof *ehdr) > (size_t)n) {
+      errno = ENOENT;
+      return -1;
+   }
+
+   ehdr = (extent_header_t *)(buf->data + (buf->offset - start));
+   if ((ehdr->magic != EXTENT_MAGIC) ||
+       (ehdr->length < (bson_int32_t)sizeof *ehdr)) {
+      errno = EBADF;
+      return -1;
+   }
+
+   end = IO_ALIGN_UP((bson_int64_t)buf->offset + ehdr->length);
+
+   if (((size_t)n == head) && ((start + n) < end)) {
+      io_buf_reserve(buf, end - start, n);
+      if (-1 == (n = io_pread(fd, buf->data + head, end - start - head,
+                              start + head))) {
+         return -1;
+      }
+      n += head;
+   }
+
+   buf->base = start;
+   buf->len = n;
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_buf_get --
+ *
+ *       Takes a buffer off the free list or allocates a new one.
+ *       io->mutex must be held.
+ *
+ * Returns:
+ *       An io_buf_t.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static io_buf_t *
+io_buf_get (io_t *io,               /* IN */
+            const file_loc_t *loc)  /* IN */
+{
+   io_buf_t *buf;
+
+   if ((buf = io->free)) {
+      io->free = buf->next;
+      io->nfree--;
+   } else {
+      buf = bson_malloc0(sizeof *buf);
+   }
+
+   buf->next = NULL;
+   buf->fileno = loc->fileno;
+   buf->offset = loc->offset;
+   buf->base = 0;
+   buf->len = 0;
+   buf->state = 0;
+   buf->err = 0;
+
+   return buf;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_buf_put --
+ *
+ *       Returns a buffer to the free list, or frees it if enough buffers
+ *       are already cached. io->mutex must be held.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buf may be freed.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+io_buf_put (io_t *io,      /* IN */
+            io_buf_t *buf) /* IN */
+{
+   if (io->nfree >= (io->depth * 2)) {
+      free(buf->data);
+      bson_free(buf);
+      return;
+   }
+
+   buf->next = io->free;
+   io->free = buf;
+   io->nfree++;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_worker --
+ *
+ *       Reader thread main loop. Fills queued prefetch buffers in the
+ *       order they were requested.
+ *
+ * Returns:
+ *       NULL.
+ *
+ * Side effects:
+ *       Extents are read.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void *
+io_worker (void *data) /* IN */
+{
+   io_buf_t *buf;
+   io_t *io = data;
+   int err;
+
+   pthread_mutex_lock(&io->mutex);
+
+   for (;;) {
+      for (buf = io->pending; buf && (buf->state != IO_QUEUED); ) {
+         buf = buf->next;
+      }
+
+      if (!buf) {
+         if (io->shutdown) {
+            break;
+         }
+         pthread_cond_wait(&io->cond, &io->mutex);
+         continue;
+      }
+
+      buf->state = IO_READING;
+      pthread_mutex_unlock(&io->mutex);
+      err = io_buf_fill(io, buf) ? errno : 0;
+      pthread_mutex_lock(&io->mutex);
+
+      buf->err = err;
+      buf->state = IO_DONE;
+      pthread_cond_broadcast(&io->cond);
+   }
+
+   pthread_mutex_unlock(&io->mutex);
+
+   return NULL;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_new --
+ *
+ *       Creates the pread backend for @db with @depth reader threads.
+ *       At most @depth prefetched extents are buffered at a time.
+ *
+ * Returns:
+ *       A newly allocated io_t that should be freed with io_destroy(),
+ *       or NULL if no thread could be started.
+ *
+ * Side effects:
+ *       Threads are started.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+io_t *
+io_new (db_t *db,  /* IN */
+        int depth) /* IN */
+{
+   io_t *io;
+   int i;
+
+   if (!db || depth < 1) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   io = bson_malloc0(sizeof *io);
+   io->db = db;
+   io->depth = depth;
+   io->fds = bson_malloc0((db->filescnt + 1) * sizeof *io->fds);
+   for (i = 0; i < db->filescnt; i++) {
+      io->fds[i] = -1;
+   }
+
+   pthread_mutex_init(&io->mutex, NULL);
+   pthread_cond_init(&io->cond, NULL);
+
+   io->threads = bson_malloc0(depth * sizeof *io->threads);
+   for (i = 0; i < depth; i++) {
+      if (!!pthread_create(&io->threads[i], NULL, io_worker, io)) {
+         break;
+      }
+      io->nthreads++;
+   }
+
+   if (!io->nthreads) {
+      io_destroy(io);
+      errno = EAGAIN;
+      return NULL;
+   }
+
+   return io;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_extent_read --
+ *
+ *       Fetches a buffer containing the whole extent at @loc. If the
+ *       extent was prefetched, the prefetched buffer is claimed, waiting
+ *       for the read to finish if needed. Otherwise it is read on the
+ *       calling thread.
+ *
+ * Returns:
+ *       An io_buf_t to be released with io_release() -- otherwise NULL
+ *       and errno is set.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+io_buf_t *
+io_extent_read (io_t *io,              /* IN */
+                const file_loc_t *loc) /* IN */
+{
+   io_buf_t **prev;
+   io_buf_t *buf;
+   int err;
+
+   if (!io || !loc) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   pthread_mutex_lock(&io->mutex);
+
+   for (prev = &io->pending; (buf = *prev); prev = &buf->next) {
+      if ((buf->fileno == loc->fileno) && (buf->offset == loc->offset)) {
+         *prev = buf->next;
+         io->npending--;
+         break;
+      }
+   }
+
+   if (buf && (buf->state != IO_QUEUED)) {
+      while (buf->state != IO_DONE) {
+         pthread_cond_wait(&io->cond, &io->mutex);
+      }
+      pthread_mutex_unlock(&io->mutex);
+      err = buf->err;
+   } else {
+      if (!buf) {
+         buf = io_buf_get(io, loc);
+      }
+      buf->state = IO_READING;
+      pthread_mutex_unlock(&io->mutex);
+      err = io_buf_fill(io, buf) ? errno : 0;
+      buf->state = IO_DONE;
+   }
+
+   if (err) {
+      io_release(io, buf);
+      errno = err;
+      return NULL;
+   }
+
+   return buf;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_prefetch --
+ *
+ *       Queues the extent at @loc to be read by a reader thread. Nothing
+ *       is done if it is already queued. If @depth buffers are already
+ *       taken by prefetches, the oldest finished one that nobody claimed
+ *       is discarded; if there is none, the request is dropped.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       A read may be queued.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+io_prefetch (io_t *io,              /* IN */
+             const file_loc_t *loc) /* IN */
+{
+   io_buf_t **prev;
+   io_buf_t *buf;
+
+   bson_return_if_fail(io);
+   bson_return_if_fail(loc);
+
+   if ((loc->fileno < 0) || (loc->fileno >= io->db->filescnt) ||
+       (loc->offset < 0)) {
+      return;
+   }
+
+   pthread_mutex_lock(&io->mutex);
+
+   for (prev = &io->pending; (buf = *prev); prev = &buf->next) {
+      if ((buf->fileno == loc->fileno) && (buf->offset == loc->offset)) {
+         pthread_mutex_unlock(&io->mutex);
+         return;
+      }
+   }
+
+   if (io->npending >= io->depth) {
+      for (prev = &io->pending; (buf = *prev); prev = &buf->next) {
+         if (buf->state == IO_DONE) {
+            *prev = buf->next;
+            io->npending--;
+            io_buf_put(io, buf);
+            break;
+         }
+      }
+      if (!buf) {
+         pthread_mutex_unlock(&io->mutex);
+         return;
+      }
+   }
+
+   buf = io_buf_get(io, loc);
+   buf->state = IO_QUEUED;
+
+   for (prev = &io->pending; *prev; prev = &(*prev)->next) { }
+   *prev = buf;
+   io->npending++;
+
+   pthread_cond_broadcast(&io->cond);
+   pthread_mutex_unlock(&io->mutex);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_header_read --
+ *
+ *       Reads only the extent header at @loc. This is used to walk an
+ *       extent chain without reading the extents themselves.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       ehdr is filled in.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+io_header_read (io_t *io,               /* IN */
+                const file_loc_t *loc,  /* IN */
+                extent_header_t *ehdr)  /* OUT */
+{
+   bson_int64_t start;
+   void *data;
+   size_t len;
+   ssize_t n;
+   int fd;
+
+   if (!io || !loc || !ehdr) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (-1 == (fd = io_fd(io, loc->fileno))) {
+      return -1;
+   }
+
+   start = IO_ALIGN_DOWN((bson_int64_t)loc->offset);
+   len = IO_ALIGN_UP(loc->offset + sizeof *ehdr) - start;
+
+   if (!!posix_memalign(&data, IO_ALIGN, len)) {
+      abort();
+   }
+
+   if (-1 == (n = io_pread(fd, data, len, start))) {
+      free(data);
+      return -1;
+   }
+
+   if ((loc->offset - start + sizeof *ehdr) > (size_t)n) {
+      free(data);
+      errno = ENOENT;
+      return -1;
+   }
+
+   memcpy(ehdr, (char *)data + (loc->offset - start), sizeof *ehdr);
+   free(data);
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_release --
+ *
+ *       Releases a buffer returned from io_extent_read().
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       The buffer is recycled.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+io_release (io_t *io,      /* IN */
+            io_buf_t *buf) /* IN */
+{
+   bson_return_if_fail(io);
+   bson_return_if_fail(buf);
+
+   pthread_mutex_lock(&io->mutex);
+   io_buf_put(io, buf);
+   pthread_mutex_unlock(&io->mutex);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * io_destroy --
+ *
+ *       Stops the reader threads and frees all buffers. Buffers handed
+ *       out by io_extent_read() must have been released.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       Everything.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+io_destroy (io_t *io) /* IN */
+{
+   io_buf_t *buf;
+   int i;
+
+   bson_return_if_fail(io);
+
+   pthread_mutex_lock(&io->mutex);
+   io->shutdown = TRUE;
+   for (buf = io->pending; buf; buf = buf->next) {
+      if (buf->state == IO_QUEUED) {
+         buf->state = IO_DONE;
+      }
+   }
+   pthread_cond_broadcast(&io->cond);
+   pthread_mutex_unlock(&io->mutex);
+
+   for (i = 0; i < io->nthreads; i++) {
+      pthread_join(io->threads[i], NULL);
+   }
+
+   while ((buf = io->pending)) {
+      io->pending = buf->next;
+      free(buf->data);
+      bson_free(buf);
+   }
+
+   while ((buf = io->free)) {
+      io->free = buf->next;
+      free(buf->data);
+      bson_free(buf);
+   }
+
+   for (i = 0; i < io->db->filescnt; i++) {
+      if (io->fds[i] != -1) {
+         close(io->fds[i]);
+      }
+   }
+
+   pthread_cond_destroy(&io->cond);
+   pthread_mutex_destroy(&io->mutex);
+
+   bson_free(io->fds);
+   bson_free(io->threads);
+   bson_free(io);
+}
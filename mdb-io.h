@@ -0,0 +1,74 @@
+/* mdb-io.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_IO_H
+#define MDB_IO_H
+
+
+#include "mdb.h"
+
+
+BSON_BEGIN_DECLS
+
+
+/*
+ * The pread backend reads whole extents into buffers instead of going
+ * through the mmap() of a data file. Files are opened with O_DIRECT when
+ * the filesystem allows it so that the page cache is bypassed, and a set
+ * of reader threads keeps up to "depth" prefetched extents in flight.
+ *
+ * This is internal to the library; callers select the backend with
+ * db_set_backend() and use the regular extent and record iterators.
+ */
+
+
+typedef struct _io_t io_t;
+
+
+struct _io_buf_t
+{
+   io_buf_t     *next;
+   int           fileno;
+   bson_int32_t  offset;
+   bson_int64_t  base;
+   char         *data;
+   size_t        len;
+   size_t        alloc;
+   int           state;
+   int           err;
+};
+
+
+io_t     *io_new          (db_t *db,
+                           int depth);
+io_buf_t *io_extent_read  (io_t *io,
+                           const file_loc_t *loc);
+void      io_prefetch     (io_t *io,
+                           const file_loc_t *loc);
+int       io_header_read  (io_t *io,
+                           const file_loc_t *loc,
+                           extent_header_t *ehdr);
+void      io_release      (io_t *io,
+                           io_buf_t *buf);
+void      io_destroy      (io_t *io);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_IO_H */
@@ -0,0 +1,920 @@
+/* mdb-json.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mdb-json.h"
+
+
+/*
+ * Nesting limit for embedded documents, so that a corrupt record cannot
+ * exhaust the stack.
+ */
+#define JSON_MAX_DEPTH 200
+
+
+#define JSON_APPEND_LITERAL(b, s) buffer_append((b), (s), sizeof(s) - 1)
+
+
+static const char gHex[] = "0123456789abcdef";
+
+
+static const char gBase64[] =
+   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static bson_int32_t
+json_read_int32 (const bson_uint8_t *p) /* IN */
+{
+   bson_int32_t v;
+
+   memcpy(&v, p, sizeof v);
+   return BSON_UINT32_FROM_LE(v);
+}
+
+
+static bson_int64_t
+json_read_int64 (const bson_uint8_t *p) /* IN */
+{
+   bson_int64_t v;
+
+   memcpy(&v, p, sizeof v);
+   return BSON_UINT64_FROM_LE(v);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_scan_plain --
+ *
+ *       Find the first byte in @str that cannot be copied to the output
+ *       as is: a quote, a backslash, a control character, or the start
+ *       of a multi-byte UTF-8 sequence.
+ *
+ *       Sixteen bytes are checked at a time with SSE2 where available,
+ *       otherwise eight at a time within a 64-bit word.
+ *
+ * Returns:
+ *       The offset of that byte, or @len if there is none.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static size_t
+json_scan_plain (const bson_uint8_t *str, /* IN */
+                 size_t len)              /* IN */
+{
+   size_t i = 0;
+
+#ifdef __SSE2__
+   const __m128i quote = _mm_set1_epi8('"');
+   const __m128i bslash = _mm_set1_epi8('\\');
+   const __m128i space = _mm_set1_epi8(' ');
+   __m128i v;
+   __m128i m;
+   int mask;
+
+   for (; (i + 16) <= len; i += 16) {
+      v = _mm_loadu_si128((const __m128i *)(str + i));
+      /*
+       * The signed comparison with ' ' catches both control characters
+       * and bytes with the high bit set.
+       */
+      m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash));
+      m = _mm_or_si128(m, _mm_cmplt_epi8(v, space));
+      if ((mask = _mm_movemask_epi8(m))) {
+         return i + __builtin_ctz(mask);
+      }
+   }
+#else
+   const bson_uint64_t ones = 0x0101010101010101ULL;
+   const bson_uint64_t highs = 0x8080808080808080ULL;
+   bson_uint64_t w;
+   bson_uint64_t q;
+   bson_uint64_t b;
+
+   for (; (i + 8) <= len; i += 8) {
+      memcpy(&w, str + i, sizeof w);
+      q = w ^ (ones * '"');
+      b = w ^ (ones * '\\');
+      if ((w | ((w - ones * ' ') & ~w) |
+           ((q - ones) & ~q) |
+           ((b - ones) & ~b)) & highs) {
+         break;
+      }
+   }
+#endif
+
+   for (; i < len; i++) {
+      if ((str[i] < ' ') || (str[i] >= 0x80) ||
+          (str[i] == '"') || (str[i] == '\\')) {
+         break;
+      }
+   }
+
+   return i;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_utf8_sequence --
+ *
+ *       Validate the multi-byte UTF-8 sequence at the start of @str.
+ *       Overlong encodings, surrogates and code points above U+10FFFF
+ *       are rejected.
+ *
+ * Returns:
+ *       The length of the sequence, or 0 if it is invalid.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static size_t
+json_utf8_sequence (const bson_uint8_t *str, /* IN */
+                    size_t len)              /* IN */
+{
+   bson_uint8_t c = str[0];
+   bson_uint8_t lo = 0x80;
+   bson_uint8_t hi = 0xbf;
+   size_t n;
+   size_t i;
+
+   if ((c >= 0xc2) && (c <= 0xdf)) {
+      n = 2;
+   } else if ((c >= 0xe0) && (c <= 0xef)) {
+      n = 3;
+      if (c == 0xe0) {
+         lo = 0xa0;
+      } else if (c == 0xed) {
+         hi = 0x9f;
+      }
+   } else if ((c >= 0xf0) && (c <= 0xf4)) {
+      n = 4;
+      if (c == 0xf0) {
+         lo = 0x90;
+      } else if (c == 0xf4) {
+         hi = 0x8f;
+      }
+   } else {
+      return 0;
+   }
+
+   if (len < n) {
+      return 0;
+   }
+
+   if ((str[1] < lo) || (str[1] > hi)) {
+      return 0;
+   }
+
+   for (i = 2; i < n; i++) {
+      if ((str[i] & 0xc0) != 0x80) {
+         return 0;
+      }
+   }
+
+   return n;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_append_string --
+ *
+ *       Append @str as a quoted and escaped JSON string. Runs of bytes
+ *       that need no escaping are copied in one piece.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 if @str is not valid UTF-8.
+ *
+ * Side effects:
+ *       buffer is appended to, unless @str is not valid UTF-8.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+json_append_string (buffer_t *buffer,        /* IN */
+                    const bson_uint8_t *str, /* IN */
+                    size_t len)              /* IN */
+{
+   char esc[6] = { '\\', 'u', '0', '0' };
+   size_t start = buffer->len;
+   size_t n;
+
+   buffer_append(buffer, "\"", 1);
+
+   while (len) {
+      n = json_scan_plain(str, len);
+      buffer_append(buffer, str, n);
+      str += n;
+      len -= n;
+
+      if (!len) {
+         break;
+      }
+
+      if (*str >= 0x80) {
+         if (!(n = json_utf8_sequence(str, len))) {
+            buffer->len = start;
+            return -1;
+         }
+         buffer_append(buffer, str, n);
+         str += n;
+         len -= n;
+         continue;
+      }
+
+      switch (*str) {
+      case '"':
+         JSON_APPEND_LITERAL(buffer, "\\\"");
+         break;
+      case '\\':
+         JSON_APPEND_LITERAL(buffer, "\\\\");
+         break;
+      case '\b':
+         JSON_APPEND_LITERAL(buffer, "\\b");
+         break;
+      case '\f':
+         JSON_APPEND_LITERAL(buffer, "\\f");
+         break;
+      case '\n':
+         JSON_APPEND_LITERAL(buffer, "\\n");
+         break;
+      case '\r':
+         JSON_APPEND_LITERAL(buffer, "\\r");
+         break;
+      case '\t':
+         JSON_APPEND_LITERAL(buffer, "\\t");
+         break;
+      default:
+         esc[4] = gHex[*str >> 4];
+         esc[5] = gHex[*str & 0xf];
+         buffer_append(buffer, esc, sizeof esc);
+         break;
+      }
+
+      str++;
+      len--;
+   }
+
+   buffer_append(buffer, "\"", 1);
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_append_int --
+ *
+ *       Append the decimal representation of @v.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buffer is appended to.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+json_append_int (buffer_t *buffer, /* IN */
+                 bson_int64_t v)   /* IN */
+{
+   char str[24];
+   char *p = str + sizeof str;
+   bson_uint64_t u;
+
+   u = (v < 0) ? -(bson_uint64_t)v : (bson_uint64_t)v;
+
+   do {
+      *--p = '0' + (u % 10);
+      u /= 10;
+   } while (u);
+
+   if (v < 0) {
+      *--p = '-';
+   }
+
+   buffer_append(buffer, p, (str + sizeof str) - p);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_append_double --
+ *
+ *       Append @v formatted as bson_as_json() does.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buffer is appended to.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+json_append_double (buffer_t *buffer, /* IN */
+                    double v)         /* IN */
+{
+   char str[64];
+   int n;
+
+   n = snprintf(str, sizeof str, "%lf", v);
+
+   if (n < (int)sizeof str) {
+      buffer_append(buffer, str, n);
+   } else {
+      snprintf(buffer_reserve(buffer, n + 1), n + 1, "%lf", v);
+      buffer->len--;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_append_hex --
+ *
+ *       Append @len bytes of @data as lower case hexadecimal.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buffer is appended to.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+json_append_hex (buffer_t *buffer,         /* IN */
+                 const bson_uint8_t *data, /* IN */
+                 size_t len)               /* IN */
+{
+   char *p = buffer_reserve(buffer, len * 2);
+   size_t i;
+
+   for (i = 0; i < len; i++) {
+      *p++ = gHex[data[i] >> 4];
+      *p++ = gHex[data[i] & 0xf];
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_append_base64 --
+ *
+ *       Append @len bytes of @data encoded as padded base64.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       buffer is appended to.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+json_append_base64 (buffer_t *buffer,         /* IN */
+                    const bson_uint8_t *data, /* IN */
+                    size_t len)               /* IN */
+{
+   char *p = buffer_reserve(buffer, ((len + 2) / 3) * 4);
+   bson_uint32_t v;
+
+   for (; len >= 3; data += 3, len -= 3) {
+      v = (data[0] << 16) | (data[1] << 8) | data[2];
+      *p++ = gBase64[(v >> 18) & 0x3f];
+      *p++ = gBase64[(v >> 12) & 0x3f];
+      *p++ = gBase64[(v >> 6) & 0x3f];
+      *p++ = gBase64[v & 0x3f];
+   }
+
+   if (len) {
+      v = (data[0] << 16) | ((len > 1) ? (data[1] << 8) : 0);
+      *p++ = gBase64[(v >> 18) & 0x3f];
+      *p++ = gBase64[(v >> 12) & 0x3f];
+      *p++ = (len > 1) ? gBase64[(v >> 6) & 0x3f] : '=';
+      *p++ = '=';
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_read_string --
+ *
+ *       Read a BSON string (int32 length, bytes, NUL) from @p, which has
+ *       @avail bytes available.
+ *
+ * Returns:
+ *       The number of bytes consumed, or 0 if the string is invalid.
+ *
+ * Side effects:
+ *       str and len are set to the string contents.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static size_t
+json_read_string (const bson_uint8_t *p,     /* IN */
+                  size_t avail,              /* IN */
+                  const bson_uint8_t **str,  /* OUT */
+                  size_t *len)               /* OUT */
+{
+   bson_int32_t slen;
+
+   if (avail < 4) {
+      return 0;
+   }
+
+   slen = json_read_int32(p);
+   if ((slen < 1) || ((size_t)slen > (avail - 4)) || p[4 + slen - 1]) {
+      return 0;
+   }
+
+   *str = p + 4;
+   *len = slen - 1;
+
+   return 4 + slen;
+}
+
+
+static int json_append_document (buffer_t *buffer,
+                                 const bson_uint8_t *data,
+                                 size_t len,
+                                 int array,
+                                 int depth);
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_append_element --
+ *
+ *       Append the value of an element of @type whose data starts at @p,
+ *       with @avail bytes left in the enclosing document.
+ *
+ * Returns:
+ *       The number of bytes of element data consumed, or -1 if the
+ *       element is invalid.
+ *
+ * Side effects:
+ *       buffer is appended to.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static ssize_t
+json_append_element (buffer_t *buffer,      /* IN */
+                     bson_uint8_t type,     /* IN */
+                     const bson_uint8_t *p, /* IN */
+                     size_t avail,          /* IN */
+                     int depth)             /* IN */
+{
+   const bson_uint8_t *str;
+   const bson_uint8_t *opts;
+   bson_int32_t blen;
+   size_t olen;
+   size_t len;
+   size_t n;
+   double d;
+
+   switch (type) {
+   case BSON_TYPE_DOUBLE:
+      if (avail < 8) {
+         return -1;
+      }
+      memcpy(&d, p, 8);
+      json_append_double(buffer, d);
+      return 8;
+   case BSON_TYPE_UTF8:
+   case BSON_TYPE_SYMBOL:
+   case BSON_TYPE_CODE:
+      if (!(n = json_read_string(p, avail, &str, &len)) ||
+          !!json_append_string(buffer, str, len)) {
+         return -1;
+      }
+      return n;
+   case BSON_TYPE_DOCUMENT:
+   case BSON_TYPE_ARRAY:
+      if (avail < 5) {
+         return -1;
+      }
+      blen = json_read_int32(p);
+      if ((blen < 5) || ((size_t)blen > avail) ||
+          !!json_append_document(buffer, p, blen,
+                                 (type == BSON_TYPE_ARRAY), depth + 1)) {
+         return -1;
+      }
+      return blen;
+   case BSON_TYPE_BINARY:
+      if (avail < 5) {
+         return -1;
+      }
+      blen = json_read_int32(p);
+      if ((blen < 0) || ((size_t)blen > (avail - 5))) {
+         return -1;
+      }
+      str = p + 5;
+      len = blen;
+      /*
+       * The deprecated binary subtype repeats the length inside the
+       * data, which is not part of the value.
+       */
+      if (p[4] == BSON_SUBTYPE_BINARY_DEPRECATED) {
+         if ((len < 4) || ((size_t)json_read_int32(str) != (len - 4))) {
+            return -1;
+         }
+         str += 4;
+         len -= 4;
+      }
+      JSON_APPEND_LITERAL(buffer, "{ \"$type\" : \"");
+      json_append_hex(buffer, p + 4, 1);
+      JSON_APPEND_LITERAL(buffer, "\", \"$binary\" : \"");
+      json_append_base64(buffer, str, len);
+      JSON_APPEND_LITERAL(buffer, "\" }");
+      return 5 + blen;
+   case BSON_TYPE_UNDEFINED:
+      JSON_APPEND_LITERAL(buffer, "{ \"$undefined\" : true }");
+      return 0;
+   case BSON_TYPE_OID:
+      if (avail < 12) {
+         return -1;
+      }
+      JSON_APPEND_LITERAL(buffer, "{ \"$oid\" : \"");
+      json_append_hex(buffer, p, 12);
+      JSON_APPEND_LITERAL(buffer, "\" }");
+      return 12;
+   case BSON_TYPE_BOOL:
+      if (avail < 1) {
+         return -1;
+      }
+      if (*p) {
+         JSON_APPEND_LITERAL(buffer, "true");
+      } else {
+         JSON_APPEND_LITERAL(buffer, "false");
+      }
+      return 1;
+   case BSON_TYPE_DATE_TIME:
+      if (avail < 8) {
+         return -1;
+      }
+      JSON_APPEND_LITERAL(buffer, "{ \"$date\" : ");
+      json_append_int(buffer, json_read_int64(p));
+      JSON_APPEND_LITERAL(buffer, " }");
+      return 8;
+   case BSON_TYPE_NULL:
+      JSON_APPEND_LITERAL(buffer, "null");
+      return 0;
+   case BSON_TYPE_REGEX:
+      if (!(str = memchr(p, '\0', avail))) {
+         return -1;
+      }
+      len = str - p;
+      opts = p + len + 1;
+      if (!(str = memchr(opts, '\0', avail - len - 1))) {
+         return -1;
+      }
+      olen = str - opts;
+      str = p;
+      JSON_APPEND_LITERAL(buffer, "{ \"$regex\" : ");
+      if (!!json_append_string(buffer, str, len)) {
+         return -1;
+      }
+      JSON_APPEND_LITERAL(buffer, ", \"$options\" : ");
+      if (!!json_append_string(buffer, opts, olen)) {
+         return -1;
+      }
+      JSON_APPEND_LITERAL(buffer, " }");
+      return len + olen + 2;
+   case BSON_TYPE_DBPOINTER:
+      if (!(n = json_read_string(p, avail, &str, &len)) ||
+          ((avail - n) < 12)) {
+         return -1;
+      }
+      JSON_APPEND_LITERAL(buffer, "{ \"$ref\" : ");
+      if (!!json_append_string(buffer, str, len)) {
+         return -1;
+      }
+      JSON_APPEND_LITERAL(buffer, ", \"$id\" : \"");
+      json_append_hex(buffer, p + n, 12);
+      JSON_APPEND_LITERAL(buffer, "\" }");
+      return n + 12;
+   case BSON_TYPE_CODEWSCOPE:
+      /*
+       * Like bson_as_json(), only the code is written; the scope is
+       * validated but dropped.
+       */
+      if (avail < 4) {
+         return -1;
+      }
+      blen = json_read_int32(p);
+      if ((blen < 14) || ((size_t)blen > avail) ||
+          !(n = json_read_string(p + 4, blen - 4, &str, &len)) ||
+          !!json_append_string(buffer, str, len)) {
+         return -1;
+      }
+      olen = buffer->len;
+      if ((blen - 4 - n) < 5 ||
+          !!json_append_document(buffer, p + 4 + n, blen - 4 - n,
+                                 FALSE, depth + 1)) {
+         return -1;
+      }
+      buffer->len = olen;
+      return blen;
+   case BSON_TYPE_INT32:
+      if (avail < 4) {
+         return -1;
+      }
+      json_append_int(buffer, json_read_int32(p));
+      return 4;
+   case BSON_TYPE_TIMESTAMP:
+      if (avail < 8) {
+         return -1;
+      }
+      JSON_APPEND_LITERAL(buffer, "{ \"$timestamp\" : { \"t\": ");
+      json_append_int(buffer, (bson_uint32_t)json_read_int32(p + 4));
+      JSON_APPEND_LITERAL(buffer, ", \"i\": ");
+      json_append_int(buffer, (bson_uint32_t)json_read_int32(p));
+      JSON_APPEND_LITERAL(buffer, " } }");
+      return 8;
+   case BSON_TYPE_INT64:
+      if (avail < 8) {
+         return -1;
+      }
+      json_append_int(buffer, json_read_int64(p));
+      return 8;
+   case BSON_TYPE_MINKEY:
+      JSON_APPEND_LITERAL(buffer, "{ \"$minKey\" : 1 }");
+      return 0;
+   case BSON_TYPE_MAXKEY:
+      JSON_APPEND_LITERAL(buffer, "{ \"$maxKey\" : 1 }");
+      return 0;
+   default:
+      return -1;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_append_document --
+ *
+ *       Append the BSON document or array in @data, which must be exactly
+ *       @len bytes long.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 if the document is invalid.
+ *
+ * Side effects:
+ *       buffer is appended to, possibly partially on failure.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+json_append_document (buffer_t *buffer,         /* IN */
+                      const bson_uint8_t *data, /* IN */
+                      size_t len,               /* IN */
+                      int array,                /* IN */
+                      int depth)                /* IN */
+{
+   const bson_uint8_t *end;
+   const bson_uint8_t *key;
+   const bson_uint8_t *p;
+   bson_uint8_t type;
+   size_t klen;
+   ssize_t n;
+
+   if ((depth > JSON_MAX_DEPTH) ||
+       (len < 5) ||
+       ((size_t)json_read_int32(data) != len) ||
+       data[len - 1]) {
+      return -1;
+   }
+
+   p = data + 4;
+   end = data + len - 1;
+
+   if (array) {
+      JSON_APPEND_LITERAL(buffer, "[ ");
+   } else {
+      JSON_APPEND_LITERAL(buffer, "{ ");
+   }
+
+   while (p < end) {
+      if (p != (data + 4)) {
+         JSON_APPEND_LITERAL(buffer, ", ");
+      }
+
+      type = *p++;
+      if (!(key = memchr(p, '\0', end - p))) {
+         return -1;
+      }
+      klen = key - p;
+      key = p;
+      p += klen + 1;
+
+      if (!array) {
+         if (!!json_append_string(buffer, key, klen)) {
+            return -1;
+         }
+         JSON_APPEND_LITERAL(buffer, " : ");
+      }
+
+      if (-1 == (n = json_append_element(buffer, type, p, end - p, depth))) {
+         return -1;
+      }
+      p += n;
+   }
+
+   if (array) {
+      JSON_APPEND_LITERAL(buffer, " ]");
+   } else {
+      JSON_APPEND_LITERAL(buffer, " }");
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_append_bson --
+ *
+ *       Append the Extended JSON form of the BSON document in @data to
+ *       @buffer. The text is identical to that of bson_as_json(), without
+ *       a trailing newline.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set to EBADF if the
+ *       document is invalid.
+ *
+ * Side effects:
+ *       buffer is appended to on success, and left unchanged on failure.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+json_append_bson (buffer_t *buffer,         /* IN */
+                  const bson_uint8_t *data, /* IN */
+                  size_t len)               /* IN */
+{
+   size_t start;
+
+   if (!buffer || !data) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   start = buffer->len;
+
+   if (!!json_append_document(buffer, data, len, FALSE, 0)) {
+      buffer->len = start;
+      errno = EBADF;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_append_value --
+ *
+ *       Append the Extended JSON form of a single BSON value of @type,
+ *       whose encoding is the @len bytes at @data, such as the value of
+ *       an element found with a bson_iter_t.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set to EBADF if the
+ *       value is invalid.
+ *
+ * Side effects:
+ *       buffer is appended to on success, and left unchanged on failure.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+json_append_value (buffer_t *buffer,         /* IN */
+                   bson_type_t type,         /* IN */
+                   const bson_uint8_t *data, /* IN */
+                   size_t len)               /* IN */
+{
+   size_t start;
+
+   if (!buffer || (!data && len)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   start = buffer->len;
+
+   if ((size_t)json_append_element(buffer, type, data, len, 0) != len) {
+      buffer->len = start;
+      errno = EBADF;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * json_parse_key --
+ *
+ *       Parse the Extended JSON value @arg into @key as { name : value }.
+ *       If @arg does not parse, it is used as a string instead.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       key is initialized and must be destroyed with bson_destroy().
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+json_parse_key (const char *arg,  /* IN */
+                const char *name, /* IN */
+                bson_t *key)      /* OUT */
+{
+   bson_error_t error;
+   buffer_t json;
+   int ret;
+
+   bson_return_if_fail(arg);
+   bson_return_if_fail(name);
+   bson_return_if_fail(key);
+
+   buffer_init(&json);
+   JSON_APPEND_LITERAL(&json, "{ ");
+   json_append_string(&json, (const bson_uint8_t *)name, strlen(name));
+   JSON_APPEND_LITERAL(&json, " : ");
+   buffer_append(&json, arg, strlen(arg));
+   JSON_APPEND_LITERAL(&json, " }");
+
+   ret = bson_init_from_json(key, json.data, json.len, &error);
+
+   buffer_destroy(&json);
+
+   if (!ret) {
+      bson_init(key);
+      bson_append_utf8(key, name, -1, arg, -1);
+   }
+}
@@ -0,0 +1,71 @@
+/* mdb-json.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_JSON_H
+#define MDB_JSON_H
+
+
+#include <bson.h>
+
+#include "mdb-buffer.h"
+
+
+BSON_BEGIN_DECLS
+
+
+/*
+ * An Extended JSON encoder producing the same text as bson_as_json(), but
+ * writing directly into a caller-provided buffer_t. Since a buffer keeps
+ * its allocation when cleared, a worker that reuses one buffer performs
+ * no heap allocation per document once the buffer has grown to size.
+ *
+ * The document is validated while it is encoded, including the UTF-8 in
+ * keys and strings. On failure nothing is appended.
+ */
+int json_append_bson  (buffer_t *buffer,
+                       const bson_uint8_t *data,
+                       size_t len);
+int json_append_value (buffer_t *buffer,
+                       bson_type_t type,
+                       const bson_uint8_t *data,
+                       size_t len);
+
+
+/*
+ * Append a UTF-8 string of @len bytes, quoted and escaped, for tools that
+ * write JSON of their own around it.
+ */
+int json_append_string (buffer_t *buffer,
+                        const bson_uint8_t *str,
+                        size_t len);
+
+
+/*
+ * Parse a key given on the command line, such as 42, '"abc"' or
+ * '{ "$oid" : "..." }', into the document { name : value }. Anything that
+ * is not valid Extended JSON is taken as a string.
+ */
+void json_parse_key   (const char *arg,
+                       const char *name,
+                       bson_t *key);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_JSON_H */
@@ -0,0 +1,256 @@
+/* mdb-output.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mdb-json.h"
+#include "mdb-output.h"
+
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * output_init --
+ *
+ *       Initialize @output to write to @fd. If @flags contains
+ *       OUTPUT_SPLICE and @fd is a pipe, output_writev() will use
+ *       vmsplice().
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       output is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+output_init (output_t *output, /* OUT */
+             int fd,           /* IN */
+             int flags)        /* IN */
+{
+   struct stat st;
+
+   if (!output || fd < 0) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   memset(output, 0, sizeof *output);
+   output->fd = fd;
+
+#ifdef SPLICE_F_GIFT
+   if ((flags & OUTPUT_SPLICE) && !fstat(fd, &st) && S_ISFIFO(st.st_mode)) {
+      output->splice = TRUE;
+   }
+#endif
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * output_write --
+ *
+ *       Write @len bytes of @data, retrying short writes.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+output_write (output_t *output,  /* IN */
+              const void *data,  /* IN */
+              size_t len)        /* IN */
+{
+   struct iovec iov;
+
+   iov.iov_base = (void *)data;
+   iov.iov_len = len;
+
+   return output_writev(output, &iov, 1);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * output_writev --
+ *
+ *       Write all of the regions in @iov, in order. Short writes are
+ *       retried and large vectors are submitted in batches of IOV_MAX.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       The contents of @iov are consumed and must not be reused.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+output_writev (output_t *output, /* IN */
+               struct iovec *iov, /* IN */
+               int iovcnt)        /* IN */
+{
+   ssize_t n;
+   int cnt;
+
+   if (!output || (!iov && iovcnt)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   while (iovcnt) {
+      if (!iov->iov_len) {
+         iov++;
+         iovcnt--;
+         continue;
+      }
+
+      cnt = (iovcnt < IOV_MAX) ? iovcnt : IOV_MAX;
+
+#ifdef SPLICE_F_GIFT
+      if (output->splice) {
+         n = vmsplice(output->fd, iov, cnt, 0);
+         if ((n == -1) && ((errno == EINVAL) || (errno == ENOSYS))) {
+            output->splice = FALSE;
+            continue;
+         }
+      } else
+#endif
+      {
+         n = writev(output->fd, iov, cnt);
+      }
+
+      if (n == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return -1;
+      }
+
+      while (n && ((size_t)n >= iov->iov_len)) {
+         n -= iov->iov_len;
+         iov++;
+         iovcnt--;
+      }
+
+      if (n) {
+         iov->iov_base = (char *)iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * output_append_doc --
+ *
+ *       Append the document in @data to @buffer, as it is if @bson is
+ *       set, or otherwise as a line of Extended JSON.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set to EBADF if the
+ *       document is invalid.
+ *
+ * Side effects:
+ *       buffer is appended to on success, and left unchanged on failure.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+output_append_doc (buffer_t *buffer,         /* IN */
+                   const bson_uint8_t *data, /* IN */
+                   size_t len,               /* IN */
+                   int bson)                 /* IN */
+{
+   if (bson) {
+      buffer_append(buffer, data, len);
+      return 0;
+   }
+
+   if (!!json_append_bson(buffer, data, len)) {
+      return -1;
+   }
+
+   buffer_append(buffer, "\n", 1);
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * output_flush --
+ *
+ *       Write out and clear @buffer if it holds at least @min bytes. A
+ *       @min of 0 writes out whatever is left.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       buffer is cleared, even if the write fails.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+output_flush (output_t *output, /* IN */
+              buffer_t *buffer, /* IN */
+              size_t min)       /* IN */
+{
+   int ret = 0;
+
+   if (buffer->len && (buffer->len >= min)) {
+      ret = output_write(output, buffer->data, buffer->len);
+      buffer_clear(buffer);
+   }
+
+   return ret;
+}
@@ -0,0 +1,84 @@
+/* mdb-output.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_OUTPUT_H
+#define MDB_OUTPUT_H
+
+
+#include <bson.h>
+#include <sys/uio.h>
+
+#include "mdb-buffer.h"
+
+
+BSON_BEGIN_DECLS
+
+
+typedef struct _output_t output_t;
+
+
+/*
+ * An output stream on top of a file descriptor that can write scattered
+ * regions of memory without first copying them into a buffer.
+ *
+ * With OUTPUT_SPLICE, and when the descriptor is a pipe, the regions are
+ * handed to the pipe with vmsplice() so the kernel references the pages
+ * instead of copying them. The pages may still be read by the consumer
+ * after output_writev() returns, so this must only be used for memory
+ * that is never modified afterwards, such as a read-only mapping of a
+ * data file. Otherwise writev() is used.
+ */
+struct _output_t
+{
+   int fd;
+   int splice;
+};
+
+
+#define OUTPUT_SPLICE (1 << 0)
+
+
+int output_init   (output_t *output,
+                   int fd,
+                   int flags);
+int output_write  (output_t *output,
+                   const void *data,
+                   size_t len);
+int output_writev (output_t *output,
+                   struct iovec *iov,
+                   int iovcnt);
+
+
+/*
+ * Documents looked up one at a time are collected in a buffer, as a line
+ * of Extended JSON each or as raw BSON, and written out once the buffer
+ * holds at least a given number of bytes.
+ */
+int output_append_doc (buffer_t *buffer,
+                       const bson_uint8_t *data,
+                       size_t len,
+                       int bson);
+int output_flush      (output_t *output,
+                       buffer_t *buffer,
+                       size_t min);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_OUTPUT_H */
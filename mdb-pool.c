@@ -0,0 +1,272 @@
+/* mdb-pool.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "mdb-pool.h"
+
+
+typedef struct
+{
+   buffer_t buffer;
+   int      done;
+   int      ret;
+   int      err;
+} slot_t;
+
+
+typedef struct
+{
+   pthread_mutex_t  mutex;
+   pthread_cond_t   cond;
+   pool_func_t      func;
+   void            *data;
+   int              ntasks;
+   int              window;
+   int              next;
+   int              emitted;
+   int              failed;
+   slot_t          *slots;
+} pool_t;
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * pool_worker --
+ *
+ *       Worker thread main loop. Claims the next task as long as it is
+ *       within the window of the emitter and stores its result in the
+ *       slot for that task.
+ *
+ * Returns:
+ *       NULL.
+ *
+ * Side effects:
+ *       Tasks are executed.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void *
+pool_worker (void *data) /* IN */
+{
+   pool_t *pool = data;
+   slot_t *slot;
+   int index;
+   int ret;
+   int err;
+
+   pthread_mutex_lock(&pool->mutex);
+
+   for (;;) {
+      while (!pool->failed &&
+             (pool->next < pool->ntasks) &&
+             (pool->next >= (pool->emitted + pool->window))) {
+         pthread_cond_wait(&pool->cond, &pool->mutex);
+      }
+
+      if (pool->failed || (pool->next >= pool->ntasks)) {
+         break;
+      }
+
+      index = pool->next++;
+      slot = &pool->slots[index % pool->window];
+
+      pthread_mutex_unlock(&pool->mutex);
+      errno = 0;
+      ret = pool->func(pool->data, index, &slot->buffer);
+      err = errno;
+      pthread_mutex_lock(&pool->mutex);
+
+      slot->ret = ret;
+      slot->err = err;
+      slot->done = TRUE;
+      pthread_cond_broadcast(&pool->cond);
+   }
+
+   pthread_mutex_unlock(&pool->mutex);
+
+   return NULL;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * pool_run_serial --
+ *
+ *       Run all tasks on the calling thread, emitting after each one.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       Tasks are executed.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+pool_run_serial (int ntasks,        /* IN */
+                 pool_func_t func,  /* IN */
+                 pool_emit_t emit,  /* IN */
+                 void *data)        /* IN */
+{
+   buffer_t buffer;
+   int ret = 0;
+   int i;
+
+   buffer_init(&buffer);
+
+   for (i = 0; !ret && i < ntasks; i++) {
+      if (!(ret = func(data, i, &buffer)) && emit) {
+         ret = emit(data, i, &buffer);
+      }
+      buffer_clear(&buffer);
+   }
+
+   buffer_destroy(&buffer);
+
+   return ret ? -1 : 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * pool_run --
+ *
+ *       Execute tasks 0 through @ntasks - 1 using @nthreads workers.
+ *       @func is called from the worker threads; @emit, if not NULL, is
+ *       called from the calling thread once per task in ascending task
+ *       order with the buffer that @func filled.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set to the error of
+ *       the first failing task or emit.
+ *
+ * Side effects:
+ *       Tasks are executed. On failure, tasks that have not started are
+ *       skipped.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+pool_run (int nthreads,       /* IN */
+          int ntasks,         /* IN */
+          pool_func_t func,   /* IN */
+          pool_emit_t emit,   /* IN */
+          void *data)         /* IN */
+{
+   pthread_t *threads;
+   slot_t *slot;
+   pool_t pool;
+   int started = 0;
+   int ret = 0;
+   int err = 0;
+   int i;
+
+   if (!func || ntasks < 0) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (nthreads > ntasks) {
+      nthreads = ntasks;
+   }
+
+   if (nthreads <= 1) {
+      return pool_run_serial(ntasks, func, emit, data);
+   }
+
+   memset(&pool, 0, sizeof pool);
+   pthread_mutex_init(&pool.mutex, NULL);
+   pthread_cond_init(&pool.cond, NULL);
+   pool.func = func;
+   pool.data = data;
+   pool.ntasks = ntasks;
+   pool.window = nthreads * 2;
+   pool.slots = bson_malloc0(pool.window * sizeof *pool.slots);
+
+   threads = bson_malloc0(nthreads * sizeof *threads);
+   for (i = 0; i < nthreads; i++) {
+      if (!!pthread_create(&threads[i], NULL, pool_worker, &pool)) {
+         break;
+      }
+      started++;
+   }
+
+   if (!started) {
+      err = EAGAIN;
+      ret = -1;
+      pool.failed = TRUE;
+   }
+
+   for (i = 0; !ret && i < ntasks; i++) {
+      slot = &pool.slots[i % pool.window];
+
+      pthread_mutex_lock(&pool.mutex);
+      while (!slot->done) {
+         pthread_cond_wait(&pool.cond, &pool.mutex);
+      }
+      pthread_mutex_unlock(&pool.mutex);
+
+      if (slot->ret) {
+         err = slot->err;
+         ret = -1;
+      } else if (emit && !!emit(data, i, &slot->buffer)) {
+         err = errno;
+         ret = -1;
+      }
+
+      buffer_clear(&slot->buffer);
+
+      pthread_mutex_lock(&pool.mutex);
+      slot->done = FALSE;
+      pool.emitted++;
+      if (ret) {
+         pool.failed = TRUE;
+      }
+      pthread_cond_broadcast(&pool.cond);
+      pthread_mutex_unlock(&pool.mutex);
+   }
+
+   for (i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+   }
+
+   for (i = 0; i < pool.window; i++) {
+      buffer_destroy(&pool.slots[i].buffer);
+   }
+
+   bson_free(pool.slots);
+   bson_free(threads);
+   pthread_cond_destroy(&pool.cond);
+   pthread_mutex_destroy(&pool.mutex);
+
+   if (ret) {
+      errno = err;
+   }
+
+   return ret;
+}
@@ -0,0 +1,62 @@
+/* mdb-pool.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_POOL_H
+#define MDB_POOL_H
+
+
+#include <bson.h>
+
+#include "mdb-buffer.h"
+
+
+BSON_BEGIN_DECLS
+
+
+/*
+ * pool_run() executes @ntasks numbered tasks on a set of worker threads.
+ * Each task renders its result into a private buffer_t. The results are
+ * then handed to the emit callback on the calling thread in task order,
+ * so output stays in the same order a single-threaded scan would produce.
+ *
+ * Only a bounded window of tasks may be in flight ahead of the emitter,
+ * which keeps memory proportional to the thread count rather than the
+ * size of the data set.
+ *
+ * Both callbacks return 0 on success, or -1 with errno set to abort
+ * the run.
+ */
+typedef int (*pool_func_t) (void *data,
+                            int index,
+                            buffer_t *buffer);
+typedef int (*pool_emit_t) (void *data,
+                            int index,
+                            buffer_t *buffer);
+
+
+int pool_run (int nthreads,
+              int ntasks,
+              pool_func_t func,
+              pool_emit_t emit,
+              void *data);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_POOL_H */
@@ -0,0 +1,637 @@
+/* mdb-sidecar.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "mdb-sidecar.h"
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_keys --
+ *
+ *       Appends the sidecar_key_t of the .ns file and of every data file
+ *       of @db to @buffer. A database that was carved has no .ns file,
+ *       which gets a key with a size of -1. Other files derived from a
+ *       database can use the same keys to tell when they are stale.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+sidecar_keys (db_t *db,         /* IN */
+              buffer_t *buffer) /* OUT */
+{
+   sidecar_key_t key;
+   struct stat st;
+   const char *path;
+   int i;
+
+   for (i = -1; i < db->filescnt; i++) {
+      path = (i == -1) ? db->nsfile.path : db->files[i].path;
+
+      memset(&key, 0, sizeof key);
+
+      if (!path) {
+         key.size = -1;
+      } else if (!!stat(path, &st)) {
+         return -1;
+      } else {
+         key.size = st.st_size;
+         key.mtime = st.st_mtim.tv_sec;
+         key.mtime_nsec = st.st_mtim.tv_nsec;
+      }
+
+      buffer_append(buffer, &key, sizeof key);
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_open --
+ *
+ *       Maps the sidecar at @path for @db. The sidecar must have been
+ *       written for the same files of @db, unchanged since.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set. ESTALE if the
+ *       files have changed, EBADF if the sidecar is corrupt.
+ *
+ * Side effects:
+ *       sidecar is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+sidecar_open (sidecar_t *sidecar, /* OUT */
+              const char *path,   /* IN */
+              db_t *db)           /* IN */
+{
+   const sidecar_header_t *header;
+   bson_uint64_t size;
+   bson_uint64_t i;
+   buffer_t keys;
+   struct stat st;
+   void *map;
+   int fd;
+
+   if (!sidecar || !path || !db) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   memset(sidecar, 0, sizeof *sidecar);
+
+   if (-1 == (fd = open(path, O_RDONLY))) {
+      return -1;
+   }
+
+   if (!!fstat(fd, &st)) {
+      close(fd);
+      return -1;
+   }
+
+   if (st.st_size < (off_t)sizeof *header) {
+      close(fd);
+      errno = EBADF;
+      return -1;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED) {
+      return -1;
+   }
+
+   sidecar->map = map;
+   sidecar->maplen = st.st_size;
+   header = map;
+   size = st.st_size;
+
+   /*
+    * The counts are checked against the file size one at a time, so
+    * that a corrupt header cannot overflow the expected size.
+    */
+   if (!!strncmp(header->magic, SIDECAR_MAGIC, sizeof header->magic) ||
+       (header->nfiles != (bson_uint32_t)db->filescnt) ||
+       (header->nns > size) || (header->nextents > size) ||
+       (header->nrecords > size) ||
+       (size != (sizeof *header +
+                 ((header->nfiles + 1) * sizeof(sidecar_key_t)) +
+                 (header->nns * sizeof *sidecar->ns) +
+                 (header->nextents * sizeof *sidecar->extents) +
+                 (header->nrecords * sizeof *sidecar->records)))) {
+      sidecar_close(sidecar);
+      errno = EBADF;
+      return -1;
+   }
+
+   buffer_init(&keys);
+
+   if (!!sidecar_keys(db, &keys)) {
+      buffer_destroy(&keys);
+      sidecar_close(sidecar);
+      return -1;
+   }
+
+   if (!!memcmp(sidecar->map + sizeof *header, keys.data, keys.len)) {
+      buffer_destroy(&keys);
+      sidecar_close(sidecar);
+      errno = ESTALE;
+      return -1;
+   }
+
+   sidecar->ns = (const sidecar_ns_t *)(sidecar->map + sizeof *header +
+                                        keys.len);
+   sidecar->nns = header->nns;
+   sidecar->extents = (const sidecar_extent_t *)(sidecar->ns + sidecar->nns);
+   sidecar->nextents = header->nextents;
+   sidecar->records = (const sidecar_record_t *)(sidecar->extents +
+                                                 sidecar->nextents);
+   sidecar->nrecords = header->nrecords;
+
+   buffer_destroy(&keys);
+
+   for (i = 0; i < sidecar->nns; i++) {
+      if (!memchr(sidecar->ns[i].name, '\0', sizeof sidecar->ns[i].name) ||
+          (sidecar->ns[i].first > sidecar->nextents) ||
+          (sidecar->ns[i].count > (sidecar->nextents -
+                                   sidecar->ns[i].first))) {
+         sidecar_close(sidecar);
+         errno = EBADF;
+         return -1;
+      }
+   }
+
+   for (i = 0; i < sidecar->nextents; i++) {
+      if ((sidecar->extents[i].first > sidecar->nrecords) ||
+          (sidecar->extents[i].count > (sidecar->nrecords -
+                                        sidecar->extents[i].first))) {
+         sidecar_close(sidecar);
+         errno = EBADF;
+         return -1;
+      }
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_lookup --
+ *
+ *       Finds the namespace @name (such as "db.collection") in @sidecar.
+ *
+ * Returns:
+ *       The sidecar_ns_t, or NULL if the namespace was not recorded.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+const sidecar_ns_t *
+sidecar_lookup (const sidecar_t *sidecar, /* IN */
+                const char *name)         /* IN */
+{
+   bson_uint64_t i;
+
+   bson_return_val_if_fail(sidecar, NULL);
+   bson_return_val_if_fail(name, NULL);
+
+   for (i = 0; i < sidecar->nns; i++) {
+      if (!strncmp(sidecar->ns[i].name, name, sizeof sidecar->ns[i].name)) {
+         return &sidecar->ns[i];
+      }
+   }
+
+   return NULL;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_record_batch --
+ *
+ *       Fills @batch with the documents of records @pos up to @end of
+ *       @sidecar, which must lie in @extent, like extent_record_batch()
+ *       does by following the record chain. Since every location is
+ *       known up front, the start of each document in the batch is
+ *       prefetched before the caller gets to it.
+ *
+ *       Records that do not lie within @extent are skipped and counted
+ *       as invalid.
+ *
+ * Returns:
+ *       The number of documents in @batch, 0 once @end is reached.
+ *
+ * Side effects:
+ *       @pos is advanced past the records that were consumed.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+sidecar_record_batch (const sidecar_t *sidecar, /* IN */
+                      extent_t *extent,         /* IN */
+                      bson_uint64_t *pos,       /* IN/OUT */
+                      bson_uint64_t end,        /* IN */
+                      record_batch_t *batch)    /* OUT */
+{
+   const sidecar_record_t *rec;
+   bson_int64_t start;
+   int i;
+
+   batch->count = 0;
+
+   if (end > sidecar->nrecords) {
+      end = sidecar->nrecords;
+   }
+
+   while ((batch->count < RECORD_BATCH_MAX) && (*pos < end)) {
+      rec = &sidecar->records[(*pos)++];
+      start = (bson_int64_t)rec->offset - extent->base;
+
+      if ((rec->fileno != extent->fileno) || (start < 0) ||
+          (rec->len < 5) ||
+          ((start + rec->len) > (bson_int64_t)extent->maplen)) {
+         batch->invalid++;
+         continue;
+      }
+
+      batch->records[batch->count].data =
+         (const bson_uint8_t *)extent->map + start;
+      batch->records[batch->count].len = rec->len;
+      batch->count++;
+   }
+
+#ifdef __GNUC__
+   for (i = 0; i < batch->count; i++) {
+      __builtin_prefetch(batch->records[i].data);
+   }
+#endif
+
+   return batch->count;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_close --
+ *
+ *       Unmaps @sidecar. It is safe to call on a sidecar_t that failed
+ *       to open.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       sidecar is reset.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+sidecar_close (sidecar_t *sidecar) /* IN */
+{
+   bson_return_if_fail(sidecar);
+
+   if (sidecar->map) {
+      munmap(sidecar->map, sidecar->maplen);
+   }
+
+   memset(sidecar, 0, sizeof *sidecar);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_builder_init --
+ *
+ *       Starts a new sidecar for @db. The files of @db are keyed now, at
+ *       the start of the scan, so that a file that changes during the
+ *       scan keeps the sidecar from being written.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       builder is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+sidecar_builder_init (sidecar_builder_t *builder, /* OUT */
+                      db_t *db)                   /* IN */
+{
+   if (!builder || !db) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   buffer_init(&builder->keys);
+   buffer_init(&builder->ns);
+   buffer_init(&builder->extents);
+   buffer_init(&builder->records);
+
+   if (!!sidecar_keys(db, &builder->keys)) {
+      sidecar_builder_destroy(builder);
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_builder_ns --
+ *
+ *       Starts the namespace @name. The extents added next belong to it.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+sidecar_builder_ns (sidecar_builder_t *builder, /* IN */
+                    const char *name)           /* IN */
+{
+   sidecar_ns_t ns;
+
+   bson_return_if_fail(builder);
+   bson_return_if_fail(name);
+
+   memset(&ns, 0, sizeof ns);
+   strncpy(ns.name, name, sizeof ns.name - 1);
+   ns.first = builder->extents.len / sizeof(sidecar_extent_t);
+
+   buffer_append(&builder->ns, &ns, sizeof ns);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_builder_extent --
+ *
+ *       Adds the extent at @loc with the @nrecords documents in @records
+ *       to the current namespace. Extents must be added in chain order.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+sidecar_builder_extent (sidecar_builder_t *builder,       /* IN */
+                        const file_loc_t *loc,            /* IN */
+                        const sidecar_record_t *records,  /* IN */
+                        size_t nrecords)                  /* IN */
+{
+   sidecar_extent_t extent;
+   sidecar_ns_t *ns;
+
+   bson_return_if_fail(builder);
+   bson_return_if_fail(loc);
+   bson_return_if_fail(builder->ns.len);
+
+   memset(&extent, 0, sizeof extent);
+   extent.loc = *loc;
+   extent.first = builder->records.len / sizeof *records;
+   extent.count = nrecords;
+
+   buffer_append(&builder->extents, &extent, sizeof extent);
+   if (nrecords) {
+      buffer_append(&builder->records, records, nrecords * sizeof *records);
+   }
+
+   ns = (sidecar_ns_t *)(builder->ns.data + builder->ns.len - sizeof *ns);
+   ns->count++;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_builder_merge --
+ *
+ *       Copies the namespaces of @sidecar that have not been added to
+ *       @builder, so that a scan of some namespaces does not lose what an
+ *       earlier scan recorded for others.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+sidecar_builder_merge (sidecar_builder_t *builder, /* IN */
+                       const sidecar_t *sidecar)   /* IN */
+{
+   const sidecar_extent_t *extent;
+   const sidecar_ns_t *ns;
+   size_t nadded;
+   size_t j;
+   bson_uint64_t i;
+   bson_uint64_t k;
+
+   bson_return_if_fail(builder);
+   bson_return_if_fail(sidecar);
+
+   nadded = builder->ns.len / sizeof *ns;
+
+   for (i = 0; i < sidecar->nns; i++) {
+      ns = &sidecar->ns[i];
+
+      for (j = 0; j < nadded; j++) {
+         if (!strncmp(((const sidecar_ns_t *)builder->ns.data)[j].name,
+                      ns->name, sizeof ns->name)) {
+            break;
+         }
+      }
+
+      if (j < nadded) {
+         continue;
+      }
+
+      sidecar_builder_ns(builder, ns->name);
+
+      for (k = 0; k < ns->count; k++) {
+         extent = &sidecar->extents[ns->first + k];
+         sidecar_builder_extent(builder, &extent->loc,
+                                &sidecar->records[extent->first],
+                                extent->count);
+      }
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_builder_write --
+ *
+ *       Writes the sidecar to @path. It is written to a temporary file
+ *       that is synced and renamed over @path, so readers never see a
+ *       partial sidecar.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set. ESTALE if a file
+ *       of @db changed since sidecar_builder_init().
+ *
+ * Side effects:
+ *       The builder is emptied.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+sidecar_builder_write (sidecar_builder_t *builder, /* IN */
+                       const char *path,           /* IN */
+                       db_t *db)                   /* IN */
+{
+   sidecar_header_t header;
+   buffer_t keys;
+   char *tmp;
+   int ret = -1;
+   int fd;
+
+   if (!builder || !path || !db) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   buffer_init(&keys);
+
+   if (!!sidecar_keys(db, &keys)) {
+      buffer_destroy(&keys);
+      return -1;
+   }
+
+   if ((keys.len != builder->keys.len) ||
+       !!memcmp(keys.data, builder->keys.data, keys.len)) {
+      buffer_destroy(&keys);
+      errno = ESTALE;
+      return -1;
+   }
+
+   buffer_destroy(&keys);
+
+   memset(&header, 0, sizeof header);
+   strncpy(header.magic, SIDECAR_MAGIC, sizeof header.magic);
+   header.nfiles = db->filescnt;
+   header.nns = builder->ns.len / sizeof(sidecar_ns_t);
+   header.nextents = builder->extents.len / sizeof(sidecar_extent_t);
+   header.nrecords = builder->records.len / sizeof(sidecar_record_t);
+
+   tmp = bson_strdup_printf("%s.tmp", path);
+
+   if (-1 == (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644))) {
+      bson_free(tmp);
+      return -1;
+   }
+
+   if ((sizeof header == write(fd, &header, sizeof header)) &&
+       !buffer_flush(&builder->keys, fd) &&
+       !buffer_flush(&builder->ns, fd) &&
+       !buffer_flush(&builder->extents, fd) &&
+       !buffer_flush(&builder->records, fd) &&
+       !fsync(fd)) {
+      ret = 0;
+   }
+
+   if (!!close(fd) || ret || !!rename(tmp, path)) {
+      unlink(tmp);
+      ret = -1;
+   }
+
+   bson_free(tmp);
+
+   return ret;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * sidecar_builder_destroy --
+ *
+ *       Frees everything held by @builder.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+sidecar_builder_destroy (sidecar_builder_t *builder) /* IN */
+{
+   bson_return_if_fail(builder);
+
+   buffer_destroy(&builder->keys);
+   buffer_destroy(&builder->ns);
+   buffer_destroy(&builder->extents);
+   buffer_destroy(&builder->records);
+}
@@ -0,0 +1,165 @@
+/* mdb-sidecar.h
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MDB_SIDECAR_H
+#define MDB_SIDECAR_H
+
+
+#include <bson.h>
+
+#include "mdb.h"
+#include "mdb-buffer.h"
+
+
+BSON_BEGIN_DECLS
+
+
+/*
+ * A sidecar file remembers where the live records of a database are, so
+ * that repeated scans of a database that no longer changes, such as a
+ * backup, do not have to follow the record chains again. For every
+ * namespace that was scanned it lists the extents in chain order, and for
+ * every extent the location and length of each document in chain order.
+ *
+ * A sidecar is tied to the size and modification time of the .ns file and
+ * of every data file, and is ignored once any of them changes.
+ *
+ * The file is mapped read-only and used in place. Its layout is a
+ * sidecar_header_t, one sidecar_key_t for the .ns file followed by one
+ * per data file, then the sidecar_ns_t, sidecar_extent_t and
+ * sidecar_record_t arrays.
+ */
+#define SIDECAR_MAGIC "mdb-sidecar 1"
+
+
+#pragma pack(push, 1)
+typedef struct
+{
+   char          magic[16];
+   bson_uint32_t nfiles;
+   bson_uint32_t reserved;
+   bson_uint64_t nns;
+   bson_uint64_t nextents;
+   bson_uint64_t nrecords;
+} sidecar_header_t;
+#pragma pack(pop)
+
+
+BSON_STATIC_ASSERT(sizeof(sidecar_header_t) == 48);
+
+
+#pragma pack(push, 1)
+typedef struct
+{
+   bson_int64_t size;
+   bson_int64_t mtime;
+   bson_int64_t mtime_nsec;
+} sidecar_key_t;
+#pragma pack(pop)
+
+
+#pragma pack(push, 1)
+typedef struct
+{
+   char          name[128];
+   bson_uint64_t first;
+   bson_uint64_t count;
+} sidecar_ns_t;
+#pragma pack(pop)
+
+
+#pragma pack(push, 1)
+typedef struct
+{
+   file_loc_t    loc;
+   bson_uint64_t first;
+   bson_uint64_t count;
+} sidecar_extent_t;
+#pragma pack(pop)
+
+
+#pragma pack(push, 1)
+typedef struct
+{
+   bson_int32_t fileno;
+   bson_int32_t offset;
+   bson_int32_t len;
+} sidecar_record_t;
+#pragma pack(pop)
+
+
+BSON_STATIC_ASSERT(sizeof(sidecar_record_t) == 12);
+
+
+typedef struct
+{
+   char                   *map;
+   size_t                  maplen;
+   const sidecar_ns_t     *ns;
+   bson_uint64_t           nns;
+   const sidecar_extent_t *extents;
+   bson_uint64_t           nextents;
+   const sidecar_record_t *records;
+   bson_uint64_t           nrecords;
+} sidecar_t;
+
+
+typedef struct
+{
+   buffer_t keys;
+   buffer_t ns;
+   buffer_t extents;
+   buffer_t records;
+} sidecar_builder_t;
+
+
+int                 sidecar_keys            (db_t *db,
+                                             buffer_t *buffer);
+int                 sidecar_open            (sidecar_t *sidecar,
+                                             const char *path,
+                                             db_t *db);
+const sidecar_ns_t *sidecar_lookup          (const sidecar_t *sidecar,
+                                             const char *name);
+int                 sidecar_record_batch    (const sidecar_t *sidecar,
+                                             extent_t *extent,
+                                             bson_uint64_t *pos,
+                                             bson_uint64_t end,
+                                             record_batch_t *batch);
+void                sidecar_close           (sidecar_t *sidecar);
+
+
+int                 sidecar_builder_init    (sidecar_builder_t *builder,
+                                             db_t *db);
+void                sidecar_builder_ns      (sidecar_builder_t *builder,
+                                             const char *name);
+void                sidecar_builder_extent  (sidecar_builder_t *builder,
+                                             const file_loc_t *loc,
+                                             const sidecar_record_t *records,
+                                             size_t nrecords);
+void                sidecar_builder_merge   (sidecar_builder_t *builder,
+                                             const sidecar_t *sidecar);
+int                 sidecar_builder_write   (sidecar_builder_t *builder,
+                                             const char *path,
+                                             db_t *db);
+void                sidecar_builder_destroy (sidecar_builder_t *builder);
+
+
+BSON_END_DECLS
+
+
+#endif /* MDB_SIDECAR_H */
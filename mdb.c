@@ -22,6 +22,7 @@
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -29,6 +30,14 @@
 #include <unistd.h>
 
 #include "mdb.h"
+#include "mdb-carve.h"
+#include "mdb-io.h"
+
+
+static void extent_prefetch_next (extent_t *extent);
+static const file_loc_t *extent_next_loc (const db_t *db,
+                                          const file_loc_t *loc,
+                                          const extent_header_t *ehdr);
 
 
 /*
@@ -36,9 +45,9 @@
  *
  * file_init --
  *
- *       Initialize a new file_t using the path provided. The file will be
- *       opened read-only. The file descriptor will be used to mmap() the
- *       entire contents of the file.
+ *       Initialize a new file_t using the path provided. The file is not
+ *       opened until file_map() is called, so initializing a file_t for
+ *       every data file of a database is cheap.
  *
  *       @file is the file to initialize.
  *       @fileno is the file number, or -1 for the ns file.
@@ -58,10 +67,6 @@ file_init (file_t *file,     /* OUT */
            int fileno,       /* IN */
            const char *path) /* IN */
 {
-   struct stat st;
-   void *map;
-   int fd;
-
    if (!file || !path) {
       errno = EINVAL;
       return -1;
@@ -73,21 +78,65 @@ file_init (file_t *file,     /* OUT */
       return -1;
    }
 
-   if (!!stat(path, &st)) {
+   file->next = NULL;
+   file->fileno = fileno;
+   file->fd = -1;
+   file->path = bson_strdup(path);
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * file_map --
+ *
+ *       Opens the file read-only and mmap()s its entire contents. The
+ *       mapping is read-only as well, so a stray write faults instead of
+ *       silently copying the page, and pages never stop being backed by
+ *       the page cache.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       file->fd, file->map and file->maplen are set.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+file_map (file_t *file) /* IN */
+{
+   struct stat st;
+   void *map;
+   int fd;
+
+   if (!file || !file->path) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (file->map) {
+      return 0;
+   }
+
+   if (-1 == (fd = open(file->path, O_RDONLY))) {
       return -1;
    }
 
-   if (-1 == (fd = open(path, O_RDONLY))) {
+   if (!!fstat(fd, &st)) {
+      close(fd);
       return -1;
    }
 
-   if (!(map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0))) {
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
       close(fd);
       return -1;
    }
 
-   file->next = NULL;
-   file->fileno = fileno;
    file->fd = fd;
    file->map = map;
    file->maplen = st.st_size;
@@ -99,21 +148,22 @@ file_init (file_t *file,     /* OUT */
 /*
  *--------------------------------------------------------------------------
  *
- * file_close --
+ * file_unmap --
  *
- *       Closes the file descriptors and mmap() regions for @file.
+ *       Releases the mmap() region and file descriptor of @file. The
+ *       file may be mapped again later with file_map().
  *
  * Returns:
  *       -1 on close failure.
  *
  * Side effects:
- *       file is destroyed and all values unset.
+ *       file->map is unset.
  *
  *--------------------------------------------------------------------------
  */
 
 static int
-file_close (file_t *file) /* IN */
+file_unmap (file_t *file) /* IN */
 {
    int fd;
 
@@ -131,7 +181,209 @@ file_close (file_t *file) /* IN */
    file->map = NULL;
    file->maplen = 0;
 
-   return close(fd);
+   return (fd == -1) ? 0 : close(fd);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * file_close --
+ *
+ *       Closes the file descriptors and mmap() regions for @file.
+ *
+ * Returns:
+ *       -1 on close failure.
+ *
+ * Side effects:
+ *       file is destroyed and all values unset.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+file_close (file_t *file) /* IN */
+{
+   int ret;
+
+   if (!file) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   ret = file_unmap(file);
+   bson_free(file->path);
+   file->path = NULL;
+
+   return ret;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * file_advise --
+ *
+ *       Gives the kernel a hint about how a byte range of a mapping will
+ *       be accessed. The range is widened to page boundaries and clamped
+ *       to the mapping. Failures are ignored since this is only a hint.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       madvise() is called on the range.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+file_advise (const char *map,      /* IN */
+             size_t maplen,        /* IN */
+             bson_int64_t offset,  /* IN */
+             bson_int64_t length,  /* IN */
+             int advice)           /* IN */
+{
+   bson_int64_t pagesize;
+   bson_int64_t start;
+   bson_int64_t end;
+
+   if (!map || offset < 0 || length <= 0) {
+      return;
+   }
+
+   pagesize = sysconf(_SC_PAGESIZE);
+   start = offset & ~(pagesize - 1);
+   end = BSON_MIN(offset + length, (bson_int64_t)maplen);
+
+   if (end > start) {
+      madvise((void *)(map + start), end - start, advice);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_evict_locked --
+ *
+ *       Unmaps the least recently used data files that are not in use
+ *       until the mapping limit is respected. @reserve is the number of
+ *       mappings the caller is about to add. db->mutex must be held.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       Files may be unmapped.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+db_evict_locked (db_t *db,    /* IN */
+                 int reserve) /* IN */
+{
+   file_t *victim;
+   int i;
+
+   if (!db->maxmaps) {
+      return;
+   }
+
+   while ((db->nmaps + reserve) > db->maxmaps) {
+      victim = NULL;
+      for (i = 0; i < db->filescnt; i++) {
+         if (db->files[i].map && !db->files[i].refcnt &&
+             (!victim || (db->files[i].last_used < victim->last_used))) {
+            victim = &db->files[i];
+         }
+      }
+      if (!victim) {
+         break;
+      }
+      file_unmap(victim);
+      db->nmaps--;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_init_files --
+ *
+ *       Sets up the file table for the numbered data files of a database
+ *       along with the rest of @db except for the .ns file. The files are
+ *       not opened until they are needed.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       db is initialized, except for db->nsfile.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+db_init_files (db_t *db,            /* OUT */
+               const char *dbpath,  /* IN */
+               const char *name)    /* IN */
+{
+   file_t *files = NULL;
+   char *path;
+   int filescnt = 0;
+   int fileno;
+
+   /*
+    * Count our numbered data files so that the file table can be
+    * allocated once.
+    */
+   for (;; filescnt++) {
+      path = bson_strdup_printf("%s/%s.%d", dbpath, name, filescnt);
+      if (!!access(path, R_OK)) {
+         bson_free(path);
+         break;
+      }
+      bson_free(path);
+   }
+
+   if (filescnt) {
+      files = bson_malloc0(filescnt * sizeof(file_t));
+   }
+
+   for (fileno = 0; fileno < filescnt; fileno++) {
+      path = bson_strdup_printf("%s/%s.%d", dbpath, name, fileno);
+      if (!!file_init(&files[fileno], fileno, path)) {
+         bson_free(path);
+         goto failure;
+      }
+      bson_free(path);
+
+      if (fileno) {
+         files[fileno - 1].next = &files[fileno];
+      }
+   }
+
+   pthread_mutex_init(&db->mutex, NULL);
+
+   db->advise = TRUE;
+   db->dbpath = bson_strdup(dbpath);
+   db->name = bson_strdup(name);
+   db->files = files;
+   db->filescnt = filescnt;
+
+   return 0;
+
+failure:
+   while (fileno--) {
+      file_close(&files[fileno]);
+   }
+
+   bson_free(files);
+
+   return -1;
 }
 
 
@@ -140,9 +392,8 @@ file_close (file_t *file) /* IN */
  *
  * db_init --
  *
- *       Initializes a new db_t using the dbpath directory on disk and
- *       the name of the database. The dbpath and name are combined to
- *       load the individual database files such as dbpath/name.ns.
+ *       Initializes @db from the "dbname.ns" file and the data files
+ *       "dbname.0", "dbname.1", ... in @dbpath.
  *
  * Returns:
  *       0 on success -- otherwise -1 and errno is set.
@@ -158,11 +409,7 @@ db_init (db_t *db,            /* OUT */
          const char *dbpath,  /* IN */
          const char *name)    /* IN */
 {
-   file_t *files = NULL;
-   file_t *last = NULL;
-   file_t *iter;
    char *path;
-   int fileno = 0;
 
    if (!db || !dbpath || !name) {
       errno = EINVAL;
@@ -175,256 +422,1339 @@ db_init (db_t *db,            /* OUT */
     * Try to load our namespace file.
     */
    path = bson_strdup_printf("%s/%s.ns", dbpath, name);
-   if (!!file_init(&db->nsfile, -1, path)) {
+   if (!!file_init(&db->nsfile, -1, path) || !!file_map(&db->nsfile)) {
+      file_close(&db->nsfile);
       bson_free(path);
       return -1;
    }
    bson_free(path);
 
-   /*
-    * Try to load all of our numbered data files. Calling file_init() will
-    * result in the files being fully mmap()'d.
-    */
-   for (;; last = &files[fileno++]) {
-      path = bson_strdup_printf("%s/%s.%d", dbpath, name, fileno);
-      if (!!access(path, R_OK)) {
-         bson_free(path);
-         break;
-      }
+   if (!!db_init_files(db, dbpath, name)) {
+      file_close(&db->nsfile);
+      return -1;
+   }
 
-      files = bson_realloc(files, (fileno + 1) * sizeof(file_t));
-      if (!!file_init(&files[fileno], fileno, path)) {
-         bson_free(path);
-         goto failure;
-      }
+   return 0;
+}
 
-      if (last) {
-         last->next = &files[fileno];
-      }
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_init_carved --
+ *
+ *       Initializes @db like db_init(), but without reading "dbname.ns".
+ *       Instead, the data files are scanned for extent headers with
+ *       @jobs threads and the namespaces are rebuilt from them. This
+ *       recovers the collections of a database whose .ns file is lost
+ *       or damaged, though not their indexes.
+ *
+ *       The extent iterators follow the rebuilt chains, which may differ
+ *       from the on-disk links where those were broken.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set. ENOENT if there
+ *       are no data files.
+ *
+ * Side effects:
+ *       db is initialized. @stats, if not NULL, is filled in.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+db_init_carved (db_t *db,             /* OUT */
+                const char *dbpath,   /* IN */
+                const char *name,     /* IN */
+                int jobs,             /* IN */
+                carve_stats_t *stats) /* OUT */
+{
+   int err;
+
+   if (!db || !dbpath || !name) {
+      errno = EINVAL;
+      return -1;
    }
 
-   db->dbpath = strdup(dbpath);
-   db->name = strdup(name);
-   db->files = files;
-   db->filescnt = fileno;
+   memset(db, 0, sizeof *db);
+   db->nsfile.fd = -1;
+
+   if (!!db_init_files(db, dbpath, name)) {
+      return -1;
+   }
+
+   if (!db->filescnt) {
+      db_destroy(db);
+      errno = ENOENT;
+      return -1;
+   }
+
+   if (!(db->carve = carve_scan(db, jobs, stats))) {
+      err = errno;
+      db_destroy(db);
+      errno = err;
+      return -1;
+   }
 
    return 0;
+}
 
-failure:
-   for (iter = files; iter; iter = iter->next) {
-      file_close(iter);
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_set_max_maps --
+ *
+ *       Limits the number of data files that may be mapped at once. When
+ *       the limit is reached, the least recently used file that is not
+ *       in use by an extent is unmapped to make room. Files in use are
+ *       never unmapped, so the limit may be exceeded temporarily.
+ *
+ *       @maxmaps is the limit, or 0 for no limit (the default).
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       Unused files may be unmapped.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+db_set_max_maps (db_t *db,    /* IN */
+                 int maxmaps) /* IN */
+{
+   bson_return_if_fail(db);
+   bson_return_if_fail(maxmaps >= 0);
+
+   pthread_mutex_lock(&db->mutex);
+   db->maxmaps = maxmaps;
+   db_evict_locked(db, 0);
+   pthread_mutex_unlock(&db->mutex);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_set_advise --
+ *
+ *       Enables or disables access pattern hints to the kernel. When
+ *       enabled (the default), data files are mapped for sequential
+ *       access, the extent iterators read ahead into the next extent
+ *       and pages of extents that have been passed are dropped from the
+ *       process and deactivated in the page cache. Tools doing random
+ *       lookups should disable this before touching any data file.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+db_set_advise (db_t *db,   /* IN */
+               int advise) /* IN */
+{
+   bson_return_if_fail(db);
+
+   db->advise = !!advise;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_set_backend --
+ *
+ *       Selects how the extent and record iterators read data files.
+ *
+ *       DB_BACKEND_MMAP (the default) maps each data file and lets page
+ *       faults drive I/O.
+ *
+ *       DB_BACKEND_PREAD reads each extent as a whole into a buffer,
+ *       using O_DIRECT where supported, with up to @depth extents being
+ *       read ahead by background threads. The extent and record API is
+ *       the same, but record pointers are only valid until the extent is
+ *       released.
+ *
+ *       This must be called before any extent is initialized.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       Reader threads may be started or stopped.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+db_set_backend (db_t *db,             /* IN */
+                db_backend_t backend, /* IN */
+                int depth)            /* IN */
+{
+   if (!db || ((backend == DB_BACKEND_PREAD) && (depth < 1))) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (db->io) {
+      io_destroy(db->io);
+      db->io = NULL;
+   }
+
+   switch (backend) {
+   case DB_BACKEND_MMAP:
+      return 0;
+   case DB_BACKEND_PREAD:
+      return (db->io = io_new(db, depth)) ? 0 : -1;
+   default:
+      errno = EINVAL;
+      return -1;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_file_acquire --
+ *
+ *       Fetches the mapping of data file @fileno, mapping it first if
+ *       necessary. The file stays mapped until a matching call to
+ *       db_file_release().
+ *
+ * Returns:
+ *       The start of the mapping on success -- otherwise NULL and errno
+ *       is set.
+ *
+ * Side effects:
+ *       The file may be mapped and other unused files unmapped.
+ *       @maplen is set to the length of the mapping.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+const char *
+db_file_acquire (db_t *db,        /* IN */
+                 int fileno,      /* IN */
+                 size_t *maplen)  /* OUT */
+{
+   file_t *file;
+
+   if (!db || fileno < 0 || fileno >= db->filescnt) {
+      errno = ENOENT;
+      return NULL;
+   }
+
+   file = &db->files[fileno];
+
+   pthread_mutex_lock(&db->mutex);
+
+   if (!file->map) {
+      db_evict_locked(db, 1);
+      if (!!file_map(file)) {
+         pthread_mutex_unlock(&db->mutex);
+         return NULL;
+      }
+      if (db->advise) {
+         file_advise(file->map, file->maplen, 0, file->maplen,
+                     MADV_SEQUENTIAL);
+      }
+      db->nmaps++;
+   }
+
+   file->refcnt++;
+   file->last_used = ++db->clock;
+
+   if (maplen) {
+      *maplen = file->maplen;
+   }
+
+   pthread_mutex_unlock(&db->mutex);
+
+   return file->map;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_file_release --
+ *
+ *       Releases a reference acquired with db_file_acquire().
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       The file may be unmapped if the mapping limit is exceeded.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+db_file_release (db_t *db,   /* IN */
+                 int fileno) /* IN */
+{
+   file_t *file;
+
+   bson_return_if_fail(db);
+   bson_return_if_fail(fileno >= 0 && fileno < db->filescnt);
+
+   file = &db->files[fileno];
+
+   pthread_mutex_lock(&db->mutex);
+   BSON_ASSERT(file->refcnt > 0);
+   file->refcnt--;
+   db_evict_locked(db, 0);
+   pthread_mutex_unlock(&db->mutex);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_namespaces --
+ *
+ *       Fetches the first of a series of namespaces. Use ns_next() to
+ *       move to the next namespace. You can fetch the name of the
+ *       namespace with ns_name().
+ *
+ *       A namespace contains extents, which can be fetched with
+ *       ns_next();
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       ns is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+db_namespaces (db_t *db,   /* IN */
+               ns_t *ns)   /* OUT */
+{
+   if (!db || !ns) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   memset(ns, 0, sizeof *ns);
+
+   ns->db = db;
+   ns->file = &db->nsfile;
+   ns->index = -1;
+
+   return ns_next(ns);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ns_hash --
+ *
+ *       Compute the hash of a namespace name the same way the server
+ *       does for its namespace hashtable. The result is always positive
+ *       so that zero can be used to mark unused nodes.
+ *
+ * Returns:
+ *       The hash of @name.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+bson_int32_t
+ns_hash (const char *name) /* IN */
+{
+   bson_uint32_t x = 0;
+   const char *p;
+
+   for (p = name; *p; p++) {
+      x = x * 131 + *p;
+   }
+
+   return (x & 0x7fffffff) | 0x8000000;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * db_namespace_lookup --
+ *
+ *       Locates the namespace @name (such as "db.collection") by probing
+ *       the "dbname.ns" hashtable directly instead of walking every node.
+ *       The probe sequence matches the server: linear probing starting
+ *       at hash % nnodes, giving up after 5% of the table.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       ns is initialized to point at the namespace. ns_next() may be
+ *       used afterwards to continue from there.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+db_namespace_lookup (db_t *db,          /* IN */
+                     const char *name,  /* IN */
+                     ns_t *ns)          /* OUT */
+{
+   ns_hash_node_t *nodes;
+   bson_int32_t hash;
+   int maxchain;
+   int nnodes;
+   int chain;
+   int start;
+   int i;
+
+   if (!db || !name || !ns) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   memset(ns, 0, sizeof *ns);
+
+   ns->db = db;
+   ns->file = &db->nsfile;
+   ns->index = -1;
+
+   nodes = (ns_hash_node_t *)db->nsfile.map;
+   nnodes = db->nsfile.maplen / sizeof *nodes;
+   maxchain = (int)(nnodes * 0.05);
+
+   if (!nnodes || (strlen(name) >= sizeof nodes->key)) {
+      errno = ENOENT;
+      return -1;
+   }
+
+   hash = ns_hash(name);
+   start = i = hash % nnodes;
+   chain = 0;
+
+   do {
+      if ((nodes[i].hash == hash) &&
+          !strncmp(nodes[i].key, name, sizeof nodes->key)) {
+         ns->index = i;
+         return 0;
+      }
+      i = (i + 1) % nnodes;
+   } while ((++chain < maxchain) && (i != start));
+
+   errno = ENOENT;
+
+   return -1;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ns_hash_node --
+ *
+ *       Fetch the ns_hash_node_t for the current namespace entry.
+ *
+ * Returns:
+ *       ns_hash_node_t* if sucessful -- otherwise NULL and errno is set.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static ns_hash_node_t *
+ns_hash_node (const ns_t *ns)
+{
+   ns_hash_node_t *node;
+
+   if (!ns || !ns->file || ns->index < 0) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   node = (ns_hash_node_t *)ns->file->map;
+   node += ns->index;
+
+   return node;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ns_name --
+ *
+ *       Fetch the name of the namespace.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+const char *
+ns_name (const ns_t *ns)
+{
+   ns_hash_node_t *node;
+
+   if (!ns) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   node = ns_hash_node(ns);
+
+   return node->key;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ns_next --
+ *
+ *       Move to the next namespace entry in the "dbname.ns" file.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       ns is updated to reflect the next namespace.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+ns_next (ns_t *ns)
+{
+   ns_hash_node_t *node;
+
+   if (!ns) {
+      errno = EINVAL;
+      return -1;
+   }
+
+next:
+   ns->index++;
+
+   node = ns_hash_node(ns);
+
+   if ((((char *)node) + sizeof *node) >
+       (ns->file->map + ns->file->maplen)) {
+      ns->index = -1;
+      return -1;
+   }
+
+   if (!node->key[0]) {
+      goto next;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ns_extents --
+ *
+ *       Fetches the first extent for the current namespace. You can move
+ *       to the next extent with ns_next().
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       extent is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+ns_extents (ns_t *ns,         /* IN */
+            extent_t *extent) /* OUT */
+{
+   ns_hash_node_t *node;
+   ns_details_t *details;
+
+   if (!ns || !ns->db || !extent) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   memset(extent, 0, sizeof *extent);
+
+   if (!(node = ns_hash_node(ns))) {
+      errno = ENOENT;
+      return -1;
+   }
+
+   details = (ns_details_t *)node->details;
+
+   if (!!extent_init(extent, ns->db, &details->first_extent)) {
+      return -1;
+   }
+
+   extent_advise(extent, EXTENT_ADVISE_WILLNEED);
+   extent_prefetch_next(extent);
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ns_extent_locs --
+ *
+ *       Walks the extent chain of the current namespace and collects the
+ *       location of every extent into a newly allocated array. This lets
+ *       callers hand extents out to multiple workers, since the on-disk
+ *       chain can only be followed one link at a time.
+ *
+ *       A namespace without any extents results in an empty array.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       @locs is set to an array that must be freed with bson_free().
+ *       @nlocs is set to the number of elements in @locs.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+ns_extent_locs (ns_t *ns,           /* IN */
+                file_loc_t **locs,  /* OUT */
+                int *nlocs)         /* OUT */
+{
+   extent_header_t ehdr;
+   file_loc_t *ret = NULL;
+   file_loc_t loc;
+   int alloc = 0;
+   int len = 0;
+
+   if (!ns || !ns->db || !locs || !nlocs) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   *locs = NULL;
+   *nlocs = 0;
+
+   /*
+    * Only the extent headers are needed here, so avoid extent_next()
+    * which would read ahead into the extents themselves.
+    */
+   loc = ns_get_details(ns)->first_extent;
+
+   while (loc.fileno != -1) {
+      if (!!extent_header_at(ns->db, &loc, &ehdr)) {
+         bson_free(ret);
+         return -1;
+      }
+
+      if (len == alloc) {
+         alloc = alloc ? alloc * 2 : 16;
+         ret = bson_realloc(ret, alloc * sizeof *ret);
+      }
+      ret[len++] = loc;
+      loc = *extent_next_loc(ns->db, &loc, &ehdr);
+   }
+
+   *locs = ret;
+   *nlocs = len;
+
+   return 0;
+}
+
+
+static int
+file_loc_compare (const void *a, /* IN */
+                  const void *b) /* IN */
+{
+   const file_loc_t *x = a;
+   const file_loc_t *y = b;
+
+   if (x->fileno != y->fileno) {
+      return (x->fileno < y->fileno) ? -1 : 1;
+   }
+
+   return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * file_loc_sort --
+ *
+ *       Sorts @locs by data file and offset, so that extents gathered
+ *       with ns_extent_locs() are read front to back through each data
+ *       file instead of in the order of the extent chain, which can jump
+ *       between files and distant offsets.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       locs is sorted in place.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+file_loc_sort (file_loc_t *locs, /* IN/OUT */
+               int nlocs)        /* IN */
+{
+   if (locs && (nlocs > 1)) {
+      qsort(locs, nlocs, sizeof *locs, file_loc_compare);
+   }
+}
+
+
+ns_details_t *
+ns_get_details (ns_t *ns)
+{
+   char *base;
+
+   base = ns->file->map;
+   base = base + (sizeof (ns_hash_node_t) * ns->index);
+   base = base + offsetof (ns_hash_node_t, details);
+
+   return (ns_details_t *)base;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ns_index_details --
+ *
+ *       Fetches the head bucket and index spec locations of the @index'th
+ *       index of @ns. The first N_INDEXES_BASE indexes are stored in the
+ *       namespace details, the rest in extra blocks in the .ns file.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set. ENOENT if there is
+ *       no such index, EBADF if the extra blocks are corrupt.
+ *
+ * Side effects:
+ *       details is filled in.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+ns_index_details (ns_t *ns,                 /* IN */
+                  int index,                /* IN */
+                  index_details_t *details) /* OUT */
+{
+   const ns_details_extra_t *extra;
+   const ns_details_t *nsd;
+   bson_int64_t offset;
+   bson_int64_t base;
+
+   if (!ns || !details) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   nsd = ns_get_details(ns);
+
+   if ((index < 0) || (index >= nsd->nindexes) || (index >= N_INDEXES_MAX)) {
+      errno = ENOENT;
+      return -1;
+   }
+
+   if (index < N_INDEXES_BASE) {
+      memcpy(details, &nsd->indexes[index], sizeof *details);
+      return 0;
+   }
+
+   index -= N_INDEXES_BASE;
+   base = (const char *)nsd - ns->file->map;
+   offset = nsd->extra_offset;
+
+   for (;;) {
+      if (!offset ||
+          ((base + offset) < 0) ||
+          ((base + offset + (bson_int64_t)sizeof *extra) >
+           (bson_int64_t)ns->file->maplen)) {
+         errno = EBADF;
+         return -1;
+      }
+
+      extra = (const ns_details_extra_t *)((const char *)nsd + offset);
+
+      if (index < N_INDEXES_EXTRA) {
+         memcpy(details, &extra->details[index], sizeof *details);
+         return 0;
+      }
+
+      index -= N_INDEXES_EXTRA;
+      offset = extra->next;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * extent_header --
+ *
+ *       Fetches the header of @extent. The extent may either point into
+ *       the mapping of a data file or into a buffer holding just the
+ *       extent, so offsets are relative to extent->base.
+ *
+ * Returns:
+ *       The extent_header_t.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static extent_header_t *
+extent_header (const extent_t *extent) /* IN */
+{
+   return (extent_header_t *)(extent->map + (extent->offset - extent->base));
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * record_header --
+ *
+ *       Fetches the header of @record.
+ *
+ * Returns:
+ *       The record_header_t.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static record_header_t *
+record_header (const record_t *record) /* IN */
+{
+   return (record_header_t *)(record->map + (record->offset - record->base));
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * record_in_bounds --
+ *
+ *       Checks that a record header at @offset, and the length of the
+ *       document that follows it, lie within the memory that @record
+ *       may access.
+ *
+ * Returns:
+ *       TRUE if the header can be read.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+record_in_bounds (const record_t *record, /* IN */
+                  bson_int32_t offset)    /* IN */
+{
+   return ((offset >= record->base) &&
+           ((offset - record->base + sizeof(record_header_t)) <=
+            record->maplen));
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * extent_next_loc --
+ *
+ *       Fetches the location of the extent following the one at @loc,
+ *       whose header is @ehdr. For a carved database this is the next
+ *       extent of the rebuilt chain rather than the on-disk link.
+ *
+ * Returns:
+ *       The location of the next extent, with a fileno of -1 if there
+ *       is none.
+ *
+ * Side effects:
+ *       None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static const file_loc_t *
+extent_next_loc (const db_t *db,               /* IN */
+                 const file_loc_t *loc,        /* IN */
+                 const extent_header_t *ehdr)  /* IN */
+{
+   const file_loc_t *next;
+
+   if (db->carve && (next = carve_next(db->carve, loc))) {
+      return next;
+   }
+
+   return &ehdr->next;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * extent_init --
+ *
+ *       Initializes @extent to point at the extent found at @loc. The
+ *       location is checked to be within the data files and to contain
+ *       an extent header.
+ *
+ *       With the pread backend, the whole extent is read into a buffer
+ *       (or a prefetched buffer is claimed). Otherwise the data file is
+ *       mapped and pinned.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       extent is initialized.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+extent_init (extent_t *extent,      /* OUT */
+             db_t *db,              /* IN */
+             const file_loc_t *loc) /* IN */
+{
+   const bson_int32_t magic = EXTENT_MAGIC;
+   const char *map;
+   io_buf_t *buf = NULL;
+   size_t maplen;
+   bson_int32_t base = 0;
+
+   if (!extent || !db || !loc) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   memset(extent, 0, sizeof *extent);
+
+   if ((loc->fileno < 0) || (loc->fileno >= db->filescnt) ||
+       (loc->offset < 0)) {
+      errno = ENOENT;
+      return -1;
+   }
+
+   if (db->io) {
+      if (!(buf = io_extent_read(db->io, loc))) {
+         return -1;
+      }
+      map = buf->data;
+      maplen = buf->len;
+      base = buf->base;
+   } else if (!(map = db_file_acquire(db, loc->fileno, &maplen))) {
+      return -1;
+   }
+
+   extent->db = db;
+   extent->map = map;
+   extent->maplen = maplen;
+   extent->fileno = loc->fileno;
+   extent->offset = loc->offset;
+   extent->base = base;
+   extent->buf = buf;
+
+   if ((loc->offset - base + sizeof(extent_header_t)) > maplen) {
+      extent_destroy(extent);
+      errno = ENOENT;
+      return -1;
+   }
+
+   if (!!memcmp(extent_header(extent), &magic, sizeof magic)) {
+      extent_destroy(extent);
+      errno = EBADF;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * extent_header_at --
+ *
+ *       Copies the extent header at @loc without reading the rest of the
+ *       extent.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       ehdr is filled in.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+extent_header_at (db_t *db,               /* IN */
+                  const file_loc_t *loc,  /* IN */
+                  extent_header_t *ehdr)  /* OUT */
+{
+   extent_t extent;
+
+   if (db->io) {
+      if ((loc->fileno < 0) || (loc->fileno >= db->filescnt) ||
+          (loc->offset < 0)) {
+         errno = ENOENT;
+         return -1;
+      }
+      if (!!io_header_read(db->io, loc, ehdr)) {
+         return -1;
+      }
+      if (ehdr->magic != EXTENT_MAGIC) {
+         errno = EBADF;
+         return -1;
+      }
+      return 0;
+   }
+
+   if (!!extent_init(&extent, db, loc)) {
+      return -1;
+   }
+
+   memcpy(ehdr, extent_header(&extent), sizeof *ehdr);
+   extent_destroy(&extent);
+
+   return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * extent_advise --
+ *
+ *       Tells the kernel how the pages of @extent will be used.
+ *
+ *       EXTENT_ADVISE_WILLNEED starts asynchronous readahead of the whole
+ *       extent so that it is resident by the time its records are read.
+ *
+ *       EXTENT_ADVISE_DONE marks the extent as consumed. Its pages are
+ *       deactivated in the page cache, unless another process such as
+ *       mongod also has them mapped, and dropped from this process so
+ *       that a full scan does not grow its resident set without bound.
+ *
+ *       This does nothing if hints were disabled with db_set_advise(),
+ *       or if the extent was read with the pread backend.
+ *
+ * Returns:
+ *       0 on success -- otherwise -1 and errno is set.
+ *
+ * Side effects:
+ *       None visible.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+extent_advise (extent_t *extent,        /* IN */
+               extent_advice_t advice)  /* IN */
+{
+   extent_header_t *ehdr;
+
+   if (!extent || !extent->map) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (!extent->db->advise || extent->buf) {
+      return 0;
+   }
+
+   ehdr = extent_header(extent);
+
+   switch (advice) {
+   case EXTENT_ADVISE_WILLNEED:
+      file_advise(extent->map, extent->maplen,
+                  extent->offset, ehdr->length, MADV_WILLNEED);
+      break;
+   case EXTENT_ADVISE_DONE:
+#ifdef MADV_COLD
+      file_advise(extent->map, extent->maplen,
+                  extent->offset, ehdr->length, MADV_COLD);
+#endif
+      file_advise(extent->map, extent->maplen,
+                  extent->offset, ehdr->length, MADV_DONTNEED);
+      break;
+   default:
+      errno = EINVAL;
+      return -1;
    }
 
-   bson_free(files);
-
-   return -1;
+   return 0;
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * db_namespaces --
+ * db_prefetch_extent --
  *
- *       Fetches the first of a series of namespaces. Use ns_next() to
- *       move to the next namespace. You can fetch the name of the
- *       namespace with ns_name().
+ *       Starts reading the extent at @loc in the background so that it
+ *       is ready by the time extent_init() is called for it.
  *
- *       A namespace contains extents, which can be fetched with
- *       ns_next();
+ *       With the pread backend, the extent is queued for a reader
+ *       thread. With mmap(), readahead is requested for it unless hints
+ *       were disabled with db_set_advise(); only its header is touched
+ *       synchronously.
  *
  * Returns:
- *       0 on success -- otherwise -1 and errno is set.
+ *       None.
  *
  * Side effects:
- *       ns is initialized.
+ *       None visible.
  *
  *--------------------------------------------------------------------------
  */
 
-int
-db_namespaces (db_t *db,   /* IN */
-               ns_t *ns)   /* OUT */
+void
+db_prefetch_extent (db_t *db,              /* IN */
+                    const file_loc_t *loc) /* IN */
 {
-   if (!db || !ns) {
-      errno = EINVAL;
-      return -1;
-   }
+   extent_t ahead;
 
-   memset(ns, 0, sizeof *ns);
+   bson_return_if_fail(db);
+   bson_return_if_fail(loc);
 
-   ns->db = db;
-   ns->file = &db->nsfile;
-   ns->index = -1;
+   if ((loc->fileno < 0) || (loc->offset < 0)) {
+      return;
+   }
 
-   return ns_next(ns);
+   if (db->io) {
+      io_prefetch(db->io, loc);
+   } else if (db->advise && !extent_init(&ahead, db, loc)) {
+      extent_advise(&ahead, EXTENT_ADVISE_WILLNEED);
+      extent_destroy(&ahead);
+   }
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * ns_hash_node --
+ * extent_prefetch_next --
  *
- *       Fetch the ns_hash_node_t for the current namespace entry.
+ *       Starts reading the extent following @extent in the chain so that
+ *       it is being read while @extent is processed.
  *
  * Returns:
- *       ns_hash_node_t* if sucessful -- otherwise NULL and errno is set.
+ *       None.
  *
  * Side effects:
- *       None.
+ *       None visible.
  *
  *--------------------------------------------------------------------------
  */
 
-static ns_hash_node_t *
-ns_hash_node (const ns_t *ns)
+static void
+extent_prefetch_next (extent_t *extent) /* IN */
 {
-   ns_hash_node_t *node;
-
-   if (!ns || !ns->file || ns->index < 0) {
-      errno = EINVAL;
-      return NULL;
-   }
+   file_loc_t loc;
 
-   node = (ns_hash_node_t *)ns->file->map;
-   node += ns->index;
+   loc.fileno = extent->fileno;
+   loc.offset = extent->offset;
 
-   return node;
+   db_prefetch_extent(extent->db,
+                      extent_next_loc(extent->db, &loc,
+                                      extent_header(extent)));
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * ns_name --
+ * extent_destroy --
  *
- *       Fetch the name of the namespace.
+ *       Releases the data file mapping or buffer held by @extent. This
+ *       only needs to be called when iteration stops before
+ *       extent_next() fails, or for extents created with extent_init().
+ *       It is safe to call on an extent that has already been released.
+ *
+ *       Records fetched from the extent must not be used afterwards.
  *
  * Returns:
  *       None.
  *
  * Side effects:
- *       None.
+ *       The data file may be unmapped.
  *
  *--------------------------------------------------------------------------
  */
 
-const char *
-ns_name (const ns_t *ns)
+void
+extent_destroy (extent_t *extent) /* IN */
 {
-   ns_hash_node_t *node;
+   bson_return_if_fail(extent);
 
-   if (!ns) {
-      errno = EINVAL;
-      return NULL;
+   if (extent->buf) {
+      io_release(extent->db->io, extent->buf);
+   } else if (extent->map) {
+      db_file_release(extent->db, extent->fileno);
    }
 
-   node = ns_hash_node(ns);
-
-   return node->key;
+   memset(extent, 0, sizeof *extent);
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * ns_next --
+ * extent_next --
  *
- *       Move to the next namespace entry in the "dbname.ns" file.
+ *       Advances the extent_t to point at the next extent in the on-disk
+ *       linked list of extents.
  *
  * Returns:
- *       0 on success -- otherwise -1 and errno is set.
+ *       0 on success -- otherwise -1 and errno is set. The extent is
+ *       released when there are no more extents or on failure.
  *
  * Side effects:
- *       ns is updated to reflect the next namespace.
+ *       extent is updated to point at the next extent. Unless disabled
+ *       with db_set_advise(), the previous extent is marked as consumed
+ *       and readahead of the extent after the new one is started.
  *
  *--------------------------------------------------------------------------
  */
 
 int
-ns_next (ns_t *ns)
+extent_next (extent_t *extent) /* IN */
 {
-   ns_hash_node_t *node;
+   const file_loc_t *next_loc;
+   file_loc_t loc;
+   extent_t next;
+   int ret;
 
-   if (!ns) {
+   if (!extent) {
       errno = EINVAL;
       return -1;
    }
 
-next:
-   ns->index++;
+   if (!extent->map) {
+      errno = ENOENT;
+      return -1;
+   }
 
-   node = ns_hash_node(ns);
+   loc.fileno = extent->fileno;
+   loc.offset = extent->offset;
+   next_loc = extent_next_loc(extent->db, &loc, extent_header(extent));
 
-   if ((((char *)node) + sizeof *node) >
-       (ns->file->map + ns->file->maplen)) {
-      ns->index = -1;
+   if (next_loc->fileno == -1) {
+      extent_advise(extent, EXTENT_ADVISE_DONE);
+      extent_destroy(extent);
+      errno = ENOENT;
       return -1;
    }
 
-   if (!node->key[0]) {
-      goto next;
+   /*
+    * Acquire the next extent before releasing this one so that walking
+    * within a single file does not unmap and remap it.
+    */
+   ret = extent_init(&next, extent->db, next_loc);
+   extent_advise(extent, EXTENT_ADVISE_DONE);
+   extent_destroy(extent);
+   *extent = next;
+
+   if (!ret) {
+      extent_prefetch_next(extent);
    }
 
-   return 0;
+   return ret;
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * ns_extents --
+ * extent_records --
  *
- *       Fetches the first extent for the current namespace. You can move
- *       to the next extent with ns_next().
+ *       Fetches the first record in an extent. You can move to the next
+ *       record using record_next().
  *
  * Returns:
- *       0 on success -- otherwise -1 and errno is set.
+ *       0 on success -- otherwise -1 and errno is set. ENOENT if the
+ *       extent holds no records.
  *
  * Side effects:
- *       extent is initialized.
+ *       record is initialized.
  *
  *--------------------------------------------------------------------------
  */
 
 int
-ns_extents (ns_t *ns,         /* IN */
-            extent_t *extent) /* OUT */
+extent_records (extent_t *extent,   /* IN */
+                record_t *record)   /* OUT */
 {
-   const bson_int32_t magic = EXTENT_MAGIC;
-   ns_hash_node_t *node;
-   ns_details_t *details;
-   file_loc_t *loc;
+   extent_header_t *ehdr;
 
-   if (!ns || !ns->db || !extent) {
+   if (!extent || !record) {
       errno = EINVAL;
       return -1;
    }
 
-   memset(extent, 0, sizeof *extent);
+   memset(record, 0, sizeof *record);
 
-   if (!(node = ns_hash_node(ns))) {
+   ehdr = extent_header(extent);
+
+   /*
+    * An empty extent has a null first record of { -1, 0 }, whose offset
+    * would otherwise point at the file header.
+    */
+   if (ehdr->first_record.fileno == -1) {
       errno = ENOENT;
       return -1;
    }
 
-   details = (ns_details_t *)node->details;
-   loc = &details->first_extent;
-
-   if ((loc->fileno >= ns->db->filescnt) ||
-       (loc->offset >= ns->db->files[loc->fileno].maplen)) {
-      errno = ENOENT;
+   if (ehdr->first_record.offset < 0) {
+      errno = EBADF;
       return -1;
    }
 
-   extent->db = ns->db;
-   extent->map = ns->db->files[loc->fileno].map;
-   extent->maplen = ns->db->files[loc->fileno].maplen;
-   extent->offset = loc->offset;
+   record->map = extent->map;
+   record->maplen = extent->maplen;
+   record->base = extent->base;
+   record->offset = ehdr->first_record.offset;
 
-   if (!!memcmp(extent->map + extent->offset, &magic, sizeof magic)) {
-      memset(extent, 0, sizeof *extent);
+   if (!record_in_bounds(record, record->offset)) {
       errno = EBADF;
       return -1;
    }
@@ -433,58 +1763,44 @@ ns_extents (ns_t *ns,         /* IN */
 }
 
 
-ns_details_t *
-ns_get_details (ns_t *ns)
-{
-   char *base;
-
-   base = ns->file->map;
-   base = base + (sizeof (ns_hash_node_t) * ns->index);
-   base = base + offsetof (ns_hash_node_t, details);
-
-   return (ns_details_t *)base;
-}
-
-
 /*
  *--------------------------------------------------------------------------
  *
- * extent_next --
+ * record_next --
  *
- *       Advances the extent_t to point at the next extent in the on-disk
- *       linked list of extents.
+ *       Move the record_t to the next record in the extent.
  *
  * Returns:
  *       0 on success -- otherwise -1 and errno is set.
  *
  * Side effects:
- *       extent is updated to point at the next extent.
+ *       record is updated to point to new record.
  *
  *--------------------------------------------------------------------------
  */
 
 int
-extent_next (extent_t *extent) /* IN */
+record_next (record_t *record) /* IN/OUT */
 {
-   extent_header_t *ehdr;
-   file_loc_t next;
+   record_header_t *rhdr;
 
-   if (!extent) {
+   if (!record) {
       errno = EINVAL;
       return -1;
    }
 
-   ehdr = (extent_header_t *)(extent->map + extent->offset);
-   next = ehdr->next;
-
-   if (next.fileno == -1) {
+   rhdr = record_header(record);
+   if (rhdr->next_offset < 0) {
       errno = ENOENT;
       return -1;
    }
 
-   extent->map = extent->db->files[next.fileno].map;
-   extent->maplen = extent->db->files[next.fileno].maplen;
-   extent->offset = next.offset;
+   if (!record_in_bounds(record, rhdr->next_offset)) {
+      errno = EBADF;
+      return -1;
+   }
+
+   record->offset = rhdr->next_offset;
 
    return 0;
 }
@@ -493,95 +1809,103 @@ extent_next (extent_t *extent) /* IN */
 /*
  *--------------------------------------------------------------------------
  *
- * extent_records --
+ * record_data --
  *
- *       Fetches the first record in an extent. You can move to the next
- *       record using record_next().
+ *       Get the raw BSON document stored in the record, exactly as it is
+ *       on disk. The length is taken from the embedded BSON length rather
+ *       than the record length, which includes padding.
+ *
+ *       The returned memory points into the data file mapping or extent
+ *       buffer and is only valid until the extent is released.
  *
  * Returns:
- *       0 on success -- otherwise -1 and errno is set.
+ *       A pointer to the document on success -- otherwise NULL and errno
+ *       is set.
  *
  * Side effects:
- *       record is initialized.
+ *       len is set to the length of the document.
  *
  *--------------------------------------------------------------------------
  */
 
-int
-extent_records (extent_t *extent,   /* IN */
-                record_t *record)   /* OUT */
+const bson_uint8_t *
+record_data (record_t *record, /* IN */
+             size_t *len)      /* OUT */
 {
-   extent_header_t *ehdr;
+   record_header_t *rhdr;
+   bson_int32_t blen;
 
-   if (!extent || !record) {
+   if (!record || !len) {
       errno = EINVAL;
-      return -1;
+      return NULL;
    }
 
-   memset(record, 0, sizeof *record);
+   rhdr = record_header(record);
 
-   ehdr = (extent_header_t *)(extent->map + extent->offset);
-   if (ehdr->first_record.offset < 0) {
+   memcpy(&blen, rhdr->data, 4);
+   blen = BSON_UINT32_FROM_LE(blen);
+
+   if ((blen < 5) ||
+       (blen > (rhdr->length -
+                (bson_int32_t)offsetof(record_header_t, data))) ||
+       ((record->offset - record->base + offsetof(record_header_t, data) +
+         blen) > record->maplen)) {
       errno = EBADF;
-      return -1;
+      return NULL;
    }
 
-   record->map = extent->map;
-   record->offset = ehdr->first_record.offset;
+   *len = blen;
 
-   return 0;
+   return (const bson_uint8_t *)rhdr->data;
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * record_next --
+ * record_bson --
  *
- *       Move the record_t to the next record in the extent.
+ *       Get the BSON document associated with the record. You may iterate
+ *       through the document using bson_iter_*() functions.
  *
  * Returns:
- *       0 on success -- otherwise -1 and errno is set.
+ *       A const bson_t* on success -- otherwise NULL and errno is set.
  *
  * Side effects:
- *       record is updated to point to new record.
+ *       None.
  *
  *--------------------------------------------------------------------------
  */
 
-int
-record_next (record_t *record) /* IN/OUT */
+const bson_t *
+record_bson (record_t *record)
 {
-   record_header_t *rhdr;
+   const bson_uint8_t *data;
+   size_t len;
 
-   if (!record) {
-      errno = EINVAL;
-      return -1;
+   if (!(data = record_data(record, &len))) {
+      return NULL;
    }
 
-
-   rhdr = (record_header_t *)(record->map + record->offset);
-   if (rhdr->next_offset < 0) {
-      errno = ENOENT;
-      return -1;
+   if (bson_init_static(&record->bson, data, len)) {
+      return &record->bson;
    }
 
-   record->offset = rhdr->next_offset;
-
-   return 0;
+   errno = EBADF;
+   return NULL;
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * record_bson --
+ * record_batch_init --
  *
- *       Get the BSON document associated with the record. You may iterate
- *       through the document using bson_iter_*() functions.
+ *       Initialize @batch so that the next call to extent_record_batch()
+ *       starts at the first record of its extent.
  *
  * Returns:
- *       A const bson_t* on success -- otherwise NULL and errno is set.
+ *       None.
  *
  * Side effects:
  *       None.
@@ -589,27 +1913,128 @@ record_next (record_t *record) /* IN/OUT */
  *--------------------------------------------------------------------------
  */
 
-const bson_t *
-record_bson (record_t *record)
+void
+record_batch_init (record_batch_t *batch) /* OUT */
 {
-   record_header_t *rhdr;
-   bson_int32_t len;
+   bson_return_if_fail(batch);
+
+   batch->fileno = -1;
+   batch->extent_offset = 0;
+   batch->next = -1;
+   batch->started = FALSE;
+   batch->count = 0;
+   batch->invalid = 0;
+}
 
-   if (!record) {
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * extent_record_batch --
+ *
+ *       Fill @batch with the documents of up to @max further records of
+ *       @extent, following the record chain in a single pass. The header
+ *       of each next record is prefetched as soon as its offset is known,
+ *       so the load overlaps with checking the current document.
+ *
+ *       The documents point into the data file mapping or extent buffer
+ *       and are only valid until the extent is released.
+ *
+ * Returns:
+ *       The number of records in the batch, 0 once the extent has been
+ *       exhausted -- otherwise -1 and errno is set if the record chain
+ *       leaves the extent.
+ *
+ * Side effects:
+ *       batch->records and batch->count are updated.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+extent_record_batch (extent_t *extent,      /* IN */
+                     record_batch_t *batch, /* IN/OUT */
+                     int max)               /* IN */
+{
+   const record_header_t *rhdr;
+   const file_loc_t *first;
+   record_entry_t *entry;
+   const char *map;
+   bson_int32_t offset;
+   bson_int32_t base;
+   bson_int32_t blen;
+   size_t maplen;
+   size_t pos;
+
+   if (!extent || !batch || (max < 1)) {
       errno = EINVAL;
-      return NULL;
+      return -1;
+   }
+
+   if (max > RECORD_BATCH_MAX) {
+      max = RECORD_BATCH_MAX;
    }
 
-   rhdr = (record_header_t *)(record->map + record->offset);
+   if (!batch->started ||
+       (batch->fileno != extent->fileno) ||
+       (batch->extent_offset != extent->offset)) {
+      batch->started = TRUE;
+      batch->fileno = extent->fileno;
+      batch->extent_offset = extent->offset;
+      first = &extent_header(extent)->first_record;
+      batch->next = (first->fileno == -1) ? -1 : first->offset;
+   }
 
-   memcpy(&len, rhdr->data, 4);
-   BSON_ASSERT(len <= rhdr->length);
+   map = extent->map;
+   maplen = extent->maplen;
+   base = extent->base;
+   offset = batch->next;
+
+   batch->count = 0;
+
+   while ((offset >= 0) && (batch->count < max)) {
+      /*
+       * sizeof *rhdr covers the header and the length of the document.
+       */
+      if ((offset < base) ||
+          (((size_t)(offset - base) + sizeof *rhdr) > maplen)) {
+         batch->next = -1;
+         if (!batch->count) {
+            errno = EBADF;
+            return -1;
+         }
+         return batch->count;
+      }
 
-   if (bson_init_static(&record->bson, (bson_uint8_t *)rhdr->data, len)) {
-      return &record->bson;
+      pos = offset - base;
+      rhdr = (const record_header_t *)(map + pos);
+      offset = rhdr->next_offset;
+
+#ifdef __GNUC__
+      if ((offset >= base) && ((size_t)(offset - base) < maplen)) {
+         __builtin_prefetch(map + (offset - base));
+      }
+#endif
+
+      memcpy(&blen, rhdr->data, 4);
+      blen = BSON_UINT32_FROM_LE(blen);
+
+      if ((blen < 5) ||
+          (blen > (rhdr->length -
+                   (bson_int32_t)offsetof(record_header_t, data))) ||
+          ((pos + offsetof(record_header_t, data) + blen) > maplen)) {
+         batch->invalid++;
+         continue;
+      }
+
+      entry = &batch->records[batch->count++];
+      entry->data = (const bson_uint8_t *)rhdr->data;
+      entry->len = blen;
    }
 
-   return NULL;
+   batch->next = offset;
+
+   return batch->count;
 }
 
 
@@ -625,7 +2050,7 @@ record_bson (record_t *record)
  *       None.
  *
  * Side effects:
- *       Everything.
+ *       All data files are unmapped and closed.
  *
  *--------------------------------------------------------------------------
  */
@@ -633,9 +2058,28 @@ record_bson (record_t *record)
 void
 db_destroy (db_t *db)
 {
+   int i;
+
    bson_return_if_fail(db);
 
-   /*
-    * TODO: Free up everything and close files.
-    */
+   if (db->io) {
+      io_destroy(db->io);
+   }
+
+   if (db->carve) {
+      carve_destroy(db->carve);
+   }
+
+   for (i = 0; i < db->filescnt; i++) {
+      file_close(&db->files[i]);
+   }
+
+   file_close(&db->nsfile);
+   pthread_mutex_destroy(&db->mutex);
+
+   bson_free(db->files);
+   bson_free(db->dbpath);
+   bson_free(db->name);
+
+   memset(db, 0, sizeof *db);
 }
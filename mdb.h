@@ -21,6 +21,7 @@
 
 
 #include <bson.h>
+#include <pthread.h>
 #include <stddef.h>
 
 
@@ -30,36 +31,92 @@ BSON_BEGIN_DECLS
 typedef struct _db_t db_t;
 typedef struct _extent_t extent_t;
 typedef struct _file_t file_t;
+typedef struct _io_buf_t io_buf_t;
 typedef struct _ns_t ns_t;
 typedef struct _record_t record_t;
 
 
 struct _file_t
 {
-   file_t  *next;
-   int      fileno;
-   int      fd;
-   char    *map;
-   size_t   maplen;
+   file_t        *next;
+   int            fileno;
+   int            fd;
+   char          *map;
+   size_t         maplen;
+   char          *path;
+   int            refcnt;
+   bson_uint64_t  last_used;
 };
 
 
 struct _db_t
 {
-   char   *dbpath;
-   char   *name;
-   file_t  nsfile;
-   file_t *files;
-   int     filescnt;
+   char            *dbpath;
+   char            *name;
+   file_t           nsfile;
+   file_t          *files;
+   int              filescnt;
+   int              maxmaps;
+   int              nmaps;
+   bson_uint64_t    clock;
+   int              advise;
+   struct _io_t    *io;
+   struct _carve_t *carve;
+   pthread_mutex_t  mutex;
 };
 
 
-int  db_init        (db_t *db,
-                     const char *dbpath,
-                     const char *name);
-int  db_namespaces  (db_t *db,
-                     ns_t *ns);
-void db_destroy     (db_t *db);
+typedef enum
+{
+   DB_BACKEND_MMAP,
+   DB_BACKEND_PREAD,
+} db_backend_t;
+
+
+/*
+ * Filled in by db_init_carved(). "candidates" counts every EXTENT_MAGIC
+ * found, "extents" those with a valid header that were kept, and
+ * "overlapping" valid headers that lie inside an extent already kept.
+ * "segments" is the number of pieces the chains were rebuilt from, which
+ * equals "namespaces" when no chain was broken.
+ */
+typedef struct
+{
+   bson_uint64_t bytes;
+   bson_uint64_t candidates;
+   bson_uint64_t extents;
+   bson_uint64_t overlapping;
+   bson_uint64_t segments;
+   int           namespaces;
+} carve_stats_t;
+
+
+int         db_init             (db_t *db,
+                                 const char *dbpath,
+                                 const char *name);
+int         db_init_carved      (db_t *db,
+                                 const char *dbpath,
+                                 const char *name,
+                                 int jobs,
+                                 carve_stats_t *stats);
+int         db_namespaces       (db_t *db,
+                                 ns_t *ns);
+int         db_namespace_lookup (db_t *db,
+                                 const char *name,
+                                 ns_t *ns);
+void        db_set_max_maps     (db_t *db,
+                                 int maxmaps);
+void        db_set_advise       (db_t *db,
+                                 int advise);
+int         db_set_backend      (db_t *db,
+                                 db_backend_t backend,
+                                 int depth);
+const char *db_file_acquire     (db_t *db,
+                                 int fileno,
+                                 size_t *maplen);
+void        db_file_release     (db_t *db,
+                                 int fileno);
+void        db_destroy          (db_t *db);
 
 
 struct _extent_t
@@ -67,25 +124,78 @@ struct _extent_t
    db_t         *db;
    const char   *map;
    size_t        maplen;
+   int           fileno;
    bson_int32_t  offset;
+   bson_int32_t  base;
+   io_buf_t     *buf;
 };
 
 
-int extent_next    (extent_t *extent);
-int extent_records (extent_t *extent,
-                    record_t *record);
+typedef enum
+{
+   EXTENT_ADVISE_WILLNEED,
+   EXTENT_ADVISE_DONE,
+} extent_advice_t;
+
+
+int  extent_next    (extent_t *extent);
+int  extent_records (extent_t *extent,
+                     record_t *record);
+int  extent_advise  (extent_t *extent,
+                     extent_advice_t advice);
+void extent_destroy (extent_t *extent);
 
 
 struct _record_t
 {
-   const char *map;
-   off_t offset;
-   bson_t bson;
+   const char   *map;
+   off_t         offset;
+   bson_t        bson;
+   size_t        maplen;
+   bson_int32_t  base;
 };
 
 
-int           record_next (record_t *record);
-const bson_t *record_bson (record_t *record);
+int                 record_next (record_t *record);
+const bson_t       *record_bson (record_t *record);
+const bson_uint8_t *record_data (record_t *record,
+                                 size_t *len);
+
+
+/*
+ * A record_batch_t collects the documents of up to RECORD_BATCH_MAX
+ * records of an extent at a time, so that consumers can loop over a flat
+ * array instead of calling record_next() and record_data() per document.
+ * Successive calls to extent_record_batch() continue along the extent;
+ * passing an extent at another location starts over at its first record.
+ * Records whose document is invalid are skipped and counted.
+ */
+#define RECORD_BATCH_MAX 256
+
+
+typedef struct
+{
+   const bson_uint8_t *data;
+   size_t              len;
+} record_entry_t;
+
+
+typedef struct
+{
+   int             fileno;
+   bson_int32_t    extent_offset;
+   bson_int32_t    next;
+   int             started;
+   int             count;
+   bson_uint64_t   invalid;
+   record_entry_t  records[RECORD_BATCH_MAX];
+} record_batch_t;
+
+
+void record_batch_init   (record_batch_t *batch);
+int  extent_record_batch (extent_t *extent,
+                          record_batch_t *batch,
+                          int max);
 
 
 struct _ns_t
@@ -198,26 +308,97 @@ typedef struct {
 
 
 #define N_BUCKETS 19
+#define N_INDEXES_BASE 10
+#define N_INDEXES_EXTRA 30
+#define N_INDEXES_MAX 64
+
+
+#pragma pack(push, 1)
+typedef struct {
+   file_loc_t head;
+   file_loc_t info;
+} index_details_t;
+#pragma pack(pop)
+
+
+BSON_STATIC_ASSERT(sizeof(index_details_t) == 16);
 
 
 #pragma pack(push, 1)
 typedef struct {
-   file_loc_t first_extent;
-   file_loc_t last_extent;
-   file_loc_t buckets[N_BUCKETS];
+   file_loc_t      first_extent;
+   file_loc_t      last_extent;
+   file_loc_t      buckets[N_BUCKETS];
    struct {
       bson_int64_t datasize;
       bson_int64_t nrecords;
    } stats;
-   bson_int32_t last_extent_size;
-   bson_int32_t nindexes;
-   /* some stuff is missing */
+   bson_int32_t    last_extent_size;
+   bson_int32_t    nindexes;
+   index_details_t indexes[N_INDEXES_BASE];
+   bson_int32_t    is_capped;
+   bson_int32_t    max_docs_in_capped;
+   double          padding_factor;
+   bson_int32_t    system_flags;
+   file_loc_t      cap_extent;
+   file_loc_t      cap_first_new_record;
+   unsigned short  data_file_version;
+   unsigned short  index_file_version;
+   bson_uint64_t   multi_key_index_bits;
+   bson_uint64_t   reserved_a;
+   bson_int64_t    extra_offset;
+   bson_int32_t    index_builds_in_progress;
+   bson_int32_t    user_flags;
+   char            reserved[72];
 } ns_details_t;
 #pragma pack(pop)
 
 
+BSON_STATIC_ASSERT(offsetof(ns_details_t, indexes) == 192);
+BSON_STATIC_ASSERT(offsetof(ns_details_t, extra_offset) == 408);
+BSON_STATIC_ASSERT(sizeof(ns_details_t) == NS_DETAILS_SIZE);
+
+
+/*
+ * Indexes beyond the first N_INDEXES_BASE are described by "extra" blocks
+ * stored elsewhere in the .ns file. Both extra_offset and next are byte
+ * offsets relative to the ns_details_t, with 0 meaning there is none.
+ */
+#pragma pack(push, 1)
+typedef struct {
+   bson_int64_t    next;
+   index_details_t details[N_INDEXES_EXTRA];
+   bson_uint32_t   reserved2;
+   bson_uint32_t   reserved3;
+} ns_details_extra_t;
+#pragma pack(pop)
+
+
+BSON_STATIC_ASSERT(sizeof(ns_details_extra_t) == 496);
+
+
 ns_details_t *
 ns_get_details (ns_t *ns);
+bson_int32_t
+ns_hash (const char *name);
+
+
+int  extent_init        (extent_t *extent,
+                         db_t *db,
+                         const file_loc_t *loc);
+int  extent_header_at   (db_t *db,
+                         const file_loc_t *loc,
+                         extent_header_t *ehdr);
+void db_prefetch_extent (db_t *db,
+                         const file_loc_t *loc);
+int  ns_extent_locs     (ns_t *ns,
+                         file_loc_t **locs,
+                         int *nlocs);
+void file_loc_sort      (file_loc_t *locs,
+                         int nlocs);
+int  ns_index_details   (ns_t *ns,
+                         int index,
+                         index_details_t *details);
 
 
 BSON_END_DECLS
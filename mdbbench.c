@@ -0,0 +1,782 @@
+/* mdbbench.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mdb.h"
+#include "mdb-buffer.h"
+#include "mdb-json.h"
+
+
+/*
+ * mdbbench times the main read paths of the library over every namespace
+ * of a database:
+ *
+ *   ns      enumerating the namespaces in the .ns hashtable
+ *   scan    walking every record of every extent with record_next()
+ *   batch   the same walk with extent_record_batch()
+ *   json    record_bson() plus JSON encoding, as mdbdump does
+ *   undo    walking the deleted record lists, as mdbundo does
+ *   encode  bson_as_json() against json_append_bson(), timing only the
+ *           encoders and checking that their output is identical
+ *
+ * Each benchmark runs with a cold page cache, where the data files are
+ * dropped from the cache before every iteration, and with a warm one,
+ * after an untimed pass. Dropping the cache needs no privileges but only
+ * works for pages that are not dirty, so the files are synced first.
+ *
+ * Throughput is counted in document bytes. Latency percentiles are per
+ * unit of work: one extent for scan and json, one deleted list for undo
+ * and one full pass for ns, which counts namespaces as documents. Page
+ * faults are for the timed iterations; maxrss is the high-water mark of
+ * the process.
+ *
+ * -f json writes one JSON object per line, for tracking results across
+ * releases.
+ */
+
+
+#define ARGC_FAILURE   1
+#define DB_FAILURE     2
+#define NS_FAILURE     3
+
+
+/*
+ * Output is discarded in blocks of this size, as mdbdump would flush it.
+ */
+#define BENCH_FLUSH_SIZE (1024 * 1024)
+
+
+/*
+ * Give up on a deleted list after this many records, in case it loops.
+ */
+#define BENCH_MAX_CHAIN (1 << 24)
+
+
+typedef enum
+{
+   BENCH_WARM = 1 << 0,
+   BENCH_COLD = 1 << 1,
+} bench_cache_t;
+
+
+typedef struct
+{
+   const char    *name;
+   const char    *cache;
+   int            iterations;
+   bson_uint64_t  docs;
+   bson_uint64_t  bytes;
+   bson_uint64_t  failed;
+   bson_uint64_t  mismatches;
+   double         seconds;
+   double        *lat;
+   size_t         nlat;
+   size_t         alat;
+   long           minflt;
+   long           majflt;
+   long           maxrss;
+} bench_t;
+
+
+typedef struct
+{
+   db_t       db;
+   const char *dbpath;
+   const char *dbname;
+   buffer_t    buffer;
+} bench_ctx_t;
+
+
+typedef int (*bench_func_t) (bench_ctx_t *ctx,
+                             bench_t     *rows);
+
+
+static void
+usage (void)
+{
+   fprintf(stderr, "usage: mdbbench [-n ITERATIONS] [-b BENCH[,BENCH...]] "
+                   "[-c cold|warm|both] [-f text|json] DBPATH DBNAME\n"
+                   "benchmarks: ns, scan, batch, json, undo, encode\n");
+}
+
+
+static double
+bench_now (void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+
+/*
+ * Account for one unit of work that started at @start.
+ */
+static void
+bench_unit (bench_t *bench,
+            double   start)
+{
+   double t = bench_now() - start;
+
+   if (bench->nlat == bench->alat) {
+      bench->alat = bench->alat ? bench->alat * 2 : 256;
+      bench->lat = bson_realloc(bench->lat, bench->alat * sizeof *bench->lat);
+   }
+
+   bench->lat[bench->nlat++] = t;
+   bench->seconds += t;
+}
+
+
+static int
+bench_cmp_double (const void *a,
+                  const void *b)
+{
+   double x = *(const double *)a;
+   double y = *(const double *)b;
+
+   return (x < y) ? -1 : (x > y);
+}
+
+
+static double
+bench_percentile (bench_t *bench,
+                  int      p)
+{
+   size_t i;
+
+   if (!bench->nlat) {
+      return 0;
+   }
+
+   i = (bench->nlat - 1) * p / 100;
+
+   return bench->lat[i] * 1000000.0;
+}
+
+
+static void
+bench_report (bench_t *bench,
+              int      json)
+{
+   double seconds = bench->seconds > 0 ? bench->seconds : 1e-9;
+   double p50;
+   double p99;
+
+   qsort(bench->lat, bench->nlat, sizeof *bench->lat, bench_cmp_double);
+   p50 = bench_percentile(bench, 50);
+   p99 = bench_percentile(bench, 99);
+
+   if (json) {
+      fprintf(stdout, "{ \"bench\" : \"%s\", \"cache\" : \"%s\", "
+                      "\"iterations\" : %d, \"docs\" : %llu, "
+                      "\"bytes\" : %llu, \"seconds\" : %.6f, "
+                      "\"docs_per_sec\" : %.0f, \"mb_per_sec\" : %.1f, "
+                      "\"p50_us\" : %.1f, \"p99_us\" : %.1f, "
+                      "\"minflt\" : %ld, \"majflt\" : %ld, "
+                      "\"maxrss_kb\" : %ld, \"failed\" : %llu, "
+                      "\"mismatches\" : %llu }\n",
+              bench->name, bench->cache, bench->iterations,
+              (unsigned long long)bench->docs,
+              (unsigned long long)bench->bytes,
+              bench->seconds,
+              bench->docs / seconds,
+              (bench->bytes / (1024.0 * 1024.0)) / seconds,
+              p50, p99, bench->minflt, bench->majflt, bench->maxrss,
+              (unsigned long long)bench->failed,
+              (unsigned long long)bench->mismatches);
+      return;
+   }
+
+   fprintf(stdout, "%-18s %-5s %12llu %10.3f %12.0f %8.1f %10.1f %10.1f "
+                   "%9ld %9ld %10ld %8llu\n",
+           bench->name,
+           bench->cache,
+           (unsigned long long)bench->docs,
+           bench->seconds,
+           bench->docs / seconds,
+           (bench->bytes / (1024.0 * 1024.0)) / seconds,
+           p50, p99, bench->minflt, bench->majflt, bench->maxrss,
+           (unsigned long long)(bench->failed + bench->mismatches));
+}
+
+
+static void
+bench_header (void)
+{
+   fprintf(stdout, "%-18s %-5s %12s %10s %12s %8s %10s %10s %9s %9s %10s %8s\n",
+           "bench", "cache", "docs", "seconds", "docs/s", "MB/s",
+           "p50(us)", "p99(us)", "minflt", "majflt", "maxrss(KB)", "failed");
+}
+
+
+/*
+ * Drop the data files of the database from the page cache. The files
+ * must not be mapped, so the database is closed and reopened around it.
+ */
+static int
+bench_evict (bench_ctx_t *ctx)
+{
+   char path[4096];
+   int fd;
+   int i;
+
+   db_destroy(&ctx->db);
+
+   for (i = -1; ; i++) {
+      if (i == -1) {
+         snprintf(path, sizeof path, "%s/%s.ns", ctx->dbpath, ctx->dbname);
+      } else {
+         snprintf(path, sizeof path, "%s/%s.%d", ctx->dbpath, ctx->dbname, i);
+      }
+
+      if (-1 == (fd = open(path, O_RDONLY))) {
+         break;
+      }
+
+      fdatasync(fd);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+   }
+
+   return db_init(&ctx->db, ctx->dbpath, ctx->dbname);
+}
+
+
+static int
+bench_ns (bench_ctx_t *ctx,
+          bench_t     *rows)
+{
+   double start;
+   ns_t ns;
+
+   start = bench_now();
+
+   if (!!db_namespaces(&ctx->db, &ns)) {
+      return -1;
+   }
+
+   do {
+      if (ns_name(&ns)) {
+         rows->docs++;
+      }
+   } while (!ns_next(&ns));
+
+   bench_unit(rows, start);
+
+   return 0;
+}
+
+
+static int
+bench_scan (bench_ctx_t *ctx,
+            bench_t     *rows)
+{
+   record_t record;
+   extent_t extent;
+   double start;
+   size_t len;
+   ns_t ns;
+
+   if (!!db_namespaces(&ctx->db, &ns)) {
+      return -1;
+   }
+
+   do {
+      if (!!ns_extents(&ns, &extent)) {
+         continue;
+      }
+      do {
+         start = bench_now();
+         if (!extent_records(&extent, &record)) {
+            do {
+               if (record_data(&record, &len)) {
+                  rows->docs++;
+                  rows->bytes += len;
+               } else {
+                  rows->failed++;
+               }
+            } while (!record_next(&record));
+         }
+         bench_unit(rows, start);
+      } while (!extent_next(&extent));
+   } while (!ns_next(&ns));
+
+   return 0;
+}
+
+
+static int
+bench_batch (bench_ctx_t *ctx,
+             bench_t     *rows)
+{
+   record_batch_t batch;
+   extent_t extent;
+   double start;
+   int i;
+   ns_t ns;
+
+   if (!!db_namespaces(&ctx->db, &ns)) {
+      return -1;
+   }
+
+   do {
+      if (!!ns_extents(&ns, &extent)) {
+         continue;
+      }
+      do {
+         start = bench_now();
+         record_batch_init(&batch);
+         while (extent_record_batch(&extent, &batch, RECORD_BATCH_MAX) > 0) {
+            for (i = 0; i < batch.count; i++) {
+               rows->bytes += batch.records[i].len;
+            }
+            rows->docs += batch.count;
+         }
+         rows->failed += batch.invalid;
+         bench_unit(rows, start);
+      } while (!extent_next(&extent));
+   } while (!ns_next(&ns));
+
+   return 0;
+}
+
+
+static int
+bench_json (bench_ctx_t *ctx,
+            bench_t     *rows)
+{
+   buffer_t *buffer = &ctx->buffer;
+   const bson_t *b;
+   record_t record;
+   extent_t extent;
+   double start;
+   ns_t ns;
+
+   if (!!db_namespaces(&ctx->db, &ns)) {
+      return -1;
+   }
+
+   do {
+      if (!!ns_extents(&ns, &extent)) {
+         continue;
+      }
+      do {
+         start = bench_now();
+         if (!extent_records(&extent, &record)) {
+            do {
+               if (buffer->len >= BENCH_FLUSH_SIZE) {
+                  buffer_clear(buffer);
+               }
+               if ((b = record_bson(&record)) &&
+                   !json_append_bson(buffer, bson_get_data(b), b->len)) {
+                  buffer_append(buffer, "\n", 1);
+                  rows->docs++;
+                  rows->bytes += b->len;
+               } else {
+                  rows->failed++;
+               }
+            } while (!record_next(&record));
+         }
+         bench_unit(rows, start);
+      } while (!extent_next(&extent));
+   } while (!ns_next(&ns));
+
+   buffer_clear(buffer);
+
+   return 0;
+}
+
+
+/*
+ * Deleted records keep their header, with the location of the next
+ * deleted record in place of the next and previous record offsets.
+ */
+static int
+bench_undo (bench_ctx_t *ctx,
+            bench_t     *rows)
+{
+   const record_header_t *rec;
+   ns_details_t *details;
+   const char *map;
+   file_loc_t next;
+   file_loc_t loc;
+   double start;
+   size_t maplen;
+   int count;
+   int i;
+   ns_t ns;
+
+   if (!!db_namespaces(&ctx->db, &ns)) {
+      return -1;
+   }
+
+   do {
+      details = ns_get_details(&ns);
+
+      for (i = 0; i < N_BUCKETS; i++) {
+         loc = details->buckets[i];
+         if (loc.fileno == -1) {
+            continue;
+         }
+
+         start = bench_now();
+
+         for (count = 0; (loc.fileno != -1) && (count < BENCH_MAX_CHAIN);
+              count++) {
+            if (!(map = db_file_acquire(&ctx->db, loc.fileno, &maplen))) {
+               rows->failed++;
+               break;
+            }
+
+            if ((loc.offset < 0) ||
+                ((size_t)loc.offset + sizeof *rec) > maplen) {
+               db_file_release(&ctx->db, loc.fileno);
+               rows->failed++;
+               break;
+            }
+
+            rec = (const record_header_t *)(map + loc.offset);
+            rows->docs++;
+            rows->bytes += (rec->length > 16) ? (rec->length - 16) : 0;
+            next.fileno = rec->next_offset;
+            next.offset = rec->prev_offset;
+
+            db_file_release(&ctx->db, loc.fileno);
+            loc = next;
+         }
+
+         bench_unit(rows, start);
+      }
+   } while (!ns_next(&ns));
+
+   return 0;
+}
+
+
+/*
+ * Run both encoders over every record of an extent. The encoders are
+ * timed separately, but over the same records while they are resident,
+ * so that only encoding is measured. The text produced by both is
+ * compared as well.
+ */
+static void
+bench_encode_extent (extent_t *extent,
+                     bench_t  *json,
+                     bench_t  *bson,
+                     buffer_t *buffer)
+{
+   const bson_uint8_t *data;
+   const bson_t *b;
+   record_t record;
+   size_t start;
+   size_t dlen;
+   size_t len;
+   double t;
+   char *str;
+
+   if (!!extent_records(extent, &record)) {
+      return;
+   }
+
+   do {
+      if (!(data = record_data(&record, &dlen)) ||
+          !(b = record_bson(&record))) {
+         continue;
+      }
+
+      if (buffer->len >= BENCH_FLUSH_SIZE) {
+         buffer_clear(buffer);
+      }
+
+      t = bench_now();
+      str = bson_as_json(b, &len);
+      bson->seconds += bench_now() - t;
+
+      start = buffer->len;
+      t = bench_now();
+      if (!json_append_bson(buffer, data, dlen)) {
+         buffer_append(buffer, "\n", 1);
+         json->docs++;
+         json->bytes += dlen;
+      } else {
+         json->failed++;
+      }
+      json->seconds += bench_now() - t;
+
+      if (str) {
+         bson->docs++;
+         bson->bytes += dlen;
+
+         if ((len != (buffer->len - start - 1)) ||
+             !!memcmp(str, buffer->data + start, len)) {
+            json->mismatches++;
+         }
+
+         t = bench_now();
+         bson_free(str);
+         bson->seconds += bench_now() - t;
+      } else {
+         bson->failed++;
+      }
+   } while (!record_next(&record));
+}
+
+
+static int
+bench_encode (bench_ctx_t *ctx,
+              bench_t     *rows)
+{
+   extent_t extent;
+   ns_t ns;
+
+   rows[0].name = "bson_as_json";
+   rows[1].name = "json_append_bson";
+
+   if (!!db_namespaces(&ctx->db, &ns)) {
+      return -1;
+   }
+
+   do {
+      if (!!ns_extents(&ns, &extent)) {
+         continue;
+      }
+      do {
+         bench_encode_extent(&extent, &rows[1], &rows[0], &ctx->buffer);
+      } while (!extent_next(&extent));
+   } while (!ns_next(&ns));
+
+   buffer_clear(&ctx->buffer);
+
+   return 0;
+}
+
+
+static const struct
+{
+   const char   *name;
+   bench_func_t  func;
+   int           nrows;
+} gBenches[] = {
+   { "ns", bench_ns, 1 },
+   { "scan", bench_scan, 1 },
+   { "batch", bench_batch, 1 },
+   { "json", bench_json, 1 },
+   { "undo", bench_undo, 1 },
+   { "encode", bench_encode, 2 },
+};
+
+
+#define N_BENCHES (sizeof gBenches / sizeof gBenches[0])
+
+
+static int
+bench_select (const char *list,
+              int        *selected)
+{
+   const char *p = list;
+   size_t len;
+   size_t i;
+
+   memset(selected, 0, N_BENCHES * sizeof *selected);
+
+   while (*p) {
+      len = strcspn(p, ",");
+      for (i = 0; i < N_BENCHES; i++) {
+         if ((strlen(gBenches[i].name) == len) &&
+             !strncmp(gBenches[i].name, p, len)) {
+            selected[i] = TRUE;
+            break;
+         }
+      }
+      if (i == N_BENCHES) {
+         return -1;
+      }
+      p += len;
+      if (*p == ',') {
+         p++;
+      }
+   }
+
+   return 0;
+}
+
+
+static int
+bench_run (bench_ctx_t   *ctx,
+           int            index,
+           bench_cache_t  cache,
+           int            iterations,
+           int            json)
+{
+   struct rusage before;
+   struct rusage after;
+   bench_t rows[2];
+   int nrows = gBenches[index].nrows;
+   int i;
+
+   memset(rows, 0, sizeof rows);
+
+   if (cache == BENCH_WARM) {
+      if (!!gBenches[index].func(ctx, rows)) {
+         return -1;
+      }
+      for (i = 0; i < nrows; i++) {
+         bson_free(rows[i].lat);
+      }
+      memset(rows, 0, sizeof rows);
+   }
+
+   for (i = 0; i < nrows; i++) {
+      rows[i].name = gBenches[index].name;
+      rows[i].cache = (cache == BENCH_WARM) ? "warm" : "cold";
+      rows[i].iterations = iterations;
+   }
+
+   getrusage(RUSAGE_SELF, &before);
+
+   for (i = 0; i < iterations; i++) {
+      if ((cache == BENCH_COLD) && !!bench_evict(ctx)) {
+         return -1;
+      }
+      if (!!gBenches[index].func(ctx, rows)) {
+         return -1;
+      }
+   }
+
+   getrusage(RUSAGE_SELF, &after);
+
+   for (i = 0; i < nrows; i++) {
+      rows[i].minflt = after.ru_minflt - before.ru_minflt;
+      rows[i].majflt = after.ru_majflt - before.ru_majflt;
+      rows[i].maxrss = after.ru_maxrss;
+      bench_report(&rows[i], json);
+      bson_free(rows[i].lat);
+   }
+
+   return 0;
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+   int selected[N_BENCHES];
+   bench_ctx_t ctx;
+   int caches = BENCH_COLD | BENCH_WARM;
+   int iterations = 1;
+   int json = FALSE;
+   int opt;
+   size_t i;
+
+   for (i = 0; i < N_BENCHES; i++) {
+      selected[i] = TRUE;
+   }
+
+   while (-1 != (opt = getopt(argc, argv, "n:b:c:f:"))) {
+      switch (opt) {
+      case 'n':
+         if ((iterations = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'b':
+         if (!!bench_select(optarg, selected)) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'c':
+         if (!strcmp(optarg, "cold")) {
+            caches = BENCH_COLD;
+         } else if (!strcmp(optarg, "warm")) {
+            caches = BENCH_WARM;
+         } else if (!strcmp(optarg, "both")) {
+            caches = BENCH_COLD | BENCH_WARM;
+         } else {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'f':
+         if (!strcmp(optarg, "json")) {
+            json = TRUE;
+         } else if (!strcmp(optarg, "text")) {
+            json = FALSE;
+         } else {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      default:
+         usage();
+         return ARGC_FAILURE;
+      }
+   }
+
+   if ((argc - optind) != 2) {
+      usage();
+      return ARGC_FAILURE;
+   }
+
+   ctx.dbpath = argv[optind];
+   ctx.dbname = argv[optind + 1];
+
+   errno = 0;
+   if (!!db_init(&ctx.db, ctx.dbpath, ctx.dbname)) {
+      perror("Failed to load database");
+      return DB_FAILURE;
+   }
+
+   buffer_init(&ctx.buffer);
+
+   if (!json) {
+      bench_header();
+   }
+
+   for (i = 0; i < N_BENCHES; i++) {
+      if (!selected[i]) {
+         continue;
+      }
+      if (((caches & BENCH_COLD) &&
+           !!bench_run(&ctx, i, BENCH_COLD, iterations, json)) ||
+          ((caches & BENCH_WARM) &&
+           !!bench_run(&ctx, i, BENCH_WARM, iterations, json))) {
+         perror("Failed to run benchmark");
+         return NS_FAILURE;
+      }
+   }
+
+   buffer_destroy(&ctx.buffer);
+   db_destroy(&ctx.db);
+
+   return 0;
+}
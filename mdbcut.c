@@ -0,0 +1,712 @@
+/* mdbcut.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mdb.h"
+#include "mdb-json.h"
+#include "mdb-output.h"
+#include "mdb-pool.h"
+
+
+/*
+ * mdbcut extracts a set of fields from every document of a collection.
+ *
+ * The requested dotted paths are merged into a tree up front, so each
+ * document is walked once, descending only into the embedded documents
+ * that lead to a requested field, and stopping at each level once every
+ * field below it has been found.
+ *
+ * Text output (-f tsv or -f csv) has one line per document. Strings are
+ * written as is, numbers in decimal, dates in ISO-8601, ObjectIds in hex
+ * and embedded documents and arrays as Extended JSON. Missing fields are
+ * empty.
+ *
+ * Binary output (-f bin) is columnar. All integers are little-endian.
+ *
+ *   header:  "MDBCUT01"
+ *            uint32  number of columns
+ *            for each column: uint32 length, followed by the field path
+ *   blocks:  uint32  number of rows in the block
+ *            for each column:
+ *               uint32  number of bytes of column data that follow
+ *               for each row: uint8 BSON type, followed by the value
+ *               exactly as encoded in BSON. Missing fields have type 0
+ *               and no value.
+ *
+ * Each block holds the documents of one extent.
+ */
+
+
+#define ARGC_FAILURE   1
+#define DB_FAILURE     2
+#define NS_FAILURE     3
+#define EXTENT_FAILURE 4
+#define WRITE_FAILURE  5
+
+
+#define CUT_MAGIC "MDBCUT01"
+
+
+typedef enum
+{
+   CUT_TSV,
+   CUT_CSV,
+   CUT_BIN,
+} cut_format_t;
+
+
+typedef struct _cut_field_t cut_field_t;
+
+
+struct _cut_field_t
+{
+   char        *name;
+   int          column;
+   cut_field_t *children;
+   int          nchildren;
+};
+
+
+typedef struct
+{
+   db_t         *db;
+   file_loc_t   *locs;
+   int           nlocs;
+   cut_format_t  format;
+   cut_field_t   root;
+   char        **columns;
+   int           ncolumns;
+   output_t      output;
+} cut_t;
+
+
+static void
+usage (void)
+{
+   fprintf(stderr, "usage: mdbcut [-f tsv|csv|bin] [-H] [-o natural|physical] "
+                   "[-j JOBS] [-m MAXMAPS] DBPATH DBNAME COLNAME FIELD...\n");
+}
+
+
+static int
+cut_add_field (cut_field_t *field,
+               const char  *path,
+               int          column)
+{
+   const char *dot;
+   size_t len;
+   int i;
+
+   dot = strchr(path, '.');
+   len = dot ? (size_t)(dot - path) : strlen(path);
+
+   if (!len) {
+      return -1;
+   }
+
+   for (i = 0; i < field->nchildren; i++) {
+      if ((strlen(field->children[i].name) == len) &&
+          !memcmp(field->children[i].name, path, len)) {
+         break;
+      }
+   }
+
+   if (i == field->nchildren) {
+      field->children = bson_realloc(field->children,
+                                     (i + 1) * sizeof *field->children);
+      memset(&field->children[i], 0, sizeof *field->children);
+      field->children[i].name = bson_malloc0(len + 1);
+      memcpy(field->children[i].name, path, len);
+      field->children[i].column = -1;
+      field->nchildren++;
+   }
+
+   if (dot) {
+      return cut_add_field(&field->children[i], dot + 1, column);
+   }
+
+   if (field->children[i].column != -1) {
+      return -1;
+   }
+
+   field->children[i].column = column;
+
+   return 0;
+}
+
+
+static void
+cut_field_destroy (cut_field_t *field)
+{
+   int i;
+
+   for (i = 0; i < field->nchildren; i++) {
+      cut_field_destroy(&field->children[i]);
+   }
+
+   bson_free(field->children);
+   bson_free(field->name);
+}
+
+
+/*
+ * Walk the document that iter iterates, recording the element of each
+ * requested field in cells.
+ */
+static void
+cut_walk (const cut_field_t *field,
+          bson_iter_t       *iter,
+          bson_iter_t       *cells,
+          int               *found)
+{
+   const cut_field_t *child;
+   bson_iter_t sub;
+   bson_type_t type;
+   const char *key;
+   int remaining = field->nchildren;
+   int i;
+
+   while (remaining && bson_iter_next(iter)) {
+      key = bson_iter_key(iter);
+
+      for (i = 0; i < field->nchildren; i++) {
+         if (!strcmp(key, field->children[i].name)) {
+            break;
+         }
+      }
+
+      if (i == field->nchildren) {
+         continue;
+      }
+
+      child = &field->children[i];
+      remaining--;
+
+      if (child->column != -1) {
+         cells[child->column] = *iter;
+         found[child->column] = TRUE;
+      }
+
+      type = bson_iter_type(iter);
+      if (child->nchildren &&
+          ((type == BSON_TYPE_DOCUMENT) || (type == BSON_TYPE_ARRAY)) &&
+          bson_iter_recurse(iter, &sub)) {
+         cut_walk(child, &sub, cells, found);
+      }
+   }
+}
+
+
+static const bson_uint8_t *
+cut_value (const bson_iter_t *iter,
+           size_t            *len)
+{
+   *len = iter->next_off - iter->d1;
+   return iter->raw + iter->d1;
+}
+
+
+static void
+cut_append_escaped (buffer_t     *buffer,
+                    cut_format_t  format,
+                    const char   *str,
+                    size_t        len)
+{
+   const char *end = str + len;
+   const char *p;
+
+   if (format == CUT_CSV) {
+      for (p = str; p < end; p++) {
+         if ((*p == ',') || (*p == '"') || (*p == '\n') || (*p == '\r')) {
+            break;
+         }
+      }
+
+      if (p == end) {
+         buffer_append(buffer, str, len);
+         return;
+      }
+
+      buffer_append(buffer, "\"", 1);
+      while ((p = memchr(str, '"', end - str))) {
+         buffer_append(buffer, str, p - str + 1);
+         buffer_append(buffer, "\"", 1);
+         str = p + 1;
+      }
+      buffer_append(buffer, str, end - str);
+      buffer_append(buffer, "\"", 1);
+      return;
+   }
+
+   for (p = str; p < end; p++) {
+      switch (*p) {
+      case '\\':
+      case '\t':
+      case '\n':
+      case '\r':
+         buffer_append(buffer, str, p - str);
+         buffer_append(buffer, "\\", 1);
+         buffer_append(buffer, (*p == '\\') ? "\\" :
+                               (*p == '\t') ? "t" :
+                               (*p == '\n') ? "n" : "r", 1);
+         str = p + 1;
+         break;
+      default:
+         break;
+      }
+   }
+
+   buffer_append(buffer, str, end - str);
+}
+
+
+static void
+cut_append_double (buffer_t *buffer,
+                   double    v)
+{
+   char str[32];
+   int n;
+
+   /*
+    * Use the shortest of the two precisions that round trips.
+    */
+   n = snprintf(str, sizeof str, "%.15g", v);
+   if (strtod(str, NULL) != v) {
+      n = snprintf(str, sizeof str, "%.17g", v);
+   }
+
+   buffer_append(buffer, str, n);
+}
+
+
+static void
+cut_append_date (buffer_t     *buffer,
+                 bson_int64_t  msec)
+{
+   bson_int64_t secs;
+   struct tm tm;
+   time_t t;
+   char str[64];
+   int ms;
+   int n;
+
+   secs = msec / 1000;
+   ms = msec % 1000;
+   if (ms < 0) {
+      secs--;
+      ms += 1000;
+   }
+
+   t = secs;
+   if (!gmtime_r(&t, &tm)) {
+      n = snprintf(str, sizeof str, "%lld", (long long)msec);
+   } else {
+      n = snprintf(str, sizeof str, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+                   tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                   tm.tm_hour, tm.tm_min, tm.tm_sec, ms);
+   }
+
+   buffer_append(buffer, str, n);
+}
+
+
+static void
+cut_append_text (buffer_t          *buffer,
+                 buffer_t          *scratch,
+                 cut_format_t       format,
+                 const bson_iter_t *iter)
+{
+   const bson_uint8_t *data;
+   const char *str;
+   bson_uint32_t slen;
+   bson_type_t type;
+   char oid[25];
+   char num[24];
+   size_t len;
+
+   switch ((type = bson_iter_type(iter))) {
+   case BSON_TYPE_UTF8:
+      str = bson_iter_utf8(iter, &slen);
+      cut_append_escaped(buffer, format, str, slen);
+      break;
+   case BSON_TYPE_SYMBOL:
+      str = bson_iter_symbol(iter, &slen);
+      cut_append_escaped(buffer, format, str, slen);
+      break;
+   case BSON_TYPE_INT32:
+      buffer_append(buffer, num,
+                    snprintf(num, sizeof num, "%d", bson_iter_int32(iter)));
+      break;
+   case BSON_TYPE_INT64:
+      buffer_append(buffer, num,
+                    snprintf(num, sizeof num, "%lld",
+                             (long long)bson_iter_int64(iter)));
+      break;
+   case BSON_TYPE_DOUBLE:
+      cut_append_double(buffer, bson_iter_double(iter));
+      break;
+   case BSON_TYPE_BOOL:
+      if (bson_iter_bool(iter)) {
+         buffer_append(buffer, "true", 4);
+      } else {
+         buffer_append(buffer, "false", 5);
+      }
+      break;
+   case BSON_TYPE_DATE_TIME:
+      cut_append_date(buffer, bson_iter_date_time(iter));
+      break;
+   case BSON_TYPE_OID:
+      bson_oid_to_string(bson_iter_oid(iter), oid);
+      buffer_append(buffer, oid, 24);
+      break;
+   case BSON_TYPE_NULL:
+   case BSON_TYPE_UNDEFINED:
+      break;
+   default:
+      data = cut_value(iter, &len);
+      buffer_clear(scratch);
+      if (!json_append_value(scratch, type, data, len)) {
+         cut_append_escaped(buffer, format, scratch->data, scratch->len);
+      }
+      break;
+   }
+}
+
+
+static int
+cut_extent_text (cut_t       *cut,
+                 extent_t    *extent,
+                 buffer_t    *buffer,
+                 bson_iter_t *cells,
+                 int         *found)
+{
+   const char sep = (cut->format == CUT_CSV) ? ',' : '\t';
+   const bson_t *b;
+   bson_iter_t iter;
+   buffer_t scratch;
+   record_t record;
+   int i;
+
+   if (!!extent_records(extent, &record)) {
+      return 0;
+   }
+
+   buffer_init(&scratch);
+
+   do {
+      if (!(b = record_bson(&record)) || !bson_iter_init(&iter, b)) {
+         continue;
+      }
+
+      memset(found, 0, cut->ncolumns * sizeof *found);
+      cut_walk(&cut->root, &iter, cells, found);
+
+      for (i = 0; i < cut->ncolumns; i++) {
+         if (i) {
+            buffer_append(buffer, &sep, 1);
+         }
+         if (found[i]) {
+            cut_append_text(buffer, &scratch, cut->format, &cells[i]);
+         }
+      }
+      buffer_append(buffer, "\n", 1);
+   } while (!record_next(&record));
+
+   buffer_destroy(&scratch);
+
+   return 0;
+}
+
+
+static int
+cut_extent_bin (cut_t       *cut,
+                extent_t    *extent,
+                buffer_t    *buffer,
+                bson_iter_t *cells,
+                int         *found)
+{
+   const bson_uint8_t *data;
+   bson_uint32_t nrows = 0;
+   bson_uint32_t u32;
+   buffer_t *columns;
+   const bson_t *b;
+   bson_iter_t iter;
+   record_t record;
+   bson_uint8_t type;
+   size_t len;
+   int i;
+
+   columns = bson_malloc0(cut->ncolumns * sizeof *columns);
+
+   if (!extent_records(extent, &record)) {
+      do {
+         if (!(b = record_bson(&record)) || !bson_iter_init(&iter, b)) {
+            continue;
+         }
+
+         memset(found, 0, cut->ncolumns * sizeof *found);
+         cut_walk(&cut->root, &iter, cells, found);
+
+         for (i = 0; i < cut->ncolumns; i++) {
+            type = found[i] ? bson_iter_type(&cells[i]) : BSON_TYPE_EOD;
+            buffer_append(&columns[i], &type, 1);
+            if (found[i]) {
+               data = cut_value(&cells[i], &len);
+               buffer_append(&columns[i], data, len);
+            }
+         }
+
+         nrows++;
+      } while (!record_next(&record));
+   }
+
+   if (nrows) {
+      u32 = BSON_UINT32_TO_LE(nrows);
+      buffer_append(buffer, &u32, sizeof u32);
+      for (i = 0; i < cut->ncolumns; i++) {
+         u32 = BSON_UINT32_TO_LE(columns[i].len);
+         buffer_append(buffer, &u32, sizeof u32);
+         buffer_append(buffer, columns[i].data, columns[i].len);
+      }
+   }
+
+   for (i = 0; i < cut->ncolumns; i++) {
+      buffer_destroy(&columns[i]);
+   }
+   bson_free(columns);
+
+   return 0;
+}
+
+
+static int
+cut_extent (void     *data,
+            int       index,
+            buffer_t *buffer)
+{
+   cut_t *cut = data;
+   bson_iter_t *cells;
+   extent_t extent;
+   int *found;
+   int ret;
+
+   if (!!extent_init(&extent, cut->db, &cut->locs[index])) {
+      return -1;
+   }
+
+   extent_advise(&extent, EXTENT_ADVISE_WILLNEED);
+
+   cells = bson_malloc0(cut->ncolumns * sizeof *cells);
+   found = bson_malloc0(cut->ncolumns * sizeof *found);
+
+   if (cut->format == CUT_BIN) {
+      ret = cut_extent_bin(cut, &extent, buffer, cells, found);
+   } else {
+      ret = cut_extent_text(cut, &extent, buffer, cells, found);
+   }
+
+   bson_free(cells);
+   bson_free(found);
+
+   extent_advise(&extent, EXTENT_ADVISE_DONE);
+   extent_destroy(&extent);
+
+   return ret;
+}
+
+
+static int
+cut_emit (void     *data,
+          int       index,
+          buffer_t *buffer)
+{
+   cut_t *cut = data;
+
+   return output_write(&cut->output, buffer->data, buffer->len);
+}
+
+
+static int
+cut_header (cut_t *cut,
+            int    header)
+{
+   bson_uint32_t u32;
+   buffer_t buffer;
+   int ret;
+   int i;
+
+   buffer_init(&buffer);
+
+   if (cut->format == CUT_BIN) {
+      buffer_append(&buffer, CUT_MAGIC, strlen(CUT_MAGIC));
+      u32 = BSON_UINT32_TO_LE(cut->ncolumns);
+      buffer_append(&buffer, &u32, sizeof u32);
+      for (i = 0; i < cut->ncolumns; i++) {
+         u32 = BSON_UINT32_TO_LE(strlen(cut->columns[i]));
+         buffer_append(&buffer, &u32, sizeof u32);
+         buffer_append(&buffer, cut->columns[i], strlen(cut->columns[i]));
+      }
+   } else if (header) {
+      for (i = 0; i < cut->ncolumns; i++) {
+         if (i) {
+            buffer_append(&buffer, (cut->format == CUT_CSV) ? "," : "\t", 1);
+         }
+         cut_append_escaped(&buffer, cut->format, cut->columns[i],
+                            strlen(cut->columns[i]));
+      }
+      buffer_append(&buffer, "\n", 1);
+   }
+
+   ret = output_write(&cut->output, buffer.data, buffer.len);
+   buffer_destroy(&buffer);
+
+   return ret;
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+   const char *colname;
+   const char *dbname;
+   cut_t cut = { 0 };
+   char dotname[128];
+   int header = FALSE;
+   int physical = FALSE;
+   int maxmaps = 0;
+   int jobs = 1;
+   int opt;
+   int i;
+   db_t db;
+   ns_t ns;
+
+   cut.format = CUT_TSV;
+
+   while (-1 != (opt = getopt(argc, argv, "f:Ho:j:m:"))) {
+      switch (opt) {
+      case 'f':
+         if (!strcmp(optarg, "tsv")) {
+            cut.format = CUT_TSV;
+         } else if (!strcmp(optarg, "csv")) {
+            cut.format = CUT_CSV;
+         } else if (!strcmp(optarg, "bin")) {
+            cut.format = CUT_BIN;
+         } else {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'H':
+         header = TRUE;
+         break;
+      case 'o':
+         if (!strcmp(optarg, "natural")) {
+            physical = FALSE;
+         } else if (!strcmp(optarg, "physical")) {
+            physical = TRUE;
+         } else {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'j':
+         if ((jobs = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'm':
+         if ((maxmaps = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      default:
+         usage();
+         return ARGC_FAILURE;
+      }
+   }
+
+   if ((argc - optind) < 4) {
+      usage();
+      return ARGC_FAILURE;
+   }
+
+   dbname = argv[optind + 1];
+   colname = argv[optind + 2];
+
+   cut.columns = &argv[optind + 3];
+   cut.ncolumns = argc - optind - 3;
+
+   for (i = 0; i < cut.ncolumns; i++) {
+      if (!!cut_add_field(&cut.root, cut.columns[i], i)) {
+         fprintf(stderr, "Invalid or duplicate field \"%s\"\n",
+                 cut.columns[i]);
+         return ARGC_FAILURE;
+      }
+   }
+
+   errno = 0;
+   if (!!db_init(&db, argv[optind], dbname)) {
+      perror("Failed to load database");
+      return DB_FAILURE;
+   }
+
+   db_set_max_maps(&db, maxmaps);
+
+   snprintf(dotname, sizeof dotname, "%s.%s", dbname, colname);
+
+   errno = 0;
+   if (!!db_namespace_lookup(&db, dotname, &ns)) {
+      perror("Failed to locate namespace");
+      return NS_FAILURE;
+   }
+
+   if (!!ns_extent_locs(&ns, &cut.locs, &cut.nlocs)) {
+      perror("Failed to load extent");
+      return EXTENT_FAILURE;
+   }
+
+   if (physical) {
+      file_loc_sort(cut.locs, cut.nlocs);
+   }
+
+   cut.db = &db;
+   output_init(&cut.output, STDOUT_FILENO, 0);
+
+   if (!!cut_header(&cut, header) ||
+       !!pool_run(jobs, cut.nlocs, cut_extent, cut_emit, &cut)) {
+      perror("Failed to write output");
+      return WRITE_FAILURE;
+   }
+
+   cut_field_destroy(&cut.root);
+   bson_free(cut.locs);
+   db_destroy(&db);
+
+   return 0;
+}
@@ -17,66 +17,1696 @@
  */
 
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "mdb.h"
+#include "mdb-compress.h"
+#include "mdb-filter.h"
+#include "mdb-json.h"
+#include "mdb-output.h"
+#include "mdb-pool.h"
+#include "mdb-sidecar.h"
 
 
 #define ARGC_FAILURE   1
 #define DB_FAILURE     2
 #define NS_FAILURE     3
 #define EXTENT_FAILURE 4
+#define WRITE_FAILURE  5
+#define RESUME_FAILURE 6
+
+
+#define CHECKPOINT_MAGIC    "mdbdump-checkpoint 1"
+#define CHECKPOINT_INTERVAL 10
+
+
+#define SLICE_SIZE (4 * 1024 * 1024)
+#define MAX_OUTS   64
+
+
+/*
+ * Each task dumps one extent of one database. Without --out every task
+ * writes to stdout; with it, each collection has its own output file.
+ *
+ * When a sidecar lists the records of the extent, the task covers only
+ * the records "first" to "first + count" of the sidecar instead, and
+ * large extents are split into several such slices. Otherwise "first" is
+ * -1 and the task follows the record chain of the whole extent.
+ */
+typedef struct
+{
+   int           db;
+   const char   *ns;
+   file_loc_t    loc;
+   int           out;
+   int           seq;
+   bson_int64_t  first;
+   bson_int64_t  count;
+   int           slice;
+   int           nslices;
+} dump_task_t;
+
+
+typedef struct
+{
+   char         *path;
+   int           fd;
+   int           first;
+   int           last;
+   int           active;
+   int           used;
+   bson_int64_t  written;
+   bson_int64_t  resume;
+   seek_table_t  frames;
+   output_t      output;
+} dump_out_t;
+
+
+typedef struct
+{
+   char *dir;
+   char *name;
+} dump_dbname_t;
+
+
+/*
+ * A namespace whose record chains are followed, as tasks "first" to
+ * "first + count" in natural order, so that they can be recorded in the
+ * sidecar once the dump is complete.
+ */
+typedef struct
+{
+   int         db;
+   const char *ns;
+   int         first;
+   int         count;
+} dump_scan_t;
+
+
+typedef struct
+{
+   record_batch_t batch;
+   bson_uint64_t  pos;
+   bson_uint64_t  end;
+} dump_cursor_t;
+
+
+typedef struct
+{
+   db_t        **dbs;
+   int           ndbs;
+   dump_task_t  *tasks;
+   int           ntasks;
+   dump_out_t   *outs;
+   int           nouts;
+   int           nopen;
+   int           maxopen;
+   int           jobs;
+   int           depth;
+   int           maxmaps;
+   db_backend_t  backend;
+   int           carve;
+   const char   *sidecar;
+   sidecar_t    *sidecars;
+   dump_scan_t  *scanned;
+   int           nscanned;
+   buffer_t     *records;
+   int           bson;
+   filter_t     *filter;
+   extent_t     *extents;
+   compress_t   *compress;
+   seek_table_t *tables;
+   seek_table_t  frames;
+   output_t      output;
+   bson_int64_t  written;
+   const char   *checkpoint;
+   int           interval;
+   time_t        checkpointed;
+   int           start;
+} dump_t;
+
+
+static void
+usage (void)
+{
+   fprintf(stderr, "usage: mdbdump [--bson] [--filter QUERY] "
+                   "[--order natural|physical] [-j JOBS] [-m MAXMAPS] "
+                   "[-i mmap|pread] [-d DEPTH] [--compress zstd|lz4[:LEVEL]] "
+                   "[--carve] [--sidecar DIR] "
+                   "[--checkpoint FILE "
+                   "[--checkpoint-interval SECONDS] [--resume]] "
+                   "DBPATH DBNAME [COLNAME]\n"
+                   "       mdbdump --out DIR [OPTIONS] DBPATH "
+                   "[DBNAME [COLNAME]]\n");
+}
+
+
+static double
+dump_now (void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+
+/*
+ * With --carve the .ns file is not read at all, and the namespaces are
+ * rebuilt from the extent headers in the data files instead.
+ */
+static int
+dump_open_db (dump_t     *dump,
+              const char *dbpath,
+              const char *name)
+{
+   carve_stats_t stats;
+   double start;
+   db_t *db;
+
+   db = bson_malloc0(sizeof *db);
+
+   if (dump->carve) {
+      start = dump_now();
+      if (!!db_init_carved(db, dbpath, name, dump->jobs, &stats)) {
+         bson_free(db);
+         return -1;
+      }
+      fprintf(stderr, "Carved %s: %llu extents of %d namespaces in %llu "
+                      "chain segments from %.1f MB in %.2f seconds "
+                      "(%llu matches, %llu overlapping).\n",
+              name, (unsigned long long)stats.extents, stats.namespaces,
+              (unsigned long long)stats.segments,
+              stats.bytes / (1024.0 * 1024.0), dump_now() - start,
+              (unsigned long long)stats.candidates,
+              (unsigned long long)stats.overlapping);
+   } else if (!!db_init(db, dbpath, name)) {
+      bson_free(db);
+      return -1;
+   }
+
+   db_set_max_maps(db, dump->maxmaps);
+
+   if (!!db_set_backend(db, dump->backend, dump->depth)) {
+      db_destroy(db);
+      bson_free(db);
+      return -1;
+   }
+
+   dump->dbs = bson_realloc(dump->dbs, (dump->ndbs + 1) * sizeof *dump->dbs);
+   dump->dbs[dump->ndbs] = db;
+
+   return dump->ndbs++;
+}
+
+
+/*
+ * The sidecar of a database is DIR/DBNAME.sidecar. One that is missing,
+ * damaged or out of date is simply rebuilt by this run.
+ */
+static void
+dump_open_sidecar (dump_t *dump,
+                   int     db)
+{
+   char *path;
+
+   dump->sidecars = bson_realloc(dump->sidecars,
+                                 dump->ndbs * sizeof *dump->sidecars);
+   memset(&dump->sidecars[db], 0, sizeof *dump->sidecars);
+
+   if (!dump->sidecar) {
+      return;
+   }
+
+   path = bson_strdup_printf("%s/%s.sidecar", dump->sidecar,
+                             dump->dbs[db]->name);
+
+   if (!!sidecar_open(&dump->sidecars[db], path, dump->dbs[db]) &&
+       (errno != ENOENT)) {
+      fprintf(stderr, "Ignoring sidecar %s: %s\n", path, strerror(errno));
+   }
+
+   bson_free(path);
+}
+
+
+/*
+ * Once every chain has been followed, the records that were found are
+ * written to the sidecar of their database, together with whatever the
+ * old sidecar had for the namespaces that were not dumped this time. A
+ * sidecar that cannot be written only costs the next run its speed, so
+ * it is not an error.
+ */
+static void
+dump_write_sidecars (dump_t            *dump,
+                     sidecar_builder_t *builders)
+{
+   const dump_task_t *task;
+   const dump_scan_t *scan;
+   const buffer_t *records;
+   int *order;
+   char *path;
+   int found;
+   int db;
+   int i;
+   int j;
+
+   order = bson_malloc(dump->ntasks * sizeof *order);
+   for (i = 0; i < dump->ntasks; i++) {
+      order[dump->tasks[i].seq] = i;
+   }
+
+   for (db = 0; db < dump->ndbs; db++) {
+      found = FALSE;
+
+      for (i = 0; i < dump->nscanned; i++) {
+         scan = &dump->scanned[i];
+         if (scan->db != db) {
+            continue;
+         }
+         found = TRUE;
+         sidecar_builder_ns(&builders[db], scan->ns);
+         for (j = scan->first; j < (scan->first + scan->count); j++) {
+            task = &dump->tasks[order[j]];
+            records = &dump->records[order[j]];
+            sidecar_builder_extent(&builders[db], &task->loc,
+                                   (const sidecar_record_t *)records->data,
+                                   records->len / sizeof(sidecar_record_t));
+         }
+      }
+
+      if (!found) {
+         continue;
+      }
+
+      if (dump->sidecars[db].map) {
+         sidecar_builder_merge(&builders[db], &dump->sidecars[db]);
+      }
+
+      path = bson_strdup_printf("%s/%s.sidecar", dump->sidecar,
+                                dump->dbs[db]->name);
+      if (!!sidecar_builder_write(&builders[db], path, dump->dbs[db])) {
+         fprintf(stderr, "Failed to write sidecar %s: %s\n", path,
+                 strerror(errno));
+      }
+      bson_free(path);
+   }
+
+   bson_free(order);
+}
+
+
+static dump_task_t *
+dump_add_task (dump_t           *dump,
+               int               db,
+               ns_t             *ns,
+               const file_loc_t *loc,
+               int               out)
+{
+   dump_task_t *task;
+
+   dump->tasks = bson_realloc(dump->tasks,
+                              (dump->ntasks + 1) * sizeof *dump->tasks);
+   task = &dump->tasks[dump->ntasks];
+   task->db = db;
+   task->ns = ns_name(ns);
+   task->loc = *loc;
+   task->out = out;
+   task->seq = dump->ntasks++;
+   task->first = -1;
+   task->count = 0;
+   task->slice = 0;
+   task->nslices = 1;
+
+   return task;
+}
+
+
+/*
+ * Cut the records of a sidecar extent into slices of about SLICE_SIZE,
+ * so that one large extent does not hold up the other workers. The
+ * extent buffers of the pread backend are per task, so there each
+ * extent stays in one piece.
+ */
+static void
+dump_add_slices (dump_t                 *dump,
+                 int                     db,
+                 ns_t                   *ns,
+                 const sidecar_extent_t *extent,
+                 int                     out)
+{
+   const sidecar_t *sidecar = &dump->sidecars[db];
+   dump_task_t *task;
+   bson_uint64_t first = extent->first;
+   bson_uint64_t end = extent->first + extent->count;
+   bson_uint64_t size;
+   bson_uint64_t i;
+   int start = dump->ntasks;
+   int j;
+
+   do {
+      for (i = first, size = 0;
+           (i < end) &&
+           ((size < SLICE_SIZE) || (dump->backend == DB_BACKEND_PREAD));
+           i++) {
+         size += sidecar->records[i].len;
+      }
+      task = dump_add_task(dump, db, ns, &extent->loc, out);
+      task->first = first;
+      task->count = i - first;
+      first = i;
+   } while (first < end);
+
+   for (j = start; j < dump->ntasks; j++) {
+      dump->tasks[j].slice = j - start;
+      dump->tasks[j].nslices = dump->ntasks - start;
+   }
+}
+
+
+/*
+ * Namespaces listed in the sidecar are queued from there without
+ * touching the extents at all. The others are queued by following their
+ * extent chain, and are recorded for the next sidecar.
+ */
+static int
+dump_add_ns (dump_t *dump,
+             int     db,
+             ns_t   *ns,
+             int     out)
+{
+   const sidecar_ns_t *sns = NULL;
+   dump_scan_t *scan;
+   file_loc_t *locs;
+   bson_uint64_t j;
+   int nlocs;
+   int i;
+
+   if (dump->sidecars && dump->sidecars[db].map) {
+      sns = sidecar_lookup(&dump->sidecars[db], ns_name(ns));
+   }
+
+   if (sns) {
+      for (j = 0; j < sns->count; j++) {
+         dump_add_slices(dump, db, ns,
+                         &dump->sidecars[db].extents[sns->first + j], out);
+      }
+      return 0;
+   }
+
+   if (!!ns_extent_locs(ns, &locs, &nlocs)) {
+      return -1;
+   }
+
+   if (dump->sidecar) {
+      dump->scanned = bson_realloc(dump->scanned, (dump->nscanned + 1) *
+                                   sizeof *dump->scanned);
+      scan = &dump->scanned[dump->nscanned++];
+      scan->db = db;
+      scan->ns = ns_name(ns);
+      scan->first = dump->ntasks;
+      scan->count = nlocs;
+   }
+
+   for (i = 0; i < nlocs; i++) {
+      dump_add_task(dump, db, ns, &locs[i], out);
+   }
+
+   bson_free(locs);
+
+   return 0;
+}
+
+
+/*
+ * Index namespaces ("db.coll.$_id_", "db.$freelist") hold btree buckets
+ * rather than documents, and system.indexes and system.namespaces are
+ * the catalog rather than data.
+ */
+static int
+dump_ns_skip (const char *name)
+{
+   const char *coll;
+
+   if (strchr(name, '$') || !(coll = strchr(name, '.'))) {
+      return TRUE;
+   }
+
+   coll++;
+
+   return (!strcmp(coll, "system.indexes") ||
+           !strcmp(coll, "system.namespaces"));
+}
+
+
+static int
+dump_mkdir (const char *path)
+{
+   if (!!mkdir(path, 0755) && (errno != EEXIST)) {
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ * The seek table goes at the very end of a compressed output, after the
+ * checkpoint that covers everything before it.
+ */
+static int
+dump_write_seek (output_t           *output,
+                 const seek_table_t *seek)
+{
+   buffer_t buffer;
+   int ret;
+
+   buffer_init(&buffer);
+   seek_table_encode(seek, &buffer);
+   ret = output_write(output, buffer.data, buffer.len);
+   buffer_destroy(&buffer);
+
+   return ret;
+}
+
+
+/*
+ * Register the output file DIR/DBNAME/COLL.json (or .bson) for the
+ * namespace @ns of database @db, and queue its extents. Collections
+ * without any extents get an empty file right away, which when
+ * compressed holds just an empty seek table, so that it is still a valid
+ * stream.
+ */
+static int
+dump_add_out (dump_t     *dump,
+              const char *outdir,
+              int         db,
+              ns_t       *ns)
+{
+   seek_table_t empty;
+   output_t output;
+   dump_out_t *out;
+   const char *coll;
+   char *name;
+   char *p;
+   int ret = 0;
+   int fd;
+
+   coll = strchr(ns_name(ns), '.') + 1;
+   name = bson_strdup(coll);
+   for (p = name; *p; p++) {
+      if (*p == '/') {
+         *p = '_';
+      }
+   }
+
+   dump->outs = bson_realloc(dump->outs,
+                             (dump->nouts + 1) * sizeof *dump->outs);
+   out = &dump->outs[dump->nouts];
+   memset(out, 0, sizeof *out);
+   out->fd = -1;
+   out->first = -1;
+   out->last = -1;
+   out->resume = -1;
+   out->path = bson_strdup_printf("%s/%s/%s.%s%s", outdir,
+                                  dump->dbs[db]->name, name,
+                                  dump->bson ? "bson" : "json",
+                                  !dump->compress ? "" :
+                                  (dump->compress->codec == COMPRESS_ZSTD) ?
+                                  ".zst" : ".lz4");
+   bson_free(name);
+
+   if (!!dump_add_ns(dump, db, ns, dump->nouts++)) {
+      return -1;
+   }
+
+   if ((dump->ntasks == 0) ||
+       (dump->tasks[dump->ntasks - 1].out != (dump->nouts - 1))) {
+      if (-1 == (fd = open(out->path, O_WRONLY | O_CREAT | O_TRUNC, 0644))) {
+         return -1;
+      }
+      if (dump->compress) {
+         seek_table_init(&empty);
+         output_init(&output, fd, 0);
+         ret = dump_write_seek(&output, &empty);
+         seek_table_destroy(&empty);
+      }
+      if (!!close(fd)) {
+         ret = -1;
+      }
+   }
+
+   return ret;
+}
+
+
+static int
+dump_dbname_compare (const void *a,
+                     const void *b)
+{
+   return strcmp(((const dump_dbname_t *)a)->name,
+                 ((const dump_dbname_t *)b)->name);
+}
+
+
+/*
+ * Find every database in @dbpath, either as DBNAME.ns in @dbpath itself
+ * or as DBNAME/DBNAME.ns with --directoryperdb. When carving, databases
+ * are found by their first data file DBNAME.0 instead.
+ */
+static int
+dump_find_dbs (const char     *dbpath,
+               int             carve,
+               dump_dbname_t **names,
+               int            *nnames)
+{
+   const char *suffix = carve ? ".0" : ".ns";
+   struct dirent *ent;
+   struct stat st;
+   size_t slen;
+   size_t len;
+   char *path;
+   DIR *dir;
+   int n = 0;
+
+   if (!(dir = opendir(dbpath))) {
+      return -1;
+   }
+
+   *names = NULL;
+   slen = strlen(suffix);
+
+   while ((ent = readdir(dir))) {
+      len = strlen(ent->d_name);
+
+      if ((len > slen) && !strcmp(ent->d_name + len - slen, suffix)) {
+         *names = bson_realloc(*names, (n + 1) * sizeof **names);
+         (*names)[n].dir = bson_strdup(dbpath);
+         (*names)[n].name = bson_strndup(ent->d_name, len - slen);
+         n++;
+         continue;
+      }
+
+      if (ent->d_name[0] == '.') {
+         continue;
+      }
+
+      path = bson_strdup_printf("%s/%s/%s%s", dbpath, ent->d_name,
+                                ent->d_name, suffix);
+      if (!stat(path, &st) && S_ISREG(st.st_mode)) {
+         *names = bson_realloc(*names, (n + 1) * sizeof **names);
+         (*names)[n].dir = bson_strdup_printf("%s/%s", dbpath, ent->d_name);
+         (*names)[n].name = bson_strdup(ent->d_name);
+         n++;
+      }
+      bson_free(path);
+   }
+
+   closedir(dir);
+
+   if (n) {
+      qsort(*names, n, sizeof **names, dump_dbname_compare);
+   }
+
+   *nnames = n;
+
+   return 0;
+}
+
+
+static int
+dump_task_compare (const void *a,
+                   const void *b)
+{
+   const dump_task_t *x = a;
+   const dump_task_t *y = b;
+
+   if (x->db != y->db) {
+      return (x->db < y->db) ? -1 : 1;
+   }
+
+   if (x->loc.fileno != y->loc.fileno) {
+      return (x->loc.fileno < y->loc.fileno) ? -1 : 1;
+   }
+
+   if (x->loc.offset != y->loc.offset) {
+      return (x->loc.offset < y->loc.offset) ? -1 : 1;
+   }
+
+   return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+
+static int
+dump_sync (int fd)
+{
+   /*
+    * Pipes and the like cannot be synced, and there is nothing to lose
+    * there anyway.
+    */
+   if (!!fdatasync(fd) && (errno != EINVAL) && (errno != EROFS)) {
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ * A resumed compressed output is missing the seek table entries for the
+ * frames written before the restart, so they are read back from the
+ * output itself.
+ */
+static int
+dump_rescan (int           fd,
+             bson_int64_t  len,
+             seek_table_t *seek)
+{
+   void *map;
+   int ret;
+
+   if (!len) {
+      return 0;
+   }
+
+   map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      return -1;
+   }
+
+   ret = compress_scan(map, len, seek);
+   munmap(map, len);
+
+   return ret;
+}
+
+
+/*
+ * A checkpoint says that every task before "task" has been written out,
+ * how many bytes that came to in each output that is still active, and
+ * which extent comes next, so that a resumed dump can tell whether its
+ * task list still matches. The outputs are synced
+ * before the checkpoint is written to a temporary file and renamed over
+ * the previous one, so a crash leaves either the old or the new one, and
+ * never one that claims more than is on disk.
+ */
+static int
+dump_checkpoint (dump_t *dump,
+                 int     next)
+{
+   const dump_task_t *task = NULL;
+   char *tmp;
+   FILE *fp;
+   int ret = 0;
+   int i;
+
+   if (!dump->outs && !!dump_sync(dump->output.fd)) {
+      return -1;
+   }
+
+   for (i = 0; i < dump->nouts; i++) {
+      if ((dump->outs[i].fd != -1) && !!dump_sync(dump->outs[i].fd)) {
+         return -1;
+      }
+   }
+
+   if (next < dump->ntasks) {
+      task = &dump->tasks[next];
+   }
+
+   tmp = bson_strdup_printf("%s.tmp", dump->checkpoint);
+
+   if (!(fp = fopen(tmp, "w"))) {
+      bson_free(tmp);
+      return -1;
+   }
+
+   fprintf(fp, "%s\n", CHECKPOINT_MAGIC);
+   fprintf(fp, "tasks %d\n", dump->ntasks);
+   fprintf(fp, "task %d\n", next);
+   if (task) {
+      fprintf(fp, "ns %s\n", task->ns);
+      fprintf(fp, "loc %d %d\n", task->loc.fileno, (int)task->loc.offset);
+   }
+   if (!dump->outs) {
+      fprintf(fp, "written %lld\n", (long long)dump->written);
+   }
+   for (i = 0; i < dump->nouts; i++) {
+      if (dump->outs[i].active) {
+         fprintf(fp, "output %lld %s\n", (long long)dump->outs[i].written,
+                 dump->outs[i].path);
+      }
+   }
+
+   if (!!fflush(fp) || !!fsync(fileno(fp))) {
+      ret = -1;
+   }
+
+   if (!!fclose(fp) || ret || !!rename(tmp, dump->checkpoint)) {
+      ret = -1;
+   }
+
+   bson_free(tmp);
+
+   dump->checkpointed = time(NULL);
+
+   return ret;
+}
+
+
+/*
+ * Load the checkpoint left by an earlier run with the same arguments and
+ * pick up after the last task it covers. Without a checkpoint the dump
+ * starts over from the beginning.
+ */
+static int
+dump_resume (dump_t *dump)
+{
+   const dump_task_t *task;
+   bson_int64_t pos = 0;
+   struct stat st;
+   char line[4096];
+   long long written;
+   int ntasks = -1;
+   int file = -1;
+   int offset = -1;
+   int fd = -1;
+   int next = 0;
+   int nlen;
+   char *ns = NULL;
+   FILE *fp;
+   int ret = -1;
+   int i;
+
+   if (!(fp = fopen(dump->checkpoint, "r"))) {
+      if (errno != ENOENT) {
+         return -1;
+      }
+      ntasks = dump->ntasks;
+   } else if (!fgets(line, sizeof line, fp) ||
+              !!strcmp(line, CHECKPOINT_MAGIC "\n")) {
+      errno = EBADF;
+      goto failure;
+   }
+
+   while (fp && fgets(line, sizeof line, fp)) {
+      line[strcspn(line, "\n")] = '\0';
+
+      if (!strncmp(line, "ns ", 3)) {
+         bson_free(ns);
+         ns = bson_strdup(line + 3);
+      } else if (1 == sscanf(line, "written %lld", &written)) {
+         pos = written;
+      } else if (1 == sscanf(line, "output %lld %n", &written, &nlen)) {
+         for (i = 0; i < dump->nouts; i++) {
+            if (!strcmp(dump->outs[i].path, line + nlen)) {
+               dump->outs[i].resume = written;
+               dump->outs[i].written = written;
+               dump->outs[i].active = TRUE;
+               break;
+            }
+         }
+      } else if ((1 != sscanf(line, "tasks %d", &ntasks)) &&
+                 (1 != sscanf(line, "task %d", &next)) &&
+                 (2 != sscanf(line, "loc %d %d", &file, &offset))) {
+         errno = EBADF;
+         goto failure;
+      }
+   }
+
+   /*
+    * The task list is rebuilt from the namespaces on every run, so it
+    * has to come out the same as when the checkpoint was written.
+    */
+   if ((ntasks != dump->ntasks) || (next < 0) || (next > dump->ntasks) ||
+       (pos < 0)) {
+      errno = ESTALE;
+      goto failure;
+   }
+
+   if (fp && (next < dump->ntasks)) {
+      task = &dump->tasks[next];
+      if (!ns || !!strcmp(ns, task->ns) ||
+          (file != task->loc.fileno) || (offset != task->loc.offset)) {
+         errno = ESTALE;
+         goto failure;
+      }
+   }
+
+   dump->start = next;
+
+   /*
+    * Whatever was written after the checkpoint is cut off again, unless
+    * the output is a pipe, which just continues. A compressed output has
+    * to be read back for its seek table, so it cannot be a pipe. A file
+    * shorter than the checkpoint was not the one being written, and is
+    * not padded out to it.
+    */
+   if (!dump->outs && !fstat(dump->output.fd, &st) && S_ISREG(st.st_mode)) {
+      if (st.st_size < pos) {
+         errno = ESTALE;
+         goto failure;
+      }
+      if (!!ftruncate(dump->output.fd, pos) ||
+          (-1 == lseek(dump->output.fd, pos, SEEK_SET))) {
+         goto failure;
+      }
+      if (dump->compress) {
+         snprintf(line, sizeof line, "/proc/self/fd/%d", dump->output.fd);
+         if ((-1 == (fd = open(line, O_RDONLY))) ||
+             !!dump_rescan(fd, pos, &dump->frames)) {
+            goto failure;
+         }
+      }
+   } else if (!dump->outs && dump->compress && pos) {
+      errno = ESPIPE;
+      goto failure;
+   }
+
+   dump->written = pos;
+   ret = 0;
+
+failure:
+   if (fp) {
+      fclose(fp);
+   }
+   if (fd != -1) {
+      close(fd);
+   }
+   bson_free(ns);
+
+   return ret;
+}
+
+
+/*
+ * Records are matched against the filter before anything is encoded, so
+ * documents that are filtered out are only ever read.
+ */
+static int
+dump_record_match (dump_t               *dump,
+                   const record_entry_t *entry)
+{
+   bson_t b;
+
+   if (!dump->filter) {
+      return TRUE;
+   }
+
+   return (bson_init_static(&b, entry->data, entry->len) &&
+           filter_match(dump->filter, &b));
+}
+
+
+/*
+ * A slice from the sidecar starts at its own first record, anything else
+ * at the first record of the extent. A resumed dump starts over with
+ * the task after the last one it finished.
+ */
+static void
+dump_cursor_init (dump_t        *dump,
+                  int            index,
+                  extent_t      *extent,
+                  dump_cursor_t *cursor)
+{
+   const dump_task_t *task = &dump->tasks[index];
+
+   record_batch_init(&cursor->batch);
+
+   if (task->first >= 0) {
+      cursor->pos = task->first;
+      cursor->end = task->first + task->count;
+   }
+}
+
+
+/*
+ * While a sidecar is being built, the location of every record found
+ * along a chain is kept for it, whether or not it matches the filter.
+ */
+static int
+dump_cursor_next (dump_t        *dump,
+                  int            index,
+                  extent_t      *extent,
+                  dump_cursor_t *cursor)
+{
+   const dump_task_t *task = &dump->tasks[index];
+   const record_entry_t *entry;
+   sidecar_record_t rec;
+   int n;
+   int i;
+
+   if (task->first >= 0) {
+      return sidecar_record_batch(&dump->sidecars[task->db], extent,
+                                  &cursor->pos, cursor->end, &cursor->batch);
+   }
+
+   n = extent_record_batch(extent, &cursor->batch, RECORD_BATCH_MAX);
+
+   for (i = 0; dump->records && i < n; i++) {
+      entry = &cursor->batch.records[i];
+      rec.fileno = extent->fileno;
+      rec.offset = (const char *)entry->data - extent->map + extent->base;
+      rec.len = entry->len;
+      buffer_append(&dump->records[index], &rec, sizeof rec);
+   }
+
+   return n;
+}
+
+
+static void
+dump_extent_done (dump_t   *dump,
+                  int       index,
+                  extent_t *extent)
+{
+   const dump_task_t *task = &dump->tasks[index];
+
+   if (task->slice == (task->nslices - 1)) {
+      extent_advise(extent, EXTENT_ADVISE_DONE);
+   }
+
+   extent_destroy(extent);
+}
+
+
+static int
+dump_extent_bson (dump_t   *dump,
+                  int       index,
+                  extent_t *extent,
+                  buffer_t *buffer)
+{
+   const record_entry_t *entry;
+   dump_cursor_t cursor;
+   struct iovec iov;
+   int i;
+
+   /*
+    * The documents are written straight out of the extent, so instead of
+    * copying them the buffer collects an iovec for each one. The extent
+    * is kept until dump_emit() has written them.
+    */
+   dump_cursor_init(dump, index, extent, &cursor);
+   while (dump_cursor_next(dump, index, extent, &cursor) > 0) {
+      for (i = 0; i < cursor.batch.count; i++) {
+         entry = &cursor.batch.records[i];
+         if (!dump_record_match(dump, entry)) {
+            continue;
+         }
+         iov.iov_base = (void *)entry->data;
+         iov.iov_len = entry->len;
+         buffer_append(buffer, &iov, sizeof iov);
+      }
+   }
+
+   dump->extents[index] = *extent;
+
+   return 0;
+}
+
+
+static int
+dump_extent_compress (dump_t   *dump,
+                      int       index,
+                      extent_t *extent,
+                      buffer_t *buffer)
+{
+   const record_entry_t *entry;
+   seek_table_t *table = &dump->tables[index];
+   dump_cursor_t cursor;
+   buffer_t block;
+   int ret = 0;
+   int i;
+
+   /*
+    * Whole documents are collected into blocks of about
+    * COMPRESS_BLOCK_SIZE, and each block becomes a frame of its own, so
+    * every frame can be decoded and parsed without the ones before it.
+    */
+   buffer_init(&block);
+   dump_cursor_init(dump, index, extent, &cursor);
+   while (!ret && (dump_cursor_next(dump, index, extent, &cursor) > 0)) {
+      for (i = 0; !ret && i < cursor.batch.count; i++) {
+         entry = &cursor.batch.records[i];
+         if (!dump_record_match(dump, entry)) {
+            continue;
+         }
+         if (dump->bson) {
+            buffer_append(&block, entry->data, entry->len);
+         } else if (!json_append_bson(&block, entry->data, entry->len)) {
+            buffer_append(&block, "\n", 1);
+         }
+         if (block.len >= COMPRESS_BLOCK_SIZE) {
+            ret = compress_frame(dump->compress, block.data, block.len,
+                                 buffer, table);
+            buffer_clear(&block);
+         }
+      }
+   }
+
+   if (!ret && block.len) {
+      ret = compress_frame(dump->compress, block.data, block.len, buffer,
+                           table);
+   }
+
+   buffer_destroy(&block);
+   dump_extent_done(dump, index, extent);
+
+   return ret;
+}
+
+
+static int
+dump_extent (void     *data,
+             int       index,
+             buffer_t *buffer)
+{
+   const record_entry_t *entry;
+   const dump_task_t *task;
+   const dump_task_t *next;
+   dump_cursor_t cursor;
+   dump_t *dump = data;
+   extent_t extent;
+   int i;
+
+   index += dump->start;
+   task = &dump->tasks[index];
+
+   if (!!extent_init(&extent, dump->dbs[task->db], &task->loc)) {
+      return -1;
+   }
+
+   /*
+    * Each worker is likely to pick up the extent that is "jobs" further
+    * along next, so start reading in the next "depth" extents from there
+    * while this one is processed. The slices of an extent share the
+    * advice given for its first slice.
+    */
+   if (!task->slice) {
+      extent_advise(&extent, EXTENT_ADVISE_WILLNEED);
+   }
+   for (i = 0; i < dump->depth; i++) {
+      if ((index + dump->jobs + i) >= dump->ntasks) {
+         break;
+      }
+      next = &dump->tasks[index + dump->jobs + i];
+      if (next->slice) {
+         continue;
+      }
+      db_prefetch_extent(dump->dbs[next->db], &next->loc);
+   }
+
+   if (dump->compress) {
+      return dump_extent_compress(dump, index, &extent, buffer);
+   }
+
+   if (dump->bson) {
+      return dump_extent_bson(dump, index, &extent, buffer);
+   }
+
+   /*
+    * Documents are encoded straight into the task buffer, which is kept
+    * between tasks, so no memory is allocated per document.
+    */
+   dump_cursor_init(dump, index, &extent, &cursor);
+   while (dump_cursor_next(dump, index, &extent, &cursor) > 0) {
+      for (i = 0; i < cursor.batch.count; i++) {
+         entry = &cursor.batch.records[i];
+         if (dump_record_match(dump, entry) &&
+             !json_append_bson(buffer, entry->data, entry->len)) {
+            buffer_append(buffer, "\n", 1);
+         }
+      }
+   }
+
+   dump_extent_done(dump, index, &extent);
+
+   return 0;
+}
+
+
+static int
+dump_out_close (dump_t     *dump,
+                dump_out_t *out)
+{
+   int ret = 0;
+
+   if (dump->checkpoint) {
+      ret = dump_sync(out->fd);
+   }
+
+   if (!!close(out->fd)) {
+      ret = -1;
+   }
+
+   out->fd = -1;
+   dump->nopen--;
+
+   return ret;
+}
+
+
+/*
+ * Output files are opened when their first extent is written and closed
+ * after their last. With --order physical the extents of a collection
+ * are spread over the whole dump, so at most MAX_OUTS files are kept
+ * open, or half the file descriptor limit if that is lower, and the one that was written least recently is closed to make
+ * room and reopened for appending when its next extent comes along. An
+ * output between its first and last extent is active, open or not.
+ *
+ * A resumed dump reopens the files that were active at the checkpoint
+ * and cuts them back to where it left off, failing with ESTALE if one is
+ * already shorter than that.
+ */
+static int
+dump_out_open (dump_t     *dump,
+               dump_out_t *out,
+               int         index)
+{
+   dump_out_t *lru = NULL;
+   struct stat st;
+   int i;
+
+   if (dump->nopen >= dump->maxopen) {
+      for (i = 0; i < dump->nouts; i++) {
+         if ((dump->outs[i].fd != -1) &&
+             (!lru || (dump->outs[i].used < lru->used))) {
+            lru = &dump->outs[i];
+         }
+      }
+      if (lru && !!dump_out_close(dump, lru)) {
+         return -1;
+      }
+   }
+
+   if (out->resume >= 0) {
+      out->fd = open(out->path, O_RDWR | O_CREAT, 0644);
+      if ((out->fd != -1) && !fstat(out->fd, &st) &&
+          (st.st_size < out->resume)) {
+         close(out->fd);
+         out->fd = -1;
+         errno = ESTALE;
+         return -1;
+      }
+      if ((out->fd != -1) &&
+          (!!ftruncate(out->fd, out->resume) ||
+           (-1 == lseek(out->fd, out->resume, SEEK_SET)) ||
+           (dump->compress &&
+            !!dump_rescan(out->fd, out->resume, &out->frames)))) {
+         close(out->fd);
+         out->fd = -1;
+      }
+      out->written = out->resume;
+      out->resume = -1;
+   } else if (out->active) {
+      out->fd = open(out->path, O_WRONLY | O_APPEND);
+   } else if (index != out->first) {
+      errno = ESTALE;
+      return -1;
+   } else {
+      out->fd = open(out->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      out->active = TRUE;
+   }
+
+   if (out->fd == -1) {
+      return -1;
+   }
+
+   dump->nopen++;
+   output_init(&out->output, out->fd, 0);
+
+   return 0;
+}
+
+
+static int
+dump_emit (void     *data,
+           int       index,
+           buffer_t *buffer)
+{
+   dump_t *dump = data;
+   output_t *output = &dump->output;
+   bson_int64_t *written = &dump->written;
+   dump_out_t *out = NULL;
+   struct iovec *iov;
+   extent_t *extent;
+   size_t len = 0;
+   int ret;
+   int i;
+
+   index += dump->start;
+
+   if (dump->tasks[index].out != -1) {
+      out = &dump->outs[dump->tasks[index].out];
+      if ((out->fd == -1) && !!dump_out_open(dump, out, index)) {
+         return -1;
+      }
+      out->used = index;
+      output = &out->output;
+      written = &out->written;
+   }
+
+   if (!dump->bson || dump->compress) {
+      ret = output_write(output, buffer->data, buffer->len);
+      len = buffer->len;
+   } else {
+      extent = &dump->extents[index];
+      iov = (struct iovec *)buffer->data;
+      for (i = 0; i < (buffer->len / sizeof *iov); i++) {
+         len += iov[i].iov_len;
+      }
+      ret = output_writev(output, iov, buffer->len / sizeof *iov);
+      dump_extent_done(dump, index, extent);
+   }
+
+   *written += len;
+
+   if (dump->compress) {
+      seek_table_append(out ? &out->frames : &dump->frames,
+                        &dump->tables[index]);
+      seek_table_destroy(&dump->tables[index]);
+   }
+
+   /*
+    * A closed file is no longer part of the checkpoint, so it must be on
+    * disk before the next one claims it is complete.
+    */
+   if (out && (index == out->last)) {
+      if (dump->compress && !ret) {
+         ret = dump_write_seek(output, &out->frames);
+         seek_table_destroy(&out->frames);
+      }
+      if (!!dump_out_close(dump, out) && !ret) {
+         ret = -1;
+      }
+      out->active = FALSE;
+   }
+
+   if (!ret && dump->checkpoint &&
+       ((time(NULL) - dump->checkpointed) >= dump->interval)) {
+      ret = dump_checkpoint(dump, index + 1);
+   }
+
+   return ret;
+}
 
 
 int
 main (int   argc,
       char *argv[])
 {
-   const bson_t *b;
-   extent_t extent;
-   record_t record;
-   char *str;
-   db_t db;
+   dump_dbname_t *names = NULL;
+   sidecar_builder_t *builders = NULL;
+   const char *outdir = NULL;
+   const char *colname;
+   const char *dbname;
+   dump_t dump = { 0 };
+   struct rlimit rl;
+   char dotname[128];
+   char *path;
+   int nnames = 0;
+   int depth = 0;
+   int jobs = 1;
+   filter_t filter;
+   compress_t compress;
+   const char *codec = NULL;
+   const char *query = NULL;
+   int bson = FALSE;
+   int physical = FALSE;
+   int resume = FALSE;
+   int nargs;
+   int opt;
+   int db;
+   int i;
    ns_t ns;
 
-   if (argc != 3) {
-      fprintf(stderr, "usage: mdbdump DBPATH DBNAME\n");
+   static const struct option options[] = {
+      { "bson", no_argument, NULL, 'b' },
+      { "filter", required_argument, NULL, 'f' },
+      { "order", required_argument, NULL, 'o' },
+      { "out", required_argument, NULL, 'O' },
+      { "checkpoint", required_argument, NULL, 'c' },
+      { "checkpoint-interval", required_argument, NULL, 'C' },
+      { "resume", no_argument, NULL, 'r' },
+      { "compress", required_argument, NULL, 'z' },
+      { "carve", no_argument, NULL, 'a' },
+      { "sidecar", required_argument, NULL, 's' },
+      { NULL },
+   };
+
+   dump.backend = DB_BACKEND_MMAP;
+   dump.interval = CHECKPOINT_INTERVAL;
+
+   while (-1 != (opt = getopt_long(argc, argv, "bf:o:O:c:C:rz:as:j:m:i:d:",
+                                   options, NULL))) {
+      switch (opt) {
+      case 'b':
+         bson = TRUE;
+         break;
+      case 'f':
+         query = optarg;
+         break;
+      case 'o':
+         if (!strcmp(optarg, "natural")) {
+            physical = FALSE;
+         } else if (!strcmp(optarg, "physical")) {
+            physical = TRUE;
+         } else {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'O':
+         outdir = optarg;
+         break;
+      case 'c':
+         dump.checkpoint = optarg;
+         break;
+      case 'C':
+         if ((dump.interval = atoi(optarg)) < 0) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'r':
+         resume = TRUE;
+         break;
+      case 'z':
+         codec = optarg;
+         break;
+      case 'a':
+         dump.carve = TRUE;
+         break;
+      case 's':
+         dump.sidecar = optarg;
+         break;
+      case 'j':
+         if ((jobs = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'm':
+         if ((dump.maxmaps = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'i':
+         if (!strcmp(optarg, "mmap")) {
+            dump.backend = DB_BACKEND_MMAP;
+         } else if (!strcmp(optarg, "pread")) {
+            dump.backend = DB_BACKEND_PREAD;
+         } else {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'd':
+         if ((depth = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      default:
+         usage();
+         return ARGC_FAILURE;
+      }
+   }
+
+   nargs = argc - optind;
+
+   if ((nargs > 3) || (nargs < (outdir ? 1 : 2)) ||
+       (resume && !dump.checkpoint)) {
+      usage();
       return ARGC_FAILURE;
    }
 
-   errno = 0;
-   if (!!db_init(&db, argv[1], argv[2])) {
-      perror("Failed to load database");
+   dbname = (nargs > 1) ? argv[optind + 1] : NULL;
+   colname = (nargs > 2) ? argv[optind + 2] : NULL;
+
+   /*
+    * With mmap() the kernel does its own readahead, so only the next
+    * extent needs a hint unless asked otherwise.
+    */
+   if (!depth) {
+      depth = (dump.backend == DB_BACKEND_PREAD) ? 4 : 1;
+   }
+
+   dump.jobs = jobs;
+   dump.depth = depth;
+   dump.bson = bson;
+
+   dump.maxopen = MAX_OUTS;
+   if (!getrlimit(RLIMIT_NOFILE, &rl) && (rl.rlim_cur != RLIM_INFINITY) &&
+       ((rl.rlim_cur / 2) < MAX_OUTS)) {
+      dump.maxopen = (rl.rlim_cur > 2) ? (int)(rl.rlim_cur / 2) : 1;
+   }
+
+   if (query) {
+      errno = 0;
+      if (!!filter_init(&filter, query)) {
+         perror("Failed to parse filter");
+         return ARGC_FAILURE;
+      }
+      dump.filter = &filter;
+   }
+
+   /*
+    * Compressed frames are built in the workers, so the compressor is
+    * spread over the same threads as the encoding.
+    */
+   if (codec) {
+      if (!!compress_init(&compress, codec)) {
+         perror("Failed to set up compression");
+         return ARGC_FAILURE;
+      }
+      dump.compress = &compress;
+   }
+
+   /*
+    * Raw BSON may be spliced into a pipe from the mapping, since the
+    * mapped pages are never written. JSON task buffers and the extent
+    * buffers of the pread backend are reused, so they must be copied by
+    * the kernel.
+    */
+   output_init(&dump.output, STDOUT_FILENO,
+               (bson && !codec && (dump.backend == DB_BACKEND_MMAP)) ?
+               OUTPUT_SPLICE : 0);
+
+   if (dbname) {
+      names = bson_malloc0(sizeof *names);
+      names->dir = bson_strdup(argv[optind]);
+      names->name = bson_strdup(dbname);
+      nnames = 1;
+   } else if (!!dump_find_dbs(argv[optind], dump.carve, &names, &nnames)) {
+      perror("Failed to read DBPATH");
       return DB_FAILURE;
    }
 
-   errno = 0;
-   if (!!db_namespaces(&db, &ns)) {
-      perror("Failed to load namespaces");
-      return NS_FAILURE;
+   if (outdir && !!dump_mkdir(outdir)) {
+      perror("Failed to create output directory");
+      return WRITE_FAILURE;
    }
 
-   do {
-      //fprintf(stdout, "\nNamespace \"%s\"\n\n", ns_name(&ns));
-      if (!!ns_extents(&ns, &extent)) {
-         perror("Failed to load extent");
-         return EXTENT_FAILURE;
+   if (dump.sidecar && !!dump_mkdir(dump.sidecar)) {
+      perror("Failed to create sidecar directory");
+      return WRITE_FAILURE;
+   }
+
+   /*
+    * Collect every extent of every database up front so that they can be
+    * handed out to the workers, which share one global limit of "jobs"
+    * no matter how many databases and collections there are. Output is
+    * written in the order of the extent chains unless physical order was
+    * requested.
+    */
+   for (i = 0; i < nnames; i++) {
+      errno = 0;
+      if (-1 == (db = dump_open_db(&dump, names[i].dir, names[i].name))) {
+         perror("Failed to load database");
+         return DB_FAILURE;
+      }
+
+      dump_open_sidecar(&dump, db);
+
+      if (outdir) {
+         path = bson_strdup_printf("%s/%s", outdir, names[i].name);
+         if (!!dump_mkdir(path)) {
+            perror("Failed to create output directory");
+            return WRITE_FAILURE;
+         }
+         bson_free(path);
+      }
+
+      if (colname) {
+         snprintf(dotname, sizeof dotname, "%s.%s", names[i].name, colname);
+
+         errno = 0;
+         if (!!db_namespace_lookup(dump.dbs[db], dotname, &ns)) {
+            perror("Failed to locate namespace");
+            return NS_FAILURE;
+         }
+
+         if (outdir ? !!dump_add_out(&dump, outdir, db, &ns) :
+                      !!dump_add_ns(&dump, db, &ns, -1)) {
+            perror("Failed to load extent");
+            return EXTENT_FAILURE;
+         }
+         continue;
       }
+
+      errno = 0;
+      if (!!db_namespaces(dump.dbs[db], &ns)) {
+         perror("Failed to load namespaces");
+         return NS_FAILURE;
+      }
+
       do {
-         if (!extent_records(&extent, &record)) {
-            do {
-               b = record_bson(&record);
-               if ((str = bson_as_json(b, NULL))) {
-                  puts(str);
-               }
-               bson_free(str);
-            } while (!record_next(&record));
-         }
-      } while (!extent_next(&extent));
-   } while (ns_next(&ns));
-
-   db_destroy(&db);
+         if (outdir && dump_ns_skip(ns_name(&ns))) {
+            continue;
+         }
+         if (outdir ? !!dump_add_out(&dump, outdir, db, &ns) :
+                      !!dump_add_ns(&dump, db, &ns, -1)) {
+            perror("Failed to load extent");
+            return EXTENT_FAILURE;
+         }
+      } while (!ns_next(&ns));
+   }
+
+   /*
+    * After years of churn the extent chains jump back and forth between
+    * data files, which turns the dump into random I/O. In physical order
+    * each data file is read front to back instead, and the documents of
+    * different collections may be interleaved.
+    */
+   if (physical && dump.ntasks) {
+      qsort(dump.tasks, dump.ntasks, sizeof *dump.tasks, dump_task_compare);
+   }
+
+   for (i = 0; i < dump.ntasks; i++) {
+      if (dump.tasks[i].out != -1) {
+         if (dump.outs[dump.tasks[i].out].first == -1) {
+            dump.outs[dump.tasks[i].out].first = i;
+         }
+         dump.outs[dump.tasks[i].out].last = i;
+      }
+   }
+
+   /*
+    * To resume, run again with the same arguments plus --resume, and
+    * with standard output appending to the earlier output rather than
+    * truncating it.
+    */
+   if (resume && !!dump_resume(&dump)) {
+      perror("Failed to resume from checkpoint");
+      return RESUME_FAILURE;
+   }
+
+   dump.checkpointed = time(NULL);
+
+   /*
+    * A sidecar is only built from a dump that follows every chain from
+    * the start. The data files are keyed before they are read, so that
+    * one that changes in the meantime keeps its sidecar from being
+    * written.
+    */
+   if (dump.sidecar && dump.nscanned && !dump.start) {
+      builders = bson_malloc0(dump.ndbs * sizeof *builders);
+      for (i = 0; i < dump.ndbs; i++) {
+         if (!!sidecar_builder_init(&builders[i], dump.dbs[i])) {
+            perror("Failed to read data files");
+            return DB_FAILURE;
+         }
+      }
+      dump.records = bson_malloc0(dump.ntasks * sizeof *dump.records);
+      for (i = 0; i < dump.ntasks; i++) {
+         buffer_init(&dump.records[i]);
+      }
+   }
+
+   if (codec) {
+      dump.tables = bson_malloc0(dump.ntasks * sizeof *dump.tables);
+   } else if (bson) {
+      dump.extents = bson_malloc0(dump.ntasks * sizeof *dump.extents);
+   }
+
+   if (!!pool_run(jobs, dump.ntasks - dump.start, dump_extent, dump_emit,
+                  &dump)) {
+      perror("Failed to dump extent");
+      return WRITE_FAILURE;
+   }
+
+   if (dump.checkpoint && !!dump_checkpoint(&dump, dump.ntasks)) {
+      perror("Failed to write checkpoint");
+      return WRITE_FAILURE;
+   }
+
+   if (codec && !outdir && !!dump_write_seek(&dump.output, &dump.frames)) {
+      perror("Failed to write seek table");
+      return WRITE_FAILURE;
+   }
+
+   for (i = dump.start; dump.extents && i < dump.ntasks; i++) {
+      extent_destroy(&dump.extents[i]);
+   }
+
+   if (builders) {
+      dump_write_sidecars(&dump, builders);
+      for (i = 0; i < dump.ndbs; i++) {
+         sidecar_builder_destroy(&builders[i]);
+      }
+      for (i = 0; i < dump.ntasks; i++) {
+         buffer_destroy(&dump.records[i]);
+      }
+   }
+
+   if (dump.compress) {
+      compress_destroy(dump.compress);
+      seek_table_destroy(&dump.frames);
+   }
+
+   if (dump.filter) {
+      filter_destroy(dump.filter);
+   }
+
+   for (i = 0; i < dump.nouts; i++) {
+      bson_free(dump.outs[i].path);
+   }
+
+   for (i = 0; i < nnames; i++) {
+      bson_free(names[i].dir);
+      bson_free(names[i].name);
+   }
+
+   for (i = 0; i < dump.ndbs; i++) {
+      sidecar_close(&dump.sidecars[i]);
+      db_destroy(dump.dbs[i]);
+      bson_free(dump.dbs[i]);
+   }
+
+   bson_free(names);
+   bson_free(dump.outs);
+   bson_free(dump.extents);
+   bson_free(dump.tables);
+   bson_free(dump.tasks);
+   bson_free(dump.scanned);
+   bson_free(dump.records);
+   bson_free(dump.sidecars);
+   bson_free(builders);
+   bson_free(dump.dbs);
 
    return 0;
 }
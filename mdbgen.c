@@ -0,0 +1,835 @@
+/* mdbgen.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mdb.h"
+
+
+/*
+ * mdbgen writes a synthetic database in the MMAPv1 format, so that the
+ * tools can be tested and benchmarked without a mongod.
+ *
+ * The layout follows what the server produces: a hashtable of namespaces
+ * in DBNAME.ns, and data files DBNAME.0, DBNAME.1, ... that double in size
+ * from 64MB up to the maximum file size. Each collection is a chain of
+ * extents which grow from the minimum to the maximum extent size, and the
+ * extents of all collections are allocated round-robin so that they
+ * interleave in the data files like they do on a busy server.
+ *
+ * Every document looks like
+ *
+ *   { "_id" : ObjectId, "n" : int32, "x" : double, "ts" : date, "s" : string }
+ *
+ * with the string sized so that the document has the requested size.
+ *
+ * -f PERCENT is the chance of each record being linked out of its physical
+ * order within its extent, as happens when documents are moved and space
+ * is reused. -x PERCENT is the chance of each record being deleted; its
+ * contents are kept and it is linked into the deleted list of its size
+ * bucket, which is what mdbundo recovers. Deleted records are in addition
+ * to the -n live documents.
+ *
+ * A DBNAME.system.namespaces collection lists the generated collections.
+ * No indexes are written.
+ *
+ * The output is fully determined by the options, including -r SEED.
+ * Files are created sparse and written through a shared mapping.
+ */
+
+
+#define ARGC_FAILURE  1
+#define WRITE_FAILURE 2
+
+
+#define GEN_FILE_MIN   (64 * 1024 * 1024)
+#define GEN_FILE_MAX   0x7ff00000
+#define GEN_NS_SIZE    (16 * 1024 * 1024)
+#define GEN_MAX_FILES  1024
+
+
+typedef enum
+{
+   GEN_UNIFORM,
+   GEN_SKEW,
+} gen_dist_t;
+
+
+typedef struct
+{
+   int     fd;
+   char   *map;
+   size_t  len;
+   size_t  used;
+} gen_file_t;
+
+
+typedef struct
+{
+   char          name[128];
+   int           catalog;
+   int           ndocs;
+   int           remaining;
+   bson_int32_t  extent_size;
+   file_loc_t    first_extent;
+   file_loc_t    last_extent;
+   bson_int32_t  last_extent_size;
+   file_loc_t    buckets[N_BUCKETS];
+   bson_int64_t  datasize;
+   bson_int64_t  nrecords;
+} gen_coll_t;
+
+
+typedef struct
+{
+   bson_int32_t offset;
+   int          deleted;
+} gen_rec_t;
+
+
+typedef struct
+{
+   const char    *dbpath;
+   const char    *dbname;
+   int            ndocs;
+   int            minsize;
+   int            maxsize;
+   gen_dist_t     dist;
+   bson_int32_t   minextent;
+   bson_int32_t   maxextent;
+   size_t         maxfile;
+   int            frag;
+   int            deleted;
+   bson_uint64_t  rand;
+   bson_uint32_t  counter;
+   gen_file_t     files[GEN_MAX_FILES];
+   int            nfiles;
+   gen_coll_t    *colls;
+   int            ncolls;
+   gen_rec_t     *recs;
+   int           *order;
+   int            nalloc;
+   char          *filler;
+   bson_int64_t   nextents;
+   bson_int64_t   ndeleted;
+} gen_t;
+
+
+/*
+ * Server deleted list buckets, by the length of the record with headers.
+ */
+static const bson_int32_t gBucketSizes[N_BUCKETS] = {
+   0x20, 0x40, 0x80, 0x100, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000,
+   0x8000, 0x10000, 0x20000, 0x40000, 0x80000, 0x100000, 0x200000,
+   0x400000, 0x800000,
+};
+
+
+static void
+usage (void)
+{
+   fprintf(stderr, "usage: mdbgen [-n DOCS] [-c COLLS] [-s MIN:MAX] "
+                   "[-d uniform|skew] [-e MIN:MAX] [-F MAXFILE] "
+                   "[-f PERCENT] [-x PERCENT] [-r SEED] DBPATH DBNAME\n");
+}
+
+
+static int
+parse_range (const char *str,
+             long       *min,
+             long       *max)
+{
+   char *end;
+
+   *min = strtol(str, &end, 10);
+   if (*end == ':') {
+      *max = strtol(end + 1, &end, 10);
+   } else {
+      *max = *min;
+   }
+
+   return (*end || (*min < 0) || (*max < *min)) ? -1 : 0;
+}
+
+
+/*
+ * xorshift64* -- small, fast and reproducible across platforms.
+ */
+static bson_uint64_t
+gen_rand (gen_t *gen)
+{
+   gen->rand ^= gen->rand >> 12;
+   gen->rand ^= gen->rand << 25;
+   gen->rand ^= gen->rand >> 27;
+
+   return gen->rand * 2685821657736338717ULL;
+}
+
+
+static int
+gen_percent (gen_t *gen,
+             int    percent)
+{
+   return percent && ((int)(gen_rand(gen) % 100) < percent);
+}
+
+
+static int
+gen_size (gen_t *gen)
+{
+   double u;
+   int range = gen->maxsize - gen->minsize;
+
+   if (!range) {
+      return gen->minsize;
+   }
+
+   u = (gen_rand(gen) >> 11) * (1.0 / 9007199254740992.0);
+
+   /*
+    * The skewed distribution favors small documents with a long tail of
+    * large ones; its mean is a fifth of the way into the range.
+    */
+   if (gen->dist == GEN_SKEW) {
+      u = u * u * u * u;
+   }
+
+   return gen->minsize + (int)(u * range);
+}
+
+
+static int
+gen_bucket (bson_int32_t len)
+{
+   int i;
+
+   for (i = 0; i < (N_BUCKETS - 1); i++) {
+      if (gBucketSizes[i] > len) {
+         return i;
+      }
+   }
+
+   return N_BUCKETS - 1;
+}
+
+
+static char *
+gen_map (gen_t        *gen,
+         const char   *suffix,
+         size_t        len,
+         gen_file_t   *file)
+{
+   char *path;
+
+   path = bson_strdup_printf("%s/%s.%s", gen->dbpath, gen->dbname, suffix);
+   file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   bson_free(path);
+
+   if (file->fd == -1) {
+      return NULL;
+   }
+
+   if (!!ftruncate(file->fd, len)) {
+      close(file->fd);
+      return NULL;
+   }
+
+   file->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    file->fd, 0);
+   if (file->map == MAP_FAILED) {
+      file->map = NULL;
+      close(file->fd);
+      return NULL;
+   }
+
+   file->len = len;
+   file->used = 0;
+
+   return file->map;
+}
+
+
+static void
+gen_unmap (gen_file_t *file)
+{
+   munmap(file->map, file->len);
+   close(file->fd);
+   memset(file, 0, sizeof *file);
+}
+
+
+/*
+ * Data files start at 64MB and double in size, like the server's.
+ */
+static char *
+gen_alloc_extent (gen_t        *gen,
+                  bson_int32_t  len,
+                  file_loc_t   *loc)
+{
+   file_header_t *header;
+   gen_file_t *file = NULL;
+   char suffix[16];
+   size_t size;
+
+   if (gen->nfiles) {
+      file = &gen->files[gen->nfiles - 1];
+   }
+
+   if (!file || ((file->used + len) > file->len)) {
+      if (gen->nfiles == GEN_MAX_FILES) {
+         errno = ENOSPC;
+         return NULL;
+      }
+
+      size = (gen->nfiles < 6) ? ((size_t)GEN_FILE_MIN << gen->nfiles) :
+                                 gen->maxfile;
+      if (size > gen->maxfile) {
+         size = gen->maxfile;
+      }
+      if (size < (offsetof(file_header_t, data) + len)) {
+         size = offsetof(file_header_t, data) + len;
+      }
+
+      file = &gen->files[gen->nfiles];
+      snprintf(suffix, sizeof suffix, "%d", gen->nfiles);
+      if (!gen_map(gen, suffix, size, file)) {
+         return NULL;
+      }
+
+      header = (file_header_t *)file->map;
+      header->version = 4;
+      header->version_minor = 5;
+      header->file_length = size;
+      file->used = offsetof(file_header_t, data);
+
+      gen->nfiles++;
+   }
+
+   loc->fileno = gen->nfiles - 1;
+   loc->offset = file->used;
+   file->used += len;
+
+   header = (file_header_t *)file->map;
+   header->unused.fileno = loc->fileno;
+   header->unused.offset = file->used;
+   header->unused_length = file->len - file->used;
+
+   return file->map + loc->offset;
+}
+
+
+static char *
+gen_at (gen_t            *gen,
+        const file_loc_t *loc)
+{
+   return gen->files[loc->fileno].map + loc->offset;
+}
+
+
+static void
+gen_doc (gen_t      *gen,
+         gen_coll_t *coll,
+         int         size,
+         bson_t     *b)
+{
+   bson_uint64_t r;
+   bson_oid_t oid;
+   bson_uint32_t t;
+   int fill;
+   int i;
+
+   bson_init(b);
+
+   if (coll->catalog) {
+      bson_append_utf8(b, "name", 4, gen->colls[coll->nrecords].name, -1);
+      return;
+   }
+
+   /*
+    * ObjectIds are a big-endian timestamp, a random machine and process
+    * id, and a big-endian counter, so they sort in insertion order.
+    */
+   t = 1388534400 + (gen->counter / 1000);
+   r = gen_rand(gen);
+   oid.bytes[0] = t >> 24;
+   oid.bytes[1] = t >> 16;
+   oid.bytes[2] = t >> 8;
+   oid.bytes[3] = t;
+   for (i = 0; i < 5; i++) {
+      oid.bytes[4 + i] = r >> (i * 8);
+   }
+   oid.bytes[9] = gen->counter >> 16;
+   oid.bytes[10] = gen->counter >> 8;
+   oid.bytes[11] = gen->counter;
+
+   bson_append_oid(b, "_id", 3, &oid);
+   bson_append_int32(b, "n", 1, gen->counter);
+   bson_append_double(b, "x", 1, (gen_rand(gen) % 1000000) / 1000.0);
+   bson_append_date_time(b, "ts", 2, (bson_int64_t)t * 1000);
+
+   gen->counter++;
+
+   /*
+    * The string element costs 8 bytes besides its contents.
+    */
+   fill = size - (int)b->len - 8;
+   if (fill < 0) {
+      fill = 0;
+   }
+
+   bson_append_utf8(b, "s", 1,
+                    gen->filler + (gen_rand(gen) % (gen->maxsize + 1)),
+                    fill);
+}
+
+
+static void
+gen_reserve (gen_t *gen,
+             int    n)
+{
+   if (n > gen->nalloc) {
+      gen->nalloc = n * 2;
+      gen->recs = bson_realloc(gen->recs, gen->nalloc * sizeof *gen->recs);
+      gen->order = bson_realloc(gen->order, gen->nalloc * sizeof *gen->order);
+   }
+}
+
+
+/*
+ * Allocate the next extent of @coll and fill it with documents.
+ */
+static int
+gen_extent (gen_t      *gen,
+            gen_coll_t *coll)
+{
+   extent_header_t *extent;
+   extent_header_t *prev;
+   record_header_t *rec;
+   file_loc_t loc;
+   file_loc_t rloc;
+   bson_int32_t offset;
+   bson_int32_t reclen;
+   bson_int32_t size;
+   int nrecs = 0;
+   int nlive = 0;
+   int bucket;
+   int docsize;
+   int i;
+   int j;
+   int t;
+   bson_t b;
+
+   /*
+    * Every extent must at least fit the largest possible document.
+    */
+   size = coll->extent_size;
+   if (size < (bson_int32_t)(sizeof *extent + 16 + gen->maxsize + 64)) {
+      size = sizeof *extent + 16 + gen->maxsize + 64;
+   }
+   size = (size + 4095) & ~4095;
+
+   if (!(extent = (extent_header_t *)gen_alloc_extent(gen, size, &loc))) {
+      return -1;
+   }
+
+   extent->magic = EXTENT_MAGIC;
+   extent->my_loc = loc;
+   extent->next.fileno = -1;
+   extent->prev = coll->last_extent;
+   memcpy(extent->namespace, coll->name, strlen(coll->name));
+   extent->length = size;
+
+   if (coll->last_extent.fileno == -1) {
+      coll->first_extent = loc;
+   } else {
+      prev = (extent_header_t *)gen_at(gen, &coll->last_extent);
+      prev->next = loc;
+   }
+
+   coll->last_extent = loc;
+   coll->last_extent_size = size;
+
+   offset = loc.offset + sizeof *extent;
+
+   while (coll->remaining) {
+      docsize = coll->catalog ? 0 : gen_size(gen);
+      gen_doc(gen, coll, docsize, &b);
+      reclen = (16 + b.len + 3) & ~3;
+
+      if ((offset + reclen) > (loc.offset + size)) {
+         bson_destroy(&b);
+         break;
+      }
+
+      gen_reserve(gen, nrecs + 1);
+
+      rec = (record_header_t *)(gen->files[loc.fileno].map + offset);
+      rec->length = reclen;
+      rec->extent_offset = loc.offset;
+      memcpy(rec->data, bson_get_data(&b), b.len);
+      bson_destroy(&b);
+
+      gen->recs[nrecs].offset = offset;
+      gen->recs[nrecs].deleted = !coll->catalog &&
+                                 gen_percent(gen, gen->deleted);
+
+      if (gen->recs[nrecs].deleted) {
+         rloc.fileno = loc.fileno;
+         rloc.offset = offset;
+         bucket = gen_bucket(reclen);
+         rec->next_offset = coll->buckets[bucket].fileno;
+         rec->prev_offset = coll->buckets[bucket].offset;
+         coll->buckets[bucket] = rloc;
+         gen->ndeleted++;
+      } else {
+         gen->order[nlive++] = nrecs;
+         coll->remaining--;
+         coll->datasize += reclen - 16;
+         coll->nrecords++;
+      }
+
+      offset += reclen;
+      nrecs++;
+   }
+
+   /*
+    * Link some records out of physical order.
+    */
+   for (i = 0; i < nlive; i++) {
+      if (!coll->catalog && gen_percent(gen, gen->frag)) {
+         j = gen_rand(gen) % nlive;
+         t = gen->order[i];
+         gen->order[i] = gen->order[j];
+         gen->order[j] = t;
+      }
+   }
+
+   for (i = 0; i < nlive; i++) {
+      rec = (record_header_t *)(gen->files[loc.fileno].map +
+                                gen->recs[gen->order[i]].offset);
+      rec->prev_offset = i ? gen->recs[gen->order[i - 1]].offset : -1;
+      rec->next_offset = (i + 1 < nlive) ?
+                         gen->recs[gen->order[i + 1]].offset : -1;
+   }
+
+   if (nlive) {
+      extent->first_record.fileno = loc.fileno;
+      extent->first_record.offset = gen->recs[gen->order[0]].offset;
+      extent->last_record.fileno = loc.fileno;
+      extent->last_record.offset = gen->recs[gen->order[nlive - 1]].offset;
+   } else {
+      extent->first_record.fileno = -1;
+      extent->last_record.fileno = -1;
+   }
+
+   coll->extent_size = (size < gen->maxextent / 2) ? (size * 2) :
+                                                     gen->maxextent;
+   gen->nextents++;
+
+   return 0;
+}
+
+
+static void
+gen_coll_init (gen_t      *gen,
+               gen_coll_t *coll,
+               const char *name,
+               int         ndocs)
+{
+   int i;
+
+   memset(coll, 0, sizeof *coll);
+   snprintf(coll->name, sizeof coll->name, "%s.%s", gen->dbname, name);
+   coll->ndocs = ndocs;
+   coll->remaining = ndocs;
+   coll->extent_size = gen->minextent;
+   coll->first_extent.fileno = -1;
+   coll->last_extent.fileno = -1;
+
+   for (i = 0; i < N_BUCKETS; i++) {
+      coll->buckets[i].fileno = -1;
+   }
+}
+
+
+/*
+ * Write the namespace hashtable, probing linearly like the server.
+ */
+static int
+gen_ns (gen_t *gen)
+{
+   ns_hash_node_t *nodes;
+   ns_details_t *details;
+   gen_file_t file;
+   gen_coll_t *coll;
+   bson_int32_t hash;
+   int nnodes;
+   int i;
+   int j;
+
+   if (!gen_map(gen, "ns", GEN_NS_SIZE, &file)) {
+      return -1;
+   }
+
+   nodes = (ns_hash_node_t *)file.map;
+   nnodes = GEN_NS_SIZE / sizeof *nodes;
+
+   /*
+    * The .ns file has a fixed number of slots, so give up once the probe
+    * has come all the way around rather than spin on a full table.
+    */
+   for (i = 0; i <= gen->ncolls; i++) {
+      coll = &gen->colls[i];
+      hash = ns_hash(coll->name);
+
+      for (j = hash % nnodes; nodes[j].hash; ) {
+         j = (j + 1) % nnodes;
+         if (j == (hash % nnodes)) {
+            gen_unmap(&file);
+            errno = ENOSPC;
+            return -1;
+         }
+      }
+
+      nodes[j].hash = hash;
+      memcpy(nodes[j].key, coll->name, strlen(coll->name));
+
+      details = (ns_details_t *)nodes[j].details;
+      details->first_extent = coll->first_extent;
+      details->last_extent = coll->last_extent;
+      memcpy(details->buckets, coll->buckets, sizeof details->buckets);
+      details->stats.datasize = coll->datasize;
+      details->stats.nrecords = coll->nrecords;
+      details->last_extent_size = coll->last_extent_size;
+      details->padding_factor = 1.0;
+      details->cap_extent.fileno = -1;
+      details->cap_first_new_record.fileno = -1;
+      details->data_file_version = 4;
+      details->index_file_version = 5;
+   }
+
+   gen_unmap(&file);
+
+   return 0;
+}
+
+
+static int
+gen_run (gen_t *gen)
+{
+   gen_coll_t *coll;
+   char path[4096];
+   int active;
+   int i;
+
+   gen->filler = bson_malloc(gen->maxsize * 2 + 2);
+   for (i = 0; i < (gen->maxsize * 2 + 2); i++) {
+      gen->filler[i] = 'a' + (gen_rand(gen) % 26);
+   }
+
+   do {
+      active = FALSE;
+      for (i = 0; i < gen->ncolls; i++) {
+         coll = &gen->colls[i];
+         if (coll->remaining) {
+            if (!!gen_extent(gen, coll)) {
+               return -1;
+            }
+            active = TRUE;
+         }
+      }
+   } while (active);
+
+   coll = &gen->colls[gen->ncolls];
+   while (coll->remaining) {
+      if (!!gen_extent(gen, coll)) {
+         return -1;
+      }
+   }
+
+   if (!!gen_ns(gen)) {
+      return -1;
+   }
+
+   for (i = 0; i < gen->nfiles; i++) {
+      gen_unmap(&gen->files[i]);
+   }
+
+   /*
+    * Remove data files left over from a larger run, which would
+    * otherwise be picked up as part of the database.
+    */
+   for (i = gen->nfiles; ; i++) {
+      snprintf(path, sizeof path, "%s/%s.%d", gen->dbpath, gen->dbname, i);
+      if (!!unlink(path)) {
+         break;
+      }
+   }
+
+   bson_free(gen->filler);
+
+   return 0;
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+   char name[32];
+   gen_t gen = { 0 };
+   long min;
+   long max;
+   long v;
+   int ncolls = 1;
+   int opt;
+   int i;
+
+   gen.ndocs = 10000;
+   gen.minsize = 64;
+   gen.maxsize = 1024;
+   gen.minextent = 64 * 1024;
+   gen.maxextent = 16 * 1024 * 1024;
+   gen.maxfile = GEN_FILE_MAX;
+   gen.rand = 1;
+
+   while (-1 != (opt = getopt(argc, argv, "n:c:s:d:e:F:f:x:r:"))) {
+      switch (opt) {
+      case 'n':
+         if ((gen.ndocs = atoi(optarg)) < 0) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'c':
+         if ((ncolls = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 's':
+         if (!!parse_range(optarg, &min, &max) ||
+             (min < 64) || (max > (16 * 1024 * 1024))) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         gen.minsize = min;
+         gen.maxsize = max;
+         break;
+      case 'd':
+         if (!strcmp(optarg, "uniform")) {
+            gen.dist = GEN_UNIFORM;
+         } else if (!strcmp(optarg, "skew")) {
+            gen.dist = GEN_SKEW;
+         } else {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'e':
+         if (!!parse_range(optarg, &min, &max) ||
+             (min < 4096) || (max >= (GEN_FILE_MAX / 2))) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         gen.minextent = min;
+         gen.maxextent = max;
+         break;
+      case 'F':
+         v = atol(optarg);
+         if ((v < (1024 * 1024)) || (v > GEN_FILE_MAX)) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         gen.maxfile = v;
+         break;
+      case 'f':
+         if (((gen.frag = atoi(optarg)) < 0) || (gen.frag > 100)) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'x':
+         if (((gen.deleted = atoi(optarg)) < 0) || (gen.deleted > 99)) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'r':
+         gen.rand = strtoull(optarg, NULL, 10) | 1;
+         break;
+      default:
+         usage();
+         return ARGC_FAILURE;
+      }
+   }
+
+   if ((argc - optind) != 2) {
+      usage();
+      return ARGC_FAILURE;
+   }
+
+   gen.dbpath = argv[optind];
+   gen.dbname = argv[optind + 1];
+
+   if ((strlen(gen.dbname) + 32) > sizeof gen.colls->name) {
+      usage();
+      return ARGC_FAILURE;
+   }
+
+   gen.ncolls = ncolls;
+   gen.colls = bson_malloc0((ncolls + 1) * sizeof *gen.colls);
+
+   for (i = 0; i < ncolls; i++) {
+      snprintf(name, sizeof name, "coll%d", i);
+      gen_coll_init(&gen, &gen.colls[i], name, gen.ndocs);
+   }
+
+   gen_coll_init(&gen, &gen.colls[ncolls], "system.namespaces", ncolls);
+   gen.colls[ncolls].catalog = TRUE;
+
+   if (!!mkdir(gen.dbpath, 0755) && (errno != EEXIST)) {
+      perror("Failed to create DBPATH");
+      return WRITE_FAILURE;
+   }
+
+   if (!!gen_run(&gen)) {
+      perror("Failed to write database");
+      return WRITE_FAILURE;
+   }
+
+   fprintf(stderr, "%d collections, %lld documents, %lld deleted, "
+                   "%lld extents, %d data files\n",
+           ncolls, (long long)ncolls * gen.ndocs, (long long)gen.ndeleted,
+           (long long)gen.nextents, gen.nfiles);
+
+   bson_free(gen.colls);
+   bson_free(gen.recs);
+   bson_free(gen.order);
+
+   return 0;
+}
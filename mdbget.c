@@ -0,0 +1,260 @@
+/* mdbget.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mdb.h"
+#include "mdb-btree.h"
+#include "mdb-json.h"
+#include "mdb-output.h"
+
+
+/*
+ * mdbget fetches documents by _id without scanning the collection. Each
+ * lookup descends the _id_ index from its head bucket and dereferences
+ * the record location of the matching key, so it only touches one index
+ * bucket per level of the tree plus the document itself.
+ *
+ * Each ID is an Extended JSON value, such as 42, '"abc"' or
+ * '{ "$oid" : "52f0a3c4d1e8a9b2c3d4e5f6" }'. Anything that does not parse
+ * as JSON is looked up as a string.
+ *
+ * --min and --max select the range of _ids from MIN (inclusive) up to
+ * MAX (exclusive) in index order, like cursor.min() and cursor.max() in
+ * the shell.
+ */
+
+
+#define ARGC_FAILURE   1
+#define DB_FAILURE     2
+#define NS_FAILURE     3
+#define INDEX_FAILURE  4
+#define WRITE_FAILURE  5
+#define LOOKUP_FAILURE 6
+
+
+#define GET_FLUSH_SIZE (64 * 1024)
+
+
+typedef struct
+{
+   btree_cursor_t cursor;
+   int            bson;
+   buffer_t       buffer;
+   output_t       output;
+} get_t;
+
+
+static void
+usage (void)
+{
+   fprintf(stderr, "usage: mdbget [--bson] [--min ID] [--max ID] "
+                   "DBPATH DBNAME COLNAME [ID...]\n");
+}
+
+
+static int
+get_emit (get_t    *get,
+          record_t *record)
+{
+   const bson_uint8_t *data;
+   size_t len;
+
+   if (!(data = record_data(record, &len))) {
+      return -1;
+   }
+
+   return output_append_doc(&get->buffer, data, len, get->bson);
+}
+
+
+static int
+get_range (get_t        *get,
+           const bson_t *min,
+           const bson_t *max)
+{
+   record_t record;
+
+   if (!!btree_cursor_seek(&get->cursor, min)) {
+      return -1;
+   }
+
+   while (!btree_cursor_next(&get->cursor)) {
+      if (max && (btree_cursor_compare(&get->cursor, max) >= 0)) {
+         return 0;
+      }
+
+      if (!!btree_cursor_record(&get->cursor, &record) ||
+          !!get_emit(get, &record)) {
+         perror("Failed to read record");
+         continue;
+      }
+
+      if (!!output_flush(&get->output, &get->buffer, GET_FLUSH_SIZE)) {
+         return -1;
+      }
+   }
+
+   return (errno == ENOENT) ? 0 : -1;
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+   const char *colname;
+   const char *dbname;
+   const char *minarg = NULL;
+   const char *maxarg = NULL;
+   record_t record;
+   char dotname[128];
+   bson_t min;
+   bson_t max;
+   bson_t key;
+   get_t get = { { 0 } };
+   int missing = 0;
+   int opt;
+   int i;
+   db_t db;
+   ns_t ns;
+
+   static const struct option options[] = {
+      { "bson", no_argument, NULL, 'b' },
+      { "min", required_argument, NULL, 'l' },
+      { "max", required_argument, NULL, 'u' },
+      { NULL },
+   };
+
+   while (-1 != (opt = getopt_long(argc, argv, "b", options, NULL))) {
+      switch (opt) {
+      case 'b':
+         get.bson = TRUE;
+         break;
+      case 'l':
+         minarg = optarg;
+         break;
+      case 'u':
+         maxarg = optarg;
+         break;
+      default:
+         usage();
+         return ARGC_FAILURE;
+      }
+   }
+
+   if (((argc - optind) < 3) ||
+       (((argc - optind) == 3) && !minarg && !maxarg)) {
+      usage();
+      return ARGC_FAILURE;
+   }
+
+   dbname = argv[optind + 1];
+   colname = argv[optind + 2];
+
+   errno = 0;
+   if (!!db_init(&db, argv[optind], dbname)) {
+      perror("Failed to load database");
+      return DB_FAILURE;
+   }
+
+   snprintf(dotname, sizeof dotname, "%s.%s", dbname, colname);
+
+   errno = 0;
+   if (!!db_namespace_lookup(&db, dotname, &ns)) {
+      perror("Failed to locate namespace");
+      return NS_FAILURE;
+   }
+
+   errno = 0;
+   if (!!btree_cursor_init_id(&get.cursor, &ns)) {
+      perror("Failed to load _id index");
+      return INDEX_FAILURE;
+   }
+
+   buffer_init(&get.buffer);
+   output_init(&get.output, STDOUT_FILENO, 0);
+
+   for (i = optind + 3; i < argc; i++) {
+      json_parse_key(argv[i], "_id", &key);
+
+      if (!!btree_cursor_find(&get.cursor, &key, &record)) {
+         if (errno == ENOENT) {
+            fprintf(stderr, "Not found: %s\n", argv[i]);
+         } else {
+            perror("Failed to look up _id");
+         }
+         missing++;
+      } else if (!!get_emit(&get, &record)) {
+         perror("Failed to read record");
+         missing++;
+      }
+
+      bson_destroy(&key);
+
+      if (!!output_flush(&get.output, &get.buffer, GET_FLUSH_SIZE)) {
+         perror("Failed to write output");
+         return WRITE_FAILURE;
+      }
+   }
+
+   if (minarg || maxarg) {
+      /*
+       * Without a lower bound, seek to MinKey which sorts before every
+       * other value.
+       */
+      if (minarg) {
+         json_parse_key(minarg, "_id", &min);
+      } else {
+         bson_init(&min);
+         bson_append_minkey(&min, "_id", 3);
+      }
+
+      if (maxarg) {
+         json_parse_key(maxarg, "_id", &max);
+      }
+
+      if (!!get_range(&get, &min, maxarg ? &max : NULL)) {
+         perror("Failed to scan _id range");
+         missing++;
+      }
+
+      bson_destroy(&min);
+      if (maxarg) {
+         bson_destroy(&max);
+      }
+   }
+
+   if (!!output_flush(&get.output, &get.buffer, 0)) {
+      perror("Failed to write output");
+      return WRITE_FAILURE;
+   }
+
+   buffer_destroy(&get.buffer);
+   btree_cursor_destroy(&get.cursor);
+   db_destroy(&db);
+
+   return missing ? LOOKUP_FAILURE : 0;
+}
@@ -0,0 +1,1165 @@
+/* mdbindex.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mdb.h"
+#include "mdb-btree.h"
+#include "mdb-json.h"
+#include "mdb-output.h"
+#include "mdb-pool.h"
+#include "mdb-sidecar.h"
+
+
+/*
+ * mdbindex builds a secondary index on a field that the database itself
+ * does not index, for repeated lookups against a backup, and then answers
+ * those lookups from the index file alone.
+ *
+ * --build FIELD scans the collection once and writes one entry per
+ * document to INDEX, holding the value of FIELD (a dotted path into
+ * embedded documents) and the location of the record. Like the server,
+ * an array is indexed under each of its elements, and a missing field
+ * as null. The entries are sorted in the order of the server's indexes
+ * with an external merge sort: the workers extract the keys of one
+ * extent at a time, which are spilled to a scratch file next to INDEX
+ * in runs of a bounded size, the runs are sorted in parallel, and then
+ * merged into the index.
+ *
+ * Without --build, each KEY (an Extended JSON value, as with mdbget) is
+ * found by binary search over the sorted entries, and the matching
+ * records are read straight from the data files, so a lookup touches a
+ * handful of index pages plus the documents themselves. --min and --max
+ * select the range of keys from MIN (inclusive) up to MAX (exclusive).
+ * A record is emitted once per lookup, at its first key in the range,
+ * however many elements of an array field match.
+ *
+ * The index remembers the size and modification time of the files of
+ * the database, and refuses to answer once any of them has changed.
+ */
+
+
+#define ARGC_FAILURE   1
+#define DB_FAILURE     2
+#define NS_FAILURE     3
+#define INDEX_FAILURE  4
+#define WRITE_FAILURE  5
+#define LOOKUP_FAILURE 6
+
+
+#define INDEX_MAGIC       "mdbindex 1"
+#define INDEX_MEMORY      256
+#define INDEX_FLUSH_SIZE  (1024 * 1024)
+#define LOOKUP_FLUSH_SIZE (64 * 1024)
+
+
+/*
+ * The index file is an index_header_t, the sidecar_key_t of the .ns
+ * file and of every data file, "datalen" bytes of entries and then the
+ * offset of each of the "nentries" entries into the entry bytes. An entry
+ * is the file_loc_t of the record followed by its key, an index key
+ * document such as { "" : 42 }.
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+   char          magic[16];
+   bson_uint32_t nfiles;
+   bson_uint32_t reserved;
+   bson_uint64_t nentries;
+   bson_uint64_t datalen;
+   char          ns[128];
+   char          field[128];
+} index_header_t;
+#pragma pack(pop)
+
+
+BSON_STATIC_ASSERT(sizeof(index_header_t) == 296);
+
+
+typedef struct
+{
+   bson_uint64_t documents;
+   bson_uint64_t invalid;
+} index_counts_t;
+
+
+typedef struct
+{
+   const char *pos;
+   const char *end;
+} index_run_t;
+
+
+typedef struct
+{
+   file_loc_t    loc;
+   bson_uint64_t seq;
+} index_hit_t;
+
+
+typedef struct
+{
+   db_t           *db;
+   const char     *field;
+   file_loc_t     *locs;
+   int             nlocs;
+   int             jobs;
+   index_counts_t *counts;
+   int             fd;
+   bson_uint64_t   written;
+   bson_uint64_t   runsize;
+   bson_uint64_t  *runs;
+   int             nruns;
+   bson_uint64_t  *sorted;
+   char           *map;
+} index_build_t;
+
+
+typedef struct
+{
+   db_t                 *db;
+   char                 *map;
+   size_t                maplen;
+   const index_header_t *header;
+   const char           *data;
+   const char           *offsets;
+   int                   bson;
+   buffer_t              buffer;
+   output_t              output;
+} index_t;
+
+
+static void
+usage (void)
+{
+   fprintf(stderr, "usage: mdbindex --build FIELD [-j JOBS] [-M MEMORY] "
+                   "DBPATH DBNAME COLNAME INDEX\n"
+                   "       mdbindex [--bson] [--min KEY] [--max KEY] "
+                   "DBPATH DBNAME COLNAME INDEX [KEY...]\n");
+}
+
+
+static double
+index_now (void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+
+static size_t
+index_entry_len (const char *entry)
+{
+   bson_uint32_t len;
+
+   memcpy(&len, entry + sizeof(file_loc_t), 4);
+
+   return sizeof(file_loc_t) + BSON_UINT32_FROM_LE(len);
+}
+
+
+static int
+index_key_compare (const char   *entry,
+                   const bson_t *key)
+{
+   bson_t ekey;
+
+   if (!bson_init_static(&ekey, (const bson_uint8_t *)entry +
+                         sizeof(file_loc_t),
+                         index_entry_len(entry) - sizeof(file_loc_t))) {
+      return -1;
+   }
+
+   return btree_key_compare(&ekey, key, 0);
+}
+
+
+/*
+ * Entries with equal keys are kept in the order of their records in the
+ * data files, so the documents of a lookup are read front to back, and
+ * the same key of the same record comes out next to itself.
+ */
+static int
+index_entry_compare (const char *a,
+                     const char *b)
+{
+   file_loc_t aloc;
+   file_loc_t bloc;
+   bson_t bkey;
+   int cmp;
+
+   if (!bson_init_static(&bkey, (const bson_uint8_t *)b + sizeof bloc,
+                         index_entry_len(b) - sizeof bloc)) {
+      return 0;
+   }
+
+   if ((cmp = index_key_compare(a, &bkey))) {
+      return cmp;
+   }
+
+   memcpy(&aloc, a, sizeof aloc);
+   memcpy(&bloc, b, sizeof bloc);
+
+   if (aloc.fileno != bloc.fileno) {
+      return (aloc.fileno < bloc.fileno) ? -1 : 1;
+   }
+
+   return (aloc.offset < bloc.offset) ? -1 : (aloc.offset > bloc.offset);
+}
+
+
+static int
+index_entry_ptr_compare (const void *a,
+                         const void *b)
+{
+   return index_entry_compare(*(const char * const *)a,
+                              *(const char * const *)b);
+}
+
+
+static void
+index_append_key (buffer_t          *buffer,
+                  const file_loc_t  *loc,
+                  const bson_iter_t *value)
+{
+   bson_t key;
+
+   bson_init(&key);
+   if (value) {
+      bson_append_iter(&key, "", 0, value);
+   } else {
+      bson_append_null(&key, "", 0);
+   }
+
+   buffer_append(buffer, loc, sizeof *loc);
+   buffer_append(buffer, bson_get_data(&key), key.len);
+
+   bson_destroy(&key);
+}
+
+
+static void
+index_append_keys (index_build_t    *build,
+                   const bson_t     *doc,
+                   const file_loc_t *loc,
+                   buffer_t         *buffer)
+{
+   bson_iter_t iter;
+   bson_iter_t value;
+   bson_iter_t child;
+   int n = 0;
+
+   if (!bson_iter_init(&iter, doc) ||
+       !bson_iter_find_descendant(&iter, build->field, &value)) {
+      index_append_key(buffer, loc, NULL);
+      return;
+   }
+
+   if ((bson_iter_type(&value) != BSON_TYPE_ARRAY) ||
+       !bson_iter_recurse(&value, &child)) {
+      index_append_key(buffer, loc, &value);
+      return;
+   }
+
+   while (bson_iter_next(&child)) {
+      index_append_key(buffer, loc, &child);
+      n++;
+   }
+
+   if (!n) {
+      index_append_key(buffer, loc, NULL);
+   }
+}
+
+
+static int
+index_extent (void     *data,
+              int       index,
+              buffer_t *buffer)
+{
+   const record_entry_t *entry;
+   index_build_t *build = data;
+   index_counts_t *counts = &build->counts[index];
+   record_batch_t batch;
+   file_loc_t loc;
+   extent_t extent;
+   bson_t doc;
+   int i;
+
+   if (!!extent_init(&extent, build->db, &build->locs[index])) {
+      return -1;
+   }
+
+   extent_advise(&extent, EXTENT_ADVISE_WILLNEED);
+   if ((index + build->jobs) < build->nlocs) {
+      db_prefetch_extent(build->db, &build->locs[index + build->jobs]);
+   }
+
+   record_batch_init(&batch);
+   while (extent_record_batch(&extent, &batch, RECORD_BATCH_MAX) > 0) {
+      for (i = 0; i < batch.count; i++) {
+         entry = &batch.records[i];
+         if (!bson_init_static(&doc, entry->data, entry->len)) {
+            counts->invalid++;
+            continue;
+         }
+         loc.fileno = extent.fileno;
+         loc.offset = (const char *)entry->data - extent.map + extent.base -
+                      offsetof(record_header_t, data);
+         index_append_keys(build, &doc, &loc, buffer);
+         counts->documents++;
+      }
+   }
+
+   counts->invalid += batch.invalid;
+
+   extent_advise(&extent, EXTENT_ADVISE_DONE);
+   extent_destroy(&extent);
+
+   return 0;
+}
+
+
+/*
+ * The keys of each extent go to the scratch file in extent order, and a
+ * new run starts at the first entry that no longer fits into the current
+ * one, so a run only exceeds the run size when a single entry does.
+ */
+static int
+index_spill (void     *data,
+             int       index,
+             buffer_t *buffer)
+{
+   index_build_t *build = data;
+   const char *end = buffer->data + buffer->len;
+   const char *pos;
+   size_t len;
+
+   for (pos = buffer->data; pos < end; pos += len) {
+      len = index_entry_len(pos);
+      if ((build->written > build->runs[build->nruns]) &&
+          ((build->written - build->runs[build->nruns] + len) >
+           build->runsize)) {
+         build->runs = bson_realloc(build->runs, (build->nruns + 2) *
+                                    sizeof *build->runs);
+         build->runs[++build->nruns] = build->written;
+      }
+      build->written += len;
+   }
+
+   if (!!buffer_flush(buffer, build->fd)) {
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*
+ * Each run is sorted through an array of pointers to its entries, and
+ * the sorted entries are copied back over the run in the scratch file.
+ */
+static int
+index_sort_run (void     *data,
+                int       index,
+                buffer_t *buffer)
+{
+   index_build_t *build = data;
+   const char *start = build->map + build->runs[index];
+   const char *end = build->map + build->runs[index + 1];
+   const char **entries = NULL;
+   const char *pos;
+   char *sorted;
+   size_t len;
+   size_t n = 0;
+   size_t i;
+
+   for (pos = start; pos < end; pos += index_entry_len(pos)) {
+      if (!(n & (n - 1))) {
+         entries = bson_realloc(entries, (n ? n * 2 : 1) * sizeof *entries);
+      }
+      entries[n++] = pos;
+   }
+
+   qsort(entries, n, sizeof *entries, index_entry_ptr_compare);
+
+   sorted = buffer_reserve(buffer, end - start);
+   for (i = 0; i < n; i++) {
+      len = index_entry_len(entries[i]);
+      memcpy(sorted, entries[i], len);
+      sorted += len;
+   }
+
+   memcpy(build->map + build->runs[index], buffer->data, buffer->len);
+   build->sorted[index] = n;
+
+   bson_free(entries);
+
+   return 0;
+}
+
+
+static void
+index_heap_down (index_run_t *heap,
+                 int          n,
+                 int          i)
+{
+   index_run_t tmp;
+   int child;
+
+   while ((child = (2 * i) + 1) < n) {
+      if (((child + 1) < n) &&
+          (index_entry_compare(heap[child + 1].pos, heap[child].pos) < 0)) {
+         child++;
+      }
+      if (index_entry_compare(heap[i].pos, heap[child].pos) <= 0) {
+         break;
+      }
+      tmp = heap[i];
+      heap[i] = heap[child];
+      heap[child] = tmp;
+      i = child;
+   }
+}
+
+
+/*
+ * Merge the sorted runs into @fd, dropping an entry that repeats the key
+ * and record of the one before it, as an array with the same element
+ * twice would leave.
+ */
+static int
+index_merge (index_build_t  *build,
+             int             fd,
+             index_header_t *header)
+{
+   const char *prev = NULL;
+   const char *entry;
+   index_run_t *heap;
+   bson_uint64_t offset;
+   buffer_t buffer;
+   buffer_t offsets;
+   size_t len;
+   int ret = 0;
+   int n = 0;
+   int i;
+
+   heap = bson_malloc((build->nruns + 1) * sizeof *heap);
+   for (i = 0; i < build->nruns; i++) {
+      if (build->runs[i] < build->runs[i + 1]) {
+         heap[n].pos = build->map + build->runs[i];
+         heap[n].end = build->map + build->runs[i + 1];
+         n++;
+      }
+   }
+
+   for (i = (n / 2) - 1; i >= 0; i--) {
+      index_heap_down(heap, n, i);
+   }
+
+   buffer_init(&buffer);
+   buffer_init(&offsets);
+
+   while (!ret && n) {
+      entry = heap[0].pos;
+      len = index_entry_len(entry);
+
+      if (!prev || !!index_entry_compare(prev, entry)) {
+         offset = header->datalen;
+         buffer_append(&offsets, &offset, sizeof offset);
+         buffer_append(&buffer, entry, len);
+         header->datalen += len;
+         header->nentries++;
+         prev = entry;
+      }
+
+      if ((heap[0].pos += len) >= heap[0].end) {
+         heap[0] = heap[--n];
+      }
+      index_heap_down(heap, n, 0);
+
+      if (buffer.len >= INDEX_FLUSH_SIZE) {
+         ret = buffer_flush(&buffer, fd);
+      }
+   }
+
+   if (!ret) {
+      ret = buffer_flush(&buffer, fd);
+   }
+
+   if (!ret) {
+      ret = buffer_flush(&offsets, fd);
+   }
+
+   buffer_destroy(&buffer);
+   buffer_destroy(&offsets);
+   bson_free(heap);
+
+   return ret;
+}
+
+
+/*
+ * The index is written to INDEX.tmp, which is synced and renamed over
+ * INDEX, so a failed build leaves any earlier index alone.
+ */
+static int
+index_write (index_build_t *build,
+             const char    *dotname,
+             const char    *path)
+{
+   index_header_t header;
+   buffer_t keys;
+   char *tmp;
+   int ret = -1;
+   int fd;
+
+   memset(&header, 0, sizeof header);
+   strncpy(header.magic, INDEX_MAGIC, sizeof header.magic);
+   strncpy(header.ns, dotname, sizeof header.ns - 1);
+   strncpy(header.field, build->field, sizeof header.field - 1);
+   header.nfiles = build->db->filescnt;
+
+   buffer_init(&keys);
+
+   tmp = bson_strdup_printf("%s.tmp", path);
+
+   if (-1 == (fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644))) {
+      bson_free(tmp);
+      return -1;
+   }
+
+   if ((sizeof header == write(fd, &header, sizeof header)) &&
+       !sidecar_keys(build->db, &keys) &&
+       !buffer_flush(&keys, fd) &&
+       !index_merge(build, fd, &header) &&
+       (sizeof header == pwrite(fd, &header, sizeof header, 0)) &&
+       !fsync(fd)) {
+      ret = 0;
+   }
+
+   if (!!close(fd) || ret || !!rename(tmp, path)) {
+      unlink(tmp);
+      ret = -1;
+   }
+
+   buffer_destroy(&keys);
+   bson_free(tmp);
+
+   return ret;
+}
+
+
+static int
+index_build (db_t       *db,
+             ns_t       *ns,
+             const char *field,
+             const char *path,
+             int         jobs,
+             int         memory)
+{
+   index_build_t build = { 0 };
+   bson_uint64_t documents = 0;
+   bson_uint64_t invalid = 0;
+   bson_uint64_t entries = 0;
+   double start;
+   char *scratch;
+   int ret = -1;
+   int i;
+
+   start = index_now();
+
+   if (!!ns_extent_locs(ns, &build.locs, &build.nlocs)) {
+      return -1;
+   }
+
+   /*
+    * The scratch file is unlinked right away, so it goes away with the
+    * process however that ends.
+    */
+   scratch = bson_strdup_printf("%s.XXXXXX", path);
+   build.fd = mkstemp(scratch);
+   if (build.fd != -1) {
+      unlink(scratch);
+   }
+   bson_free(scratch);
+
+   if (build.fd == -1) {
+      bson_free(build.locs);
+      return -1;
+   }
+
+   /*
+    * Every worker holds a copy of the run it sorts next to the run
+    * itself, so two runs per worker have to fit into the memory budget.
+    */
+   build.db = db;
+   build.field = field;
+   build.jobs = jobs;
+   build.runsize = ((bson_uint64_t)memory * 1024 * 1024) / (2 * jobs);
+   build.counts = bson_malloc0((build.nlocs + 1) * sizeof *build.counts);
+   build.runs = bson_malloc0(2 * sizeof *build.runs);
+
+   if (!!pool_run(jobs, build.nlocs, index_extent, index_spill, &build)) {
+      goto failure;
+   }
+
+   if (build.written > build.runs[build.nruns]) {
+      build.runs = bson_realloc(build.runs, (build.nruns + 2) *
+                                sizeof *build.runs);
+      build.runs[++build.nruns] = build.written;
+   }
+
+   if (build.written) {
+      build.map = mmap(NULL, build.written, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, build.fd, 0);
+      if (build.map == MAP_FAILED) {
+         build.map = NULL;
+         goto failure;
+      }
+   }
+
+   build.sorted = bson_malloc0((build.nruns + 1) * sizeof *build.sorted);
+
+   if (!!pool_run(jobs, build.nruns, index_sort_run, NULL, &build) ||
+       !!index_write(&build, ns_name(ns), path)) {
+      goto failure;
+   }
+
+   for (i = 0; i < build.nlocs; i++) {
+      documents += build.counts[i].documents;
+      invalid += build.counts[i].invalid;
+   }
+
+   for (i = 0; i < build.nruns; i++) {
+      entries += build.sorted[i];
+   }
+
+   fprintf(stderr, "Indexed %s of %llu documents (%llu invalid) as %llu "
+                   "keys from %.1f MB in %d runs in %.2f seconds.\n",
+           field, (unsigned long long)documents, (unsigned long long)invalid,
+           (unsigned long long)entries, build.written / (1024.0 * 1024.0),
+           build.nruns, index_now() - start);
+
+   ret = 0;
+
+failure:
+   if (build.map) {
+      munmap(build.map, build.written);
+   }
+   close(build.fd);
+   bson_free(build.sorted);
+   bson_free(build.runs);
+   bson_free(build.counts);
+   bson_free(build.locs);
+
+   return ret;
+}
+
+
+/*
+ * Map INDEX and check that it was built for this collection from the
+ * data files as they are now.
+ */
+static int
+index_open (index_t    *index,
+            const char *path,
+            const char *dotname)
+{
+   const index_header_t *header;
+   bson_uint64_t size;
+   buffer_t keys;
+   struct stat st;
+   void *map;
+   int ret = -1;
+   int fd;
+
+   if (-1 == (fd = open(path, O_RDONLY))) {
+      return -1;
+   }
+
+   if (!!fstat(fd, &st)) {
+      close(fd);
+      return -1;
+   }
+
+   if (st.st_size < (off_t)sizeof *header) {
+      close(fd);
+      errno = EBADF;
+      return -1;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED) {
+      return -1;
+   }
+
+   index->map = map;
+   index->maplen = st.st_size;
+   index->header = header = map;
+   size = st.st_size;
+
+   if (!!strncmp(header->magic, INDEX_MAGIC, sizeof header->magic) ||
+       (header->nfiles != (bson_uint32_t)index->db->filescnt) ||
+       (header->nentries > size) || (header->datalen > size) ||
+       (size != (sizeof *header +
+                 ((header->nfiles + 1) * sizeof(sidecar_key_t)) +
+                 header->datalen +
+                 (header->nentries * sizeof(bson_uint64_t))))) {
+      errno = EBADF;
+      goto failure;
+   }
+
+   if (!!strncmp(header->ns, dotname, sizeof header->ns)) {
+      fprintf(stderr, "%s is an index of %.128s.\n", path, header->ns);
+      errno = EINVAL;
+      goto failure;
+   }
+
+   buffer_init(&keys);
+
+   if (!sidecar_keys(index->db, &keys)) {
+      if (!!memcmp(index->map + sizeof *header, keys.data, keys.len)) {
+         errno = ESTALE;
+      } else {
+         index->data = index->map + sizeof *header + keys.len;
+         index->offsets = index->data + header->datalen;
+         ret = 0;
+      }
+   }
+
+   buffer_destroy(&keys);
+
+   if (!ret) {
+      return 0;
+   }
+
+failure:
+   munmap(index->map, index->maplen);
+   index->map = NULL;
+   index->maplen = 0;
+   index->header = NULL;
+
+   return -1;
+}
+
+
+/*
+ * Find the @i'th entry, checking that it lies within the entry bytes.
+ */
+static const char *
+index_entry (const index_t *index,
+             bson_uint64_t  i,
+             file_loc_t    *loc)
+{
+   const char *entry;
+   bson_uint64_t offset;
+   bson_uint32_t len;
+
+   memcpy(&offset, index->offsets + (i * sizeof offset), sizeof offset);
+
+   if ((offset > index->header->datalen) ||
+       ((index->header->datalen - offset) < (sizeof *loc + 5))) {
+      return NULL;
+   }
+
+   entry = index->data + offset;
+   memcpy(&len, entry + sizeof *loc, 4);
+   len = BSON_UINT32_FROM_LE(len);
+
+   if ((len < 5) || (len > (index->header->datalen - offset - sizeof *loc))) {
+      return NULL;
+   }
+
+   memcpy(loc, entry, sizeof *loc);
+
+   return entry;
+}
+
+
+/*
+ * The first entry whose key is not less than @key, or nentries if there
+ * is none.
+ */
+static bson_uint64_t
+index_lower_bound (const index_t *index,
+                   const bson_t  *key)
+{
+   bson_uint64_t lo = 0;
+   bson_uint64_t hi = index->header->nentries;
+   bson_uint64_t mid;
+   const char *entry;
+   file_loc_t loc;
+
+   while (lo < hi) {
+      mid = lo + ((hi - lo) / 2);
+      if ((entry = index_entry(index, mid, &loc)) &&
+          (index_key_compare(entry, key) < 0)) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+
+   return lo;
+}
+
+
+/*
+ * Read the record at @loc straight out of its data file.
+ */
+static int
+index_emit (index_t          *index,
+            const file_loc_t *loc)
+{
+   const bson_uint8_t *data;
+   const char *map;
+   record_t record;
+   size_t maplen;
+   size_t len;
+   int ret = 0;
+
+   if ((loc->fileno < 0) || (loc->fileno >= index->db->filescnt) ||
+       (loc->offset < 0)) {
+      errno = EBADF;
+      return -1;
+   }
+
+   if (!(map = db_file_acquire(index->db, loc->fileno, &maplen))) {
+      return -1;
+   }
+
+   memset(&record, 0, sizeof record);
+   record.map = map;
+   record.maplen = maplen;
+   record.offset = loc->offset;
+
+   if (((size_t)loc->offset + offsetof(record_header_t, data) + 5) > maplen) {
+      errno = EBADF;
+      ret = -1;
+   } else if (!(data = record_data(&record, &len)) ||
+              !!output_append_doc(&index->buffer, data, len, index->bson)) {
+      ret = -1;
+   }
+
+   db_file_release(index->db, loc->fileno);
+
+   return ret;
+}
+
+
+/*
+ * Order hits by record, and the hits of a record by their position in
+ * the index.
+ */
+static int
+index_hit_loc_compare (const void *a,
+                       const void *b)
+{
+   const index_hit_t *x = a;
+   const index_hit_t *y = b;
+
+   if (x->loc.fileno != y->loc.fileno) {
+      return (x->loc.fileno < y->loc.fileno) ? -1 : 1;
+   }
+
+   if (x->loc.offset != y->loc.offset) {
+      return (x->loc.offset < y->loc.offset) ? -1 : 1;
+   }
+
+   return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+
+static int
+index_hit_seq_compare (const void *a,
+                       const void *b)
+{
+   const index_hit_t *x = a;
+   const index_hit_t *y = b;
+
+   return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+
+/*
+ * Emit every record from the first key not less than @min up to the
+ * last key not greater than @max, or less than @max when @exclusive.
+ * Without @min the range starts at the first entry.
+ *
+ * A record with several array elements in the range has an entry for
+ * each, so the matching locations are collected first, and only the
+ * first hit of each record is kept before the records are read in key
+ * order.
+ */
+static int
+index_range (index_t      *index,
+             const bson_t *min,
+             const bson_t *max,
+             int           exclusive,
+             int          *found)
+{
+   index_hit_t *hits = NULL;
+   const char *entry;
+   bson_uint64_t i;
+   file_loc_t loc;
+   size_t n = 0;
+   size_t m = 0;
+   size_t j;
+   int ret = 0;
+   int cmp;
+
+   *found = 0;
+
+   for (i = min ? index_lower_bound(index, min) : 0;
+        i < index->header->nentries;
+        i++) {
+      if (!(entry = index_entry(index, i, &loc))) {
+         bson_free(hits);
+         errno = EBADF;
+         return -1;
+      }
+
+      if (max) {
+         cmp = index_key_compare(entry, max);
+         if ((cmp > 0) || (exclusive && !cmp)) {
+            break;
+         }
+      }
+
+      if (!(n & (n - 1))) {
+         hits = bson_realloc(hits, (n ? n * 2 : 1) * sizeof *hits);
+      }
+      hits[n].loc = loc;
+      hits[n].seq = i;
+      n++;
+   }
+
+   if (n > 1) {
+      qsort(hits, n, sizeof *hits, index_hit_loc_compare);
+      for (j = 1, m = 1; j < n; j++) {
+         if ((hits[j].loc.fileno != hits[m - 1].loc.fileno) ||
+             (hits[j].loc.offset != hits[m - 1].loc.offset)) {
+            hits[m++] = hits[j];
+         }
+      }
+      qsort(hits, m, sizeof *hits, index_hit_seq_compare);
+   } else {
+      m = n;
+   }
+
+   for (j = 0; j < m; j++) {
+      if (!!index_emit(index, &hits[j].loc)) {
+         perror("Failed to read record");
+         continue;
+      }
+
+      (*found)++;
+
+      if (!!output_flush(&index->output, &index->buffer,
+                         LOOKUP_FLUSH_SIZE)) {
+         ret = -1;
+         break;
+      }
+   }
+
+   bson_free(hits);
+
+   return ret;
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+   const char *colname;
+   const char *dbname;
+   const char *field = NULL;
+   const char *minarg = NULL;
+   const char *maxarg = NULL;
+   const char *path;
+   index_t index = { 0 };
+   char dotname[128];
+   int memory = INDEX_MEMORY;
+   int missing = 0;
+   int jobs = 1;
+   int found;
+   int opt;
+   int i;
+   bson_t min;
+   bson_t max;
+   bson_t key;
+   db_t db;
+   ns_t ns;
+
+   static const struct option options[] = {
+      { "build", required_argument, NULL, 'B' },
+      { "bson", no_argument, NULL, 'b' },
+      { "min", required_argument, NULL, 'l' },
+      { "max", required_argument, NULL, 'u' },
+      { NULL },
+   };
+
+   while (-1 != (opt = getopt_long(argc, argv, "bj:M:", options, NULL))) {
+      switch (opt) {
+      case 'B':
+         field = optarg;
+         break;
+      case 'b':
+         index.bson = TRUE;
+         break;
+      case 'l':
+         minarg = optarg;
+         break;
+      case 'u':
+         maxarg = optarg;
+         break;
+      case 'j':
+         if ((jobs = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'M':
+         if ((memory = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      default:
+         usage();
+         return ARGC_FAILURE;
+      }
+   }
+
+   if (((argc - optind) < 4) ||
+       (field && (((argc - optind) > 4) || minarg || maxarg)) ||
+       (!field && ((argc - optind) == 4) && !minarg && !maxarg)) {
+      usage();
+      return ARGC_FAILURE;
+   }
+
+   dbname = argv[optind + 1];
+   colname = argv[optind + 2];
+   path = argv[optind + 3];
+
+   errno = 0;
+   if (!!db_init(&db, argv[optind], dbname)) {
+      perror("Failed to load database");
+      return DB_FAILURE;
+   }
+
+   snprintf(dotname, sizeof dotname, "%s.%s", dbname, colname);
+
+   errno = 0;
+   if (!!db_namespace_lookup(&db, dotname, &ns)) {
+      perror("Failed to locate namespace");
+      return NS_FAILURE;
+   }
+
+   if (field) {
+      errno = 0;
+      if (!!index_build(&db, &ns, field, path, jobs, memory)) {
+         perror("Failed to build index");
+         return INDEX_FAILURE;
+      }
+      db_destroy(&db);
+      return 0;
+   }
+
+   index.db = &db;
+
+   errno = 0;
+   if (!!index_open(&index, path, dotname)) {
+      perror("Failed to load index");
+      return INDEX_FAILURE;
+   }
+
+   buffer_init(&index.buffer);
+   output_init(&index.output, STDOUT_FILENO, 0);
+
+   for (i = optind + 4; i < argc; i++) {
+      json_parse_key(argv[i], "key", &key);
+
+      if (!!index_range(&index, &key, &key, FALSE, &found)) {
+         perror("Failed to look up key");
+         missing++;
+      } else if (!found) {
+         fprintf(stderr, "Not found: %s\n", argv[i]);
+         missing++;
+      }
+
+      bson_destroy(&key);
+
+      if (!!output_flush(&index.output, &index.buffer, LOOKUP_FLUSH_SIZE)) {
+         perror("Failed to write output");
+         return WRITE_FAILURE;
+      }
+   }
+
+   if (minarg || maxarg) {
+      if (minarg) {
+         json_parse_key(minarg, "key", &min);
+      }
+
+      if (maxarg) {
+         json_parse_key(maxarg, "key", &max);
+      }
+
+      if (!!index_range(&index, minarg ? &min : NULL, maxarg ? &max : NULL,
+                        TRUE, &found)) {
+         perror("Failed to scan key range");
+         missing++;
+      }
+
+      if (minarg) {
+         bson_destroy(&min);
+      }
+      if (maxarg) {
+         bson_destroy(&max);
+      }
+   }
+
+   if (!!output_flush(&index.output, &index.buffer, 0)) {
+      perror("Failed to write output");
+      return WRITE_FAILURE;
+   }
+
+   buffer_destroy(&index.buffer);
+   munmap(index.map, index.maplen);
+   db_destroy(&db);
+
+   return missing ? LOOKUP_FAILURE : 0;
+}
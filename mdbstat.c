@@ -0,0 +1,605 @@
+/* mdbstat.c
+ *
+ * Copyright (C) 2014 10gen, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mdb.h"
+#include "mdb-json.h"
+#include "mdb-pool.h"
+
+
+/*
+ * mdbstat reports the size of every collection of a database, for
+ * capacity planning, without decoding any documents.
+ *
+ * The record count, the data size, the padding factor and the number of
+ * indexes come straight from the namespace details in the .ns file. The
+ * extent count and the allocated bytes come from the extent headers, and
+ * the free bytes from walking the deleted record lists. The bytes taken
+ * by records and the distribution of record sizes come from walking the
+ * record headers of each extent.
+ *
+ * Walking every record header still touches every page of a collection,
+ * so for very large collections -s PERCENT only walks that share of the
+ * extents, spread evenly over the collection. The record bytes and the
+ * histogram are then scaled up by the ratio of all allocated bytes to
+ * the allocated bytes of the extents walked.
+ *
+ * Extents are handed out to the workers across all collections, so a
+ * database with a few large collections is processed as quickly as one
+ * with many small ones. Index namespaces and the free list only report
+ * their extents.
+ *
+ * The histogram has a bucket for each power of two, counting the records
+ * whose length including the header is at most that many bytes.
+ */
+
+
+#define ARGC_FAILURE   1
+#define DB_FAILURE     2
+#define NS_FAILURE     3
+#define EXTENT_FAILURE 4
+#define WRITE_FAILURE  5
+
+
+#define STAT_BUCKETS 32
+
+
+typedef struct
+{
+   bson_uint64_t extents;
+   bson_uint64_t allocated;
+   bson_uint64_t sampled;
+   bson_uint64_t sampled_allocated;
+   bson_uint64_t records;
+   bson_uint64_t record_bytes;
+   bson_uint64_t invalid;
+   bson_uint64_t histogram[STAT_BUCKETS];
+} stat_counts_t;
+
+
+typedef struct
+{
+   const char    *name;
+   ns_details_t  *details;
+   int            walk;
+   bson_uint64_t  deleted;
+   bson_uint64_t  free_bytes;
+   stat_counts_t  counts;
+} stat_ns_t;
+
+
+typedef struct
+{
+   int         ns;
+   file_loc_t  loc;
+   int         sample;
+} stat_task_t;
+
+
+typedef struct
+{
+   db_t        *db;
+   stat_ns_t   *nss;
+   int          nnss;
+   stat_task_t *tasks;
+   int          ntasks;
+   int          percent;
+} stat_t;
+
+
+static void
+usage (void)
+{
+   fprintf(stderr, "usage: mdbstat [-f text|json] [-H] [-s PERCENT] "
+                   "[-j JOBS] [-m MAXMAPS] DBPATH DBNAME [COLNAME...]\n");
+}
+
+
+static int
+stat_bucket (bson_int32_t length)
+{
+   int bucket = 0;
+
+   while ((bucket < (STAT_BUCKETS - 1)) &&
+          ((bson_int64_t)1 << bucket) < length) {
+      bucket++;
+   }
+
+   return bucket;
+}
+
+
+/*
+ * The deleted lists hang off the namespace details in size buckets. A
+ * deleted record keeps its length, and its next pointer takes the place
+ * of next_offset and prev_offset.
+ */
+static int
+stat_deleted (stat_t    *stat,
+              stat_ns_t *ns)
+{
+   const record_header_t *rhdr;
+   const char *base;
+   bson_uint64_t limit;
+   file_loc_t next;
+   file_loc_t loc;
+   size_t maplen;
+   int i;
+
+   for (i = 0; i < N_BUCKETS; i++) {
+      loc = ns->details->buckets[i];
+      limit = 0;
+
+      while ((loc.fileno != -1) && (loc.offset != 0)) {
+         if (!(base = db_file_acquire(stat->db, loc.fileno, &maplen))) {
+            return -1;
+         }
+
+         if ((loc.offset < 0) ||
+             ((size_t)loc.offset + sizeof *rhdr) > maplen ||
+             (++limit > (maplen / 16))) {
+            db_file_release(stat->db, loc.fileno);
+            errno = EBADF;
+            return -1;
+         }
+
+         rhdr = (const record_header_t *)(base + loc.offset);
+         ns->deleted++;
+         ns->free_bytes += rhdr->length;
+
+         next.fileno = rhdr->next_offset;
+         next.offset = rhdr->prev_offset;
+
+         db_file_release(stat->db, loc.fileno);
+         loc = next;
+      }
+   }
+
+   return 0;
+}
+
+
+/*
+ * Follow the record chain of a mapped extent by its headers only. An
+ * empty extent has a null first record, and the walk is bounded so that
+ * a cycle in the chain is counted as invalid rather than followed.
+ */
+static int
+stat_records (extent_t      *extent,
+              stat_counts_t *counts)
+{
+   const extent_header_t *ehdr;
+   const record_header_t *rhdr;
+   bson_uint64_t limit = 0;
+   bson_int32_t offset;
+   size_t pos;
+
+   ehdr = (const extent_header_t *)(extent->map +
+                                    (extent->offset - extent->base));
+   if (ehdr->first_record.fileno == -1) {
+      return 0;
+   }
+   offset = ehdr->first_record.offset;
+
+   while (offset != -1) {
+      if ((offset < extent->base) ||
+          (((size_t)(offset - extent->base) + sizeof *rhdr) >
+           extent->maplen) ||
+          (++limit > (extent->maplen / 16))) {
+         counts->invalid++;
+         break;
+      }
+
+      pos = offset - extent->base;
+      rhdr = (const record_header_t *)(extent->map + pos);
+
+      if ((rhdr->length < (bson_int32_t)sizeof *rhdr) ||
+          ((pos + rhdr->length) > extent->maplen)) {
+         counts->invalid++;
+         break;
+      }
+
+      counts->records++;
+      counts->record_bytes += rhdr->length;
+      counts->histogram[stat_bucket(rhdr->length)]++;
+
+      offset = rhdr->next_offset;
+   }
+
+   return 0;
+}
+
+
+static int
+stat_extent (void     *data,
+             int       index,
+             buffer_t *buffer)
+{
+   const stat_task_t *task;
+   extent_header_t ehdr;
+   stat_counts_t counts;
+   stat_t *stat = data;
+   extent_t extent;
+
+   task = &stat->tasks[index];
+   memset(&counts, 0, sizeof counts);
+
+   /*
+    * Extents that are not sampled only have their header read, which
+    * with the pread backend avoids reading the whole extent.
+    */
+   if (!task->sample) {
+      if (!!extent_header_at(stat->db, &task->loc, &ehdr)) {
+         return -1;
+      }
+      counts.extents = 1;
+      counts.allocated = ehdr.length;
+   } else {
+      if (!!extent_init(&extent, stat->db, &task->loc)) {
+         return -1;
+      }
+      extent_advise(&extent, EXTENT_ADVISE_WILLNEED);
+      ehdr = *(const extent_header_t *)(extent.map +
+                                        (extent.offset - extent.base));
+      counts.extents = 1;
+      counts.allocated = ehdr.length;
+      counts.sampled = 1;
+      counts.sampled_allocated = ehdr.length;
+      stat_records(&extent, &counts);
+      extent_advise(&extent, EXTENT_ADVISE_DONE);
+      extent_destroy(&extent);
+   }
+
+   buffer_append(buffer, &counts, sizeof counts);
+
+   return 0;
+}
+
+
+static int
+stat_emit (void     *data,
+           int       index,
+           buffer_t *buffer)
+{
+   const stat_counts_t *counts;
+   stat_counts_t *total;
+   stat_t *stat = data;
+   int i;
+
+   counts = (const stat_counts_t *)buffer->data;
+   total = &stat->nss[stat->tasks[index].ns].counts;
+
+   total->extents += counts->extents;
+   total->allocated += counts->allocated;
+   total->sampled += counts->sampled;
+   total->sampled_allocated += counts->sampled_allocated;
+   total->records += counts->records;
+   total->record_bytes += counts->record_bytes;
+   total->invalid += counts->invalid;
+
+   for (i = 0; i < STAT_BUCKETS; i++) {
+      total->histogram[i] += counts->histogram[i];
+   }
+
+   return 0;
+}
+
+
+static int
+stat_add_ns (stat_t *stat,
+             ns_t   *ns)
+{
+   stat_ns_t *sns;
+   file_loc_t *locs;
+   int nlocs;
+   int i;
+
+   stat->nss = bson_realloc(stat->nss, (stat->nnss + 1) * sizeof *stat->nss);
+   sns = &stat->nss[stat->nnss];
+   memset(sns, 0, sizeof *sns);
+   sns->name = ns_name(ns);
+   sns->details = ns_get_details(ns);
+   sns->walk = !strchr(sns->name, '$');
+
+   if (!!ns_extent_locs(ns, &locs, &nlocs)) {
+      return -1;
+   }
+
+   /*
+    * Every (100 / PERCENT)th extent is sampled, starting with the first,
+    * so even a collection with a single extent has one.
+    */
+   stat->tasks = bson_realloc(stat->tasks,
+                              (stat->ntasks + nlocs) * sizeof *stat->tasks);
+   for (i = 0; i < nlocs; i++) {
+      stat->tasks[stat->ntasks].ns = stat->nnss;
+      stat->tasks[stat->ntasks].loc = locs[i];
+      stat->tasks[stat->ntasks].sample =
+         sns->walk && (((i * stat->percent) % 100) < stat->percent);
+      stat->ntasks++;
+   }
+
+   bson_free(locs);
+   stat->nnss++;
+
+   return 0;
+}
+
+
+static double
+stat_scale (const stat_ns_t *ns)
+{
+   if (!ns->counts.sampled_allocated) {
+      return 0.0;
+   }
+
+   return (double)ns->counts.allocated / ns->counts.sampled_allocated;
+}
+
+
+/*
+ * The name is escaped like any other JSON string. A name that is not
+ * valid UTF-8 can only come from a damaged .ns file and is written as
+ * null rather than as invalid JSON.
+ */
+static void
+stat_print_json (const stat_ns_t *ns,
+                 buffer_t        *name)
+{
+   double scale = stat_scale(ns);
+   int last = -1;
+   int i;
+
+   buffer_clear(name);
+   if (!!json_append_string(name, (const bson_uint8_t *)ns->name,
+                            strlen(ns->name))) {
+      buffer_append(name, "null", 4);
+   }
+
+   for (i = 0; i < STAT_BUCKETS; i++) {
+      if (ns->counts.histogram[i]) {
+         last = i;
+      }
+   }
+
+   fprintf(stdout, "{ \"ns\" : %.*s, \"records\" : %lld, "
+                   "\"data_size\" : %lld, \"extents\" : %llu, "
+                   "\"allocated\" : %llu, \"record_bytes\" : %.0f, "
+                   "\"free\" : %llu, \"deleted\" : %llu, "
+                   "\"padding_factor\" : %g, \"indexes\" : %d, "
+                   "\"capped\" : %s, \"sampled_extents\" : %llu, "
+                   "\"invalid\" : %llu, \"histogram\" : [",
+           (int)name->len, name->data,
+           (long long)ns->details->stats.nrecords,
+           (long long)ns->details->stats.datasize,
+           (unsigned long long)ns->counts.extents,
+           (unsigned long long)ns->counts.allocated,
+           ns->counts.record_bytes * scale,
+           (unsigned long long)ns->free_bytes,
+           (unsigned long long)ns->deleted,
+           ns->details->padding_factor,
+           ns->details->nindexes,
+           ns->details->is_capped ? "true" : "false",
+           (unsigned long long)ns->counts.sampled,
+           (unsigned long long)ns->counts.invalid);
+
+   for (i = 0; i <= last; i++) {
+      fprintf(stdout, "%s{ \"le\" : %llu, \"count\" : %.0f }",
+              i ? ", " : " ",
+              (unsigned long long)1 << i,
+              ns->counts.histogram[i] * scale);
+   }
+
+   fprintf(stdout, "%s] }\n", (last >= 0) ? " " : "");
+}
+
+
+static void
+stat_print_text (const stat_ns_t *ns,
+                 int              histogram)
+{
+   double scale = stat_scale(ns);
+   bson_uint64_t max = 0;
+   int i;
+
+   fprintf(stdout, "%-32s %12lld %14lld %8llu %14llu %14.0f %14llu %7.2f %3d "
+                   "%8llu\n",
+           ns->name,
+           (long long)ns->details->stats.nrecords,
+           (long long)ns->details->stats.datasize,
+           (unsigned long long)ns->counts.extents,
+           (unsigned long long)ns->counts.allocated,
+           ns->counts.record_bytes * scale,
+           (unsigned long long)ns->free_bytes,
+           ns->details->padding_factor,
+           ns->details->nindexes,
+           (unsigned long long)ns->counts.sampled);
+
+   if (!histogram || !ns->counts.records) {
+      return;
+   }
+
+   for (i = 0; i < STAT_BUCKETS; i++) {
+      if (ns->counts.histogram[i] > max) {
+         max = ns->counts.histogram[i];
+      }
+   }
+
+   for (i = 0; i < STAT_BUCKETS; i++) {
+      if (ns->counts.histogram[i]) {
+         fprintf(stdout, "    <= %-10llu %14.0f %.*s\n",
+                 (unsigned long long)1 << i,
+                 ns->counts.histogram[i] * scale,
+                 (int)((40 * ns->counts.histogram[i]) / max),
+                 "########################################");
+      }
+   }
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+   const char *dbname;
+   char dotname[128];
+   stat_t stat = { 0 };
+   buffer_t name;
+   int histogram = FALSE;
+   int json = FALSE;
+   int maxmaps = 0;
+   int jobs = 1;
+   int opt;
+   int i;
+   db_t db;
+   ns_t ns;
+
+   stat.percent = 100;
+
+   while (-1 != (opt = getopt(argc, argv, "f:Hs:j:m:"))) {
+      switch (opt) {
+      case 'f':
+         if (!strcmp(optarg, "text")) {
+            json = FALSE;
+         } else if (!strcmp(optarg, "json")) {
+            json = TRUE;
+         } else {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'H':
+         histogram = TRUE;
+         break;
+      case 's':
+         stat.percent = atoi(optarg);
+         if ((stat.percent < 1) || (stat.percent > 100)) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'j':
+         if ((jobs = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      case 'm':
+         if ((maxmaps = atoi(optarg)) < 1) {
+            usage();
+            return ARGC_FAILURE;
+         }
+         break;
+      default:
+         usage();
+         return ARGC_FAILURE;
+      }
+   }
+
+   if ((argc - optind) < 2) {
+      usage();
+      return ARGC_FAILURE;
+   }
+
+   dbname = argv[optind + 1];
+
+   errno = 0;
+   if (!!db_init(&db, argv[optind], dbname)) {
+      perror("Failed to load database");
+      return DB_FAILURE;
+   }
+
+   db_set_max_maps(&db, maxmaps);
+   stat.db = &db;
+
+   if ((argc - optind) > 2) {
+      for (i = optind + 2; i < argc; i++) {
+         snprintf(dotname, sizeof dotname, "%s.%s", dbname, argv[i]);
+
+         errno = 0;
+         if (!!db_namespace_lookup(&db, dotname, &ns)) {
+            perror("Failed to locate namespace");
+            return NS_FAILURE;
+         }
+
+         if (!!stat_add_ns(&stat, &ns)) {
+            perror("Failed to load extent");
+            return EXTENT_FAILURE;
+         }
+      }
+   } else {
+      errno = 0;
+      if (!!db_namespaces(&db, &ns)) {
+         perror("Failed to load namespaces");
+         return NS_FAILURE;
+      }
+
+      do {
+         if (!!stat_add_ns(&stat, &ns)) {
+            perror("Failed to load extent");
+            return EXTENT_FAILURE;
+         }
+      } while (!ns_next(&ns));
+   }
+
+   for (i = 0; i < stat.nnss; i++) {
+      if (stat.nss[i].walk && !!stat_deleted(&stat, &stat.nss[i])) {
+         perror("Failed to load a deleted record");
+         return EXTENT_FAILURE;
+      }
+   }
+
+   if (!!pool_run(jobs, stat.ntasks, stat_extent, stat_emit, &stat)) {
+      perror("Failed to load extent");
+      return EXTENT_FAILURE;
+   }
+
+   if (!json) {
+      fprintf(stdout, "%-32s %12s %14s %8s %14s %14s %14s %7s %3s %8s\n",
+              "ns", "records", "datasize", "extents", "allocated",
+              "recordbytes", "free", "padding", "idx", "sampled");
+   }
+
+   buffer_init(&name);
+
+   for (i = 0; i < stat.nnss; i++) {
+      if (json) {
+         stat_print_json(&stat.nss[i], &name);
+      } else {
+         stat_print_text(&stat.nss[i], histogram);
+      }
+   }
+
+   if (!!fflush(stdout)) {
+      perror("Failed to write output");
+      return WRITE_FAILURE;
+   }
+
+   buffer_destroy(&name);
+   bson_free(stat.tasks);
+   bson_free(stat.nss);
+   db_destroy(&db);
+
+   return 0;
+}
@@ -1,16 +1,118 @@
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mdb.h"
+#include "mdb-buffer.h"
+#include "mdb-output.h"
+#include "mdb-pool.h"
+
+
+/*
+ * mdbundo recovers the documents left in the deleted record lists of a
+ * collection, for instance after an accidental remove().
+ *
+ * The deleted lists are walked first, one worker per size bucket, which
+ * only reads the record headers. A record that is reachable more than
+ * once, through a cycle or from two lists, is only recovered once. The
+ * records are then split into chunks of UNDO_CHUNK that are repaired and
+ * validated in parallel.
+ *
+ * With -o the extents of the collection are swept as well, for orphaned
+ * records that are neither live nor on a deleted list, as left behind by
+ * extent reuse or a corrupted list. Every 4-byte aligned offset between
+ * the extent header and the end of the extent that is not inside a live
+ * record is checked for a record header that points back at the extent,
+ * followed by a document that bson_validate() accepts as it is. The
+ * extents are swept in parallel, after a first pass that hashes the live
+ * documents, so that orphans which are still identical to a live document
+ * are skipped.
+ *
+ * Recovered documents are deduplicated by their contents, so identical
+ * copies are written once. With -i only one document is written for each
+ * _id, the first one found, deleted lists in bucket order before orphans.
+ * Nothing records when a version was written, so this keeps an arbitrary
+ * one of them, not necessarily the latest; an orphan whose _id is live is
+ * skipped as well. Output is raw BSON, written in blocks of UNDO_BLOCK
+ * bytes, deleted documents first.
+ *
+ * A summary of throughput and of everything skipped goes to stderr.
+ */
+
+
+#define UNDO_CHUNK 1024
+#define UNDO_BLOCK (1024 * 1024)
+
+
+/*
+ * A set of 64-bit keys. A set of document hashes also keeps, for each
+ * key, the location of the document it came from, so that a matching
+ * hash can be confirmed against the document itself.
+ */
+typedef struct
+{
+   bson_uint64_t *slots;
+   file_loc_t    *locs;
+   size_t         mask;
+   size_t         count;
+} undo_set_t;
+
+
+typedef struct
+{
+   bson_uint64_t hash;
+   bson_uint64_t id_hash;
+   file_loc_t    loc;
+   bson_int32_t  len;
+   bson_int32_t  has_id;
+} undo_doc_t;
+
+
+typedef struct
+{
+   db_t          *db;
+   ns_details_t  *details;
+   file_loc_t    *buckets[N_BUCKETS];
+   int            nbuckets[N_BUCKETS];
+   file_loc_t    *locs;
+   int            nlocs;
+   file_loc_t    *extents;
+   int            nextents;
+   int            by_id;
+   int            sweep;
+   int            sweeping;
+   undo_set_t     known;
+   undo_set_t     live;
+   undo_set_t     live_ids;
+   undo_set_t     hashes;
+   undo_set_t     ids;
+   buffer_t       block;
+   buffer_t       scratch;
+   output_t       output;
+   bson_uint64_t  records;
+   bson_uint64_t  overlapping;
+   bson_uint64_t  invalid;
+   bson_uint64_t  duplicates;
+   bson_uint64_t  id_duplicates;
+   bson_uint64_t  live_records;
+   bson_uint64_t  swept;
+   bson_uint64_t  orphans;
+   bson_uint64_t  live_duplicates;
+   bson_uint64_t  docs;
+   bson_uint64_t  bytes;
+} undo_t;
 
 
 static void
 usage (void)
 {
-   fprintf (stderr, "usage: mdbundo DBPATH DBNAME COLNAME\n");
+   fprintf (stderr,
+            "usage: mdbundo [-i] [-o] [-j JOBS] DBPATH DBNAME COLNAME\n");
 }
 
 
@@ -47,42 +149,69 @@ fixup_bson (char *base,
 }
 
 
-static record_header_t *
-get_record_at_loc (db_t       *db,
-                   file_loc_t *loc)
+static const record_header_t *
+get_record_at_loc (db_t             *db,
+                   const file_loc_t *loc)
 {
-   char *base;
+   const record_header_t *rec;
+   const char *base;
+   size_t maplen;
 
    assert (loc->fileno != -1);
 
-   base = db->files [loc->fileno].map;
-   base = base + loc->offset;
-   return (record_header_t *)base;
+   if (!(base = db_file_acquire (db, loc->fileno, &maplen))) {
+      return NULL;
+   }
+
+   if ((loc->offset < 0) ||
+       ((size_t)loc->offset + sizeof *rec) > maplen) {
+      db_file_release (db, loc->fileno);
+      errno = EBADF;
+      return NULL;
+   }
+
+   rec = (const record_header_t *)(base + loc->offset);
+
+   if ((rec->length < 0) ||
+       ((size_t)loc->offset + rec->length) > maplen) {
+      db_file_release (db, loc->fileno);
+      errno = EBADF;
+      return NULL;
+   }
+
+   return rec;
 }
 
 
+/*
+ * The data files are mapped read-only, so a deleted document is repaired
+ * in a copy. The scratch buffer is reused for every record, which keeps
+ * memory bounded by the largest record no matter how many are undone.
+ */
 static int
-get_bson_at_loc (db_t       *db,
-                 file_loc_t *loc,
-                 bson_t     *b)
+get_bson_at_loc (const record_header_t *rec,
+                 buffer_t              *scratch,
+                 bson_t                *b)
 {
-   record_header_t *rec;
    size_t off;
    int len;
 
-   assert (loc->fileno != -1);
+   len = rec->length - 16;
 
-   rec = get_record_at_loc (db, loc);
+   if (len < 5) {
+      return 0;
+   }
 
-   len = rec->length - 16;
+   buffer_clear (scratch);
+   buffer_append (scratch, rec->data, len);
 
-   if (!fixup_bson (rec->data, len)) {
+   if (!fixup_bson (scratch->data, len)) {
       return 0;
    }
 
-   memcpy (&len, rec->data, 4);
+   memcpy (&len, scratch->data, 4);
 
-   if (!bson_init_static (b, (bson_uint8_t *)rec->data, len)) {
+   if (!bson_init_static (b, (bson_uint8_t *)scratch->data, len)) {
       return 0;
    }
 
@@ -95,51 +224,852 @@ get_bson_at_loc (db_t       *db,
 
 
 static void
-mdbundo (ns_t *ns)
+undo_set_init (undo_set_t *set)
+{
+   memset (set, 0, sizeof *set);
+}
+
+
+static void
+undo_set_destroy (undo_set_t *set)
+{
+   bson_free (set->slots);
+   bson_free (set->locs);
+   memset (set, 0, sizeof *set);
+}
+
+
+/*
+ * Place @key in the first free slot of its probe sequence, next to
+ * @loc if the set keeps locations. Keys are not compared, so a key may
+ * be in the set more than once.
+ */
+static void
+undo_set_put (undo_set_t       *set,
+              bson_uint64_t     key,
+              const file_loc_t *loc)
+{
+   size_t i;
+
+   for (i = key & set->mask; set->slots [i]; i = (i + 1) & set->mask) {
+   }
+
+   set->slots [i] = key;
+   if (loc) {
+      set->locs [i] = *loc;
+   }
+   set->count++;
+}
+
+
+/*
+ * Make room for one more key, doubling the table whenever it gets half
+ * full.
+ */
+static void
+undo_set_grow (undo_set_t *set,
+               int         with_locs)
+{
+   bson_uint64_t *old;
+   file_loc_t *oldlocs;
+   size_t oldsize;
+   size_t i;
+
+   if ((set->count + 1) * 2 <= (set->slots ? set->mask + 1 : 0)) {
+      return;
+   }
+
+   old = set->slots;
+   oldlocs = set->locs;
+   oldsize = old ? set->mask + 1 : 0;
+   set->mask = oldsize ? (oldsize * 2) - 1 : 1023;
+   set->slots = bson_malloc0 ((set->mask + 1) * sizeof *set->slots);
+   set->locs = with_locs ?
+               bson_malloc ((set->mask + 1) * sizeof *set->locs) : NULL;
+   set->count = 0;
+
+   for (i = 0; i < oldsize; i++) {
+      if (old [i]) {
+         undo_set_put (set, old [i], oldlocs ? &oldlocs [i] : NULL);
+      }
+   }
+
+   bson_free (old);
+   bson_free (oldlocs);
+}
+
+
+/*
+ * Open addressing over 64-bit keys, with 0 marking an empty slot.
+ * Returns TRUE if @key was not in the set yet.
+ */
+static int
+undo_set_add (undo_set_t    *set,
+              bson_uint64_t  key)
+{
+   size_t i;
+
+   if (!key) {
+      key = 1;
+   }
+
+   undo_set_grow (set, FALSE);
+
+   for (i = key & set->mask; set->slots [i]; i = (i + 1) & set->mask) {
+      if (set->slots [i] == key) {
+         return FALSE;
+      }
+   }
+
+   undo_set_put (set, key, NULL);
+
+   return TRUE;
+}
+
+
+static int
+undo_set_has (const undo_set_t *set,
+              bson_uint64_t     key)
+{
+   size_t i;
+
+   if (!key) {
+      key = 1;
+   }
+
+   if (!set->slots) {
+      return FALSE;
+   }
+
+   for (i = key & set->mask; set->slots [i]; i = (i + 1) & set->mask) {
+      if (set->slots [i] == key) {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+
+static bson_uint64_t
+undo_mix (bson_uint64_t h)
+{
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+
+   return h;
+}
+
+
+/*
+ * A 64-bit hash taking eight bytes at a time. Documents whose hashes
+ * match are compared byte for byte before one is taken for a copy of
+ * the other.
+ */
+static bson_uint64_t
+undo_hash (const void *data,
+           size_t      len,
+           bson_uint64_t seed)
+{
+   const bson_uint8_t *p = data;
+   bson_uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+   bson_uint64_t v;
+
+   while (len >= 8) {
+      memcpy (&v, p, 8);
+      h = undo_mix (h ^ v) + 0x9e3779b97f4a7c15ULL;
+      p += 8;
+      len -= 8;
+   }
+
+   v = 0;
+   memcpy (&v, p, len);
+
+   return undo_mix (h ^ v);
+}
+
+
+static bson_uint64_t
+undo_loc_key (const file_loc_t *loc)
+{
+   return undo_mix (((bson_uint64_t)(bson_uint32_t)loc->fileno << 32) |
+                    (bson_uint32_t)loc->offset);
+}
+
+
+static void
+undo_doc_hash (const bson_t *b,
+               undo_doc_t   *doc)
+{
+   bson_iter_t iter;
+
+   memset (doc, 0, sizeof *doc);
+
+   doc->len = b->len;
+   doc->hash = undo_hash (bson_get_data (b), b->len, 0);
+
+   if (bson_iter_init (&iter, b) && bson_iter_find (&iter, "_id")) {
+      doc->has_id = TRUE;
+      doc->id_hash = undo_hash (iter.raw + iter.d1, iter.next_off - iter.d1,
+                                bson_iter_type (&iter));
+   }
+}
+
+
+/*
+ * Read the document at @loc again into the scratch buffer, repaired as
+ * undo_chunk() did if it is on a deleted list, and as it is otherwise.
+ */
+static const bson_uint8_t *
+undo_doc_at (undo_t           *undo,
+             const file_loc_t *loc,
+             size_t           *len)
+{
+   const record_header_t *rec;
+   const bson_uint8_t *ret = NULL;
+   bson_int32_t blen;
+   bson_t b;
+
+   if (!(rec = get_record_at_loc (undo->db, loc))) {
+      return NULL;
+   }
+
+   if (undo_set_has (&undo->known, undo_loc_key (loc))) {
+      if (get_bson_at_loc (rec, &undo->scratch, &b)) {
+         ret = (const bson_uint8_t *)undo->scratch.data;
+         *len = b.len;
+      }
+   } else if (rec->length >= 16 + 5) {
+      memcpy (&blen, rec->data, 4);
+      if ((blen >= 5) && (blen <= rec->length - 16)) {
+         buffer_clear (&undo->scratch);
+         buffer_append (&undo->scratch, rec->data, blen);
+         ret = (const bson_uint8_t *)undo->scratch.data;
+         *len = blen;
+      }
+   }
+
+   db_file_release (undo->db, loc->fileno);
+
+   return ret;
+}
+
+
+static int
+undo_id_value (const bson_uint8_t  *data,
+               size_t               len,
+               int                 *type,
+               const bson_uint8_t **value,
+               size_t              *vlen)
 {
-   ns_details_t *details;
-   record_header_t *record;
+   bson_iter_t iter;
+   bson_t b;
+
+   if (!bson_init_static (&b, data, len) ||
+       !bson_iter_init (&iter, &b) ||
+       !bson_iter_find (&iter, "_id")) {
+      return FALSE;
+   }
+
+   *type = bson_iter_type (&iter);
+   *value = iter.raw + iter.d1;
+   *vlen = iter.next_off - iter.d1;
+
+   return TRUE;
+}
+
+
+/*
+ * Whether the document at @loc is the same as @data, or with @by_id,
+ * whether it has the same _id.
+ */
+static int
+undo_same (undo_t             *undo,
+           const file_loc_t   *loc,
+           const bson_uint8_t *data,
+           size_t              len,
+           int                 by_id)
+{
+   const bson_uint8_t *other;
+   const bson_uint8_t *a;
+   const bson_uint8_t *b;
+   size_t olen;
+   size_t alen;
+   size_t blen;
+   int atype;
+   int btype;
+
+   if (!(other = undo_doc_at (undo, loc, &olen))) {
+      return FALSE;
+   }
+
+   if (!by_id) {
+      return (olen == len) && !memcmp (other, data, len);
+   }
+
+   return (undo_id_value (data, len, &atype, &a, &alen) &&
+           undo_id_value (other, olen, &btype, &b, &blen) &&
+           (atype == btype) && (alen == blen) && !memcmp (a, b, alen));
+}
+
+
+/*
+ * Whether a document that hashes to @key and matches @data is in @set.
+ */
+static int
+undo_doc_has (undo_t             *undo,
+              const undo_set_t   *set,
+              bson_uint64_t       key,
+              const bson_uint8_t *data,
+              size_t              len,
+              int                 by_id)
+{
+   size_t i;
+
+   if (!key) {
+      key = 1;
+   }
+
+   if (!set->slots) {
+      return FALSE;
+   }
+
+   for (i = key & set->mask; set->slots [i]; i = (i + 1) & set->mask) {
+      if ((set->slots [i] == key) &&
+          undo_same (undo, &set->locs [i], data, len, by_id)) {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+
+/*
+ * Add the document at @loc to @set under @key, unless one matching
+ * @data is there already. Without @data it is added unchecked. Returns
+ * TRUE if it was added.
+ */
+static int
+undo_doc_add (undo_t             *undo,
+              undo_set_t         *set,
+              bson_uint64_t       key,
+              const file_loc_t   *loc,
+              const bson_uint8_t *data,
+              size_t              len,
+              int                 by_id)
+{
+   if (!key) {
+      key = 1;
+   }
+
+   if (data && undo_doc_has (undo, set, key, data, len, by_id)) {
+      return FALSE;
+   }
+
+   undo_set_grow (set, TRUE);
+   undo_set_put (set, key, loc);
+
+   return TRUE;
+}
+
+
+/*
+ * Walk one deleted list, collecting the location of every record. The
+ * walk stops at the first location that was already seen, which also
+ * ends a chain that loops back on itself.
+ */
+static int
+undo_walk (void     *data,
+           int       index,
+           buffer_t *buffer)
+{
+   const record_header_t *record;
+   undo_t *undo = data;
+   undo_set_t seen;
+   file_loc_t next;
    file_loc_t loc;
+   loc = undo->details->buckets [index];
+   undo_set_init (&seen);
+
+   while (loc.fileno != -1 && loc.offset != 0) {
+      if (!undo_set_add (&seen, undo_loc_key (&loc))) {
+         break;
+      }
+
+      if (!(record = get_record_at_loc (undo->db, &loc))) {
+         perror ("Failed to load a deleted record");
+         break;
+      }
+
+      buffer_append (buffer, &loc, sizeof loc);
+
+      /* next fileno is overriden from old prev field. */
+      next.fileno = record->next_offset;
+      next.offset = record->prev_offset;
+
+      db_file_release (undo->db, loc.fileno);
+      loc = next;
+   }
+
+   undo_set_destroy (&seen);
+
+   return 0;
+}
+
+
+static int
+undo_collect (void     *data,
+              int       index,
+              buffer_t *buffer)
+{
+   undo_t *undo = data;
+
+   undo->nbuckets [index] = buffer->len / sizeof (file_loc_t);
+   undo->buckets [index] = bson_malloc (buffer->len + 1);
+   if (buffer->len) {
+      memcpy (undo->buckets [index], buffer->data, buffer->len);
+   }
+
+   return 0;
+}
+
+
+/*
+ * Repair and validate one chunk of deleted records. Each document that
+ * survives is appended to the task buffer behind an undo_doc_t with its
+ * hashes, so that the emitter can deduplicate without looking into it.
+ */
+static int
+undo_chunk (void     *data,
+            int       index,
+            buffer_t *buffer)
+{
+   const record_header_t *record;
+   const file_loc_t *loc;
+   undo_t *undo = data;
+   buffer_t scratch;
+   undo_doc_t doc;
    bson_t b;
    int i;
 
-   details = ns_get_details (ns);
+   buffer_init (&scratch);
 
-   for (i = 0; i < N_BUCKETS; i++) {
-      if (details->buckets [i].fileno == -1) {
+   for (i = index * UNDO_CHUNK;
+        (i < undo->nlocs) && (i < (index + 1) * UNDO_CHUNK);
+        i++) {
+      loc = &undo->locs [i];
+
+      if (!(record = get_record_at_loc (undo->db, loc))) {
+         buffer_destroy (&scratch);
+         return -1;
+      }
+
+      if (!get_bson_at_loc (record, &scratch, &b)) {
+         memset (&doc, 0, sizeof doc);
+         doc.len = -1;
+         buffer_append (buffer, &doc, sizeof doc);
+         db_file_release (undo->db, loc->fileno);
          continue;
       }
 
-      loc.fileno = details->buckets [i].fileno;
-      loc.offset = details->buckets [i].offset;
+      undo_doc_hash (&b, &doc);
+      doc.loc = *loc;
+      buffer_append (buffer, &doc, sizeof doc);
+      buffer_append (buffer, bson_get_data (&b), b.len);
+      db_file_release (undo->db, loc->fileno);
+   }
 
-      record = get_record_at_loc (ns->db, &loc);
+   buffer_destroy (&scratch);
 
-      do {
-         if (get_bson_at_loc (ns->db, &loc, &b)) {
-            const bson_uint8_t *data;
-            size_t len;
+   return 0;
+}
 
-            data = bson_get_data (&b);
-            len = b.len;
 
-            if (len != write (STDOUT_FILENO, data, len)) {
-               assert (FALSE);
-            }
-         } else {
-            fprintf (stderr, "Failed to load a document.\n");
-         }
+static int
+undo_emit (void     *data,
+           int       index,
+           buffer_t *buffer)
+{
+   const bson_uint8_t *doc_data;
+   undo_t *undo = data;
+   undo_doc_t doc;
+   size_t pos = 0;
+
+   while (pos < buffer->len) {
+      memcpy (&doc, buffer->data + pos, sizeof doc);
+      pos += sizeof doc;
+      doc_data = (const bson_uint8_t *)buffer->data + pos;
+
+      if (doc.len < 0) {
+         undo->invalid++;
+         continue;
+      }
+
+      if (undo->sweeping) {
+         undo->orphans++;
+      }
+
+      if (undo->sweeping &&
+          undo_doc_has (undo, &undo->live, doc.hash, doc_data, doc.len,
+                        FALSE)) {
+         undo->live_duplicates++;
+      } else if (!undo_doc_add (undo, &undo->hashes, doc.hash, &doc.loc,
+                                doc_data, doc.len, FALSE)) {
+         undo->duplicates++;
+      } else if (undo->by_id && doc.has_id &&
+                 ((undo->sweeping &&
+                   undo_doc_has (undo, &undo->live_ids, doc.id_hash,
+                                 doc_data, doc.len, TRUE)) ||
+                  !undo_doc_add (undo, &undo->ids, doc.id_hash, &doc.loc,
+                                 doc_data, doc.len, TRUE))) {
+         undo->id_duplicates++;
+      } else {
+         buffer_append (&undo->block, buffer->data + pos, doc.len);
+         undo->docs++;
+         undo->bytes += doc.len;
+      }
+
+      pos += doc.len;
+   }
+
+   if (undo->block.len >= UNDO_BLOCK) {
+      if (!!output_write (&undo->output, undo->block.data, undo->block.len)) {
+         return -1;
+      }
+      buffer_clear (&undo->block);
+   }
+
+   return 0;
+}
+
+
+static const extent_header_t *
+undo_extent_header (const extent_t *extent)
+{
+   return (const extent_header_t *)(extent->map +
+                                    (extent->offset - extent->base));
+}
+
+
+static const record_header_t *
+undo_record (const extent_t *extent,
+             bson_int64_t    ofs)
+{
+   return (const record_header_t *)(extent->map + (ofs - extent->base));
+}
+
+
+/*
+ * Records lie between the extent header and the end of the extent, as
+ * far as it is mapped.
+ */
+static bson_int64_t
+undo_extent_end (const extent_t *extent)
+{
+   bson_int64_t mapped = extent->base + (bson_int64_t)extent->maplen;
+   bson_int64_t end;
+
+   end = (bson_int64_t)extent->offset + undo_extent_header (extent)->length;
+
+   return (end < mapped) ? end : mapped;
+}
+
+
+/*
+ * Collect the offsets of the live records of an extent into @live, and
+ * into @offsets in chain order if it is not NULL. The walk stops at the
+ * first offset seen twice.
+ */
+static void
+undo_live_walk (const extent_t *extent,
+                undo_set_t     *live,
+                buffer_t       *offsets)
+{
+   const extent_header_t *ehdr = undo_extent_header (extent);
+   bson_int64_t start = (bson_int64_t)extent->offset + sizeof *ehdr;
+   bson_int64_t end = undo_extent_end (extent);
+   bson_int32_t ofs;
+
+   if (ehdr->first_record.fileno != extent->fileno) {
+      return;
+   }
+
+   ofs = ehdr->first_record.offset;
+
+   while ((ofs != -1) && (ofs >= start) && ((ofs + 16) <= end) &&
+          undo_set_add (live, undo_mix (ofs))) {
+      if (offsets) {
+         buffer_append (offsets, &ofs, sizeof ofs);
+      }
+      ofs = undo_record (extent, ofs)->next_offset;
+   }
+}
+
+
+/*
+ * The record at @ofs holds a document if it fits in the extent, and the
+ * document fits in the record and validates as it is. Unlike the deleted
+ * lists, nothing is repaired, since any offset may be tried here.
+ */
+static int
+undo_record_bson (const extent_t *extent,
+                  bson_int64_t    end,
+                  bson_int64_t    ofs,
+                  bson_t         *b)
+{
+   const record_header_t *rec;
+   bson_int32_t len;
+   size_t off;
+
+   if ((ofs + 16 + 5) > end) {
+      return FALSE;
+   }
+
+   rec = undo_record (extent, ofs);
+
+   if ((rec->length < 16 + 5) || ((ofs + rec->length) > end)) {
+      return FALSE;
+   }
+
+   memcpy (&len, rec->data, 4);
+
+   if ((len < 5) || (len > rec->length - 16) ||
+       ((const char *)rec) [offsetof (record_header_t, data) + len - 1]) {
+      return FALSE;
+   }
+
+   return (bson_init_static (b, (const bson_uint8_t *)rec->data, len) &&
+           bson_validate (b, BSON_VALIDATE_NONE, &off));
+}
+
+
+/*
+ * Hash the live documents of one extent, so that orphans that are still
+ * identical to one of them can be skipped.
+ */
+static int
+undo_live_task (void     *data,
+                int       index,
+                buffer_t *buffer)
+{
+   undo_t *undo = data;
+   undo_set_t live;
+   buffer_t offsets;
+   extent_t extent;
+   undo_doc_t doc;
+   bson_int64_t end;
+   bson_int32_t ofs;
+   size_t i;
+   bson_t b;
+
+   if (!!extent_init (&extent, undo->db, &undo->extents [index])) {
+      return -1;
+   }
+
+   undo_set_init (&live);
+   buffer_init (&offsets);
+
+   end = undo_extent_end (&extent);
+   undo_live_walk (&extent, &live, &offsets);
+
+   for (i = 0; (i + 1) * sizeof ofs <= offsets.len; i++) {
+      memcpy (&ofs, offsets.data + (i * sizeof ofs), sizeof ofs);
+      if (undo_record_bson (&extent, end, ofs, &b)) {
+         undo_doc_hash (&b, &doc);
+         doc.loc.fileno = extent.fileno;
+         doc.loc.offset = ofs;
+         buffer_append (buffer, &doc, sizeof doc);
+      }
+   }
+
+   buffer_destroy (&offsets);
+   undo_set_destroy (&live);
+   extent_destroy (&extent);
+
+   return 0;
+}
+
+
+static int
+undo_live_emit (void     *data,
+                int       index,
+                buffer_t *buffer)
+{
+   undo_t *undo = data;
+   undo_doc_t doc;
+   size_t pos;
+
+   for (pos = 0; (pos + sizeof doc) <= buffer->len; pos += sizeof doc) {
+      memcpy (&doc, buffer->data + pos, sizeof doc);
+      undo->live_records++;
+      undo_doc_add (undo, &undo->live, doc.hash, &doc.loc, NULL, 0, FALSE);
+      if (undo->by_id && doc.has_id) {
+         undo_doc_add (undo, &undo->live_ids, doc.id_hash, &doc.loc, NULL, 0,
+                       TRUE);
+      }
+   }
+
+   return 0;
+}
+
+
+/*
+ * Sweep one extent for orphaned records. Live records are stepped over
+ * whole. Everything else is tried at every 4-byte aligned offset, since
+ * the space of a deleted or orphaned record may still hold older records
+ * of its own. A record must point back at this extent and must not be on
+ * a deleted list, which was recovered already.
+ */
+static int
+undo_sweep (void     *data,
+            int       index,
+            buffer_t *buffer)
+{
+   const record_header_t *rec;
+   undo_t *undo = data;
+   undo_set_t live;
+   extent_t extent;
+   file_loc_t loc;
+   undo_doc_t doc;
+   bson_int64_t end;
+   bson_int64_t ofs;
+   bson_t b;
+
+   if (!!extent_init (&extent, undo->db, &undo->extents [index])) {
+      return -1;
+   }
+
+   undo_set_init (&live);
+
+   end = undo_extent_end (&extent);
+   undo_live_walk (&extent, &live, NULL);
+   loc.fileno = extent.fileno;
+
+   for (ofs = (bson_int64_t)extent.offset + sizeof (extent_header_t);
+        (ofs + 16 + 5) <= end;
+        ofs += 4) {
+      rec = undo_record (&extent, ofs);
 
-         loc.fileno = record->next_offset;
-         loc.offset = record->prev_offset;
+      if (undo_set_has (&live, undo_mix (ofs)) &&
+          (rec->length >= 16) && ((ofs + rec->length) <= end)) {
+         ofs += (((bson_int64_t)rec->length + 3) & ~(bson_int64_t)3) - 4;
+         continue;
+      }
+
+      loc.offset = (bson_int32_t)ofs;
+
+      if ((rec->extent_offset == extent.offset) &&
+          !undo_set_has (&undo->known, undo_loc_key (&loc)) &&
+          undo_record_bson (&extent, end, ofs, &b)) {
+         undo_doc_hash (&b, &doc);
+         doc.loc = loc;
+         buffer_append (buffer, &doc, sizeof doc);
+         buffer_append (buffer, bson_get_data (&b), b.len);
+      }
+   }
+
+   undo_set_destroy (&live);
+   extent_destroy (&extent);
+
+   return 0;
+}
+
+
+static int
+undo_orphans (undo_t *undo,
+              int     jobs)
+{
+   extent_header_t ehdr;
+   int i;
+
+   for (i = 0; i < undo->nextents; i++) {
+      if (!!extent_header_at (undo->db, &undo->extents [i], &ehdr)) {
+         return -1;
+      }
+      undo->swept += ehdr.length - sizeof ehdr;
+   }
+
+   if (!!pool_run (jobs, undo->nextents, undo_live_task, undo_live_emit,
+                   undo)) {
+      return -1;
+   }
+
+   undo->sweeping = TRUE;
+
+   if (!!pool_run (jobs, undo->nextents, undo_sweep, undo_emit, undo)) {
+      return -1;
+   }
 
-         if (loc.fileno == -1 || loc.offset == 0) {
-            break;
+   undo->sweeping = FALSE;
+
+   return 0;
+}
+
+
+static int
+mdbundo (undo_t *undo,
+         int     jobs)
+{
+   int nchunks;
+   int i;
+   int j;
+
+   /*
+    * The lists are walked in parallel, then merged in bucket order,
+    * dropping records that another list already reached.
+    */
+   if (!!pool_run (jobs, N_BUCKETS, undo_walk, undo_collect, undo)) {
+      return -1;
+   }
+
+   for (i = 0; i < N_BUCKETS; i++) {
+      undo->locs = bson_realloc (undo->locs,
+                                 (undo->nlocs + undo->nbuckets [i]) *
+                                 sizeof *undo->locs);
+      for (j = 0; j < undo->nbuckets [i]; j++) {
+         undo->records++;
+         if (!undo_set_add (&undo->known,
+                            undo_loc_key (&undo->buckets [i][j]))) {
+            undo->overlapping++;
+            continue;
          }
+         undo->locs [undo->nlocs++] = undo->buckets [i][j];
+      }
+      bson_free (undo->buckets [i]);
+   }
+
+   nchunks = (undo->nlocs + UNDO_CHUNK - 1) / UNDO_CHUNK;
 
-         /* next fileno is overriden from old prev field. */
-      } while ((record = get_record_at_loc (ns->db, &loc)));
+   if (!!pool_run (jobs, nchunks, undo_chunk, undo_emit, undo)) {
+      return -1;
    }
+
+   if (undo->sweep && !!undo_orphans (undo, jobs)) {
+      return -1;
+   }
+
+   if (!!output_write (&undo->output, undo->block.data, undo->block.len)) {
+      return -1;
+   }
+
+   buffer_clear (&undo->block);
+
+   return 0;
+}
+
+
+static double
+undo_now (void)
+{
+   struct timespec ts;
+
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
 }
 
 
@@ -151,17 +1081,42 @@ main (int   argc,
    const char *dbname;
    const char *colname;
    char dotname [128];
+   undo_t undo = { 0 };
+   double seconds;
+   double start;
+   int jobs = 1;
+   int opt;
    db_t db;
    ns_t ns;
 
-   if (argc != 4) {
+   while (-1 != (opt = getopt (argc, argv, "ioj:"))) {
+      switch (opt) {
+      case 'i':
+         undo.by_id = TRUE;
+         break;
+      case 'o':
+         undo.sweep = TRUE;
+         break;
+      case 'j':
+         if ((jobs = atoi (optarg)) < 1) {
+            usage ();
+            return EXIT_FAILURE;
+         }
+         break;
+      default:
+         usage ();
+         return EXIT_FAILURE;
+      }
+   }
+
+   if ((argc - optind) != 3) {
       usage ();
       return EXIT_FAILURE;
    }
 
-   dbpath = argv [1];
-   dbname = argv [2];
-   colname = argv [3];
+   dbpath = argv [optind];
+   dbname = argv [optind + 1];
+   colname = argv [optind + 2];
 
    snprintf (dotname, sizeof dotname, "%s.%s", dbname, colname);
    dotname [sizeof dotname - 1] = '\0';
@@ -174,16 +1129,73 @@ main (int   argc,
       return EXIT_FAILURE;
    }
 
-   if (0 != db_namespaces (&db, &ns)) {
-      perror ("Failed to locate namespaces");
+   if (0 != db_namespace_lookup (&db, dotname, &ns)) {
+      perror ("Failed to locate namespace");
       return EXIT_FAILURE;
    }
 
-   do {
-      if (0 == strcmp (dotname, ns_name (&ns))) {
-         mdbundo (&ns);
-      }
-   } while (0 == ns_next (&ns));
+   if (undo.sweep &&
+       (0 != ns_extent_locs (&ns, &undo.extents, &undo.nextents))) {
+      perror ("Failed to load extents");
+      return EXIT_FAILURE;
+   }
+
+   undo.db = &db;
+   undo.details = ns_get_details (&ns);
+   undo_set_init (&undo.known);
+   undo_set_init (&undo.live);
+   undo_set_init (&undo.live_ids);
+   undo_set_init (&undo.hashes);
+   undo_set_init (&undo.ids);
+   buffer_init (&undo.block);
+   buffer_init (&undo.scratch);
+   output_init (&undo.output, STDOUT_FILENO, 0);
+
+   start = undo_now ();
+
+   if (!!mdbundo (&undo, jobs)) {
+      perror ("Failed to undo");
+      return EXIT_FAILURE;
+   }
+
+   seconds = undo_now () - start;
+
+   fprintf (stderr, "Recovered %llu documents (%llu bytes) from %llu deleted "
+                    "records in %.3f seconds, %.0f docs/s, %.1f MB/s.\n",
+            (unsigned long long)undo.docs,
+            (unsigned long long)undo.bytes,
+            (unsigned long long)undo.records,
+            seconds,
+            undo.docs / (seconds > 0 ? seconds : 1e-9),
+            (undo.bytes / (1024.0 * 1024.0)) / (seconds > 0 ? seconds : 1e-9));
+   fprintf (stderr, "Skipped %llu reachable more than once, %llu invalid, "
+                    "%llu duplicate contents, %llu duplicate _id.\n",
+            (unsigned long long)undo.overlapping,
+            (unsigned long long)undo.invalid,
+            (unsigned long long)undo.duplicates,
+            (unsigned long long)undo.id_duplicates);
+
+   if (undo.sweep) {
+      fprintf (stderr, "Swept %d extents (%.1f MB) with %llu live documents: "
+                       "%llu orphaned records, %llu identical to a live "
+                       "document.\n",
+               undo.nextents,
+               undo.swept / (1024.0 * 1024.0),
+               (unsigned long long)undo.live_records,
+               (unsigned long long)undo.orphans,
+               (unsigned long long)undo.live_duplicates);
+   }
+
+   undo_set_destroy (&undo.known);
+   undo_set_destroy (&undo.live);
+   undo_set_destroy (&undo.live_ids);
+   undo_set_destroy (&undo.hashes);
+   undo_set_destroy (&undo.ids);
+   buffer_destroy (&undo.block);
+   buffer_destroy (&undo.scratch);
+   bson_free (undo.locs);
+   bson_free (undo.extents);
+   db_destroy (&db);
 
    return EXIT_SUCCESS;
 }